@@ -0,0 +1,362 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+
+/*
+ * The CPU affinity of each thread, given by the cpu-affinity
+ * directive.  The thread names are the following.
+ *
+ *   main             the main thread (the tun queue 0, the AF_XDP
+ *                    socket, the stat interface and the ICMP errors)
+ *   queue<N>         the worker of the tun queue N
+ *   pipeline-reader  the pipeline reader
+ *   pipeline-writer  the pipeline writer
+ *   pipeline<N>      the pipeline translator N
+ */
+struct affinity_entry {
+  char name[AFFINITY_NAME_LEN];
+  cpu_set_t cpus;
+};
+
+static struct affinity_entry affinity_entries[AFFINITY_MAX_THREADS];
+static int affinity_entry_count;
+
+static struct affinity_entry *affinity_find(const char *);
+static int affinity_valid_name(const char *);
+static int affinity_parse_cpus(const char *, cpu_set_t *);
+static int affinity_first_cpu(const cpu_set_t *);
+static int affinity_cpu_node(int);
+static void affinity_format_cpus(const cpu_set_t *, char *, size_t);
+
+/*
+ * Set the CPUs of the thread.  The cpu_list parameter is a comma
+ * separated list of CPU numbers and ranges, e.g. "0,2-3".
+ */
+int
+affinity_set(const char *name, const char *cpu_list)
+{
+  assert(name != NULL);
+  assert(cpu_list != NULL);
+
+  if (!affinity_valid_name(name)) {
+    warnx("invalid thread name %s.", name);
+    return (-1);
+  }
+
+  cpu_set_t cpus;
+  if (affinity_parse_cpus(cpu_list, &cpus) == -1) {
+    warnx("invalid CPU list %s.", cpu_list);
+    return (-1);
+  }
+
+  /* The CPUs must be usable by this process. */
+  cpu_set_t allowed, both;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+    CPU_AND(&both, &cpus, &allowed);
+    if (!CPU_EQUAL(&both, &cpus)) {
+      warnx("CPU list %s includes unavailable CPUs.", cpu_list);
+      return (-1);
+    }
+  }
+
+  struct affinity_entry *entryp = affinity_find(name);
+  if (entryp == NULL) {
+    if (affinity_entry_count == AFFINITY_MAX_THREADS) {
+      warnx("too many cpu-affinity entries.");
+      return (-1);
+    }
+    entryp = &affinity_entries[affinity_entry_count++];
+    strncpy(entryp->name, name, AFFINITY_NAME_LEN);
+  }
+  memcpy(&entryp->cpus, &cpus, sizeof(cpu_set_t));
+
+  return (0);
+}
+
+/*
+ * Returns the NUMA node of the thread, which is the node of the first
+ * CPU of the thread, or -1 if the thread is not pinned or the node is
+ * unknown.
+ */
+int
+affinity_node(const char *name)
+{
+  assert(name != NULL);
+
+  struct affinity_entry *entryp = affinity_find(name);
+  if (entryp == NULL)
+    return (-1);
+
+  return (affinity_cpu_node(affinity_first_cpu(&entryp->cpus)));
+}
+
+/* Pin the calling thread to the CPUs of the thread name. */
+int
+affinity_pin_self(const char *name)
+{
+  assert(name != NULL);
+
+  struct affinity_entry *entryp = affinity_find(name);
+  if (entryp == NULL)
+    return (0);
+
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &entryp->cpus) == -1) {
+    warn("cannot set the CPU affinity of the %s thread.", name);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Initialize the thread attributes to create the thread name.  The
+ * thread starts on its CPUs, so the pages of its stack are allocated
+ * on its NUMA node.
+ */
+int
+affinity_init_attr(const char *name, pthread_attr_t *attrp)
+{
+  assert(name != NULL);
+  assert(attrp != NULL);
+
+  pthread_attr_init(attrp);
+
+  struct affinity_entry *entryp = affinity_find(name);
+  if (entryp == NULL)
+    return (0);
+
+  int error = pthread_attr_setaffinity_np(attrp, sizeof(cpu_set_t),
+					  &entryp->cpus);
+  if (error != 0) {
+    errno = error;
+    warn("cannot set the CPU affinity of the %s thread.", name);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Allocate zero-filled memory on the NUMA node, or anywhere if the
+ * node is -1.  The memory is allocated by pages, and never freed.
+ */
+void *
+affinity_alloc(size_t size, int node)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    warn("cannot allocate %zu bytes.", size);
+    return (NULL);
+  }
+
+  affinity_bind(p, size, node);
+
+  return (p);
+}
+
+/*
+ * Prefer the NUMA node for the pages of the memory not touched yet.
+ * Does nothing if the node is -1.  Failure is not fatal, since the
+ * memory is still usable.
+ */
+void
+affinity_bind(void *p, size_t size, int node)
+{
+  if (node < 0 || node >= (int)(sizeof(unsigned long) * 8))
+    return;
+
+  unsigned long nodemask = 1UL << node;
+  if (syscall(SYS_mbind, p, size, MPOL_PREFERRED, &nodemask,
+	      sizeof(nodemask) * 8, 0) == -1) {
+    warn("cannot bind memory to the NUMA node %d.", node);
+  }
+}
+
+/* Log the CPUs and the NUMA node of the thread. */
+void
+affinity_log(const char *name)
+{
+  assert(name != NULL);
+
+  struct affinity_entry *entryp = affinity_find(name);
+  if (entryp == NULL) {
+    warnx("thread %s: not pinned.", name);
+    return;
+  }
+
+  char cpu_list[256];
+  affinity_format_cpus(&entryp->cpus, cpu_list, sizeof(cpu_list));
+  warnx("thread %s: cpus %s, node %d.", name, cpu_list,
+	affinity_node(name));
+}
+
+static struct affinity_entry *
+affinity_find(const char *name)
+{
+  int count;
+  for (count = 0; count < affinity_entry_count; count++) {
+    if (strcmp(affinity_entries[count].name, name) == 0)
+      return (&affinity_entries[count]);
+  }
+
+  return (NULL);
+}
+
+static int
+affinity_valid_name(const char *name)
+{
+  int index;
+  char c;
+
+  if (strlen(name) >= AFFINITY_NAME_LEN)
+    return (0);
+  if (strcmp(name, "main") == 0
+      || strcmp(name, "pipeline-reader") == 0
+      || strcmp(name, "pipeline-writer") == 0)
+    return (1);
+  if (sscanf(name, "queue%d%c", &index, &c) == 1)
+    return (index > 0);
+  if (sscanf(name, "pipeline%d%c", &index, &c) == 1)
+    return (index >= 0);
+
+  return (0);
+}
+
+static int
+affinity_parse_cpus(const char *cpu_list, cpu_set_t *cpusp)
+{
+  CPU_ZERO(cpusp);
+
+  const char *p = cpu_list;
+  while (*p != '\0') {
+    char *endp;
+    long first = strtol(p, &endp, 10);
+    if (endp == p || first < 0 || first >= CPU_SETSIZE)
+      return (-1);
+    long last = first;
+    p = endp;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &endp, 10);
+      if (endp == p || last < first || last >= CPU_SETSIZE)
+	return (-1);
+      p = endp;
+    }
+    for (; first <= last; first++) {
+      CPU_SET(first, cpusp);
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return (-1);
+    }
+  }
+
+  return (CPU_COUNT(cpusp) == 0 ? -1 : 0);
+}
+
+static int
+affinity_first_cpu(const cpu_set_t *cpusp)
+{
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, cpusp))
+      return (cpu);
+  }
+
+  return (-1);
+}
+
+/*
+ * Find the NUMA node of the CPU from the nodeN entry in the sysfs
+ * directory of the CPU.
+ */
+static int
+affinity_cpu_node(int cpu)
+{
+  if (cpu < 0)
+    return (-1);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dirp = opendir(path);
+  if (dirp == NULL)
+    return (-1);
+
+  int node = -1;
+  struct dirent *entp;
+  while ((entp = readdir(dirp)) != NULL) {
+    if (sscanf(entp->d_name, "node%d", &node) == 1)
+      break;
+    node = -1;
+  }
+  closedir(dirp);
+
+  return (node);
+}
+
+static void
+affinity_format_cpus(const cpu_set_t *cpusp, char *buf, size_t buf_len)
+{
+  size_t len = 0;
+  int cpu = 0;
+
+  buf[0] = '\0';
+  while (cpu < CPU_SETSIZE && len < buf_len) {
+    if (!CPU_ISSET(cpu, cpusp)) {
+      cpu++;
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpusp))
+      last++;
+    if (last == cpu) {
+      len += snprintf(buf + len, buf_len - len, "%s%d", len ? "," : "", cpu);
+    } else {
+      len += snprintf(buf + len, buf_len - len, "%s%d-%d", len ? "," : "",
+		      cpu, last);
+    }
+    cpu = last + 1;
+  }
+}
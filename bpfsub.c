@@ -0,0 +1,513 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#if defined(__linux__)
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#endif
+
+#include "bpfsub.h"
+
+#define BPFSUB_LOG_BUF_SIZE 65536
+
+static int bpfsub_sys_bpf(int, union bpf_attr *);
+#if defined(__linux__)
+static int bpfsub_netlink_request(struct nlmsghdr *);
+static struct rtattr *bpfsub_add_rtattr(struct nlmsghdr *, int, const void *,
+					int);
+#endif
+
+/* Prepare an empty program. */
+void
+bpfsub_prog_init(struct bpfsub_prog *progp)
+{
+  assert(progp != NULL);
+
+  memset(progp, 0, sizeof(struct bpfsub_prog));
+  int count = BPFSUB_PROG_MAX_LABELS;
+  while (count--) {
+    progp->label_pos[count] = -1;
+  }
+}
+
+/* Append one instruction to the program. */
+void
+bpfsub_emit(struct bpfsub_prog *progp, struct bpf_insn insn)
+{
+  assert(progp != NULL);
+
+  if (progp->insn_cnt >= BPFSUB_PROG_MAX_INSNS) {
+    progp->error = 1;
+    return;
+  }
+  progp->insns[progp->insn_cnt++] = insn;
+}
+
+/*
+ * Append a jump instruction.  The offset field of the instruction is
+ * ignored, and will be replaced with the relative offset to the label
+ * when the program is loaded.
+ */
+void
+bpfsub_emit_jmp(struct bpfsub_prog *progp, struct bpf_insn insn, int label)
+{
+  assert(progp != NULL);
+  assert(label >= 0 && label < BPFSUB_PROG_MAX_LABELS);
+
+  if (progp->insn_cnt < BPFSUB_PROG_MAX_INSNS) {
+    progp->label_ref[progp->insn_cnt] = label + 1;
+  }
+  bpfsub_emit(progp, insn);
+}
+
+/*
+ * Append the 16 bytes wide instruction which loads the map specified
+ * by the map_fd parameter to the register.
+ */
+void
+bpfsub_emit_map_fd(struct bpfsub_prog *progp, int reg, int map_fd)
+{
+  assert(progp != NULL);
+
+  bpfsub_emit(progp, BPF_RAW_INSN(BPF_LD | BPF_DW | BPF_IMM, reg,
+				  BPF_PSEUDO_MAP_FD, 0, map_fd));
+  bpfsub_emit(progp, BPF_RAW_INSN(0, 0, 0, 0, 0));
+}
+
+/* Bind the label to the position of the next instruction. */
+void
+bpfsub_label(struct bpfsub_prog *progp, int label)
+{
+  assert(progp != NULL);
+  assert(label >= 0 && label < BPFSUB_PROG_MAX_LABELS);
+
+  progp->label_pos[label] = progp->insn_cnt;
+}
+
+/*
+ * Resolve the jump offsets and load the program to the kernel.
+ * Returns the file descriptor of the loaded program, or -1 when the
+ * kernel rejected it.  The verifier log is printed in that case.
+ */
+int
+bpfsub_prog_load(struct bpfsub_prog *progp, int prog_type, const char *name)
+{
+  assert(progp != NULL);
+  assert(name != NULL);
+
+  if (progp->error) {
+    warnx("too many instructions in the eBPF program %s.", name);
+    return (-1);
+  }
+
+  int insn;
+  for (insn = 0; insn < progp->insn_cnt; insn++) {
+    if (progp->label_ref[insn] == 0)
+      continue;
+    int target = progp->label_pos[progp->label_ref[insn] - 1];
+    if (target == -1) {
+      warnx("unresolved label %d in the eBPF program %s.",
+	    progp->label_ref[insn] - 1, name);
+      return (-1);
+    }
+    progp->insns[insn].off = target - insn - 1;
+  }
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = prog_type;
+  attr.insns = (uint64_t)(unsigned long)progp->insns;
+  attr.insn_cnt = progp->insn_cnt;
+  attr.license = (uint64_t)(unsigned long)"Dual BSD/GPL";
+  strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+
+  int prog_fd = bpfsub_sys_bpf(BPF_PROG_LOAD, &attr);
+  if (prog_fd != -1) {
+    return (prog_fd);
+  }
+
+  /* Load the program again with the verifier log to see the reason. */
+  int saved_errno = errno;
+  char *log_buf = malloc(BPFSUB_LOG_BUF_SIZE);
+  if (log_buf != NULL) {
+    log_buf[0] = '\0';
+    attr.log_buf = (uint64_t)(unsigned long)log_buf;
+    attr.log_size = BPFSUB_LOG_BUF_SIZE;
+    attr.log_level = 1;
+    prog_fd = bpfsub_sys_bpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd != -1) {
+      /* Should not happen, but accept it anyway. */
+      free(log_buf);
+      return (prog_fd);
+    }
+    warnx("eBPF program %s was rejected:\n%s", name, log_buf);
+    free(log_buf);
+  }
+  errno = saved_errno;
+  warn("loading the eBPF program %s failed.", name);
+
+  return (-1);
+}
+
+/* Create a new eBPF map.  Returns the map file descriptor or -1. */
+int
+bpfsub_map_create(int map_type, int key_size, int value_size,
+		  int max_entries, int map_flags)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = map_type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  attr.map_flags = map_flags;
+
+  int map_fd = bpfsub_sys_bpf(BPF_MAP_CREATE, &attr);
+  if (map_fd == -1) {
+    warn("creating an eBPF map (type %d) failed.", map_type);
+  }
+
+  return (map_fd);
+}
+
+/* Insert or replace the map entry. */
+int
+bpfsub_map_update(int map_fd, const void *keyp, const void *valuep)
+{
+  assert(keyp != NULL);
+  assert(valuep != NULL);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)keyp;
+  attr.value = (uint64_t)(unsigned long)valuep;
+  attr.flags = BPF_ANY;
+
+  return (bpfsub_sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1 ? -1 : 0);
+}
+
+/* Delete the map entry. */
+int
+bpfsub_map_delete(int map_fd, const void *keyp)
+{
+  assert(keyp != NULL);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)keyp;
+
+  return (bpfsub_sys_bpf(BPF_MAP_DELETE_ELEM, &attr) == -1 ? -1 : 0);
+}
+
+/* Copy the value of the map entry to the valuep parameter. */
+int
+bpfsub_map_lookup(int map_fd, const void *keyp, void *valuep)
+{
+  assert(keyp != NULL);
+  assert(valuep != NULL);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(unsigned long)keyp;
+  attr.value = (uint64_t)(unsigned long)valuep;
+
+  return (bpfsub_sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == -1 ? -1 : 0);
+}
+
+/* Remove all the entries of a hash type map. */
+int
+bpfsub_map_clear(int map_fd, int key_size)
+{
+  assert(key_size > 0);
+
+  uint8_t key[64];
+  if (key_size > (int)sizeof(key)) {
+    warnx("key size %d is too long to clear the map.", key_size);
+    return (-1);
+  }
+
+  union bpf_attr attr;
+  for (;;) {
+    /* Always pick the first key, since we delete it right after. */
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = 0;
+    attr.next_key = (uint64_t)(unsigned long)key;
+    if (bpfsub_sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr) == -1) {
+      break;
+    }
+    if (bpfsub_map_delete(map_fd, key) == -1) {
+      warn("failed to delete an eBPF map entry.");
+      return (-1);
+    }
+  }
+
+  return (errno == ENOENT ? 0 : -1);
+}
+
+static int
+bpfsub_sys_bpf(int cmd, union bpf_attr *attrp)
+{
+  return (syscall(__NR_bpf, cmd, attrp, sizeof(union bpf_attr)));
+}
+
+#if defined(__linux__)
+/*
+ * Attach the XDP program to the interface.  The flags parameter is
+ * passed to the kernel as IFLA_XDP_FLAGS (XDP_FLAGS_SKB_MODE for the
+ * generic mode, XDP_FLAGS_DRV_MODE for the native mode).
+ */
+int
+bpfsub_attach_xdp(int ifindex, int prog_fd, uint32_t flags)
+{
+  struct {
+    struct nlmsghdr m_nlmsghdr;
+    struct ifinfomsg m_ifinfomsg;
+    char m_space[64];
+  } m_nlmsg;
+
+  memset(&m_nlmsg, 0, sizeof(m_nlmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_type = RTM_SETLINK;
+  m_nlmsg.m_nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+  m_nlmsg.m_ifinfomsg.ifi_family = AF_UNSPEC;
+  m_nlmsg.m_ifinfomsg.ifi_index = ifindex;
+
+  /* IFLA_XDP is a nested attribute of IFLA_XDP_FD and IFLA_XDP_FLAGS. */
+  struct rtattr *nest = (struct rtattr *)(((char *)&m_nlmsg)
+	     + NLMSG_ALIGN(m_nlmsg.m_nlmsghdr.nlmsg_len));
+  nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+  nest->rta_len = RTA_LENGTH(0);
+
+  struct rtattr *rta = (struct rtattr *)(((char *)nest) + nest->rta_len);
+  rta->rta_type = IFLA_XDP_FD;
+  rta->rta_len = RTA_LENGTH(sizeof(int32_t));
+  memcpy(RTA_DATA(rta), &prog_fd, sizeof(int32_t));
+  nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+  if (flags != 0) {
+    rta = (struct rtattr *)(((char *)nest) + nest->rta_len);
+    rta->rta_type = IFLA_XDP_FLAGS;
+    rta->rta_len = RTA_LENGTH(sizeof(uint32_t));
+    memcpy(RTA_DATA(rta), &flags, sizeof(uint32_t));
+    nest->rta_len += RTA_ALIGN(rta->rta_len);
+  }
+
+  m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_ALIGN(m_nlmsg.m_nlmsghdr.nlmsg_len)
+    + RTA_ALIGN(nest->rta_len);
+
+  return (bpfsub_netlink_request(&m_nlmsg.m_nlmsghdr));
+}
+
+/* Detach the XDP program attached by the bpfsub_attach_xdp() function. */
+int
+bpfsub_detach_xdp(int ifindex, uint32_t flags)
+{
+  return (bpfsub_attach_xdp(ifindex, -1, flags));
+}
+
+/*
+ * Attach the SCHED_CLS program to the ingress hook of the interface.
+ * The clsact qdisc is created if it doesn't exist.  The filter is
+ * installed with the fixed priority BPFSUB_TC_PRIO, and replaces the
+ * one left by the previous run if any.
+ */
+int
+bpfsub_attach_tc(int ifindex, int prog_fd, const char *name)
+{
+  assert(name != NULL);
+
+  struct {
+    struct nlmsghdr m_nlmsghdr;
+    struct tcmsg m_tcmsg;
+    char m_space[128];
+  } m_nlmsg;
+
+  /* Create the clsact qdisc. */
+  memset(&m_nlmsg, 0, sizeof(m_nlmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_type = RTM_NEWQDISC;
+  m_nlmsg.m_nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK|NLM_F_CREATE
+    |NLM_F_EXCL;
+  m_nlmsg.m_tcmsg.tcm_family = AF_UNSPEC;
+  m_nlmsg.m_tcmsg.tcm_ifindex = ifindex;
+  m_nlmsg.m_tcmsg.tcm_handle = TC_H_MAKE(TC_H_CLSACT, 0);
+  m_nlmsg.m_tcmsg.tcm_parent = TC_H_CLSACT;
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_KIND, "clsact",
+		    sizeof("clsact"));
+  if (bpfsub_netlink_request(&m_nlmsg.m_nlmsghdr) == -1 && errno != EEXIST) {
+    return (-1);
+  }
+
+  /* Install the filter. */
+  memset(&m_nlmsg, 0, sizeof(m_nlmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_type = RTM_NEWTFILTER;
+  m_nlmsg.m_nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK|NLM_F_CREATE
+    |NLM_F_REPLACE;
+  m_nlmsg.m_tcmsg.tcm_family = AF_UNSPEC;
+  m_nlmsg.m_tcmsg.tcm_ifindex = ifindex;
+  m_nlmsg.m_tcmsg.tcm_handle = 1;
+  m_nlmsg.m_tcmsg.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+  m_nlmsg.m_tcmsg.tcm_info = TC_H_MAKE(BPFSUB_TC_PRIO << 16, htons(ETH_P_ALL));
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_KIND, "bpf", sizeof("bpf"));
+  struct rtattr *nest = bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr,
+					  NLA_F_NESTED | TCA_OPTIONS, NULL, 0);
+  uint32_t bpf_flags = TCA_BPF_FLAG_ACT_DIRECT;
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_BPF_FD, &prog_fd,
+		    sizeof(int32_t));
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_BPF_NAME, name, strlen(name) + 1);
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_BPF_FLAGS, &bpf_flags,
+		    sizeof(uint32_t));
+  nest->rta_len = ((char *)&m_nlmsg) + m_nlmsg.m_nlmsghdr.nlmsg_len
+    - (char *)nest;
+
+  return (bpfsub_netlink_request(&m_nlmsg.m_nlmsghdr));
+}
+
+/*
+ * Remove the filter installed by the bpfsub_attach_tc() function.
+ * The clsact qdisc is left, since other filters may use it.
+ */
+int
+bpfsub_detach_tc(int ifindex)
+{
+  struct {
+    struct nlmsghdr m_nlmsghdr;
+    struct tcmsg m_tcmsg;
+    char m_space[32];
+  } m_nlmsg;
+
+  memset(&m_nlmsg, 0, sizeof(m_nlmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+  m_nlmsg.m_nlmsghdr.nlmsg_type = RTM_DELTFILTER;
+  m_nlmsg.m_nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+  m_nlmsg.m_tcmsg.tcm_family = AF_UNSPEC;
+  m_nlmsg.m_tcmsg.tcm_ifindex = ifindex;
+  m_nlmsg.m_tcmsg.tcm_handle = 1;
+  m_nlmsg.m_tcmsg.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+  m_nlmsg.m_tcmsg.tcm_info = TC_H_MAKE(BPFSUB_TC_PRIO << 16, htons(ETH_P_ALL));
+  bpfsub_add_rtattr(&m_nlmsg.m_nlmsghdr, TCA_KIND, "bpf", sizeof("bpf"));
+
+  return (bpfsub_netlink_request(&m_nlmsg.m_nlmsghdr));
+}
+
+/*
+ * Append an attribute at the end of the netlink message.  The buffer
+ * following the message must be large enough.
+ */
+static struct rtattr *
+bpfsub_add_rtattr(struct nlmsghdr *nlmsghdrp, int type, const void *datap,
+		  int data_len)
+{
+  assert(nlmsghdrp != NULL);
+
+  struct rtattr *rta = (struct rtattr *)(((char *)nlmsghdrp)
+	     + NLMSG_ALIGN(nlmsghdrp->nlmsg_len));
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(data_len);
+  if (data_len > 0) {
+    memcpy(RTA_DATA(rta), datap, data_len);
+  }
+  nlmsghdrp->nlmsg_len = NLMSG_ALIGN(nlmsghdrp->nlmsg_len)
+    + RTA_ALIGN(rta->rta_len);
+
+  return (rta);
+}
+
+/*
+ * Send a netlink request and wait for its acknowledgement.  Unlike
+ * the route operations in tunif.c, the caller needs to know the
+ * result (e.g. to fall back to another XDP mode), so the error code
+ * is returned through errno.
+ */
+static int
+bpfsub_netlink_request(struct nlmsghdr *nlmsghdrp)
+{
+  assert(nlmsghdrp != NULL);
+
+  int netlink_fd;
+  netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (netlink_fd == -1) {
+    warn("cannot open a netlink socket.");
+    return (-1);
+  }
+
+  struct sockaddr_nl so_nl;
+  memset(&so_nl, 0, sizeof(struct sockaddr_nl));
+  so_nl.nl_family = AF_NETLINK;
+  static int seq = 0;
+  nlmsghdrp->nlmsg_seq = ++seq;
+  if (sendto(netlink_fd, nlmsghdrp, nlmsghdrp->nlmsg_len, 0,
+	     (struct sockaddr *)&so_nl, sizeof(struct sockaddr_nl)) == -1) {
+    warn("failed to write to a netlink socket.");
+    close(netlink_fd);
+    return (-1);
+  }
+
+  char buf[4096];
+  ssize_t read_len;
+  read_len = recv(netlink_fd, buf, sizeof(buf), 0);
+  close(netlink_fd);
+  if (read_len == -1) {
+    warn("failed to read from a netlink socket.");
+    return (-1);
+  }
+
+  struct nlmsghdr *replyp = (struct nlmsghdr *)buf;
+  for (; NLMSG_OK(replyp, read_len); replyp = NLMSG_NEXT(replyp, read_len)) {
+    if (replyp->nlmsg_type != NLMSG_ERROR)
+      continue;
+    struct nlmsgerr *errp = (struct nlmsgerr *)NLMSG_DATA(replyp);
+    if (errp->error != 0) {
+      errno = -errp->error;
+      return (-1);
+    }
+    return (0);
+  }
+
+  return (0);
+}
+#endif
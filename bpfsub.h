@@ -0,0 +1,135 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BPFSUB_H__
+#define __BPFSUB_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <linux/bpf.h>
+
+/*
+ * eBPF instruction builders.  The names and the argument order are
+ * the same as the ones used in the Linux kernel tree
+ * (include/linux/filter.h), which are not exported to userland.
+ */
+#ifndef BPF_MOV64_REG
+#define BPF_RAW_INSN(CODE, DST, SRC, OFF, IMM)                          \
+  ((struct bpf_insn){ .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), \
+                      .off = (OFF), .imm = (IMM) })
+#define BPF_ALU64_REG(OP, DST, SRC)                                     \
+  BPF_RAW_INSN(BPF_ALU64 | BPF_OP(OP) | BPF_X, DST, SRC, 0, 0)
+#define BPF_ALU32_REG(OP, DST, SRC)                                     \
+  BPF_RAW_INSN(BPF_ALU | BPF_OP(OP) | BPF_X, DST, SRC, 0, 0)
+#define BPF_ALU64_IMM(OP, DST, IMM)                                     \
+  BPF_RAW_INSN(BPF_ALU64 | BPF_OP(OP) | BPF_K, DST, 0, 0, IMM)
+#define BPF_ALU32_IMM(OP, DST, IMM)                                     \
+  BPF_RAW_INSN(BPF_ALU | BPF_OP(OP) | BPF_K, DST, 0, 0, IMM)
+#define BPF_MOV64_REG(DST, SRC)                                         \
+  BPF_RAW_INSN(BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define BPF_MOV32_REG(DST, SRC)                                         \
+  BPF_RAW_INSN(BPF_ALU | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define BPF_MOV64_IMM(DST, IMM)                                         \
+  BPF_RAW_INSN(BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define BPF_MOV32_IMM(DST, IMM)                                         \
+  BPF_RAW_INSN(BPF_ALU | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define BPF_ENDIAN(TYPE, DST, LEN)                                      \
+  BPF_RAW_INSN(BPF_ALU | BPF_END | BPF_SRC(TYPE), DST, 0, 0, LEN)
+#define BPF_LDX_MEM(SIZE, DST, SRC, OFF)                                \
+  BPF_RAW_INSN(BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define BPF_STX_MEM(SIZE, DST, SRC, OFF)                                \
+  BPF_RAW_INSN(BPF_STX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define BPF_ST_MEM(SIZE, DST, OFF, IMM)                                 \
+  BPF_RAW_INSN(BPF_ST | BPF_SIZE(SIZE) | BPF_MEM, DST, 0, OFF, IMM)
+#define BPF_JMP_REG(OP, DST, SRC, OFF)                                  \
+  BPF_RAW_INSN(BPF_JMP | BPF_OP(OP) | BPF_X, DST, SRC, OFF, 0)
+#define BPF_JMP_IMM(OP, DST, IMM, OFF)                                  \
+  BPF_RAW_INSN(BPF_JMP | BPF_OP(OP) | BPF_K, DST, 0, OFF, IMM)
+#define BPF_JMP32_REG(OP, DST, SRC, OFF)                                \
+  BPF_RAW_INSN(BPF_JMP32 | BPF_OP(OP) | BPF_X, DST, SRC, OFF, 0)
+#define BPF_JMP32_IMM(OP, DST, IMM, OFF)                                \
+  BPF_RAW_INSN(BPF_JMP32 | BPF_OP(OP) | BPF_K, DST, 0, OFF, IMM)
+#define BPF_JMP_A(OFF)                                                  \
+  BPF_RAW_INSN(BPF_JMP | BPF_JA, 0, 0, OFF, 0)
+#define BPF_EMIT_CALL(FUNC)                                             \
+  BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define BPF_EXIT_INSN()                                                 \
+  BPF_RAW_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#endif
+#ifndef BPF_ATOMIC_OP
+#ifndef BPF_ATOMIC
+#define BPF_ATOMIC BPF_XADD
+#endif
+#define BPF_ATOMIC_OP(SIZE, OP, DST, SRC, OFF)                          \
+  BPF_RAW_INSN(BPF_STX | BPF_SIZE(SIZE) | BPF_ATOMIC, DST, SRC, OFF, OP)
+#endif
+
+/* The maximum number of instructions and labels of one program. */
+#define BPFSUB_PROG_MAX_INSNS 1024
+#define BPFSUB_PROG_MAX_LABELS 64
+
+/*
+ * A small assembler used to build eBPF programs at run time.  Jump
+ * instructions refer to labels instead of relative offsets, and the
+ * offsets are resolved by the bpfsub_prog_load() function.
+ */
+struct bpfsub_prog {
+  struct bpf_insn insns[BPFSUB_PROG_MAX_INSNS];
+  int insn_cnt;
+  int label_pos[BPFSUB_PROG_MAX_LABELS];
+  int label_ref[BPFSUB_PROG_MAX_INSNS];
+  int error;
+};
+
+void bpfsub_prog_init(struct bpfsub_prog *);
+void bpfsub_emit(struct bpfsub_prog *, struct bpf_insn);
+void bpfsub_emit_jmp(struct bpfsub_prog *, struct bpf_insn, int);
+void bpfsub_emit_map_fd(struct bpfsub_prog *, int, int);
+void bpfsub_label(struct bpfsub_prog *, int);
+int bpfsub_prog_load(struct bpfsub_prog *, int, const char *);
+
+int bpfsub_map_create(int, int, int, int, int);
+int bpfsub_map_update(int, const void *, const void *);
+int bpfsub_map_delete(int, const void *);
+int bpfsub_map_lookup(int, const void *, void *);
+int bpfsub_map_clear(int, int);
+
+#if defined(__linux__)
+int bpfsub_attach_xdp(int, int, uint32_t);
+int bpfsub_detach_xdp(int, uint32_t);
+
+/* The tc filter priority used by the bpfsub_attach_tc() function. */
+#define BPFSUB_TC_PRIO 0x646
+
+int bpfsub_attach_tc(int, int, const char *);
+int bpfsub_detach_tc(int);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
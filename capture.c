@@ -0,0 +1,561 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+
+/*
+ * The packet capture for debugging the translation.  Each forwarding
+ * thread has its own ring of the last packets it captured, both the
+ * packets before the translation and the translated ones, and only
+ * the thread writes to its ring.  The rings are linked to a list at
+ * their first use so that capture_dump() can read them all.
+ *
+ * A slot of a ring is protected by a sequence counter, which is odd
+ * while the slot is being written.  The reader retries nothing: a
+ * slot which was being overwritten is skipped.
+ *
+ * The filter is checked on the packet before the translation, and on
+ * the translated packets, and a match on either of them captures
+ * both.  A drop filter captures the packets which were not translated
+ * to any packet instead.
+ */
+#define CAPTURE_LINKTYPE_RAW 101
+#define CAPTURE_PCAP_MAGIC 0xa1b2c3d4
+
+enum {
+  CAPTURE_PRE_NONE,
+  CAPTURE_PRE_STAGED,		/* kept until a translated packet matches */
+  CAPTURE_PRE_MATCHED,		/* kept until it turns out to be dropped */
+  CAPTURE_PRE_COMMITTED		/* written to the ring */
+};
+
+struct capture_record {
+  uint64_t time;		/* in nanoseconds since the epoch */
+  uint32_t len;
+  uint32_t caplen;
+  uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct capture_slot {
+  uint32_t gen;
+  uint32_t index;		/* the number of the record in the ring */
+  struct capture_record record;
+};
+
+struct capture_filter {
+  int proto;			/* -1 for any protocol */
+  int family;			/* 0 for any address */
+  uint8_t addr[sizeof(struct in6_addr)];
+  int drop;
+};
+
+struct capture_ring {
+  SLIST_ENTRY(capture_ring) entries;
+  uint32_t head;		/* the number of the records written */
+  uint32_t mask;
+  struct capture_slot *slots;
+  /* The state of the packet being translated. */
+  int pre_state;
+  int outputs;
+  struct capture_record pre;
+  struct capture_record post;
+  struct capture_filter filter;	/* copied for the packet in capture_pre() */
+};
+SLIST_HEAD(capture_ring_listhead, capture_ring);
+
+/* The pcap file header and record header, in the host byte order. */
+struct capture_pcap_hdr {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct capture_pcap_record_hdr {
+  uint32_t sec;
+  uint32_t usec;
+  uint32_t caplen;
+  uint32_t len;
+};
+
+/* The records copied out of the rings by capture_dump(). */
+struct capture_entry {
+  struct capture_record record;
+  unsigned int ring;
+  uint32_t index;
+};
+
+int capture_ring_size = CAPTURE_DEFAULT_RING_SIZE;
+int capture_armed;
+
+static struct capture_ring_listhead capture_rings
+  = SLIST_HEAD_INITIALIZER(capture_rings);
+static unsigned int capture_ring_count;
+static pthread_mutex_t capture_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct capture_ring *capture_ringp;
+static __thread int capture_ring_failed;
+
+/*
+ * The filter is written only by the main thread, and protected by a
+ * sequence counter like the slots of the rings.  The counter is odd
+ * while the filter is being written, and a forwarding thread copies
+ * the filter again if the counter changed during its copy, so that it
+ * never uses a half-written one however often the filter is replaced.
+ */
+static struct capture_filter capture_filter = {.proto = -1};
+static uint32_t capture_filter_gen;
+static uint64_t capture_since;
+
+static struct capture_ring *capture_get_ring(void);
+static void capture_load_filter(struct capture_filter *);
+static uint64_t capture_now(void);
+static int capture_match(const struct capture_filter *, const uint8_t *,
+			 size_t);
+static void capture_commit(struct capture_ring *,
+			   const struct capture_record *);
+static int capture_compare(const void *, const void *);
+
+/*
+ * Arm the capture with a filter given as the words "proto <number>",
+ * "addr <address>" and "drop", all optional.  The packets captured
+ * before are not dumped any more.
+ */
+int
+capture_arm(const char *args)
+{
+  assert(args != NULL);
+
+  struct capture_filter filter;
+  struct capture_filter *filterp = &filter;
+  memset(filterp, 0, sizeof(struct capture_filter));
+  filterp->proto = -1;
+
+  char buf[256];
+  strncpy(buf, args, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  char *savep = NULL;
+  char *wordp;
+  for (wordp = strtok_r(buf, " \t\r\n", &savep); wordp != NULL;
+       wordp = strtok_r(NULL, " \t\r\n", &savep)) {
+    if (strcmp(wordp, "drop") == 0) {
+      filterp->drop = 1;
+    } else if (strcmp(wordp, "proto") == 0) {
+      char *valuep = strtok_r(NULL, " \t\r\n", &savep);
+      if (valuep == NULL || atoi(valuep) < 0 || atoi(valuep) > 255) {
+	warnx("invalid capture protocol.");
+	return (-1);
+      }
+      filterp->proto = atoi(valuep);
+    } else if (strcmp(wordp, "addr") == 0) {
+      char *valuep = strtok_r(NULL, " \t\r\n", &savep);
+      if (valuep != NULL && inet_pton(AF_INET6, valuep, filterp->addr) == 1) {
+	filterp->family = AF_INET6;
+      } else if (valuep != NULL
+		 && inet_pton(AF_INET, valuep, filterp->addr) == 1) {
+	filterp->family = AF_INET;
+      } else {
+	warnx("invalid capture address.");
+	return (-1);
+      }
+    } else {
+      warnx("unknown capture filter %s.", wordp);
+      return (-1);
+    }
+  }
+
+  uint32_t gen = capture_filter_gen;
+  __atomic_store_n(&capture_filter_gen, gen + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&capture_filter, filterp, sizeof(struct capture_filter));
+  __atomic_store_n(&capture_filter_gen, gen + 2, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&capture_since, capture_now(), __ATOMIC_RELAXED);
+  __atomic_store_n(&capture_armed, 1, __ATOMIC_RELEASE);
+
+  return (0);
+}
+
+/* The captured packets are kept until the capture is armed again. */
+void
+capture_disarm(void)
+{
+  __atomic_store_n(&capture_armed, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Capture a packet before the translation.  The pktp parameter points
+ * the IP header.
+ */
+void
+capture_pre(const uint8_t *pktp, size_t len)
+{
+  assert(pktp != NULL);
+
+  struct capture_ring *ringp = capture_get_ring();
+  if (ringp == NULL)
+    return;
+  const struct capture_filter *filterp = &ringp->filter;
+  capture_load_filter(&ringp->filter);
+
+  struct capture_record *recordp = &ringp->pre;
+  recordp->time = capture_now();
+  recordp->len = len;
+  recordp->caplen = len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN;
+  memcpy(recordp->data, pktp, recordp->caplen);
+  ringp->outputs = 0;
+
+  if (!capture_match(filterp, recordp->data, recordp->caplen)) {
+    ringp->pre_state = filterp->drop ? CAPTURE_PRE_NONE : CAPTURE_PRE_STAGED;
+  } else if (filterp->drop) {
+    ringp->pre_state = CAPTURE_PRE_MATCHED;
+  } else {
+    capture_commit(ringp, recordp);
+    ringp->pre_state = CAPTURE_PRE_COMMITTED;
+  }
+}
+
+/*
+ * Capture a translated packet.  The iov parameter has the packet from
+ * the IP header.
+ */
+void
+capture_post(const struct iovec *iov, int iovcnt)
+{
+  assert(iov != NULL);
+
+  struct capture_ring *ringp = capture_get_ring();
+  if (ringp == NULL)
+    return;
+  /* The packet is matched with the filter its capture_pre() used. */
+  const struct capture_filter *filterp = &ringp->filter;
+
+  ringp->outputs++;
+  if (filterp->drop)
+    return;
+
+  struct capture_record *recordp = &ringp->post;
+  recordp->time = capture_now();
+  recordp->len = 0;
+  recordp->caplen = 0;
+  int index;
+  for (index = 0; index < iovcnt; index++) {
+    size_t copy_len = iov[index].iov_len;
+    if (copy_len > CAPTURE_SNAPLEN - recordp->caplen)
+      copy_len = CAPTURE_SNAPLEN - recordp->caplen;
+    memcpy(recordp->data + recordp->caplen, iov[index].iov_base, copy_len);
+    recordp->caplen += copy_len;
+    recordp->len += iov[index].iov_len;
+  }
+
+  if (ringp->pre_state != CAPTURE_PRE_COMMITTED
+      && !capture_match(filterp, recordp->data, recordp->caplen))
+    return;
+  if (ringp->pre_state == CAPTURE_PRE_STAGED) {
+    capture_commit(ringp, &ringp->pre);
+    ringp->pre_state = CAPTURE_PRE_COMMITTED;
+  }
+  capture_commit(ringp, recordp);
+}
+
+/*
+ * Called when the translation of the packet given to capture_pre() is
+ * finished.  The packet is captured here if it matches a drop filter
+ * and nothing was sent for it.
+ */
+void
+capture_end(void)
+{
+  struct capture_ring *ringp = capture_ringp;
+  if (ringp == NULL)
+    return;
+
+  if (ringp->pre_state == CAPTURE_PRE_MATCHED && ringp->outputs == 0)
+    capture_commit(ringp, &ringp->pre);
+  ringp->pre_state = CAPTURE_PRE_NONE;
+}
+
+/*
+ * Returns the captured packets of all the threads as a pcap file of
+ * raw IP packets, in the order of their times.  The packets captured
+ * before the capture was armed last are not included.  The buffer is
+ * allocated by malloc(3), and NULL is returned on failure.
+ */
+uint8_t *
+capture_dump(size_t *lenp)
+{
+  assert(lenp != NULL);
+
+  uint64_t since = __atomic_load_n(&capture_since, __ATOMIC_RELAXED);
+  struct capture_entry *entries = NULL;
+  size_t count = 0;
+
+  pthread_mutex_lock(&capture_rings_lock);
+  size_t max_count = 0;
+  struct capture_ring *ringp;
+  SLIST_FOREACH(ringp, &capture_rings, entries) {
+    max_count += ringp->mask + 1;
+  }
+  if (max_count > 0) {
+    entries = malloc(max_count * sizeof(struct capture_entry));
+    if (entries == NULL) {
+      pthread_mutex_unlock(&capture_rings_lock);
+      warnx("cannot allocate the capture dump.");
+      return (NULL);
+    }
+  }
+  unsigned int ring_index = 0;
+  SLIST_FOREACH(ringp, &capture_rings, entries) {
+    uint32_t head = __atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE);
+    uint32_t size = (head < ringp->mask + 1) ? head : ringp->mask + 1;
+    uint32_t index;
+    for (index = head - size; index != head; index++) {
+      const struct capture_slot *slotp = &ringp->slots[index & ringp->mask];
+      struct capture_entry *entryp = &entries[count];
+      uint32_t gen = __atomic_load_n(&slotp->gen, __ATOMIC_ACQUIRE);
+      if (gen & 1)
+	continue;
+      entryp->index = slotp->index;
+      memcpy(&entryp->record, &slotp->record, sizeof(struct capture_record));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slotp->gen, __ATOMIC_RELAXED) != gen
+	  || entryp->index != index || entryp->record.time < since)
+	continue;
+      entryp->ring = ring_index;
+      count++;
+    }
+    ring_index++;
+  }
+  pthread_mutex_unlock(&capture_rings_lock);
+
+  if (count > 0)
+    qsort(entries, count, sizeof(struct capture_entry), capture_compare);
+
+  size_t len = sizeof(struct capture_pcap_hdr);
+  size_t index;
+  for (index = 0; index < count; index++) {
+    len += sizeof(struct capture_pcap_record_hdr)
+      + entries[index].record.caplen;
+  }
+  uint8_t *bufp = malloc(len);
+  if (bufp == NULL) {
+    free(entries);
+    warnx("cannot allocate the capture dump.");
+    return (NULL);
+  }
+  struct capture_pcap_hdr file_hdr;
+  memset(&file_hdr, 0, sizeof(file_hdr));
+  file_hdr.magic = CAPTURE_PCAP_MAGIC;
+  file_hdr.version_major = 2;
+  file_hdr.version_minor = 4;
+  file_hdr.snaplen = CAPTURE_SNAPLEN;
+  file_hdr.linktype = CAPTURE_LINKTYPE_RAW;
+  memcpy(bufp, &file_hdr, sizeof(file_hdr));
+  uint8_t *p = bufp + sizeof(file_hdr);
+  for (index = 0; index < count; index++) {
+    const struct capture_record *recordp = &entries[index].record;
+    struct capture_pcap_record_hdr record_hdr;
+    record_hdr.sec = recordp->time / 1000000000;
+    record_hdr.usec = (recordp->time % 1000000000) / 1000;
+    record_hdr.caplen = recordp->caplen;
+    record_hdr.len = recordp->len;
+    memcpy(p, &record_hdr, sizeof(record_hdr));
+    memcpy(p + sizeof(record_hdr), recordp->data, recordp->caplen);
+    p += sizeof(record_hdr) + recordp->caplen;
+  }
+  free(entries);
+
+  *lenp = len;
+  return (bufp);
+}
+
+/* Write the state and the filter of the capture as a string. */
+void
+capture_describe(char *bufp, size_t len)
+{
+  assert(bufp != NULL);
+
+  /* The filter is written by this thread. */
+  const struct capture_filter *filterp = &capture_filter;
+  char addr[INET6_ADDRSTRLEN] = "any";
+  if (filterp->family != 0)
+    inet_ntop(filterp->family, filterp->addr, addr, sizeof(addr));
+  char proto[8] = "any";
+  if (filterp->proto != -1)
+    snprintf(proto, sizeof(proto), "%d", filterp->proto);
+
+  pthread_mutex_lock(&capture_rings_lock);
+  unsigned int rings = capture_ring_count;
+  pthread_mutex_unlock(&capture_rings_lock);
+
+  snprintf(bufp, len, "%s proto %s addr %s%s rings %u",
+	   capture_is_armed() ? "armed" : "disarmed", proto, addr,
+	   filterp->drop ? " drop" : "", rings);
+}
+
+/*
+ * Returns the ring of the calling thread, allocated at the first use.
+ * A thread whose ring cannot be allocated does not capture.
+ */
+static struct capture_ring *
+capture_get_ring(void)
+{
+  if (capture_ringp != NULL || capture_ring_failed)
+    return (capture_ringp);
+
+  uint32_t size = 2;
+  while (size < (uint32_t)capture_ring_size) {
+    size <<= 1;
+  }
+  struct capture_ring *ringp = calloc(1, sizeof(struct capture_ring));
+  if (ringp != NULL)
+    ringp->slots = calloc(size, sizeof(struct capture_slot));
+  if (ringp == NULL || ringp->slots == NULL) {
+    free(ringp);
+    capture_ring_failed = 1;
+    warnx("cannot allocate the capture ring.");
+    return (NULL);
+  }
+  ringp->mask = size - 1;
+  capture_load_filter(&ringp->filter);
+
+  pthread_mutex_lock(&capture_rings_lock);
+  SLIST_INSERT_HEAD(&capture_rings, ringp, entries);
+  capture_ring_count++;
+  pthread_mutex_unlock(&capture_rings_lock);
+  capture_ringp = ringp;
+  return (ringp);
+}
+
+/* Copy the filter, retrying while it is being replaced. */
+static void
+capture_load_filter(struct capture_filter *filterp)
+{
+  uint32_t gen;
+  do {
+    gen = __atomic_load_n(&capture_filter_gen, __ATOMIC_ACQUIRE);
+    if (gen & 1)
+      continue;
+    memcpy(filterp, &capture_filter, sizeof(struct capture_filter));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((gen & 1)
+	   || gen != __atomic_load_n(&capture_filter_gen, __ATOMIC_RELAXED));
+}
+
+static uint64_t
+capture_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Returns 1 if the protocol and one of the addresses of the packet
+ * match the filter.
+ */
+static int
+capture_match(const struct capture_filter *filterp, const uint8_t *pktp,
+	      size_t len)
+{
+  int family, proto;
+  const uint8_t *srcp, *dstp;
+  size_t addr_len;
+  if (len >= 20 && (pktp[0] >> 4) == 4) {
+    family = AF_INET;
+    proto = pktp[9];
+    srcp = pktp + 12;
+    dstp = pktp + 16;
+    addr_len = sizeof(struct in_addr);
+  } else if (len >= 40 && (pktp[0] >> 4) == 6) {
+    family = AF_INET6;
+    proto = pktp[6];
+    srcp = pktp + 8;
+    dstp = pktp + 24;
+    addr_len = sizeof(struct in6_addr);
+  } else {
+    return (0);
+  }
+
+  if (filterp->proto != -1 && proto != filterp->proto)
+    return (0);
+  if (filterp->family != 0
+      && (family != filterp->family
+	  || (memcmp(srcp, filterp->addr, addr_len) != 0
+	      && memcmp(dstp, filterp->addr, addr_len) != 0)))
+    return (0);
+  return (1);
+}
+
+/* Write a record to the next slot of the ring. */
+static void
+capture_commit(struct capture_ring *ringp, const struct capture_record *recordp)
+{
+  struct capture_slot *slotp = &ringp->slots[ringp->head & ringp->mask];
+  uint32_t gen = slotp->gen;
+
+  __atomic_store_n(&slotp->gen, gen + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slotp->index = ringp->head;
+  memcpy(&slotp->record, recordp,
+	 offsetof(struct capture_record, data) + recordp->caplen);
+  __atomic_store_n(&slotp->gen, gen + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ringp->head, ringp->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Sort the records by their times, and in the order of each ring. */
+static int
+capture_compare(const void *ap, const void *bp)
+{
+  const struct capture_entry *entry_ap = ap;
+  const struct capture_entry *entry_bp = bp;
+
+  if (entry_ap->record.time != entry_bp->record.time)
+    return (entry_ap->record.time < entry_bp->record.time ? -1 : 1);
+  if (entry_ap->ring != entry_bp->ring)
+    return (entry_ap->ring < entry_bp->ring ? -1 : 1);
+  if (entry_ap->index != entry_bp->index)
+    return ((int32_t)(entry_ap->index - entry_bp->index) < 0 ? -1 : 1);
+  return (0);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAPTURE_DEFAULT_RING_SIZE 1024
+#define CAPTURE_MAX_RING_SIZE 65536
+#define CAPTURE_SNAPLEN 256
+
+extern int capture_ring_size;
+extern int capture_armed;
+
+int capture_arm(const char *);
+void capture_disarm(void);
+void capture_pre(const uint8_t *, size_t);
+void capture_post(const struct iovec *, int);
+void capture_end(void);
+uint8_t *capture_dump(size_t *);
+void capture_describe(char *, size_t);
+
+/*
+ * Returns 1 if the capture is armed.  The forwarding threads call the
+ * capture functions only when this is true, so a disarmed capture
+ * costs one branch predicted not taken.
+ */
+static inline int
+capture_is_armed(void)
+{
+  return (__builtin_expect(__atomic_load_n(&capture_armed, __ATOMIC_RELAXED),
+			   0));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -296,7 +296,7 @@ cksum_calc_ulp(int ulp, struct iovec *iov)
       sum += cksum_acc_words(iov[4].iov_base, iov[4].iov_len);
     }
     ADDCARRY(sum);
-    icmp6_hdrp->icmp6_cksum = ~sum & 0xfff;
+    icmp6_hdrp->icmp6_cksum = ~sum & 0xffff;
     break;
 
   default:
@@ -308,34 +308,33 @@ cksum_calc_ulp(int ulp, struct iovec *iov)
 }
 
 /*
- * Adjust the checksum value of an ICMP/ICMPv6 packet, based on the
- * original type/code values and new type/code values.
+ * Sum the 16-bit words of the data, for the incremental update by
+ * cksum_adjust().
  */
-int
-cksum_update_icmp_type_code(void *icmp46_hdrp, int orig_type, int orig_code,
-			    int new_type, int new_code)
+int32_t
+cksum_sum_words(const void *datap, int data_len)
 {
-  assert(icmp46_hdrp != NULL);
-
-  struct icmp6_hdr *icmp6_hdrp = icmp46_hdrp;
-  int32_t sum = icmp6_hdrp->icmp6_cksum;
-  sum = ~sum & 0xffff;
-  uint8_t typecode[2];
+  assert(datap != NULL);
 
-  /* Subtract the original type/code values from the checksum value. */
-  typecode[0] = orig_type;
-  typecode[1] = orig_code;
-  sum -= cksum_acc_words((const uint16_t *)typecode, 2);
+  return (cksum_acc_words(datap, data_len));
+}
 
-  /* Add the new type/code values to the checksum value. */
-  typecode[0] = new_type;
-  typecode[1] = new_code;
-  sum += cksum_acc_words((const uint16_t *)typecode, 2);
+/*
+ * Return the checksum value updated for the change of the data whose
+ * sum was old_sum to the data whose sum is new_sum.  Both sums are
+ * the ones returned by cksum_sum_words(), or their totals.
+ */
+uint16_t
+cksum_adjust(uint16_t cksum, int32_t old_sum, int32_t new_sum)
+{
+  int32_t sum = ~cksum & 0xffff;
 
+  ADDCARRY(old_sum);
+  ADDCARRY(new_sum);
+  sum += (~old_sum & 0xffff) + new_sum;
   ADDCARRY(sum);
-  icmp6_hdrp->icmp6_cksum = ~sum & 0xffff;
 
-  return (0);
+  return (~sum & 0xffff);
 }
 
 /*
@@ -33,7 +33,8 @@ uint16_t cksum_calc_ip4_header(const struct ip *);
 int cksum_update_ulp(int, const void *, struct iovec *);
 int cksum66_update_ulp(int, const void *, struct iovec *);
 int cksum_calc_ulp(int, struct iovec *);
-int cksum_update_icmp_type_code(void *, int, int, int, int);
+int32_t cksum_sum_words(const void *, int);
+uint16_t cksum_adjust(uint16_t, int32_t, int32_t);
 
 #ifdef __cplusplus
 }
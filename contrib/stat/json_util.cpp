@@ -45,6 +45,10 @@ int json_merge(json_object* jobj){
 
                int proto = map646_stat::get_proto_ID(key);
                
+               if(proto < 0){
+                  /* The traffic counters are not merged. */
+                  continue;
+               }
                if(jelement != NULL){
                   stat[addr].stat_element[proto].num += json_object_get_int(json_object_object_get(jelement, "num"));
                   json_object *jlen = json_object_object_get(jelement, "len");
@@ -82,6 +86,10 @@ int json_merge(json_object* jobj){
             json_object_object_foreach(jchunk6, key, jelement){
                int proto = map646_stat::get_proto_ID(key);
 
+               if(proto < 0){
+                  /* The traffic counters are not merged. */
+                  continue;
+               }
                if(jelement != NULL){
                   stat66[addr6].stat_element[proto].num += json_object_get_int(json_object_object_get(jelement, "num"));
                   json_object *jlen = json_object_object_get(jelement, "len");
@@ -0,0 +1,916 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns64.h"
+#include "mapping.h"
+#include "affinity.h"
+
+/*
+ * The DNS64 responder (RFC 6147).  The queries from the clients are
+ * forwarded to the upstream server with a new ID, and the responses
+ * are sent back to the clients with the original ID.  When the
+ * upstream has no AAAA record for a name, the A records of the name
+ * are queried and the AAAA records are synthesized by embedding the
+ * IPv4 addresses in the mapping prefix.
+ *
+ * The AAAA answers, both the native and the synthesized ones, are
+ * kept in a cache until their TTL expires.  The cache is an open
+ * addressing hash table of fixed size entries allocated at startup.
+ * A name is searched in a few entries from its hash index, and a new
+ * name replaces the entry which expires first among them when they
+ * are all in use.
+ *
+ * All the work is done by one thread, so the cache and the pending
+ * queries need no locking.
+ */
+#define DNS64_MAX_MSG 4096
+#define DNS64_MAX_NAME 255
+#define DNS64_MAX_ADDRS 8
+#define DNS64_MAX_TTL 86400
+#define DNS64_CACHE_PROBES 8
+#define DNS64_MAX_PENDING 4096
+#define DNS64_PENDING_TIMEOUT 5
+#define DNS64_BURST 64
+#define DNS64_EDNS_SIZE 1232
+
+#define DNS64_HDR_LEN 12
+#define DNS64_FLAG_QR 0x8000
+#define DNS64_FLAG_OPCODE 0x7800
+#define DNS64_FLAG_TC 0x0200
+#define DNS64_FLAG_RD 0x0100
+#define DNS64_FLAG_RA 0x0080
+#define DNS64_FLAG_RCODE 0x000f
+
+#define DNS64_TYPE_A 1
+#define DNS64_TYPE_AAAA 28
+#define DNS64_TYPE_OPT 41
+#define DNS64_CLASS_IN 1
+
+struct dns64_cache_entry {
+  uint64_t hash;		/* 0 if the entry is not used */
+  uint32_t expire;
+  uint8_t name_len;
+  uint8_t count;
+  uint8_t name[DNS64_MAX_NAME];	/* in lower case */
+  struct in6_addr addrs[DNS64_MAX_ADDRS];
+};
+
+enum {
+  DNS64_PENDING_FREE,
+  DNS64_PENDING_RELAY,		/* relay the response as is */
+  DNS64_PENDING_AAAA,		/* waiting for the AAAA response */
+  DNS64_PENDING_A		/* waiting for the A response to synthesize */
+};
+
+struct dns64_pending {
+  uint8_t state;
+  uint8_t rd;
+  uint16_t id;			/* the ID sent to the upstream */
+  uint16_t client_id;
+  uint16_t question_len;
+  uint32_t sent;
+  struct sockaddr_storage client;
+  socklen_t client_len;
+  uint8_t question[DNS64_MAX_NAME + 4];
+};
+
+int dns64_cache_size = DNS64_DEFAULT_CACHE_SIZE;
+
+static struct sockaddr_storage dns64_listen_addr;
+static socklen_t dns64_listen_addr_len;
+static struct sockaddr_storage dns64_upstream_addr;
+static socklen_t dns64_upstream_addr_len;
+static int dns64_active;
+static int dns64_listen_fd = -1;
+static int dns64_upstream_fd = -1;
+static pthread_t dns64_thread;
+
+static struct dns64_cache_entry *dns64_cache;
+static uint32_t dns64_cache_mask;
+
+static struct dns64_pending *dns64_pendings;
+static uint16_t *dns64_ids;	/* the ID to the pending index + 1 */
+static unsigned int dns64_pending_cursor;
+
+static struct dns64_stats dns64_counters;
+
+static int dns64_parse_addr(const char *, const char *,
+			    struct sockaddr_storage *, socklen_t *);
+static void *dns64_main(void *);
+static uint32_t dns64_now(void);
+static void dns64_count(uint64_t *);
+static uint16_t dns64_get16(const uint8_t *);
+static void dns64_put16(uint8_t *, uint16_t);
+static uint32_t dns64_get32(const uint8_t *);
+static void dns64_put32(uint8_t *, uint32_t);
+static int dns64_parse_question(const uint8_t *, size_t, uint16_t *,
+				uint16_t *);
+static int dns64_skip_name(const uint8_t *, size_t, int);
+static int dns64_collect(const uint8_t *, size_t, uint16_t, uint8_t *, int,
+			 int, uint32_t *);
+static uint64_t dns64_hash_name(const uint8_t *, size_t, uint8_t *);
+static const struct dns64_cache_entry *dns64_cache_lookup(const uint8_t *,
+							  size_t, uint32_t);
+static void dns64_cache_insert(const uint8_t *, size_t,
+			       const struct in6_addr *, int, uint32_t,
+			       uint32_t);
+static int dns64_new_id(void);
+static struct dns64_pending *dns64_alloc_pending(uint32_t);
+static void dns64_free_pending(struct dns64_pending *);
+static void dns64_handle_query(uint8_t *, size_t,
+			       const struct sockaddr_storage *, socklen_t,
+			       uint32_t);
+static void dns64_handle_response(uint8_t *, size_t, uint32_t);
+static int dns64_match_question(const struct dns64_pending *,
+				const uint8_t *, size_t);
+static void dns64_send_answer(const struct dns64_pending *,
+			      const struct in6_addr *, int, uint32_t);
+static void dns64_send_client(const struct dns64_pending *,
+			      const uint8_t *, size_t);
+static int dns64_query_a(struct dns64_pending *, uint32_t);
+
+/*
+ * Set the address and the port (53 if NULL) where the responder
+ * receives the queries.  The responder is enabled by this directive.
+ */
+int
+dns64_set_listen(const char *addr, const char *port)
+{
+  assert(addr != NULL);
+
+  return (dns64_parse_addr(addr, port, &dns64_listen_addr,
+			   &dns64_listen_addr_len));
+}
+
+/* Set the address and the port (53 if NULL) of the upstream server. */
+int
+dns64_set_upstream(const char *addr, const char *port)
+{
+  assert(addr != NULL);
+
+  return (dns64_parse_addr(addr, port, &dns64_upstream_addr,
+			   &dns64_upstream_addr_len));
+}
+
+static int
+dns64_parse_addr(const char *addr, const char *port,
+		 struct sockaddr_storage *ssp, socklen_t *lenp)
+{
+  int port_num = DNS64_DEFAULT_PORT;
+  if (port != NULL) {
+    port_num = atoi(port);
+    if (port_num < 1 || port_num > 65535) {
+      warnx("invalid port %s.", port);
+      return (-1);
+    }
+  }
+
+  memset(ssp, 0, sizeof(struct sockaddr_storage));
+  struct sockaddr_in6 *sin6p = (struct sockaddr_in6 *)ssp;
+  struct sockaddr_in *sinp = (struct sockaddr_in *)ssp;
+  if (inet_pton(AF_INET6, addr, &sin6p->sin6_addr) == 1) {
+    sin6p->sin6_family = AF_INET6;
+    sin6p->sin6_port = htons(port_num);
+    *lenp = sizeof(struct sockaddr_in6);
+  } else if (inet_pton(AF_INET, addr, &sinp->sin_addr) == 1) {
+    sinp->sin_family = AF_INET;
+    sinp->sin_port = htons(port_num);
+    *lenp = sizeof(struct sockaddr_in);
+  } else {
+    warnx("invalid address %s.", addr);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Open the sockets, allocate the cache and start the responder thread
+ * if the dns64-listen directive is given.  The settings are read only
+ * at startup.
+ */
+int
+dns64_start(void)
+{
+  if (dns64_listen_addr_len == 0 || dns64_active) {
+    return (0);
+  }
+  if (dns64_upstream_addr_len == 0) {
+    warnx("dns64-upstream is not specified.");
+    return (-1);
+  }
+
+  dns64_listen_fd = socket(dns64_listen_addr.ss_family, SOCK_DGRAM, 0);
+  if (dns64_listen_fd == -1) {
+    warn("cannot open the DNS64 socket.");
+    return (-1);
+  }
+  int on = 1;
+  setsockopt(dns64_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(dns64_listen_fd, (const struct sockaddr *)&dns64_listen_addr,
+	   dns64_listen_addr_len) == -1) {
+    warn("cannot bind the DNS64 socket.");
+    return (-1);
+  }
+  dns64_upstream_fd = socket(dns64_upstream_addr.ss_family, SOCK_DGRAM, 0);
+  if (dns64_upstream_fd == -1) {
+    warn("cannot open the DNS64 upstream socket.");
+    return (-1);
+  }
+  if (connect(dns64_upstream_fd,
+	      (const struct sockaddr *)&dns64_upstream_addr,
+	      dns64_upstream_addr_len) == -1) {
+    warn("cannot connect to the DNS64 upstream.");
+    return (-1);
+  }
+
+  uint32_t entries = 1;
+  while (entries < (uint32_t)dns64_cache_size) {
+    entries <<= 1;
+  }
+  dns64_cache = affinity_alloc(entries * sizeof(struct dns64_cache_entry),
+			       affinity_node("dns64"));
+  if (dns64_cache == NULL) {
+    return (-1);
+  }
+  dns64_cache_mask = entries - 1;
+  dns64_counters.cache_size = entries;
+
+  dns64_pendings = calloc(DNS64_MAX_PENDING, sizeof(struct dns64_pending));
+  dns64_ids = calloc(65536, sizeof(uint16_t));
+  if (dns64_pendings == NULL || dns64_ids == NULL) {
+    warnx("cannot allocate the DNS64 pending queries.");
+    return (-1);
+  }
+
+  pthread_attr_t attr;
+  affinity_init_attr("dns64", &attr);
+  int error = pthread_create(&dns64_thread, &attr, dns64_main, NULL);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    errno = error;
+    warn("cannot start the DNS64 thread.");
+    return (-1);
+  }
+  affinity_log("dns64");
+  dns64_active = 1;
+
+  return (0);
+}
+
+/* Returns 1 if the responder is running. */
+int
+dns64_is_active(void)
+{
+  return (dns64_active);
+}
+
+void
+dns64_get_stats(struct dns64_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  statsp->queries = __atomic_load_n(&dns64_counters.queries,
+				    __ATOMIC_RELAXED);
+  statsp->cache_hits = __atomic_load_n(&dns64_counters.cache_hits,
+				       __ATOMIC_RELAXED);
+  statsp->forwarded = __atomic_load_n(&dns64_counters.forwarded,
+				      __ATOMIC_RELAXED);
+  statsp->synthesized = __atomic_load_n(&dns64_counters.synthesized,
+					__ATOMIC_RELAXED);
+  statsp->timeouts = __atomic_load_n(&dns64_counters.timeouts,
+				     __ATOMIC_RELAXED);
+  statsp->errors = __atomic_load_n(&dns64_counters.errors,
+				   __ATOMIC_RELAXED);
+  statsp->cache_entries = __atomic_load_n(&dns64_counters.cache_entries,
+					  __ATOMIC_RELAXED);
+  statsp->cache_size = dns64_counters.cache_size;
+}
+
+/*
+ * The responder thread.  The messages are read in bursts from both
+ * sockets.
+ */
+static void *
+dns64_main(void *argp)
+{
+  (void)argp;
+
+  struct pollfd fds[2];
+  fds[0].fd = dns64_listen_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = dns64_upstream_fd;
+  fds[1].events = POLLIN;
+
+  uint8_t msg[DNS64_MAX_MSG];
+  for (;;) {
+    if (poll(fds, 2, 1000) == -1) {
+      if (errno != EINTR)
+	warn("poll() failed in the DNS64 thread.");
+      continue;
+    }
+    uint32_t now = dns64_now();
+
+    int count;
+    for (count = 0; count < DNS64_BURST; count++) {
+      struct sockaddr_storage client;
+      socklen_t client_len = sizeof(client);
+      ssize_t len = recvfrom(dns64_listen_fd, msg, sizeof(msg), MSG_DONTWAIT,
+			     (struct sockaddr *)&client, &client_len);
+      if (len == -1)
+	break;
+      dns64_handle_query(msg, len, &client, client_len, now);
+    }
+    for (count = 0; count < DNS64_BURST; count++) {
+      ssize_t len = recv(dns64_upstream_fd, msg, sizeof(msg), MSG_DONTWAIT);
+      if (len == -1)
+	break;
+      dns64_handle_response(msg, len, now);
+    }
+  }
+
+  return (NULL);
+}
+
+static uint32_t
+dns64_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec);
+}
+
+/* The counters are written by the responder thread only. */
+static void
+dns64_count(uint64_t *counterp)
+{
+  __atomic_store_n(counterp, *counterp + 1, __ATOMIC_RELAXED);
+}
+
+static uint16_t
+dns64_get16(const uint8_t *p)
+{
+  return ((p[0] << 8) | p[1]);
+}
+
+static void
+dns64_put16(uint8_t *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value;
+}
+
+static uint32_t
+dns64_get32(const uint8_t *p)
+{
+  return (((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+static void
+dns64_put32(uint8_t *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/*
+ * Parse the question of a query which has exactly one question with
+ * an uncompressed name.  Returns the length of the question, or -1.
+ */
+static int
+dns64_parse_question(const uint8_t *msg, size_t len, uint16_t *qtypep,
+		     uint16_t *qclassp)
+{
+  if (len < DNS64_HDR_LEN || dns64_get16(msg + 4) != 1)
+    return (-1);
+
+  size_t off = DNS64_HDR_LEN;
+  for (;;) {
+    if (off >= len)
+      return (-1);
+    uint8_t label_len = msg[off];
+    if (label_len == 0)
+      break;
+    if (label_len > 63)
+      return (-1);
+    off += 1 + label_len;
+  }
+  off++;
+  if (off - DNS64_HDR_LEN > DNS64_MAX_NAME || off + 4 > len)
+    return (-1);
+  *qtypep = dns64_get16(msg + off);
+  *qclassp = dns64_get16(msg + off + 2);
+
+  return (off + 4 - DNS64_HDR_LEN);
+}
+
+/* Skip a possibly compressed name.  Returns the offset after it, or -1. */
+static int
+dns64_skip_name(const uint8_t *msg, size_t len, int off)
+{
+  for (;;) {
+    if ((size_t)off >= len)
+      return (-1);
+    uint8_t label_len = msg[off];
+    if (label_len == 0)
+      return (off + 1);
+    if ((label_len & 0xc0) == 0xc0)
+      return ((size_t)off + 2 <= len ? off + 2 : -1);
+    if (label_len > 63)
+      return (-1);
+    off += 1 + label_len;
+  }
+}
+
+/*
+ * Collect the RDATA of the answers of the type into the array.  The
+ * smallest TTL is stored in ttlp.  Returns the number of the records,
+ * or -1 if the message is malformed.
+ */
+static int
+dns64_collect(const uint8_t *msg, size_t len, uint16_t type, uint8_t *rdatas,
+	      int rdata_len, int max, uint32_t *ttlp)
+{
+  if (len < DNS64_HDR_LEN)
+    return (-1);
+  int qdcount = dns64_get16(msg + 4);
+  int ancount = dns64_get16(msg + 6);
+
+  int off = DNS64_HDR_LEN;
+  while (qdcount--) {
+    off = dns64_skip_name(msg, len, off);
+    if (off == -1 || (size_t)off + 4 > len)
+      return (-1);
+    off += 4;
+  }
+
+  int count = 0;
+  uint32_t ttl = DNS64_MAX_TTL;
+  while (ancount--) {
+    off = dns64_skip_name(msg, len, off);
+    if (off == -1 || (size_t)off + 10 > len)
+      return (-1);
+    uint16_t rr_type = dns64_get16(msg + off);
+    uint16_t rr_class = dns64_get16(msg + off + 2);
+    uint32_t rr_ttl = dns64_get32(msg + off + 4);
+    uint16_t rr_len = dns64_get16(msg + off + 8);
+    off += 10;
+    if ((size_t)off + rr_len > len)
+      return (-1);
+    if (rr_type == type && rr_class == DNS64_CLASS_IN && rr_len == rdata_len
+	&& count < max) {
+      memcpy(rdatas + count * rdata_len, msg + off, rdata_len);
+      count++;
+      /* A TTL with the highest bit set is treated as 0 (RFC 2181). */
+      if (rr_ttl > 0x7fffffff)
+	rr_ttl = 0;
+      if (rr_ttl < ttl)
+	ttl = rr_ttl;
+    }
+    off += rr_len;
+  }
+  *ttlp = ttl;
+
+  return (count);
+}
+
+/* Hash a name in lower case, which is also copied to lower. */
+static uint64_t
+dns64_hash_name(const uint8_t *name, size_t name_len, uint8_t *lower)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t index;
+  for (index = 0; index < name_len; index++) {
+    uint8_t c = name[index];
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    lower[index] = c;
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return (h != 0 ? h : 1);
+}
+
+static const struct dns64_cache_entry *
+dns64_cache_lookup(const uint8_t *name, size_t name_len, uint32_t now)
+{
+  uint8_t lower[DNS64_MAX_NAME];
+  uint64_t h = dns64_hash_name(name, name_len, lower);
+
+  int probe;
+  for (probe = 0; probe < DNS64_CACHE_PROBES; probe++) {
+    const struct dns64_cache_entry *entryp
+      = &dns64_cache[(h + probe) & dns64_cache_mask];
+    if (entryp->hash == h && entryp->name_len == name_len
+	&& memcmp(entryp->name, lower, name_len) == 0) {
+      return (entryp->expire > now ? entryp : NULL);
+    }
+  }
+  return (NULL);
+}
+
+/*
+ * Insert an answer to the cache.  The entry of the same name, an
+ * unused or expired entry, or the entry which expires first is used,
+ * in this order.
+ */
+static void
+dns64_cache_insert(const uint8_t *name, size_t name_len,
+		   const struct in6_addr *addrs, int count, uint32_t ttl,
+		   uint32_t now)
+{
+  if (ttl == 0)
+    return;
+
+  uint8_t lower[DNS64_MAX_NAME];
+  uint64_t h = dns64_hash_name(name, name_len, lower);
+
+  struct dns64_cache_entry *victimp = NULL;
+  struct dns64_cache_entry *oldestp = NULL;
+  int probe;
+  for (probe = 0; probe < DNS64_CACHE_PROBES; probe++) {
+    struct dns64_cache_entry *entryp
+      = &dns64_cache[(h + probe) & dns64_cache_mask];
+    if (entryp->hash == h && entryp->name_len == name_len
+	&& memcmp(entryp->name, lower, name_len) == 0) {
+      victimp = entryp;
+      break;
+    }
+    if (victimp == NULL && (entryp->hash == 0 || entryp->expire <= now))
+      victimp = entryp;
+    if (oldestp == NULL || entryp->expire < oldestp->expire)
+      oldestp = entryp;
+  }
+  if (victimp == NULL)
+    victimp = oldestp;
+
+  if (victimp->hash == 0)
+    __atomic_store_n(&dns64_counters.cache_entries,
+		     dns64_counters.cache_entries + 1, __ATOMIC_RELAXED);
+  victimp->hash = h;
+  victimp->expire = now + ttl;
+  victimp->name_len = name_len;
+  victimp->count = count;
+  memcpy(victimp->name, lower, name_len);
+  memcpy(victimp->addrs, addrs, count * sizeof(struct in6_addr));
+}
+
+/*
+ * Draw an unused ID from the random numbers of the kernel, so that
+ * the IDs of the queries to the upstream cannot be predicted by a
+ * spoofer.  Returns -1 if no random number is available.
+ */
+static int
+dns64_new_id(void)
+{
+  uint16_t id;
+  do {
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+      return (-1);
+  } while (dns64_ids[id] != 0);
+  return (id);
+}
+
+/*
+ * Take a pending query slot with a new random ID.  The slots are used
+ * in turn, and a slot whose query has not been answered within the
+ * timeout is reused.
+ */
+static struct dns64_pending *
+dns64_alloc_pending(uint32_t now)
+{
+  int count;
+  for (count = 0; count < DNS64_MAX_PENDING; count++) {
+    unsigned int index = dns64_pending_cursor++ % DNS64_MAX_PENDING;
+    struct dns64_pending *pendingp = &dns64_pendings[index];
+    if (pendingp->state != DNS64_PENDING_FREE) {
+      if (pendingp->sent + DNS64_PENDING_TIMEOUT > now)
+	continue;
+      dns64_count(&dns64_counters.timeouts);
+      dns64_free_pending(pendingp);
+    }
+
+    int id = dns64_new_id();
+    if (id == -1)
+      return (NULL);
+    dns64_ids[id] = index + 1;
+    pendingp->id = id;
+    pendingp->sent = now;
+    return (pendingp);
+  }
+  return (NULL);
+}
+
+static void
+dns64_free_pending(struct dns64_pending *pendingp)
+{
+  dns64_ids[pendingp->id] = 0;
+  pendingp->state = DNS64_PENDING_FREE;
+}
+
+/*
+ * A query from a client.  A query of AAAA records is answered from
+ * the cache if possible.  Any other query is forwarded as is.
+ */
+static void
+dns64_handle_query(uint8_t *msg, size_t len,
+		   const struct sockaddr_storage *clientp, socklen_t client_len,
+		   uint32_t now)
+{
+  dns64_count(&dns64_counters.queries);
+  if (len < DNS64_HDR_LEN || (dns64_get16(msg + 2) & DNS64_FLAG_QR)) {
+    dns64_count(&dns64_counters.errors);
+    return;
+  }
+
+  uint16_t flags = dns64_get16(msg + 2);
+  uint16_t qtype = 0, qclass = 0;
+  int question_len = dns64_parse_question(msg, len, &qtype, &qclass);
+  int state = DNS64_PENDING_RELAY;
+  if (question_len != -1 && (flags & DNS64_FLAG_OPCODE) == 0
+      && qtype == DNS64_TYPE_AAAA && qclass == DNS64_CLASS_IN) {
+    state = DNS64_PENDING_AAAA;
+  }
+
+  if (state == DNS64_PENDING_AAAA) {
+    const struct dns64_cache_entry *entryp
+      = dns64_cache_lookup(msg + DNS64_HDR_LEN, question_len - 4, now);
+    if (entryp != NULL) {
+      struct dns64_pending pending;
+      pending.rd = (flags & DNS64_FLAG_RD) != 0;
+      pending.client_id = dns64_get16(msg);
+      pending.question_len = question_len;
+      memcpy(pending.question, msg + DNS64_HDR_LEN, question_len);
+      memcpy(&pending.client, clientp, client_len);
+      pending.client_len = client_len;
+      dns64_count(&dns64_counters.cache_hits);
+      dns64_send_answer(&pending, entryp->addrs, entryp->count,
+			entryp->expire - now);
+      return;
+    }
+  }
+
+  struct dns64_pending *pendingp = dns64_alloc_pending(now);
+  if (pendingp == NULL) {
+    dns64_count(&dns64_counters.errors);
+    return;
+  }
+  pendingp->state = state;
+  pendingp->rd = (flags & DNS64_FLAG_RD) != 0;
+  pendingp->client_id = dns64_get16(msg);
+  memcpy(&pendingp->client, clientp, client_len);
+  pendingp->client_len = client_len;
+  pendingp->question_len = 0;
+  if (question_len != -1) {
+    pendingp->question_len = question_len;
+    memcpy(pendingp->question, msg + DNS64_HDR_LEN, question_len);
+  }
+
+  dns64_put16(msg, pendingp->id);
+  if (send(dns64_upstream_fd, msg, len, MSG_DONTWAIT) == -1) {
+    dns64_count(&dns64_counters.errors);
+    dns64_free_pending(pendingp);
+    return;
+  }
+  dns64_count(&dns64_counters.forwarded);
+}
+
+/*
+ * A response from the upstream.  A response to a AAAA query without
+ * any AAAA record is not returned to the client, but the A records of
+ * the name are queried instead.
+ */
+static void
+dns64_handle_response(uint8_t *msg, size_t len, uint32_t now)
+{
+  if (len < DNS64_HDR_LEN || dns64_ids[dns64_get16(msg)] == 0) {
+    dns64_count(&dns64_counters.errors);
+    return;
+  }
+  struct dns64_pending *pendingp
+    = &dns64_pendings[dns64_ids[dns64_get16(msg)] - 1];
+  if (!dns64_match_question(pendingp, msg, len)) {
+    /* Possibly spoofed.  Keep waiting for the real response. */
+    dns64_count(&dns64_counters.errors);
+    return;
+  }
+  uint16_t flags = dns64_get16(msg + 2);
+  int failed = (flags & (DNS64_FLAG_RCODE | DNS64_FLAG_TC)) != 0;
+
+  if (pendingp->state == DNS64_PENDING_AAAA && !failed) {
+    struct in6_addr addrs[DNS64_MAX_ADDRS];
+    uint32_t ttl;
+    int count = dns64_collect(msg, len, DNS64_TYPE_AAAA, (uint8_t *)addrs,
+			      sizeof(struct in6_addr), DNS64_MAX_ADDRS, &ttl);
+    if (count == 0) {
+      /* No AAAA record, ask the A records. */
+      if (dns64_query_a(pendingp, now) == -1) {
+	dns64_count(&dns64_counters.errors);
+	dns64_free_pending(pendingp);
+      }
+      return;
+    }
+    if (count > 0)
+      dns64_cache_insert(pendingp->question, pendingp->question_len - 4,
+			 addrs, count, ttl, now);
+  } else if (pendingp->state == DNS64_PENDING_A) {
+    struct in6_addr addrs[DNS64_MAX_ADDRS];
+    struct in_addr addrs4[DNS64_MAX_ADDRS];
+    uint32_t ttl = 0;
+    int count = 0;
+    if (!failed) {
+      count = dns64_collect(msg, len, DNS64_TYPE_A, (uint8_t *)addrs4,
+			    sizeof(struct in_addr), DNS64_MAX_ADDRS, &ttl);
+    }
+    if (count > 0) {
+      struct in6_addr prefix;
+      mapping_read_lock();
+      mapping_get_prefix(&prefix);
+      mapping_read_unlock();
+      int index;
+      for (index = 0; index < count; index++) {
+	memcpy(&addrs[index], &prefix, 12);
+	memcpy(&addrs[index].s6_addr[12], &addrs4[index],
+	       sizeof(struct in_addr));
+      }
+      dns64_cache_insert(pendingp->question, pendingp->question_len - 4,
+			 addrs, count, ttl, now);
+      dns64_count(&dns64_counters.synthesized);
+    } else {
+      /* Neither AAAA nor A, the name has no data for the client. */
+      count = 0;
+      ttl = 0;
+    }
+    dns64_send_answer(pendingp, addrs, count, ttl);
+    dns64_free_pending(pendingp);
+    return;
+  }
+
+  dns64_put16(msg, pendingp->client_id);
+  dns64_send_client(pendingp, msg, len);
+  dns64_free_pending(pendingp);
+}
+
+/*
+ * Returns 1 if the question of a response is the question of the
+ * pending query, the name compared case-insensitively.  A relayed
+ * query whose question could not be parsed is not checked, as the
+ * response is only relayed to the client.
+ */
+static int
+dns64_match_question(const struct dns64_pending *pendingp,
+		     const uint8_t *msg, size_t len)
+{
+  if (pendingp->question_len == 0)
+    return (pendingp->state == DNS64_PENDING_RELAY);
+
+  uint16_t qtype, qclass;
+  int question_len = dns64_parse_question(msg, len, &qtype, &qclass);
+  if (question_len != pendingp->question_len)
+    return (0);
+  const uint8_t *questionp = msg + DNS64_HDR_LEN;
+  int off;
+  for (off = 0; off < question_len - 4; off++) {
+    uint8_t c1 = questionp[off], c2 = pendingp->question[off];
+    if (c1 >= 'A' && c1 <= 'Z')
+      c1 += 'a' - 'A';
+    if (c2 >= 'A' && c2 <= 'Z')
+      c2 += 'a' - 'A';
+    if (c1 != c2)
+      return (0);
+  }
+  uint16_t pending_qtype = pendingp->state == DNS64_PENDING_A
+    ? DNS64_TYPE_A : dns64_get16(pendingp->question + off);
+  return (qtype == pending_qtype
+	  && qclass == dns64_get16(pendingp->question + off + 2));
+}
+
+/*
+ * Query the A records of the name of a pending AAAA query.  The
+ * query advertises a larger UDP payload with EDNS so that the answer
+ * is not truncated.
+ */
+static int
+dns64_query_a(struct dns64_pending *pendingp, uint32_t now)
+{
+  uint8_t query[DNS64_HDR_LEN + sizeof(pendingp->question) + 11];
+  memset(query, 0, DNS64_HDR_LEN);
+
+  int id = dns64_new_id();
+  if (id == -1)
+    return (-1);
+  dns64_ids[pendingp->id] = 0;
+  dns64_ids[id] = pendingp - dns64_pendings + 1;
+  pendingp->id = id;
+  pendingp->sent = now;
+  pendingp->state = DNS64_PENDING_A;
+
+  dns64_put16(query, id);
+  dns64_put16(query + 2, DNS64_FLAG_RD);
+  dns64_put16(query + 4, 1);
+  dns64_put16(query + 10, 1);
+  size_t off = DNS64_HDR_LEN;
+  memcpy(query + off, pendingp->question, pendingp->question_len);
+  off += pendingp->question_len;
+  dns64_put16(query + off - 4, DNS64_TYPE_A);
+
+  /* The OPT record: root, type, payload size, extended RCODE and flags. */
+  query[off++] = 0;
+  dns64_put16(query + off, DNS64_TYPE_OPT);
+  dns64_put16(query + off + 2, DNS64_EDNS_SIZE);
+  dns64_put32(query + off + 4, 0);
+  dns64_put16(query + off + 8, 0);
+  off += 10;
+
+  if (send(dns64_upstream_fd, query, off, MSG_DONTWAIT) == -1)
+    return (-1);
+  dns64_count(&dns64_counters.forwarded);
+  return (0);
+}
+
+/*
+ * Send an answer with the AAAA records under the query name.  The
+ * answers refer to the name in the question by a compression pointer.
+ */
+static void
+dns64_send_answer(const struct dns64_pending *pendingp,
+		  const struct in6_addr *addrs, int count, uint32_t ttl)
+{
+  uint8_t msg[DNS64_HDR_LEN + sizeof(pendingp->question)
+	      + DNS64_MAX_ADDRS * 28];
+  memset(msg, 0, DNS64_HDR_LEN);
+
+  dns64_put16(msg, pendingp->client_id);
+  dns64_put16(msg + 2, DNS64_FLAG_QR | DNS64_FLAG_RA
+	      | (pendingp->rd ? DNS64_FLAG_RD : 0));
+  dns64_put16(msg + 4, 1);
+  dns64_put16(msg + 6, count);
+  size_t off = DNS64_HDR_LEN;
+  memcpy(msg + off, pendingp->question, pendingp->question_len);
+  off += pendingp->question_len;
+
+  int index;
+  for (index = 0; index < count; index++) {
+    dns64_put16(msg + off, 0xc000 | DNS64_HDR_LEN);
+    dns64_put16(msg + off + 2, DNS64_TYPE_AAAA);
+    dns64_put16(msg + off + 4, DNS64_CLASS_IN);
+    dns64_put32(msg + off + 6, ttl);
+    dns64_put16(msg + off + 10, sizeof(struct in6_addr));
+    memcpy(msg + off + 12, &addrs[index], sizeof(struct in6_addr));
+    off += 12 + sizeof(struct in6_addr);
+  }
+
+  dns64_send_client(pendingp, msg, off);
+}
+
+static void
+dns64_send_client(const struct dns64_pending *pendingp, const uint8_t *msg,
+		  size_t len)
+{
+  if (sendto(dns64_listen_fd, msg, len, MSG_DONTWAIT,
+	     (const struct sockaddr *)&pendingp->client,
+	     pendingp->client_len) == -1) {
+    dns64_count(&dns64_counters.errors);
+  }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __DNS64_H__
+#define __DNS64_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DNS64_DEFAULT_PORT 53
+#define DNS64_DEFAULT_CACHE_SIZE 16384
+#define DNS64_MAX_CACHE_SIZE 1048576
+
+extern int dns64_cache_size;
+
+struct dns64_stats {
+  uint64_t queries;		/* the queries from the clients */
+  uint64_t cache_hits;		/* answered from the cache */
+  uint64_t forwarded;		/* the queries sent to the upstream */
+  uint64_t synthesized;		/* answered with the synthesized AAAA */
+  uint64_t timeouts;		/* no response from the upstream */
+  uint64_t errors;		/* dropped, malformed or no room */
+  unsigned int cache_entries;	/* the valid entries of the cache */
+  unsigned int cache_size;
+};
+
+int dns64_set_listen(const char *, const char *);
+int dns64_set_upstream(const char *, const char *);
+int dns64_start(void);
+int dns64_is_active(void);
+void dns64_get_stats(struct dns64_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
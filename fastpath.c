@@ -0,0 +1,941 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include "bpfsub.h"
+#include "pmtudisc.h"
+#include "mapping.h"
+#include "fastpath.h"
+
+/*
+ * The configuration shared with the fast path program.  The program
+ * reads it from the index 0 of an array map.
+ */
+struct fastpath_config {
+  struct in6_addr prefix;
+  uint32_t mtu;
+  uint32_t flow_key;		/* the flow label hash key, or 0 */
+};
+
+static char fastpath_if_names[FASTPATH_MAX_INTERFACES][IFNAMSIZ];
+static int fastpath_if_indexes[FASTPATH_MAX_INTERFACES];
+static int fastpath_if_count;
+static int fastpath_attached_count;
+
+static int fastpath_prog_fd = -1;
+static int fastpath_config_map_fd = -1;
+static int fastpath_map4_fd = -1;
+static int fastpath_map6_fd = -1;
+static int fastpath_map66_GtoI_fd = -1;
+static int fastpath_map66_ItoG_fd = -1;
+static int fastpath_pmtu4_map_fd = -1;
+static int fastpath_pmtu6_map_fd = -1;
+static int fastpath_stats_map_fd = -1;
+
+static int fastpath_create_maps(void);
+static int fastpath_load_program(void);
+static void fastpath_emit_lookup(struct bpfsub_prog *, int, int);
+static void fastpath_emit_copy(struct bpfsub_prog *, int, int, int, int);
+static void fastpath_emit_mtu_check(struct bpfsub_prog *, int, int, int, int,
+				    int, int, int);
+static void fastpath_emit_l4_csum(struct bpfsub_prog *, int);
+static void fastpath_emit_count(struct bpfsub_prog *, int);
+static void fastpath_emit_rewrite66(struct bpfsub_prog *, int);
+static void fastpath_close_fd(int *);
+
+/*
+ * Register the interface to which the fast path program is attached.
+ * This is called while reading the configuration file, and takes
+ * effect when the fastpath_alloc() function is called.
+ */
+int
+fastpath_add_interface(const char *if_name)
+{
+  assert(if_name != NULL);
+
+  if (strlen(if_name) >= IFNAMSIZ) {
+    warnx("invalid interface name %s.", if_name);
+    return (-1);
+  }
+
+  int count;
+  for (count = 0; count < fastpath_if_count; count++) {
+    if (strcmp(fastpath_if_names[count], if_name) == 0) {
+      /* Already registered (e.g. reloaded). */
+      return (0);
+    }
+  }
+  if (fastpath_if_count == FASTPATH_MAX_INTERFACES) {
+    warnx("too many fast path interfaces.");
+    return (-1);
+  }
+  strncpy(fastpath_if_names[fastpath_if_count++], if_name, IFNAMSIZ);
+
+  return (0);
+}
+
+/*
+ * Load the fast path program and attach it to the tc ingress hook of
+ * the registered interfaces.  The program translates the plain TCP
+ * and UDP packets in the kernel, and passes all other packets to the
+ * kernel unchanged, so that they are routed to the tun interface as
+ * before.
+ *
+ * Returns 0 if the fast path is not configured or works, -1 if it is
+ * configured but not available.
+ */
+int
+fastpath_alloc(void)
+{
+  if (fastpath_if_count == 0) {
+    /* Not configured. */
+    return (0);
+  }
+
+  if (fastpath_create_maps() == -1
+      || fastpath_load_program() == -1) {
+    fastpath_dealloc();
+    return (-1);
+  }
+
+  int count;
+  for (count = 0; count < fastpath_if_count; count++) {
+    fastpath_if_indexes[count] = if_nametoindex(fastpath_if_names[count]);
+    if (fastpath_if_indexes[count] == 0) {
+      warn("cannot find the fast path interface %s.",
+	   fastpath_if_names[count]);
+      fastpath_dealloc();
+      return (-1);
+    }
+    if (bpfsub_attach_tc(fastpath_if_indexes[count], fastpath_prog_fd,
+			 "map646_fastpath") == -1) {
+      warn("failed to attach the fast path program to %s.",
+	   fastpath_if_names[count]);
+      fastpath_dealloc();
+      return (-1);
+    }
+    fastpath_attached_count = count + 1;
+  }
+
+  warnx("fast path is attached to %d interface(s).", fastpath_if_count);
+
+  return (0);
+}
+
+/* Detach the fast path program and release all the resources. */
+void
+fastpath_dealloc(void)
+{
+  while (fastpath_attached_count > 0) {
+    fastpath_attached_count--;
+    if (bpfsub_detach_tc(fastpath_if_indexes[fastpath_attached_count])
+	== -1) {
+      warn("failed to detach the fast path program from %s.",
+	   fastpath_if_names[fastpath_attached_count]);
+    }
+  }
+
+  fastpath_close_fd(&fastpath_prog_fd);
+  fastpath_close_fd(&fastpath_config_map_fd);
+  fastpath_close_fd(&fastpath_map4_fd);
+  fastpath_close_fd(&fastpath_map6_fd);
+  fastpath_close_fd(&fastpath_map66_GtoI_fd);
+  fastpath_close_fd(&fastpath_map66_ItoG_fd);
+  fastpath_close_fd(&fastpath_pmtu4_map_fd);
+  fastpath_close_fd(&fastpath_pmtu6_map_fd);
+  fastpath_close_fd(&fastpath_stats_map_fd);
+}
+
+/* Returns 1 if the fast path program is attached. */
+int
+fastpath_is_active(void)
+{
+  return (fastpath_attached_count > 0);
+}
+
+/* Add a mapping entry of the map-static directive. */
+int
+fastpath_add_mapping(const struct in_addr *addr4p,
+		     const struct in6_addr *addr6p)
+{
+  assert(addr4p != NULL);
+  assert(addr6p != NULL);
+
+  if (fastpath_prog_fd == -1)
+    return (0);
+
+  if (bpfsub_map_update(fastpath_map4_fd, addr4p, addr6p) == -1
+      || bpfsub_map_update(fastpath_map6_fd, addr6p, addr4p) == -1) {
+    warn("failed to add a mapping entry to the fast path.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* Add a mapping entry of the map66-static directive. */
+int
+fastpath_add_mapping66(const struct in6_addr *globalp,
+		       const struct in6_addr *intrap)
+{
+  assert(globalp != NULL);
+  assert(intrap != NULL);
+
+  if (fastpath_prog_fd == -1)
+    return (0);
+
+  if (bpfsub_map_update(fastpath_map66_GtoI_fd, globalp, intrap) == -1
+      || bpfsub_map_update(fastpath_map66_ItoG_fd, intrap, globalp) == -1) {
+    warn("failed to add a 6-to-6 mapping entry to the fast path.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Set the mapping prefix and the key of the flow label hash
+ * (mapping_flow_key).  The fast path doesn't work until this is
+ * called.
+ */
+int
+fastpath_set_prefix(const struct in6_addr *prefixp, uint32_t flow_key)
+{
+  assert(prefixp != NULL);
+
+  if (fastpath_prog_fd == -1)
+    return (0);
+
+  struct fastpath_config config;
+  memset(&config, 0, sizeof(struct fastpath_config));
+  memcpy(&config.prefix, prefixp, sizeof(struct in6_addr));
+  config.mtu = pmtudisc_default_mtu;
+  config.flow_key = flow_key;
+  uint32_t key = 0;
+  if (bpfsub_map_update(fastpath_config_map_fd, &key, &config) == -1) {
+    warn("failed to set the fast path configuration.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Set the path MTU size toward the address, which is the destination
+ * address of the translated packet.  The fast path program passes the
+ * packets which don't fit in the MTU to the tun interface, so that
+ * they are fragmented in the same way as the other packets.  If the
+ * mtu parameter is 0, the entry is removed.
+ */
+int
+fastpath_set_path_mtu(int af, const void *addrp, int mtu)
+{
+  assert(addrp != NULL);
+
+  if (fastpath_prog_fd == -1)
+    return (0);
+
+  int map_fd;
+  switch (af) {
+  case AF_INET:
+    map_fd = fastpath_pmtu4_map_fd;
+    break;
+  case AF_INET6:
+    map_fd = fastpath_pmtu6_map_fd;
+    break;
+  default:
+    warnx("unsupported address family %d.", af);
+    return (-1);
+  }
+
+  if (mtu == 0) {
+    if (bpfsub_map_delete(map_fd, addrp) == -1 && errno != ENOENT) {
+      warn("failed to remove a path MTU entry from the fast path.");
+      return (-1);
+    }
+    return (0);
+  }
+
+  uint32_t value = mtu;
+  if (bpfsub_map_update(map_fd, addrp, &value) == -1) {
+    warn("failed to add a path MTU entry to the fast path.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Remove all the mapping entries.  The fast path passes all the
+ * packets to the tun interface until the entries are added again.
+ */
+int
+fastpath_clear(void)
+{
+  if (fastpath_prog_fd == -1)
+    return (0);
+
+  uint32_t key = 0;
+  struct fastpath_config config;
+  memset(&config, 0, sizeof(struct fastpath_config));
+  if (bpfsub_map_update(fastpath_config_map_fd, &key, &config) == -1
+      || bpfsub_map_clear(fastpath_map4_fd, sizeof(struct in_addr)) == -1
+      || bpfsub_map_clear(fastpath_map6_fd, sizeof(struct in6_addr)) == -1
+      || bpfsub_map_clear(fastpath_map66_GtoI_fd,
+			  sizeof(struct in6_addr)) == -1
+      || bpfsub_map_clear(fastpath_map66_ItoG_fd,
+			  sizeof(struct in6_addr)) == -1) {
+    warnx("failed to clear the fast path maps.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* Read the packet counters of the fast path program. */
+void
+fastpath_get_stats(struct fastpath_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  memset(statsp, 0, sizeof(struct fastpath_stats));
+  if (fastpath_stats_map_fd == -1)
+    return;
+
+  uint32_t key;
+  for (key = 0; key < FASTPATH_STAT_MAX; key++) {
+    bpfsub_map_lookup(fastpath_stats_map_fd, &key, &statsp->packets[key]);
+  }
+}
+
+static int
+fastpath_create_maps(void)
+{
+  fastpath_config_map_fd = bpfsub_map_create(BPF_MAP_TYPE_ARRAY,
+    sizeof(uint32_t), sizeof(struct fastpath_config), 1, 0);
+  fastpath_map4_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in_addr), sizeof(struct in6_addr), FASTPATH_MAX_MAPPINGS, 0);
+  fastpath_map6_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in6_addr), sizeof(struct in_addr), FASTPATH_MAX_MAPPINGS, 0);
+  fastpath_map66_GtoI_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in6_addr), sizeof(struct in6_addr),
+    FASTPATH_MAX_MAPPINGS, 0);
+  fastpath_map66_ItoG_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in6_addr), sizeof(struct in6_addr),
+    FASTPATH_MAX_MAPPINGS, 0);
+  fastpath_pmtu4_map_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in_addr), sizeof(uint32_t), FASTPATH_MAX_PATH_MTUS, 0);
+  fastpath_pmtu6_map_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in6_addr), sizeof(uint32_t), FASTPATH_MAX_PATH_MTUS, 0);
+  fastpath_stats_map_fd = bpfsub_map_create(BPF_MAP_TYPE_ARRAY,
+    sizeof(uint32_t), sizeof(uint64_t), FASTPATH_STAT_MAX, 0);
+
+  if (fastpath_config_map_fd == -1
+      || fastpath_map4_fd == -1
+      || fastpath_map6_fd == -1
+      || fastpath_map66_GtoI_fd == -1
+      || fastpath_map66_ItoG_fd == -1
+      || fastpath_pmtu4_map_fd == -1
+      || fastpath_pmtu6_map_fd == -1
+      || fastpath_stats_map_fd == -1) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Offsets in the Ethernet frame seen by the program, and the stack
+ * layout of the program.
+ */
+#define FP_IP4_VHL 14
+#define FP_IP4_LEN 16
+#define FP_IP4_OFF 20
+#define FP_IP4_TTL 22
+#define FP_IP4_PROTO 23
+#define FP_IP4_SRC 26
+#define FP_IP4_DST 30
+#define FP_IP4_L4 34
+#define FP_IP6_PLEN 18
+#define FP_IP6_NXT 20
+#define FP_IP6_HLIM 21
+#define FP_IP6_SRC 22
+#define FP_IP6_DST 38
+#define FP_IP6_L4 54
+#define FP_UDP_SUM 6
+#define FP_TCP_SUM 16
+
+#define FP_STACK_HDR (-40)	/* the new IP header, 40 bytes */
+#define FP_STACK_KEY (-48)	/* 4 bytes map key or ether type */
+#define FP_STACK_KEY6 (-64)	/* 16 bytes map key */
+#define FP_STACK_MTU (-68)	/* the default MTU */
+#define FP_STACK_FLOW (-72)	/* the flow label hash key */
+
+enum {
+  FP_L_PASS, FP_L_DROP,
+  FP_L_IP4, FP_L_IP4_TCP, FP_L_IP4_L4, FP_L_FLOW4,
+  FP_L_IP6, FP_L_IP6_TCP, FP_L_IP6_L4,
+  FP_L_MTU4_DEFAULT, FP_L_MTU4_GSO, FP_L_MTU4_LEN,
+  FP_L_MTU6_DEFAULT, FP_L_MTU6_GSO, FP_L_MTU6_LEN,
+  FP_L_66, FP_L_66_GTOI
+};
+
+/*
+ * Build and load the fast path program.  The registers are used as
+ * follows.
+ *
+ *   r6: the context (struct __sk_buff)
+ *   r7: the checksum difference, or the MTU size
+ *   r8: the start of the Ethernet frame
+ *   r9: the offset of the checksum field in the TCP or UDP header
+ *
+ * Packets are passed unchanged (TC_ACT_OK) unless all the following
+ * conditions are satisfied.
+ *
+ *   - TCP or UDP, not fragmented, no IPv4 options or IPv6 extension
+ *     headers (ICMP is always handled by map646 itself).
+ *   - The UDP checksum is not 0 for IPv4.
+ *   - The mapping entry exists and the direction is the same as the
+ *     one the dispatch() function decides.
+ *   - The translated packet (or each segment of a GSO packet) fits
+ *     in the path MTU.  The path MTU is pmtudisc_default_mtu unless
+ *     the pmtudisc module has learned a smaller one.
+ */
+static int
+fastpath_load_program(void)
+{
+  struct bpfsub_prog *progp = malloc(sizeof(struct bpfsub_prog));
+  if (progp == NULL) {
+    warnx("memory allocation failed for struct bpfsub_prog{}.");
+    return (-1);
+  }
+  bpfsub_prog_init(progp);
+
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+				 offsetof(struct __sk_buff, protocol)));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IP), 0),
+		  FP_L_IP4);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IPV6), 0),
+		  FP_L_IP6);
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), FP_L_PASS);
+
+  /*
+   * IPv4 to IPv6.
+   */
+  bpfsub_label(progp, FP_L_IP4);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_8, BPF_REG_6,
+				 offsetof(struct __sk_buff, data)));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6,
+				 offsetof(struct __sk_buff, data_end)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4,
+				   FP_IP4_L4 + FP_UDP_SUM + 2));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  FP_L_PASS);
+  /* No options, no fragments. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP4_VHL));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, 0x45, 0), FP_L_PASS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_8, FP_IP4_OFF));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_AND, BPF_REG_2,
+				   htons(IP_MF|IP_OFFMASK)));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, 0, 0), FP_L_PASS);
+  /* TCP or UDP with checksum. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP4_PROTO));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, IPPROTO_TCP, 0),
+		  FP_L_IP4_TCP);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, IPPROTO_UDP, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_9, FP_UDP_SUM));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_8,
+				 FP_IP4_L4 + FP_UDP_SUM));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, 0, 0), FP_L_PASS);
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), FP_L_IP4_L4);
+  bpfsub_label(progp, FP_L_IP4_TCP);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, FP_IP4_L4 + 20));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_9, FP_TCP_SUM));
+  bpfsub_label(progp, FP_L_IP4_L4);
+
+  /* The source address is the mapping prefix + the IPv4 source. */
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_W, BPF_REG_10, FP_STACK_KEY, 0));
+  fastpath_emit_lookup(progp, fastpath_config_map_fd, FP_STACK_KEY);
+  fastpath_emit_copy(progp, BPF_REG_0, 0, FP_STACK_HDR + 8, 3);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0,
+				 offsetof(struct fastpath_config, mtu)));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_MTU));
+  fastpath_emit_copy(progp, BPF_REG_0, offsetof(struct fastpath_config,
+						flow_key), FP_STACK_FLOW, 1);
+  fastpath_emit_copy(progp, BPF_REG_8, FP_IP4_SRC, FP_STACK_HDR + 20, 1);
+
+  /* The destination address comes from the mapping table. */
+  fastpath_emit_copy(progp, BPF_REG_8, FP_IP4_DST, FP_STACK_KEY, 1);
+  fastpath_emit_lookup(progp, fastpath_map4_fd, FP_STACK_KEY);
+  fastpath_emit_copy(progp, BPF_REG_0, 0, FP_STACK_HDR + 24, 4);
+
+  /* Path MTU check. */
+  fastpath_emit_mtu_check(progp, fastpath_pmtu6_map_fd, FP_STACK_HDR + 24,
+			  FP_IP4_LEN, sizeof(struct ip6_hdr) - sizeof(struct ip),
+			  sizeof(struct ip6_hdr), FP_IP4_L4, FP_L_MTU4_DEFAULT);
+
+  /*
+   * The version and the flow label.  The same hash as
+   * flow_label_4to6() in map646.cpp, over the words as they are in
+   * the packet.  The label is 0 if the key is 0.
+   */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 FP_STACK_FLOW));
+  bpfsub_emit(progp, BPF_MOV32_IMM(BPF_REG_5, 0));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, 0, 0),
+		  FP_L_FLOW4);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_8, FP_IP4_SRC));
+  bpfsub_emit(progp, BPF_ALU32_REG(BPF_XOR, BPF_REG_2, BPF_REG_4));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_MUL, BPF_REG_2,
+				   (int32_t)MAPPING_FLOW_MUL1));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_8, FP_IP4_DST));
+  bpfsub_emit(progp, BPF_ALU32_REG(BPF_XOR, BPF_REG_2, BPF_REG_4));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_4, BPF_REG_8, FP_IP4_PROTO));
+  bpfsub_emit(progp, BPF_ALU32_REG(BPF_XOR, BPF_REG_2, BPF_REG_4));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_MUL, BPF_REG_2,
+				   (int32_t)MAPPING_FLOW_MUL2));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_8, FP_IP4_L4));
+  bpfsub_emit(progp, BPF_ALU32_REG(BPF_XOR, BPF_REG_2, BPF_REG_4));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_MUL, BPF_REG_2,
+				   (int32_t)MAPPING_FLOW_MUL3));
+  bpfsub_emit(progp, BPF_MOV32_REG(BPF_REG_5, BPF_REG_2));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_RSH, BPF_REG_5, 12));
+  bpfsub_emit(progp, BPF_ALU32_REG(BPF_XOR, BPF_REG_5, BPF_REG_2));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_AND, BPF_REG_5,
+				   MAPPING_FLOW_LABEL_MASK));
+  bpfsub_label(progp, FP_L_FLOW4);
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_OR, BPF_REG_5, 0x60000000));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_TO_BE, BPF_REG_5, 32));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_5, FP_STACK_HDR));
+
+  /* The rest of the IPv6 header. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_8, FP_IP4_LEN));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_FROM_BE, BPF_REG_2, 16));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_SUB, BPF_REG_2, sizeof(struct ip)));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_TO_BE, BPF_REG_2, 16));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 4));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP4_PROTO));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_B, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 6));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP4_TTL));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_B, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 7));
+
+  /*
+   * The difference of the pseudo headers.  The length and protocol
+   * parts are the same, so only the addresses are counted.
+   */
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, FP_IP4_SRC));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 8));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR + 8));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, 32));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_csum_diff));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+
+  /* Replace the headers. */
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, htons(ETH_P_IPV6)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_3, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_change_proto));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_PASS);
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_KEY,
+				htons(ETH_P_IPV6)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, ETH_HLEN - 2));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_KEY));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, 2));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_store_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, ETH_HLEN));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, sizeof(struct ip6_hdr)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_store_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+  fastpath_emit_l4_csum(progp, FP_IP6_L4);
+  fastpath_emit_count(progp, FASTPATH_STAT_4TO6);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_OK));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  /*
+   * IPv6 to IPv4, or IPv6 to IPv6.
+   */
+  bpfsub_label(progp, FP_L_IP6);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_8, BPF_REG_6,
+				 offsetof(struct __sk_buff, data)));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6,
+				 offsetof(struct __sk_buff, data_end)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4,
+				   FP_IP6_L4 + FP_UDP_SUM + 2));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  FP_L_PASS);
+  /* TCP or UDP without any extension headers. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP6_NXT));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, IPPROTO_TCP, 0),
+		  FP_L_IP6_TCP);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, IPPROTO_UDP, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_9, FP_UDP_SUM));
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), FP_L_IP6_L4);
+  bpfsub_label(progp, FP_L_IP6_TCP);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, FP_IP6_L4 + 20));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_9, FP_TCP_SUM));
+  bpfsub_label(progp, FP_L_IP6_L4);
+
+  /*
+   * Same as dispatch(), the direction is decided by the source
+   * address.  If it is one of the IPv6 servers mapped to IPv4
+   * addresses, the packet is translated to IPv4.
+   */
+  fastpath_emit_copy(progp, BPF_REG_8, FP_IP6_SRC, FP_STACK_KEY6, 4);
+  bpfsub_emit_map_fd(progp, BPF_REG_1, fastpath_map6_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, FP_STACK_KEY6));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), FP_L_66);
+  fastpath_emit_copy(progp, BPF_REG_0, 0, FP_STACK_HDR + 12, 1);
+
+  /* The destination must be in the mapping prefix. */
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_W, BPF_REG_10, FP_STACK_KEY, 0));
+  fastpath_emit_lookup(progp, fastpath_config_map_fd, FP_STACK_KEY);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0, 0));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_8, FP_IP6_DST));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JNE, BPF_REG_2, BPF_REG_3, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0, 4));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_8, FP_IP6_DST + 4));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JNE, BPF_REG_2, BPF_REG_3, 0),
+		  FP_L_PASS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0,
+				 offsetof(struct fastpath_config, mtu)));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_MTU));
+  fastpath_emit_copy(progp, BPF_REG_8, FP_IP6_DST + 12, FP_STACK_HDR + 16, 1);
+
+  /* Path MTU check. */
+  fastpath_emit_mtu_check(progp, fastpath_pmtu4_map_fd, FP_STACK_HDR + 16,
+			  FP_IP6_PLEN, sizeof(struct ip), sizeof(struct ip),
+			  FP_IP6_L4, FP_L_MTU6_DEFAULT);
+
+  /* The rest of the IPv4 header, the same as send_6to4() makes. */
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_HDR,
+				htons(0x4500)));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_8, FP_IP6_PLEN));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_FROM_BE, BPF_REG_2, 16));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, sizeof(struct ip)));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_TO_BE, BPF_REG_2, 16));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 2));
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_HDR + 4, 0));
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_HDR + 6,
+				htons(IP_DF)));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP6_HLIM));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_B, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 8));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, FP_IP6_NXT));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_B, BPF_REG_10, BPF_REG_2,
+				 FP_STACK_HDR + 9));
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_HDR + 10, 0));
+
+  /* The IPv4 header checksum. */
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_1, 0));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, sizeof(struct ip)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_csum_diff));
+  bpfsub_emit(progp, BPF_MOV32_REG(BPF_REG_0, BPF_REG_0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_0));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, 16));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_AND, BPF_REG_0, 0xffff));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_0));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, 16));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_XOR, BPF_REG_0, 0xffff));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0,
+				 FP_STACK_HDR + 10));
+
+  /* The difference of the pseudo headers. */
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, FP_IP6_SRC));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 32));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR + 12));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, 8));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_csum_diff));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+
+  /* Replace the headers. */
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, htons(ETH_P_IP)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_3, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_change_proto));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_PASS);
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_H, BPF_REG_10, FP_STACK_KEY,
+				htons(ETH_P_IP)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, ETH_HLEN - 2));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_KEY));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, 2));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_store_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, ETH_HLEN));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, sizeof(struct ip)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_store_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+  fastpath_emit_l4_csum(progp, FP_IP4_L4);
+  fastpath_emit_count(progp, FASTPATH_STAT_6TO4);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_OK));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  /*
+   * IPv6 to IPv6.  If the source is an internal address, it is
+   * replaced with the global address.  Otherwise, the destination
+   * global address is replaced with the internal address.  The key
+   * area still has the source address here.
+   */
+  bpfsub_label(progp, FP_L_66);
+  bpfsub_emit_map_fd(progp, BPF_REG_1, fastpath_map66_ItoG_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, FP_STACK_KEY6));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), FP_L_66_GTOI);
+  fastpath_emit_rewrite66(progp, FP_IP6_SRC);
+
+  bpfsub_label(progp, FP_L_66_GTOI);
+  fastpath_emit_copy(progp, BPF_REG_8, FP_IP6_DST, FP_STACK_KEY6, 4);
+  fastpath_emit_lookup(progp, fastpath_map66_GtoI_fd, FP_STACK_KEY6);
+  fastpath_emit_rewrite66(progp, FP_IP6_DST);
+
+  bpfsub_label(progp, FP_L_DROP);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_SHOT));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  bpfsub_label(progp, FP_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_OK));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  fastpath_prog_fd = bpfsub_prog_load(progp, BPF_PROG_TYPE_SCHED_CLS,
+				      "map646_fastpath");
+  free(progp);
+
+  return (fastpath_prog_fd == -1 ? -1 : 0);
+}
+
+/*
+ * Look up the map with the key on the stack.  Jumps to FP_L_PASS if
+ * not found, otherwise r0 points the value.
+ */
+static void
+fastpath_emit_lookup(struct bpfsub_prog *progp, int map_fd, int key_off)
+{
+  bpfsub_emit_map_fd(progp, BPF_REG_1, map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, key_off));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), FP_L_PASS);
+}
+
+/* Copy the words from the memory pointed by the register to the stack. */
+static void
+fastpath_emit_copy(struct bpfsub_prog *progp, int src_reg, int src_off,
+		   int stack_off, int words)
+{
+  int count;
+  for (count = 0; count < words; count++) {
+    bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_1, src_reg,
+				   src_off + count * 4));
+    bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1,
+				   stack_off + count * 4));
+  }
+}
+
+/*
+ * Pass the packet if the translated packet doesn't fit in the path
+ * MTU toward the translated destination address on the stack at
+ * key_off.  The length of the translated packet is the length field
+ * at len_off + len_adj.  For a GSO packet, the size of each segment
+ * is checked instead, which is the new IP header (hdr_len) + the TCP
+ * or UDP header + gso_size.  Uses 3 labels from label.
+ */
+static void
+fastpath_emit_mtu_check(struct bpfsub_prog *progp, int pmtu_map_fd,
+			int key_off, int len_off, int len_adj, int hdr_len,
+			int l4_off, int label)
+{
+  bpfsub_emit_map_fd(progp, BPF_REG_1, pmtu_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, key_off));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_10, FP_STACK_MTU));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), label);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_0, 0));
+  bpfsub_label(progp, label);
+
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_8, len_off));
+  bpfsub_emit(progp, BPF_ENDIAN(BPF_FROM_BE, BPF_REG_2, 16));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, len_adj));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6,
+				 offsetof(struct __sk_buff, gso_size)));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_3, 0, 0), label + 2);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 8));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, FP_UDP_SUM, 0),
+		  label + 1);
+  /* The TCP data offset. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_8, l4_off + 12));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_RSH, BPF_REG_2, 4));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_LSH, BPF_REG_2, 2));
+  bpfsub_label(progp, label + 1);
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_ADD, BPF_REG_2, BPF_REG_3));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, hdr_len));
+  bpfsub_label(progp, label + 2);
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_2, BPF_REG_7, 0),
+		  FP_L_PASS);
+}
+
+/*
+ * Update the TCP or UDP checksum with the difference of the pseudo
+ * header in r7.  l4_off is the offset of the TCP or UDP header after
+ * the translation.
+ */
+static void
+fastpath_emit_l4_csum(struct bpfsub_prog *progp, int l4_off)
+{
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_9));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, l4_off));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_3, 0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_7));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, BPF_F_PSEUDO_HDR));
+  /* A UDP checksum must not become 0. */
+  bpfsub_emit(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_9, FP_UDP_SUM, 1));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5,
+				   BPF_F_PSEUDO_HDR|BPF_F_MARK_MANGLED_0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_l4_csum_replace));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+}
+
+/* Increment the packet counter. */
+static void
+fastpath_emit_count(struct bpfsub_prog *progp, int index)
+{
+  bpfsub_emit(progp, BPF_ST_MEM(BPF_W, BPF_REG_10, FP_STACK_KEY, index));
+  bpfsub_emit_map_fd(progp, BPF_REG_1, fastpath_stats_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, FP_STACK_KEY));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_1, 1));
+  bpfsub_emit(progp, BPF_ATOMIC_OP(BPF_DW, BPF_ADD, BPF_REG_0, BPF_REG_1, 0));
+}
+
+/*
+ * Replace the IPv6 address at addr_off with the one pointed by r0,
+ * and finish the 6-to-6 translation.
+ */
+static void
+fastpath_emit_rewrite66(struct bpfsub_prog *progp, int addr_off)
+{
+  fastpath_emit_copy(progp, BPF_REG_0, 0, FP_STACK_HDR, 4);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, addr_off));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, sizeof(struct in6_addr)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, sizeof(struct in6_addr)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_csum_diff));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_7, BPF_REG_0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, addr_off));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, FP_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, sizeof(struct in6_addr)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_5, 0));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_store_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), FP_L_DROP);
+  fastpath_emit_l4_csum(progp, FP_IP6_L4);
+  fastpath_emit_count(progp, FASTPATH_STAT_66);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, TC_ACT_OK));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+}
+
+static void
+fastpath_close_fd(int *fdp)
+{
+  assert(fdp != NULL);
+
+  if (*fdp != -1) {
+    close(*fdp);
+    *fdp = -1;
+  }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FASTPATH_H__
+#define __FASTPATH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FASTPATH_MAX_INTERFACES 8
+#define FASTPATH_MAX_MAPPINGS 65536
+#define FASTPATH_MAX_PATH_MTUS 10000
+
+/* Indexes of the packet counters of the fast path program. */
+#define FASTPATH_STAT_4TO6 0
+#define FASTPATH_STAT_6TO4 1
+#define FASTPATH_STAT_66 2
+#define FASTPATH_STAT_MAX 3
+
+struct fastpath_stats {
+  uint64_t packets[FASTPATH_STAT_MAX];
+};
+
+int fastpath_add_interface(const char *);
+int fastpath_alloc(void);
+void fastpath_dealloc(void);
+int fastpath_is_active(void);
+int fastpath_add_mapping(const struct in_addr *, const struct in6_addr *);
+int fastpath_add_mapping66(const struct in6_addr *, const struct in6_addr *);
+int fastpath_set_prefix(const struct in6_addr *, uint32_t);
+int fastpath_set_path_mtu(int, const void *, int);
+int fastpath_clear(void);
+void fastpath_get_stats(struct fastpath_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
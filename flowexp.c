@@ -0,0 +1,735 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+
+#include "flowexp.h"
+#include "affinity.h"
+
+/*
+ * The flow table and its IPFIX (RFC 7011) exporter.  A flow is keyed
+ * by the 5-tuple of the packets before the translation, and counts
+ * the packets and the bytes, and the times of the first and the last
+ * packets.
+ *
+ * The table is an open addressing hash table of fixed size entries
+ * allocated at startup.  A flow is searched in the window of
+ * FLOWEXP_PROBES entries which contains its hash index, and a new
+ * flow takes an unused entry of the window, or pushes out the entry
+ * which was seen least recently.  The forwarding threads update the
+ * table under the lock of the window, so that they do not wait for
+ * each other except on the same windows.
+ *
+ * The exporter thread sweeps the table every second, and removes the
+ * flows which are idle longer than the idle timeout or live longer
+ * than the active timeout.  The removed flows and the flows pushed out
+ * by the forwarding threads are exported to the collector in batches,
+ * as many records as fit in a message.  Nothing but the table update
+ * is done on the forwarding threads.
+ */
+#define FLOWEXP_PROBES 8
+#define FLOWEXP_LOCKS 256
+#define FLOWEXP_MAX_EVICTED 1024
+#define FLOWEXP_TICK 1
+#define FLOWEXP_TEMPLATE_INTERVAL 60
+#define FLOWEXP_KEY_WORDS 5
+
+/* The IPFIX message, sized for the minimum IPv6 MTU. */
+#define FLOWEXP_MAX_MSG 1232
+#define FLOWEXP_VERSION 10
+#define FLOWEXP_HDR_LEN 16
+#define FLOWEXP_SET_HDR_LEN 4
+#define FLOWEXP_TEMPLATE_SET_ID 2
+#define FLOWEXP_TEMPLATE_ID4 256
+#define FLOWEXP_TEMPLATE_ID6 257
+#define FLOWEXP_FIELDS 10
+#define FLOWEXP_RECORD_LEN4 46
+#define FLOWEXP_RECORD_LEN6 70
+
+/* The information elements and the end reasons (RFC 7012). */
+#define FLOWEXP_IE_OCTETS 1
+#define FLOWEXP_IE_PACKETS 2
+#define FLOWEXP_IE_PROTOCOL 4
+#define FLOWEXP_IE_SRC_PORT 7
+#define FLOWEXP_IE_SRC_ADDR4 8
+#define FLOWEXP_IE_DST_PORT 11
+#define FLOWEXP_IE_DST_ADDR4 12
+#define FLOWEXP_IE_SRC_ADDR6 27
+#define FLOWEXP_IE_DST_ADDR6 28
+#define FLOWEXP_IE_END_REASON 136
+#define FLOWEXP_IE_START_MS 152
+#define FLOWEXP_IE_END_MS 153
+
+#define FLOWEXP_END_IDLE 1
+#define FLOWEXP_END_ACTIVE 2
+#define FLOWEXP_END_RESOURCES 5
+
+/*
+ * The key is the source and the destination addresses (an IPv4
+ * address in the first 4 bytes), and the word of the ports, the
+ * protocol and the address family.  An entry is unused if its packet
+ * count is 0.
+ */
+struct flowexp_entry {
+  uint64_t key[FLOWEXP_KEY_WORDS];
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t first;		/* in milliseconds of the monotonic clock */
+  uint64_t last;
+};
+
+struct flowexp_evicted {
+  struct flowexp_entry entry;
+  uint8_t reason;
+};
+
+int flowexp_table_size = FLOWEXP_DEFAULT_TABLE_SIZE;
+
+static struct sockaddr_storage flowexp_collector_addr;
+static socklen_t flowexp_collector_addr_len;
+static int flowexp_idle_timeout = FLOWEXP_DEFAULT_IDLE_TIMEOUT;
+static int flowexp_active_timeout = FLOWEXP_DEFAULT_ACTIVE_TIMEOUT;
+static int flowexp_active;
+static int flowexp_fd = -1;
+static pthread_t flowexp_thread;
+static uint64_t flowexp_hash_seed;
+
+static struct flowexp_entry *flowexp_table;
+static uint32_t flowexp_mask;
+static pthread_mutex_t flowexp_locks[FLOWEXP_LOCKS];
+
+/* The flows pushed out by the forwarding threads. */
+static struct flowexp_evicted flowexp_evicted[FLOWEXP_MAX_EVICTED];
+static unsigned int flowexp_evicted_count;
+static pthread_mutex_t flowexp_evicted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The message being built, used only by the exporter thread. */
+static uint8_t flowexp_msg[FLOWEXP_MAX_MSG];
+static int flowexp_msg_len;
+static int flowexp_set_off;
+static uint16_t flowexp_set_id;
+static unsigned int flowexp_msg_records;
+static uint32_t flowexp_sequence;
+static uint64_t flowexp_template_sent;
+static int64_t flowexp_clock_offset;
+
+static struct flowexp_stats flowexp_counters;
+
+static void *flowexp_main(void *);
+static void flowexp_sweep(uint64_t);
+static void flowexp_export_evicted(void);
+static uint64_t flowexp_now(void);
+static void flowexp_count(uint64_t *, int64_t);
+static uint32_t flowexp_hash(const uint64_t *);
+static void flowexp_put16(uint8_t *, uint16_t);
+static void flowexp_put32(uint8_t *, uint32_t);
+static void flowexp_put64(uint8_t *, uint64_t);
+static void flowexp_begin_msg(uint64_t);
+static void flowexp_add_template(uint8_t *, uint16_t, uint16_t, uint16_t);
+static void flowexp_close_set(void);
+static void flowexp_add_record(const struct flowexp_entry *, uint8_t,
+			       uint64_t);
+static void flowexp_send_msg(void);
+
+/*
+ * Set the address and the port (4739 if NULL) of the collector.  The
+ * flow table is enabled by this directive.
+ */
+int
+flowexp_set_collector(const char *addr, const char *port)
+{
+  assert(addr != NULL);
+
+  if (flowexp_active) {
+    /* Read only at startup. */
+    return (0);
+  }
+
+  int port_num = FLOWEXP_DEFAULT_PORT;
+  if (port != NULL) {
+    port_num = atoi(port);
+    if (port_num < 1 || port_num > 65535) {
+      warnx("invalid port %s.", port);
+      return (-1);
+    }
+  }
+
+  struct sockaddr_storage *ssp = &flowexp_collector_addr;
+  memset(ssp, 0, sizeof(struct sockaddr_storage));
+  struct sockaddr_in6 *sin6p = (struct sockaddr_in6 *)ssp;
+  struct sockaddr_in *sinp = (struct sockaddr_in *)ssp;
+  if (inet_pton(AF_INET6, addr, &sin6p->sin6_addr) == 1) {
+    sin6p->sin6_family = AF_INET6;
+    sin6p->sin6_port = htons(port_num);
+    flowexp_collector_addr_len = sizeof(struct sockaddr_in6);
+  } else if (inet_pton(AF_INET, addr, &sinp->sin_addr) == 1) {
+    sinp->sin_family = AF_INET;
+    sinp->sin_port = htons(port_num);
+    flowexp_collector_addr_len = sizeof(struct sockaddr_in);
+  } else {
+    warnx("invalid address %s.", addr);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* Set the idle or the active timeout in seconds. */
+int
+flowexp_set_timeout(const char *name, int timeout)
+{
+  assert(name != NULL);
+
+  if (timeout < 1 || timeout > FLOWEXP_MAX_TIMEOUT) {
+    warnx("the timeout must be 1 to %d seconds.", FLOWEXP_MAX_TIMEOUT);
+    return (-1);
+  }
+
+  if (strcmp(name, "idle") == 0) {
+    __atomic_store_n(&flowexp_idle_timeout, timeout, __ATOMIC_RELAXED);
+  } else if (strcmp(name, "active") == 0) {
+    __atomic_store_n(&flowexp_active_timeout, timeout, __ATOMIC_RELAXED);
+  } else {
+    warnx("unknown timeout %s.", name);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Open the socket to the collector, allocate the flow table and start
+ * the exporter thread if the flow-export directive is given.  The
+ * settings except the timeouts are read only at startup.
+ */
+int
+flowexp_start(void)
+{
+  if (flowexp_collector_addr_len == 0 || flowexp_active) {
+    return (0);
+  }
+
+  flowexp_fd = socket(flowexp_collector_addr.ss_family, SOCK_DGRAM, 0);
+  if (flowexp_fd == -1) {
+    warn("cannot open the flow export socket.");
+    return (-1);
+  }
+  if (connect(flowexp_fd, (const struct sockaddr *)&flowexp_collector_addr,
+	      flowexp_collector_addr_len) == -1) {
+    warn("cannot connect to the flow collector.");
+    return (-1);
+  }
+
+  uint32_t entries = FLOWEXP_PROBES;
+  while (entries < (uint32_t)flowexp_table_size) {
+    entries <<= 1;
+  }
+  flowexp_table = affinity_alloc(entries * sizeof(struct flowexp_entry),
+				 affinity_node("main"));
+  if (flowexp_table == NULL) {
+    return (-1);
+  }
+  flowexp_mask = entries - 1;
+  flowexp_counters.table_size = entries;
+
+  int index;
+  for (index = 0; index < FLOWEXP_LOCKS; index++) {
+    pthread_mutex_init(&flowexp_locks[index], NULL);
+  }
+  if (getrandom(&flowexp_hash_seed, sizeof(flowexp_hash_seed), 0)
+      != sizeof(flowexp_hash_seed)) {
+    warn("cannot get the flow hash seed.");
+    return (-1);
+  }
+
+  pthread_attr_t attr;
+  affinity_init_attr("flowexp", &attr);
+  int error = pthread_create(&flowexp_thread, &attr, flowexp_main, NULL);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    errno = error;
+    warn("cannot start the flow export thread.");
+    return (-1);
+  }
+  affinity_log("flowexp");
+  __atomic_store_n(&flowexp_active, 1, __ATOMIC_RELEASE);
+
+  return (0);
+}
+
+/* Returns 1 if the flow table is enabled. */
+int
+flowexp_is_active(void)
+{
+  return (__atomic_load_n(&flowexp_active, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Count a packet in its flow.  The pktp parameter points the IP
+ * header of the packet before the translation, and len is the length
+ * of the data read.  The ports are taken only from the TCP and UDP
+ * packets which are not fragments.
+ */
+void
+flowexp_record(const uint8_t *pktp, size_t len)
+{
+  assert(pktp != NULL);
+
+  uint64_t key[FLOWEXP_KEY_WORDS];
+  uint8_t family, proto;
+  uint16_t ports[2] = {0, 0};
+  uint64_t bytes;
+  memset(key, 0, sizeof(key));
+
+  if ((pktp[0] >> 4) == 4) {
+    const struct ip *ip4_hdrp = (const struct ip *)pktp;
+    size_t hlen = ip4_hdrp->ip_hl << 2;
+    if (len < sizeof(struct ip))
+      return;
+    memcpy(&key[0], &ip4_hdrp->ip_src, sizeof(struct in_addr));
+    memcpy(&key[2], &ip4_hdrp->ip_dst, sizeof(struct in_addr));
+    family = AF_INET;
+    proto = ip4_hdrp->ip_p;
+    bytes = ntohs(ip4_hdrp->ip_len);
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP)
+	&& (ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) == 0
+	&& len >= hlen + sizeof(ports)) {
+      memcpy(ports, pktp + hlen, sizeof(ports));
+    }
+  } else {
+    const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)pktp;
+    if (len < sizeof(struct ip6_hdr))
+      return;
+    memcpy(&key[0], &ip6_hdrp->ip6_src, sizeof(struct in6_addr));
+    memcpy(&key[2], &ip6_hdrp->ip6_dst, sizeof(struct in6_addr));
+    family = AF_INET6;
+    proto = ip6_hdrp->ip6_nxt;
+    bytes = sizeof(struct ip6_hdr) + ntohs(ip6_hdrp->ip6_plen);
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP)
+	&& len >= sizeof(struct ip6_hdr) + sizeof(ports)) {
+      memcpy(ports, pktp + sizeof(struct ip6_hdr), sizeof(ports));
+    }
+  }
+  key[4] = ((uint64_t)ntohs(ports[0]) << 32)
+    | ((uint64_t)ntohs(ports[1]) << 16) | (proto << 8) | family;
+
+  uint32_t window = flowexp_hash(key) & flowexp_mask & ~(FLOWEXP_PROBES - 1);
+  struct flowexp_entry *windowp = &flowexp_table[window];
+  pthread_mutex_t *lockp
+    = &flowexp_locks[(window / FLOWEXP_PROBES) & (FLOWEXP_LOCKS - 1)];
+  uint64_t now = flowexp_now();
+
+  pthread_mutex_lock(lockp);
+  struct flowexp_entry *victimp = NULL;
+  int probe;
+  for (probe = 0; probe < FLOWEXP_PROBES; probe++) {
+    struct flowexp_entry *entryp = &windowp[probe];
+    if (entryp->packets == 0) {
+      if (victimp == NULL || victimp->packets != 0)
+	victimp = entryp;
+      continue;
+    }
+    if (memcmp(entryp->key, key, sizeof(key)) == 0) {
+      entryp->packets++;
+      entryp->bytes += bytes;
+      entryp->last = now;
+      pthread_mutex_unlock(lockp);
+      return;
+    }
+    if (victimp == NULL
+	|| (victimp->packets != 0 && entryp->last < victimp->last))
+      victimp = entryp;
+  }
+
+  if (victimp->packets != 0) {
+    /* Push out the flow seen least recently to the exporter. */
+    pthread_mutex_lock(&flowexp_evicted_lock);
+    if (flowexp_evicted_count < FLOWEXP_MAX_EVICTED) {
+      struct flowexp_evicted *evictedp
+	= &flowexp_evicted[flowexp_evicted_count++];
+      memcpy(&evictedp->entry, victimp, sizeof(struct flowexp_entry));
+      evictedp->reason = FLOWEXP_END_RESOURCES;
+      flowexp_count(&flowexp_counters.evicted, 1);
+    } else {
+      flowexp_count(&flowexp_counters.lost, 1);
+    }
+    pthread_mutex_unlock(&flowexp_evicted_lock);
+  } else {
+    flowexp_count(&flowexp_counters.flows, 1);
+  }
+  memcpy(victimp->key, key, sizeof(key));
+  victimp->packets = 1;
+  victimp->bytes = bytes;
+  victimp->first = now;
+  victimp->last = now;
+  pthread_mutex_unlock(lockp);
+
+  flowexp_count(&flowexp_counters.created, 1);
+}
+
+void
+flowexp_get_stats(struct flowexp_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  statsp->flows = __atomic_load_n(&flowexp_counters.flows, __ATOMIC_RELAXED);
+  statsp->created = __atomic_load_n(&flowexp_counters.created,
+				    __ATOMIC_RELAXED);
+  statsp->expired = __atomic_load_n(&flowexp_counters.expired,
+				    __ATOMIC_RELAXED);
+  statsp->evicted = __atomic_load_n(&flowexp_counters.evicted,
+				    __ATOMIC_RELAXED);
+  statsp->lost = __atomic_load_n(&flowexp_counters.lost, __ATOMIC_RELAXED);
+  statsp->exported = __atomic_load_n(&flowexp_counters.exported,
+				     __ATOMIC_RELAXED);
+  statsp->messages = __atomic_load_n(&flowexp_counters.messages,
+				     __ATOMIC_RELAXED);
+  statsp->send_errors = __atomic_load_n(&flowexp_counters.send_errors,
+					__ATOMIC_RELAXED);
+  statsp->table_size = flowexp_counters.table_size;
+}
+
+/*
+ * The exporter thread.  The clock offset converts the monotonic times
+ * of the flows to the times since the epoch for the records.
+ */
+static void *
+flowexp_main(void *argp)
+{
+  (void)argp;
+
+  for (;;) {
+    sleep(FLOWEXP_TICK);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = flowexp_now();
+    flowexp_clock_offset = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000
+      - (int64_t)now;
+
+    flowexp_export_evicted();
+    flowexp_sweep(now);
+    flowexp_send_msg();
+  }
+
+  return (NULL);
+}
+
+/*
+ * Remove the expired flows from the table and add them to the
+ * message.  The flows of a window are copied out under its lock, and
+ * the records are built after the lock is released.
+ */
+static void
+flowexp_sweep(uint64_t now)
+{
+  uint64_t idle = (uint64_t)__atomic_load_n(&flowexp_idle_timeout,
+					    __ATOMIC_RELAXED) * 1000;
+  uint64_t active = (uint64_t)__atomic_load_n(&flowexp_active_timeout,
+					      __ATOMIC_RELAXED) * 1000;
+
+  uint32_t window;
+  for (window = 0; window <= flowexp_mask; window += FLOWEXP_PROBES) {
+    struct flowexp_entry expired[FLOWEXP_PROBES];
+    uint8_t reasons[FLOWEXP_PROBES];
+    int count = 0;
+    pthread_mutex_t *lockp
+      = &flowexp_locks[(window / FLOWEXP_PROBES) & (FLOWEXP_LOCKS - 1)];
+
+    pthread_mutex_lock(lockp);
+    int probe;
+    for (probe = 0; probe < FLOWEXP_PROBES; probe++) {
+      struct flowexp_entry *entryp = &flowexp_table[window + probe];
+      if (entryp->packets == 0)
+	continue;
+      if (entryp->last + idle <= now) {
+	reasons[count] = FLOWEXP_END_IDLE;
+      } else if (entryp->first + active <= now) {
+	reasons[count] = FLOWEXP_END_ACTIVE;
+      } else {
+	continue;
+      }
+      memcpy(&expired[count++], entryp, sizeof(struct flowexp_entry));
+      entryp->packets = 0;
+    }
+    pthread_mutex_unlock(lockp);
+
+    if (count == 0)
+      continue;
+    flowexp_count(&flowexp_counters.flows, -count);
+    flowexp_count(&flowexp_counters.expired, count);
+    for (probe = 0; probe < count; probe++) {
+      flowexp_add_record(&expired[probe], reasons[probe], now);
+    }
+  }
+}
+
+/* Add the flows pushed out by the forwarding threads to the message. */
+static void
+flowexp_export_evicted(void)
+{
+  static struct flowexp_evicted evicted[FLOWEXP_MAX_EVICTED];
+
+  pthread_mutex_lock(&flowexp_evicted_lock);
+  unsigned int count = flowexp_evicted_count;
+  memcpy(evicted, flowexp_evicted, count * sizeof(struct flowexp_evicted));
+  flowexp_evicted_count = 0;
+  pthread_mutex_unlock(&flowexp_evicted_lock);
+
+  uint64_t now = flowexp_now();
+  unsigned int index;
+  for (index = 0; index < count; index++) {
+    flowexp_add_record(&evicted[index].entry, evicted[index].reason, now);
+  }
+}
+
+/* The coarse clock is enough for the flow times. */
+static uint64_t
+flowexp_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* The counters are updated by the forwarding and the exporter threads. */
+static void
+flowexp_count(uint64_t *counterp, int64_t delta)
+{
+  __atomic_fetch_add(counterp, delta, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+flowexp_hash(const uint64_t *words)
+{
+  uint64_t h = flowexp_hash_seed;
+  int count;
+  for (count = 0; count < FLOWEXP_KEY_WORDS; count++) {
+    h = (h ^ words[count]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+  return ((uint32_t)h);
+}
+
+static void
+flowexp_put16(uint8_t *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value;
+}
+
+static void
+flowexp_put32(uint8_t *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static void
+flowexp_put64(uint8_t *p, uint64_t value)
+{
+  flowexp_put32(p, value >> 32);
+  flowexp_put32(p + 4, value);
+}
+
+/*
+ * Start a message.  The templates are sent in the first message and
+ * again after every FLOWEXP_TEMPLATE_INTERVAL seconds, since the
+ * collector may have been restarted (RFC 7011 section 8.4).
+ */
+static void
+flowexp_begin_msg(uint64_t now)
+{
+  flowexp_msg_len = FLOWEXP_HDR_LEN;
+  flowexp_set_off = 0;
+  flowexp_set_id = 0;
+  flowexp_msg_records = 0;
+
+  if (flowexp_template_sent != 0
+      && flowexp_template_sent + FLOWEXP_TEMPLATE_INTERVAL * 1000 > now)
+    return;
+  flowexp_template_sent = now;
+
+  uint8_t *setp = flowexp_msg + flowexp_msg_len;
+  uint8_t *p = setp + FLOWEXP_SET_HDR_LEN;
+  flowexp_add_template(p, FLOWEXP_TEMPLATE_ID4, FLOWEXP_IE_SRC_ADDR4,
+		       FLOWEXP_IE_DST_ADDR4);
+  p += 4 + FLOWEXP_FIELDS * 4;
+  flowexp_add_template(p, FLOWEXP_TEMPLATE_ID6, FLOWEXP_IE_SRC_ADDR6,
+		       FLOWEXP_IE_DST_ADDR6);
+  p += 4 + FLOWEXP_FIELDS * 4;
+  flowexp_put16(setp, FLOWEXP_TEMPLATE_SET_ID);
+  flowexp_put16(setp + 2, p - setp);
+  flowexp_msg_len += p - setp;
+}
+
+/*
+ * A template record, whose fields are in the order the records of
+ * flowexp_add_record() are written.
+ */
+static void
+flowexp_add_template(uint8_t *p, uint16_t id, uint16_t src_ie,
+		     uint16_t dst_ie)
+{
+  uint16_t addr_len = (id == FLOWEXP_TEMPLATE_ID4)
+    ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+  const uint16_t fields[FLOWEXP_FIELDS][2] = {
+    {src_ie, addr_len},
+    {dst_ie, addr_len},
+    {FLOWEXP_IE_SRC_PORT, 2},
+    {FLOWEXP_IE_DST_PORT, 2},
+    {FLOWEXP_IE_PROTOCOL, 1},
+    {FLOWEXP_IE_PACKETS, 8},
+    {FLOWEXP_IE_OCTETS, 8},
+    {FLOWEXP_IE_START_MS, 8},
+    {FLOWEXP_IE_END_MS, 8},
+    {FLOWEXP_IE_END_REASON, 1},
+  };
+
+  flowexp_put16(p, id);
+  flowexp_put16(p + 2, FLOWEXP_FIELDS);
+  p += 4;
+  int index;
+  for (index = 0; index < FLOWEXP_FIELDS; index++) {
+    flowexp_put16(p, fields[index][0]);
+    flowexp_put16(p + 2, fields[index][1]);
+    p += 4;
+  }
+}
+
+/* Write the length of the data set being built. */
+static void
+flowexp_close_set(void)
+{
+  if (flowexp_set_off == 0)
+    return;
+  flowexp_put16(flowexp_msg + flowexp_set_off + 2,
+		flowexp_msg_len - flowexp_set_off);
+  flowexp_set_off = 0;
+  flowexp_set_id = 0;
+}
+
+/*
+ * Add the record of a flow to the message.  The message is sent when
+ * it has no room for the record.  The records of the same family
+ * share a data set.
+ */
+static void
+flowexp_add_record(const struct flowexp_entry *entryp, uint8_t reason,
+		   uint64_t now)
+{
+  int family = entryp->key[4] & 0xff;
+  uint16_t set_id, record_len;
+  size_t addr_len;
+  if (family == AF_INET) {
+    set_id = FLOWEXP_TEMPLATE_ID4;
+    record_len = FLOWEXP_RECORD_LEN4;
+    addr_len = sizeof(struct in_addr);
+  } else {
+    set_id = FLOWEXP_TEMPLATE_ID6;
+    record_len = FLOWEXP_RECORD_LEN6;
+    addr_len = sizeof(struct in6_addr);
+  }
+
+  if (flowexp_msg_len == 0)
+    flowexp_begin_msg(now);
+  int need = record_len + (set_id != flowexp_set_id ? FLOWEXP_SET_HDR_LEN : 0);
+  if (flowexp_msg_len + need > FLOWEXP_MAX_MSG) {
+    flowexp_send_msg();
+    flowexp_begin_msg(now);
+  }
+  if (set_id != flowexp_set_id) {
+    flowexp_close_set();
+    flowexp_set_off = flowexp_msg_len;
+    flowexp_set_id = set_id;
+    flowexp_put16(flowexp_msg + flowexp_msg_len, set_id);
+    flowexp_msg_len += FLOWEXP_SET_HDR_LEN;
+  }
+
+  uint8_t *p = flowexp_msg + flowexp_msg_len;
+  memcpy(p, &entryp->key[0], addr_len);
+  p += addr_len;
+  memcpy(p, &entryp->key[2], addr_len);
+  p += addr_len;
+  flowexp_put16(p, entryp->key[4] >> 32);
+  flowexp_put16(p + 2, entryp->key[4] >> 16);
+  p[4] = entryp->key[4] >> 8;
+  p += 5;
+  flowexp_put64(p, entryp->packets);
+  flowexp_put64(p + 8, entryp->bytes);
+  flowexp_put64(p + 16, entryp->first + flowexp_clock_offset);
+  flowexp_put64(p + 24, entryp->last + flowexp_clock_offset);
+  p[32] = reason;
+  flowexp_msg_len += record_len;
+  flowexp_msg_records++;
+}
+
+/*
+ * Send the message built so far.  The sequence number is the number
+ * of the records sent before the message.
+ */
+static void
+flowexp_send_msg(void)
+{
+  if (flowexp_msg_len == 0)
+    return;
+  flowexp_close_set();
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  flowexp_put16(flowexp_msg, FLOWEXP_VERSION);
+  flowexp_put16(flowexp_msg + 2, flowexp_msg_len);
+  flowexp_put32(flowexp_msg + 4, ts.tv_sec);
+  flowexp_put32(flowexp_msg + 8, flowexp_sequence);
+  flowexp_put32(flowexp_msg + 12, 0);	/* the observation domain */
+
+  if (send(flowexp_fd, flowexp_msg, flowexp_msg_len, 0) == -1) {
+    flowexp_count(&flowexp_counters.send_errors, 1);
+  } else {
+    flowexp_sequence += flowexp_msg_records;
+    flowexp_count(&flowexp_counters.messages, 1);
+    flowexp_count(&flowexp_counters.exported, flowexp_msg_records);
+  }
+  flowexp_msg_len = 0;
+}
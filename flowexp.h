@@ -0,0 +1,64 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FLOWEXP_H__
+#define __FLOWEXP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLOWEXP_DEFAULT_PORT 4739
+#define FLOWEXP_DEFAULT_TABLE_SIZE 65536
+#define FLOWEXP_MAX_TABLE_SIZE 4194304
+#define FLOWEXP_DEFAULT_IDLE_TIMEOUT 15
+#define FLOWEXP_DEFAULT_ACTIVE_TIMEOUT 1800
+#define FLOWEXP_MAX_TIMEOUT 86400
+
+extern int flowexp_table_size;
+
+struct flowexp_stats {
+  uint64_t flows;		/* the flows in the table */
+  uint64_t created;
+  uint64_t expired;		/* by the idle or the active timeout */
+  uint64_t evicted;		/* pushed out by a new flow */
+  uint64_t lost;		/* evicted when the export queue is full */
+  uint64_t exported;		/* the records sent to the collector */
+  uint64_t messages;
+  uint64_t send_errors;
+  unsigned int table_size;
+};
+
+int flowexp_set_collector(const char *, const char *);
+int flowexp_set_timeout(const char *, int);
+int flowexp_start(void);
+int flowexp_is_active(void);
+void flowexp_record(const uint8_t *, size_t);
+void flowexp_get_stats(struct flowexp_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
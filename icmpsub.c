@@ -22,11 +22,13 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -43,6 +45,7 @@
 #include "checksum.h"
 #include "mapping.h"
 #include "pmtudisc.h"
+#include "probe.h"
 
 #if defined(__linux__)
 #define IPV6_VERSION 0x60
@@ -50,6 +53,11 @@
 #define ICMPSUB_IPV4_MINMTU 68
 #define ICMPSUB_IPV6_MINMTU 1280
 #define ICMPSUB_RATE_LIMIT_COUNT 10
+#define ICMPSUB_IPV4_ERROR_LEN 576	/* RFC 1812 section 4.3.2.3 */
+/* The transport header bytes changed in the original packet. */
+#define ICMPSUB_L4_SUM_LEN 20
+#define ICMPSUB_TCP_SUM_OFF 16
+#define ICMPSUB_UDP_SUM_OFF 6
 
 static int icmpsub_extract_icmp4_unreach_needfrag(const struct icmp *,
       struct in_addr *,
@@ -68,16 +76,241 @@ static int icmpsub_create_icmp6_packet_too_big(struct ip6_hdr *,
 static int icmpsub_select_source_address(int, const void *, void *);
 #endif
 static int icmpsub_check_sending_rate(void);
+struct icmpsub_xlate;
+static int icmpsub_translate_icmp4_error(int, const struct ip *,
+      const struct icmp *, int, const struct in6_addr *,
+      const struct in6_addr *, const struct icmpsub_xlate *);
+static int icmpsub_translate_icmp6_error(int, const struct ip6_hdr *,
+      const struct icmp6_hdr *, int, const struct icmpsub_xlate *);
+static void icmpsub_translate_inner_l4(int, int, uint8_t *, int, int32_t,
+      int32_t, int);
+
+/*
+ * The ICMP <=> ICMPv6 type/code translation tables (RFC 7915 section
+ * 4.2 and 5.2), indexed by the incoming type and code.  Each entry has
+ * the outgoing type and code, the one's complement difference of the
+ * type/code word to be added to the checksum, and the action.  All the
+ * values are constants computed by the compiler, so the translation is
+ * a table lookup and one addition.  The entries not listed are 0,
+ * which is ICMPSUB_DROP.
+ */
+#define ICMPSUB_DROP 0		/* not translated */
+#define ICMPSUB_QUERY 1		/* echo request or reply */
+#define ICMPSUB_ERROR 2		/* an error with an inner packet */
+#define ICMPSUB_ERROR_MTU 3	/* an error with the MTU field */
+#define ICMPSUB_ERROR_POINTER 4	/* an error with the pointer field */
+#define ICMPSUB_ERROR_PROTO 5	/* protocol unreachable <=> next header */
+
+#define ICMPSUB_MAX_CODE 15
+
+struct icmpsub_xlate {
+   uint8_t action;
+   uint8_t type;
+   uint8_t code;
+   uint16_t cksum_delta;
+};
+
+/* The type/code word as read from the packet in the host byte order. */
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define ICMPSUB_WORD(type, code) (((code) << 8) | (type))
+#else
+#define ICMPSUB_WORD(type, code) (((type) << 8) | (code))
+#endif
+#define ICMPSUB_FOLD(sum) (((sum) & 0xffff) + ((sum) >> 16))
+#define ICMPSUB_DELTA(otype, ocode, ntype, ncode)                          \
+   ICMPSUB_FOLD(ICMPSUB_WORD(ntype, ncode)                                 \
+         + (0xffff ^ ICMPSUB_WORD(otype, ocode)))
+#define ICMPSUB_XLATE(action, otype, ocode, ntype, ncode)                  \
+   { action, ntype, ncode, ICMPSUB_DELTA(otype, ocode, ntype, ncode) }
+/* All the codes are kept. */
+#define ICMPSUB_XLATE_TYPE(action, otype, ntype)                           \
+   {                                                                       \
+      ICMPSUB_XLATE(action, otype, 0, ntype, 0),                           \
+      ICMPSUB_XLATE(action, otype, 1, ntype, 1),                           \
+      ICMPSUB_XLATE(action, otype, 2, ntype, 2),                           \
+      ICMPSUB_XLATE(action, otype, 3, ntype, 3),                           \
+      ICMPSUB_XLATE(action, otype, 4, ntype, 4),                           \
+      ICMPSUB_XLATE(action, otype, 5, ntype, 5),                           \
+      ICMPSUB_XLATE(action, otype, 6, ntype, 6),                           \
+      ICMPSUB_XLATE(action, otype, 7, ntype, 7),                           \
+      ICMPSUB_XLATE(action, otype, 8, ntype, 8),                           \
+      ICMPSUB_XLATE(action, otype, 9, ntype, 9),                           \
+      ICMPSUB_XLATE(action, otype, 10, ntype, 10),                         \
+      ICMPSUB_XLATE(action, otype, 11, ntype, 11),                         \
+      ICMPSUB_XLATE(action, otype, 12, ntype, 12),                         \
+      ICMPSUB_XLATE(action, otype, 13, ntype, 13),                         \
+      ICMPSUB_XLATE(action, otype, 14, ntype, 14),                         \
+      ICMPSUB_XLATE(action, otype, 15, ntype, 15),                         \
+   }
+
+static const struct icmpsub_xlate
+icmpsub_xlate_4to6[ICMP_PARAMPROB + 1][ICMPSUB_MAX_CODE + 1] = {
+   [ICMP_ECHOREPLY] = ICMPSUB_XLATE_TYPE(ICMPSUB_QUERY, ICMP_ECHOREPLY,
+         ICMP6_ECHO_REPLY),
+   [ICMP_ECHO] = ICMPSUB_XLATE_TYPE(ICMPSUB_QUERY, ICMP_ECHO,
+         ICMP6_ECHO_REQUEST),
+   [ICMP_UNREACH] = {
+      [ICMP_UNREACH_NET] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_NET,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_HOST] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_HOST,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_PROTOCOL] = ICMPSUB_XLATE(ICMPSUB_ERROR_PROTO,
+            ICMP_UNREACH, ICMP_UNREACH_PROTOCOL,
+            ICMP6_PARAM_PROB, ICMP6_PARAMPROB_NEXTHEADER),
+      [ICMP_UNREACH_PORT] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_PORT,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT),
+      [ICMP_UNREACH_NEEDFRAG] = ICMPSUB_XLATE(ICMPSUB_ERROR_MTU,
+            ICMP_UNREACH, ICMP_UNREACH_NEEDFRAG,
+            ICMP6_PACKET_TOO_BIG, 0),
+      [ICMP_UNREACH_SRCFAIL] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_SRCFAIL,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_NET_UNKNOWN] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_NET_UNKNOWN,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_HOST_UNKNOWN] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_HOST_UNKNOWN,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_ISOLATED] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_ISOLATED,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_NET_PROHIB] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_NET_PROHIB,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN),
+      [ICMP_UNREACH_HOST_PROHIB] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_HOST_PROHIB,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN),
+      [ICMP_UNREACH_TOSNET] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_TOSNET,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_TOSHOST] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_TOSHOST,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE),
+      [ICMP_UNREACH_FILTER_PROHIB] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_FILTER_PROHIB,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN),
+      /* ICMP_UNREACH_HOST_PRECEDENCE is dropped. */
+      [ICMP_UNREACH_PRECEDENCE_CUTOFF] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP_UNREACH, ICMP_UNREACH_PRECEDENCE_CUTOFF,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN),
+   },
+   [ICMP_TIMXCEED] = ICMPSUB_XLATE_TYPE(ICMPSUB_ERROR, ICMP_TIMXCEED,
+         ICMP6_TIME_EXCEEDED),
+   [ICMP_PARAMPROB] = {
+      [0] = ICMPSUB_XLATE(ICMPSUB_ERROR_POINTER, ICMP_PARAMPROB, 0,
+            ICMP6_PARAM_PROB, ICMP6_PARAMPROB_HEADER),
+      [2] = ICMPSUB_XLATE(ICMPSUB_ERROR_POINTER, ICMP_PARAMPROB, 2,
+            ICMP6_PARAM_PROB, ICMP6_PARAMPROB_HEADER),
+   },
+};
+
+static const struct icmpsub_xlate
+icmpsub_xlate_6to4[ICMP6_ECHO_REPLY + 1][ICMPSUB_MAX_CODE + 1] = {
+   [ICMP6_DST_UNREACH] = {
+      [ICMP6_DST_UNREACH_NOROUTE] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE,
+            ICMP_UNREACH, ICMP_UNREACH_HOST),
+      [ICMP6_DST_UNREACH_ADMIN] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADMIN,
+            ICMP_UNREACH, ICMP_UNREACH_HOST_PROHIB),
+      [ICMP6_DST_UNREACH_BEYONDSCOPE] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_BEYONDSCOPE,
+            ICMP_UNREACH, ICMP_UNREACH_HOST),
+      [ICMP6_DST_UNREACH_ADDR] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_ADDR,
+            ICMP_UNREACH, ICMP_UNREACH_HOST),
+      [ICMP6_DST_UNREACH_NOPORT] = ICMPSUB_XLATE(ICMPSUB_ERROR,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOPORT,
+            ICMP_UNREACH, ICMP_UNREACH_PORT),
+   },
+   [ICMP6_PACKET_TOO_BIG] = {
+      [0] = ICMPSUB_XLATE(ICMPSUB_ERROR_MTU, ICMP6_PACKET_TOO_BIG, 0,
+            ICMP_UNREACH, ICMP_UNREACH_NEEDFRAG),
+   },
+   [ICMP6_TIME_EXCEEDED] = ICMPSUB_XLATE_TYPE(ICMPSUB_ERROR,
+         ICMP6_TIME_EXCEEDED, ICMP_TIMXCEED),
+   [ICMP6_PARAM_PROB] = {
+      [ICMP6_PARAMPROB_HEADER] = ICMPSUB_XLATE(ICMPSUB_ERROR_POINTER,
+            ICMP6_PARAM_PROB, ICMP6_PARAMPROB_HEADER,
+            ICMP_PARAMPROB, 0),
+      [ICMP6_PARAMPROB_NEXTHEADER] = ICMPSUB_XLATE(ICMPSUB_ERROR_PROTO,
+            ICMP6_PARAM_PROB, ICMP6_PARAMPROB_NEXTHEADER,
+            ICMP_UNREACH, ICMP_UNREACH_PROTOCOL),
+   },
+   [ICMP6_ECHO_REQUEST] = ICMPSUB_XLATE_TYPE(ICMPSUB_QUERY,
+         ICMP6_ECHO_REQUEST, ICMP_ECHO),
+   [ICMP6_ECHO_REPLY] = ICMPSUB_XLATE_TYPE(ICMPSUB_QUERY,
+         ICMP6_ECHO_REPLY, ICMP_ECHOREPLY),
+};
+
+/*
+ * The translation of the pointer of a Parameter Problem message, the
+ * offset of the field in the IP header (RFC 7915 Figure 3 and 6).  -1
+ * means the field has no counterpart, and the message is dropped.
+ */
+static const int8_t icmpsub_pointer_4to6[sizeof(struct ip)] = {
+   0, 1, 4, 4,                   /* version/IHL, TOS, total length */
+   -1, -1, -1, -1,               /* identification, flags, offset */
+   7, 6, -1, -1,                 /* TTL, protocol, checksum */
+   8, 8, 8, 8,                   /* source address */
+   24, 24, 24, 24,               /* destination address */
+};
+static const int8_t icmpsub_pointer_6to4[sizeof(struct ip6_hdr)] = {
+   0, 1, -1, -1,                 /* version, traffic class, flow label */
+   2, 2, 9, 8,                   /* payload length, next header, hop limit */
+   12, 12, 12, 12, 12, 12, 12, 12, /* source address */
+   12, 12, 12, 12, 12, 12, 12, 12,
+   16, 16, 16, 16, 16, 16, 16, 16, /* destination address */
+   16, 16, 16, 16, 16, 16, 16, 16,
+};
+
+/*
+ * Look up the translation of the ICMP (IPPROTO_ICMP) or ICMPv6
+ * (IPPROTO_ICMPV6) type and code.  Returns NULL if the message is not
+ * translated.
+ */
+   static inline const struct icmpsub_xlate *
+icmpsub_lookup_xlate(int icmp_protocol, int type, int code)
+{
+   const struct icmpsub_xlate *xlatep;
+
+   if (code > ICMPSUB_MAX_CODE)
+      return (NULL);
+   if (icmp_protocol == IPPROTO_ICMP) {
+      if (type > ICMP_PARAMPROB)
+         return (NULL);
+      xlatep = &icmpsub_xlate_4to6[type][code];
+   } else {
+      if (type > ICMP6_ECHO_REPLY)
+         return (NULL);
+      xlatep = &icmpsub_xlate_6to4[type][code];
+   }
+   if (xlatep->action == ICMPSUB_DROP)
+      return (NULL);
+
+   return (xlatep);
+}
 
 /*
  * Process the incoming ICMPv4 message.  The discard_ok variable is
  * set to 1 when the incoming ICMP messages are not necessarily
- * converted to ICMPv6.
+ * converted to ICMPv6.  The error messages are translated to ICMPv6
+ * and sent here, and the discard_ok variable is set to 1 for them.
+ *
+ * The ip6_srcp and ip6_dstp parameters are the addresses the message
+ * is translated to, if the caller has already looked them up (e.g. by
+ * a mapping rule or the NAT64), otherwise NULL.
  */
    int
-icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
-      int icmp4_size, int *discard_okp)
+icmpsub_process_icmp4(int tun_fd, const struct ip *ip4_hdrp,
+      const struct icmp *icmp4_hdrp, int icmp4_size,
+      const struct in6_addr *ip6_srcp, const struct in6_addr *ip6_dstp,
+      int *discard_okp)
 {
+   assert(ip4_hdrp != NULL);
    assert(icmp4_hdrp != NULL);
    assert(discard_okp != NULL);
 
@@ -90,88 +323,57 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
       return (-1);
    }
 
-   if (icmp4_hdrp->icmp_type == ICMP_ECHO
-         || icmp4_hdrp->icmp_type == ICMP_ECHOREPLY) {
+   const struct icmpsub_xlate *xlatep = icmpsub_lookup_xlate(IPPROTO_ICMP,
+         icmp4_hdrp->icmp_type, icmp4_hdrp->icmp_code);
+   if (xlatep != NULL && xlatep->action == ICMPSUB_QUERY) {
       /* These messages will be converted to ICMPv6 messages. */
       return (0);
    }
 
-   /* All other ICMP messages will be discarded. */
+   /* All other ICMP messages are translated here or discarded. */
    *discard_okp = 1;
+   if (xlatep == NULL)
+      return (0);
 
    /* Process further ICMP message contents based on the type/code. */
-   if (icmp4_hdrp->icmp_type == ICMP_UNREACH) {
-      if (icmp4_hdrp->icmp_code == ICMP_UNREACH_NEEDFRAG) {
-         /* Path MTU discovery procedure. */
-         if (icmp4_size < ICMP_MINLEN + sizeof(struct ip)) {
-            /*
-             * The original IPv4 header is necessary to extract the
-             * destination address of the original packet.
-             */
-            warnx("ICMP_UNREACH_NEEDFRAG message must be longer than %d "
-                  "(%d received).", ICMP_MINLEN + sizeof(struct ip), icmp4_size);
-            return (-1);
-         }
-
-         struct in_addr orig_local_addr, orig_remote_addr;
-         int mtu;
-         if (icmpsub_extract_icmp4_unreach_needfrag(icmp4_hdrp,
-                  &orig_local_addr,
-                  &orig_remote_addr,
-                  &mtu) == -1) {
-            warnx("cannot extract MTU information from the ICMP packet.");
-            return (-1);
-         }
-         if (pmtudisc_update_path_mtu_size(AF_INET, &orig_remote_addr,
-                  mtu) == -1) {
-            warnx("cannot update path mtu information.");
-            return (-1);
-         }
-
-         /*
-          * Generate ICMPv6 Packet Too Big message
-          *
-          *   outer source: converted from orig_remote_addr
-          *   outer destination: converted from orig_local_addr
-          *   inner source: converted from orig_local_addr
-          *   inner destination: converted from orig_remote_addr
-          */
-         struct in6_addr orig_local_addr6, orig_remote_addr6;
-         if (mapping_convert_addrs_4to6(&orig_remote_addr, &orig_local_addr,
-                  &orig_remote_addr6, &orig_local_addr6)
-               == -1) {
-            warnx("no mapping available.  gave up to convert ICMP destination unreach/needfrag message to ICMPv6 packet too big message.");
-            return (-1);
-         }
+   if (xlatep->action == ICMPSUB_ERROR_MTU) {
+      /* Path MTU discovery procedure. */
+      if (icmp4_size < ICMP_MINLEN + sizeof(struct ip)) {
          /*
-          * Construct a dummy IPv6 inner header to store original
-          * destination address.
-          */
-         struct ip6_hdr orig_ip6_hdr;
-         memset(&orig_ip6_hdr, 0, sizeof(struct ip6_hdr));
-         orig_ip6_hdr.ip6_vfc = IPV6_VERSION;
-         orig_ip6_hdr.ip6_plen
-            = htons(sizeof(struct ip6_hdr));  /* The dummy header. */
-         orig_ip6_hdr.ip6_nxt = IPPROTO_ICMPV6;
-         orig_ip6_hdr.ip6_hlim = 64; /* XXX */
-         memcpy(&orig_ip6_hdr.ip6_src, &orig_local_addr6,
-               sizeof(struct in6_addr));
-         memcpy(&orig_ip6_hdr.ip6_dst, &orig_remote_addr6,
-               sizeof(struct in6_addr));
-         /* 
-          * Check weather tun_fd is valid, 
-          * because this func is also used by stat functions 
+          * The original IPv4 header is necessary to extract the
+          * destination address of the original packet.
           */
+         warnx("ICMP_UNREACH_NEEDFRAG message must be longer than %d "
+               "(%d received).", ICMP_MINLEN + sizeof(struct ip), icmp4_size);
+         return (-1);
+      }
 
-         if(tun_fd > 0){
-            if (icmpsub_send_icmp6_packet_too_big(tun_fd, &orig_ip6_hdr,
-                     &orig_remote_addr6,
-                     &orig_local_addr6,
-                     mtu) == -1) {
-               warnx("failed to send ICMPv6 Packet Too Big message.");
-               return (-1);
-            }
-         }
+      struct in_addr orig_local_addr, orig_remote_addr;
+      int mtu;
+      if (icmpsub_extract_icmp4_unreach_needfrag(icmp4_hdrp,
+               &orig_local_addr,
+               &orig_remote_addr,
+               &mtu) == -1) {
+         warnx("cannot extract MTU information from the ICMP packet.");
+         return (-1);
+      }
+      if (pmtudisc_update_path_mtu_size(AF_INET, &orig_remote_addr,
+               mtu) == -1) {
+         warnx("cannot update path mtu information.");
+         return (-1);
+      }
+   }
+
+   /* 
+    * Check weather tun_fd is valid, 
+    * because this func is also used by stat functions 
+    */
+   if (tun_fd > 0) {
+      if (icmpsub_translate_icmp4_error(tun_fd, ip4_hdrp, icmp4_hdrp,
+               icmp4_size, ip6_srcp, ip6_dstp, xlatep) == -1) {
+         warnx("failed to translate ICMP type %d code %d to ICMPv6.",
+               icmp4_hdrp->icmp_type, icmp4_hdrp->icmp_code);
+         return (-1);
       }
    }
 
@@ -181,11 +383,17 @@ icmpsub_process_icmp4(int tun_fd, const struct icmp *icmp4_hdrp,
 /*
  * Process the incoming ICMPv6 message.  The discard_ok variable is
  * set to 1 when the incoming ICMPv6 messages are not necessarily
- * converted to ICMPv6.
+ * converted to ICMPv6.  The error messages are translated to ICMP
+ * and sent here, and the discard_ok variable is set to 1 for them.
+ *
+ * The ip6_hdrp parameter is NULL for the IPv6 to IPv6 mapping.  The
+ * error messages are not translated in that case, and an ICMP
+ * destination unreach message with a needfrag code is generated for
+ * a Packet Too Big message as before.
  */
    int
-icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
-      int icmp6_size, int *discard_okp)
+icmpsub_process_icmp6(int tun_fd, const struct ip6_hdr *ip6_hdrp,
+      const struct icmp6_hdr *icmp6_hdrp, int icmp6_size, int *discard_okp)
 {
    assert(icmp6_hdrp != NULL);
    assert(discard_okp != NULL);
@@ -199,16 +407,18 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
       return (-1);
    }
 
-   if (icmp6_hdrp->icmp6_type == ICMP6_ECHO_REQUEST
-         || icmp6_hdrp->icmp6_type == ICMP6_ECHO_REPLY) {
+   const struct icmpsub_xlate *xlatep = icmpsub_lookup_xlate(IPPROTO_ICMPV6,
+         icmp6_hdrp->icmp6_type, icmp6_hdrp->icmp6_code);
+   if (xlatep != NULL && xlatep->action == ICMPSUB_QUERY) {
       /* These messages will be converted to ICMP messages. */
       return (0);
    }
 
-   /* All other ICMPv6 messages will be discarded. */
+   /* All other ICMPv6 messages are translated here or discarded. */
    *discard_okp = 1;
 
    /* Process further ICMPv6 message contents based on the type/code. */
+#define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
    if (icmp6_hdrp->icmp6_type == ICMP6_PACKET_TOO_BIG) {
       /* Path MTU discovery procedure. */
       if (icmp6_size < sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr)) {
@@ -236,48 +446,491 @@ icmpsub_process_icmp6(int tun_fd, const struct icmp6_hdr *icmp6_hdrp,
          return (-1);
       }
 
-      /*
-       * Generate ICMP destination unreach message with a needfrag code
-       *
-       *   outer source: IPv4 converted from orig_remote_addr
-       *   outer destination: IPv4 converted from orig_local_addr
-       *   inner source: IPv4 converted from orig_local_addr
-       *   inner destination: IPv4 converted from orig_remote_addr
-       */
-      struct in_addr orig_local_addr4, orig_remote_addr4;
-      if (mapping_convert_addrs_6to4(&orig_remote_addr, &orig_local_addr,
-               &orig_remote_addr4, &orig_local_addr4)
-            == -1) {
-         warnx("no mapping available.  gave up to convert ICMPv6 packet too big message to ICMP destination unreach/needfrag message.");
-         return (-1);
+      if (ip6_hdrp == NULL) {
+         /*
+          * Generate ICMP destination unreach message with a needfrag code
+          *
+          *   outer source: IPv4 converted from orig_remote_addr
+          *   outer destination: IPv4 converted from orig_local_addr
+          *   inner source: IPv4 converted from orig_local_addr
+          *   inner destination: IPv4 converted from orig_remote_addr
+          */
+         struct in_addr orig_local_addr4, orig_remote_addr4;
+         if (mapping_convert_addrs_6to4(&orig_remote_addr, &orig_local_addr,
+                  &orig_remote_addr4, &orig_local_addr4)
+               == -1) {
+            warnx("no mapping available.  gave up to convert ICMPv6 packet too big message to ICMP destination unreach/needfrag message.");
+            return (-1);
+         }
+         /*
+          * Construct a dummy IPv4 inner header to store original
+          * destination address.
+          */
+         struct ip orig_ip4_hdr;
+         memset(&orig_ip4_hdr, 0, sizeof(struct ip));
+         orig_ip4_hdr.ip_v = 4;
+         orig_ip4_hdr.ip_hl = sizeof(struct ip) >> 2;
+         orig_ip4_hdr.ip_len = htons(sizeof(struct ip));  /* The dummy header. */
+         orig_ip4_hdr.ip_ttl = 64;
+         orig_ip4_hdr.ip_p = IPPROTO_TCP;
+         memcpy(&orig_ip4_hdr.ip_src, &orig_local_addr4, sizeof(struct in_addr));
+         memcpy(&orig_ip4_hdr.ip_dst, &orig_remote_addr4, sizeof(struct in_addr));
+         orig_ip4_hdr.ip_sum = cksum_calc_ip4_header(&orig_ip4_hdr);
+         if (icmpsub_send_icmp4_unreach_needfrag(tun_fd, &orig_ip4_hdr,
+                  &orig_remote_addr4,
+                  &orig_local_addr4,
+                  mtu - IP6_FRAG6_HDR_LEN) == -1) {
+            warnx("failed to send ICMP unreach needfrag.");
+            return (-1);
+         }
+         return (0);
       }
-      /*
-       * Construct a dummy IPv4 inner header to store original
-       * destination address.
-       */
-      struct ip orig_ip4_hdr;
-      memset(&orig_ip4_hdr, 0, sizeof(struct ip));
-      orig_ip4_hdr.ip_v = 4;
-      orig_ip4_hdr.ip_hl = sizeof(struct ip) >> 2;
-      orig_ip4_hdr.ip_len = htons(sizeof(struct ip));  /* The dummy header. */
-      orig_ip4_hdr.ip_ttl = 64;
-      orig_ip4_hdr.ip_p = IPPROTO_TCP;
-      memcpy(&orig_ip4_hdr.ip_src, &orig_local_addr4, sizeof(struct in_addr));
-      memcpy(&orig_ip4_hdr.ip_dst, &orig_remote_addr4, sizeof(struct in_addr));
-      orig_ip4_hdr.ip_sum = cksum_calc_ip4_header(&orig_ip4_hdr);
-#define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
-      if (icmpsub_send_icmp4_unreach_needfrag(tun_fd, &orig_ip4_hdr,
-               &orig_remote_addr4,
-               &orig_local_addr4,
-               mtu - IP6_FRAG6_HDR_LEN) == -1) {
-         warnx("failed to send ICMP unreach needfrag.");
+   }
+
+   if (ip6_hdrp == NULL || xlatep == NULL)
+      return (0);
+
+   if (icmpsub_translate_icmp6_error(tun_fd, ip6_hdrp, icmp6_hdrp, icmp6_size,
+            xlatep) == -1) {
+      warnx("failed to translate ICMPv6 type %d code %d to ICMP.",
+            icmp6_hdrp->icmp6_type, icmp6_hdrp->icmp6_code);
+      return (-1);
+   }
+
+   return (0);
+}
+
+/*
+ * Translate the ICMP error message to an ICMPv6 error message (RFC
+ * 7915 section 4.2 and 4.3), and send it.  The outer addresses are
+ * translated in the same way as the other packets, and the inner
+ * IPv4 header of the original packet is replaced with an IPv6 header
+ * whose addresses are translated in the reverse direction.  The
+ * transport checksum of the original packet, if it is included, and
+ * the ICMPv6 checksum are adjusted incrementally.  The message is
+ * truncated to the minimum IPv6 MTU.
+ */
+   static int
+icmpsub_translate_icmp4_error(int tun_fd, const struct ip *ip4_hdrp,
+      const struct icmp *icmp4_hdrp, int icmp4_size,
+      const struct in6_addr *ip6_srcp, const struct in6_addr *ip6_dstp,
+      const struct icmpsub_xlate *xlatep)
+{
+   assert(ip4_hdrp != NULL);
+   assert(icmp4_hdrp != NULL);
+   assert(xlatep != NULL);
+
+   /* The original packet. */
+   if (icmp4_size < ICMP_MINLEN + (int)sizeof(struct ip)) {
+      warnx("ICMP error message must be longer than %d (%d received).",
+            ICMP_MINLEN + (int)sizeof(struct ip), icmp4_size);
+      return (-1);
+   }
+   const struct ip *inner4_hdrp = (const struct ip *)
+      ((const uint8_t *)icmp4_hdrp + ICMP_MINLEN);
+   int inner4_hlen = inner4_hdrp->ip_hl << 2;
+   if (inner4_hdrp->ip_v != 4 || inner4_hlen < (int)sizeof(struct ip)
+         || icmp4_size < ICMP_MINLEN + inner4_hlen) {
+      warnx("invalid IPv4 header in the ICMP error message.");
+      return (-1);
+   }
+   const uint8_t *inner_datap = (const uint8_t *)inner4_hdrp + inner4_hlen;
+   int inner_data_len = icmp4_size - ICMP_MINLEN - inner4_hlen;
+   int inner_ulp_len = ntohs(inner4_hdrp->ip_len) - inner4_hlen;
+   if (inner_ulp_len < 0)
+      inner_ulp_len = 0;
+   int inner_off_flags = ntohs(inner4_hdrp->ip_off);
+   int inner_is_frag = (inner_off_flags & (IP_MF | IP_OFFMASK)) != 0;
+
+   /*
+    * The message is built in the buffer:
+    *
+    *   the IPv6 header, the ICMPv6 header, the inner IPv6 header, the
+    *   inner Fragment header (if the original packet is a fragment),
+    *   and the data of the original packet.
+    */
+   uint32_t buf[ICMPSUB_IPV6_MINMTU / sizeof(uint32_t)];
+   struct ip6_hdr *ip6_hdrp = (struct ip6_hdr *)buf;
+   struct icmp6_hdr *icmp6_hdrp = (struct icmp6_hdr *)(ip6_hdrp + 1);
+   struct ip6_hdr *inner6_hdrp = (struct ip6_hdr *)(icmp6_hdrp + 1);
+   uint8_t *datap = (uint8_t *)(inner6_hdrp + 1);
+   memset(buf, 0, datap - (uint8_t *)buf);
+
+   /*
+    * Convert the addresses.  The original packet was sent by the
+    * destination of the error, and its destination is on the IPv4
+    * side, under the mapping prefix.
+    */
+   if (ip6_srcp != NULL && ip6_dstp != NULL) {
+      memcpy(&ip6_hdrp->ip6_src, ip6_srcp, sizeof(struct in6_addr));
+      memcpy(&ip6_hdrp->ip6_dst, ip6_dstp, sizeof(struct in6_addr));
+      memcpy(&inner6_hdrp->ip6_src, ip6_dstp, sizeof(struct in6_addr));
+      mapping_get_prefix(&inner6_hdrp->ip6_dst);
+      memcpy(&inner6_hdrp->ip6_dst.s6_addr[12], &inner4_hdrp->ip_dst,
+            sizeof(struct in_addr));
+   } else if (mapping_convert_addrs_4to6(&ip4_hdrp->ip_src, &ip4_hdrp->ip_dst,
+            &ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst) == -1
+         || mapping_convert_addrs_4to6(&inner4_hdrp->ip_dst,
+            &inner4_hdrp->ip_src, &inner6_hdrp->ip6_dst,
+            &inner6_hdrp->ip6_src) == -1) {
+      warnx("no mapping available.  gave up to convert the ICMP error message.");
+      return (-1);
+   }
+
+   /* The inner IPv6 header. */
+   uint8_t inner_proto = inner4_hdrp->ip_p;
+   if (inner_proto == IPPROTO_ICMP)
+      inner_proto = IPPROTO_ICMPV6;
+   inner6_hdrp->ip6_vfc = IPV6_VERSION;
+   inner6_hdrp->ip6_plen = htons(inner_ulp_len);
+   inner6_hdrp->ip6_nxt = inner_proto;
+   inner6_hdrp->ip6_hlim = inner4_hdrp->ip_ttl;
+   int inner6_hlen = sizeof(struct ip6_hdr);
+   if (inner_is_frag) {
+      struct ip6_frag *inner_frag_hdrp = (struct ip6_frag *)datap;
+      inner_frag_hdrp->ip6f_nxt = inner_proto;
+      inner_frag_hdrp->ip6f_reserved = 0;
+      inner_frag_hdrp->ip6f_offlg = htons((inner_off_flags & IP_OFFMASK) << 3);
+      if (inner_off_flags & IP_MF)
+         inner_frag_hdrp->ip6f_offlg |= IP6F_MORE_FRAG;
+      inner_frag_hdrp->ip6f_ident = htonl(ntohs(inner4_hdrp->ip_id));
+      inner6_hdrp->ip6_nxt = IPPROTO_FRAGMENT;
+      inner6_hdrp->ip6_plen = htons(inner_ulp_len + sizeof(struct ip6_frag));
+      inner6_hlen += sizeof(struct ip6_frag);
+      datap += sizeof(struct ip6_frag);
+   }
+
+   /* The data of the original packet, truncated at a 16-bit word. */
+   int copy_len = (uint8_t *)buf + sizeof(buf) - datap;
+   if (inner_data_len <= copy_len)
+      copy_len = inner_data_len;
+   else
+      copy_len &= ~1;
+   memcpy(datap, inner_datap, copy_len);
+
+   /*
+    * The transport checksum of the original packet.  Only the first
+    * ICMPSUB_L4_SUM_LEN bytes are changed.
+    */
+   int l4_len = copy_len < ICMPSUB_L4_SUM_LEN ? copy_len : ICMPSUB_L4_SUM_LEN;
+   int32_t old_l4_sum = cksum_sum_words(inner_datap, l4_len);
+   if ((inner_off_flags & IP_OFFMASK) == 0) {
+      int32_t addrs4_sum = cksum_sum_words(&inner4_hdrp->ip_src,
+            2 * sizeof(struct in_addr));
+      int32_t addrs6_sum = cksum_sum_words(&inner6_hdrp->ip6_src,
+            2 * sizeof(struct in6_addr));
+      icmpsub_translate_inner_l4(IPPROTO_ICMP, inner4_hdrp->ip_p, datap,
+            copy_len, addrs4_sum, addrs6_sum, inner_ulp_len);
+   }
+   int32_t new_l4_sum = cksum_sum_words(datap, l4_len);
+
+   /* The ICMPv6 header. */
+   icmp6_hdrp->icmp6_type = xlatep->type;
+   icmp6_hdrp->icmp6_code = xlatep->code;
+   int mtu, pointer;
+   switch (xlatep->action) {
+      case ICMPSUB_ERROR_MTU:
+         mtu = ntohs(icmp4_hdrp->icmp_nextmtu);
+         if (mtu < ICMPSUB_IPV4_MINMTU)
+            mtu = ICMPSUB_IPV4_MINMTU;
+         mtu += sizeof(struct ip6_hdr) - sizeof(struct ip);
+         if (mtu < ICMPSUB_IPV6_MINMTU)
+            mtu = ICMPSUB_IPV6_MINMTU;
+         icmp6_hdrp->icmp6_mtu = htonl(mtu);
+         break;
+
+      case ICMPSUB_ERROR_POINTER:
+         pointer = icmp4_hdrp->icmp_pptr;
+         if (pointer >= (int)sizeof(icmpsub_pointer_4to6)
+               || icmpsub_pointer_4to6[pointer] == -1) {
+            /* The field has no counterpart in IPv6.  Drop it. */
+            return (0);
+         }
+         icmp6_hdrp->icmp6_pptr = htonl(icmpsub_pointer_4to6[pointer]);
+         break;
+
+      case ICMPSUB_ERROR_PROTO:
+         icmp6_hdrp->icmp6_pptr = htonl(offsetof(struct ip6_hdr, ip6_nxt));
+         break;
+   }
+
+   /* The outer IPv6 header. */
+   int icmp6_len = datap + copy_len - (uint8_t *)icmp6_hdrp;
+   ip6_hdrp->ip6_vfc = IPV6_VERSION;
+   ip6_hdrp->ip6_plen = htons(icmp6_len);
+   ip6_hdrp->ip6_nxt = IPPROTO_ICMPV6;
+   ip6_hdrp->ip6_hlim = ip4_hdrp->ip_ttl;
+
+   /*
+    * The ICMPv6 checksum.  The ICMP header, the inner IPv4 header, the
+    * changed part of the data and the truncated data are replaced with
+    * the ICMPv6 header, the inner IPv6 header, the new data and the
+    * pseudo header.
+    */
+   struct icmp icmp4_hdr;
+   memcpy(&icmp4_hdr, icmp4_hdrp, ICMP_MINLEN);
+   icmp4_hdr.icmp_cksum = 0;
+   int32_t old_sum = cksum_sum_words(&icmp4_hdr, ICMP_MINLEN)
+      + cksum_sum_words(inner4_hdrp, inner4_hlen) + old_l4_sum
+      + cksum_sum_words(inner_datap + copy_len, inner_data_len - copy_len);
+   int32_t new_sum = cksum_sum_words(icmp6_hdrp, sizeof(struct icmp6_hdr))
+      + cksum_sum_words(inner6_hdrp, inner6_hlen) + new_l4_sum
+      + cksum_sum_words(&ip6_hdrp->ip6_src, 2 * sizeof(struct in6_addr))
+      + htons(icmp6_len) + htons(IPPROTO_ICMPV6);
+   icmp6_hdrp->icmp6_cksum = cksum_adjust(icmp4_hdrp->icmp_cksum, old_sum,
+         new_sum);
+
+   struct iovec iov[2];
+   uint32_t af;
+   tun_set_af(&af, AF_INET6);
+   iov[0].iov_base = &af;
+   iov[0].iov_len = sizeof(uint32_t);
+   iov[1].iov_base = buf;
+   iov[1].iov_len = sizeof(struct ip6_hdr) + icmp6_len;
+   if (writev(tun_fd, iov, 2) == -1) {
+      warn("failed to write the ICMPv6 error message to the tun device.");
+      return (-1);
+   }
+
+   return (0);
+}
+
+/*
+ * Translate the ICMPv6 error message to an ICMP error message (RFC
+ * 7915 section 5.2 and 5.3), and send it.  The same as
+ * icmpsub_translate_icmp4_error() in the reverse direction.  The
+ * original packet may have a Fragment header, but no other extension
+ * headers.  The message is truncated to 576 bytes (RFC 1812).
+ */
+   static int
+icmpsub_translate_icmp6_error(int tun_fd, const struct ip6_hdr *ip6_hdrp,
+      const struct icmp6_hdr *icmp6_hdrp, int icmp6_size,
+      const struct icmpsub_xlate *xlatep)
+{
+   assert(ip6_hdrp != NULL);
+   assert(icmp6_hdrp != NULL);
+   assert(xlatep != NULL);
+
+   /* The original packet. */
+   if (icmp6_size
+         < (int)(sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr))) {
+      warnx("ICMPv6 error message must be longer than %d (%d received).",
+            (int)(sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr)),
+            icmp6_size);
+      return (-1);
+   }
+   const struct ip6_hdr *inner6_hdrp = (const struct ip6_hdr *)(icmp6_hdrp + 1);
+   if ((inner6_hdrp->ip6_vfc & 0xf0) != IPV6_VERSION) {
+      warnx("invalid IPv6 header in the ICMPv6 error message.");
+      return (-1);
+   }
+   int inner6_hlen = sizeof(struct ip6_hdr);
+   int inner_ulp_len = ntohs(inner6_hdrp->ip6_plen);
+   uint8_t inner_proto = inner6_hdrp->ip6_nxt;
+   const struct ip6_frag *inner_frag_hdrp = NULL;
+   if (inner_proto == IPPROTO_FRAGMENT) {
+      if (icmp6_size < (int)(sizeof(struct icmp6_hdr) + IP6_FRAG6_HDR_LEN)) {
+         warnx("ICMPv6 error message is too short for the Fragment header.");
          return (-1);
       }
+      inner_frag_hdrp = (const struct ip6_frag *)(inner6_hdrp + 1);
+      inner_proto = inner_frag_hdrp->ip6f_nxt;
+      inner6_hlen += sizeof(struct ip6_frag);
+      inner_ulp_len -= sizeof(struct ip6_frag);
+      if (inner_ulp_len < 0)
+         inner_ulp_len = 0;
+   }
+   const uint8_t *inner_datap = (const uint8_t *)inner6_hdrp + inner6_hlen;
+   int inner_data_len = icmp6_size - (int)sizeof(struct icmp6_hdr)
+      - inner6_hlen;
+
+   /*
+    * The message is built in the buffer:
+    *
+    *   the IPv4 header, the ICMP header, the inner IPv4 header, and
+    *   the data of the original packet.
+    */
+   uint32_t buf[ICMPSUB_IPV4_ERROR_LEN / sizeof(uint32_t)];
+   struct ip *ip4_hdrp = (struct ip *)buf;
+   struct icmp *icmp4_hdrp = (struct icmp *)(ip4_hdrp + 1);
+   struct ip *inner4_hdrp = (struct ip *)((uint8_t *)icmp4_hdrp + ICMP_MINLEN);
+   uint8_t *datap = (uint8_t *)(inner4_hdrp + 1);
+   memset(buf, 0, datap - (uint8_t *)buf);
+
+   /* Convert the addresses. */
+   if (mapping_convert_addrs_6to4(&ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst,
+            &ip4_hdrp->ip_src, &ip4_hdrp->ip_dst) == -1
+         || mapping_convert_addrs_6to4(&inner6_hdrp->ip6_dst,
+            &inner6_hdrp->ip6_src, &inner4_hdrp->ip_dst,
+            &inner4_hdrp->ip_src) == -1) {
+      warnx("no mapping available.  gave up to convert the ICMPv6 error message.");
+      return (-1);
+   }
+
+   /* The inner IPv4 header. */
+   inner4_hdrp->ip_v = 4;
+   inner4_hdrp->ip_hl = sizeof(struct ip) >> 2;
+   inner4_hdrp->ip_tos = (ntohl(inner6_hdrp->ip6_flow) >> 20) & 0xff;
+   inner4_hdrp->ip_len = htons(sizeof(struct ip) + inner_ulp_len);
+   if (inner_frag_hdrp != NULL) {
+      inner4_hdrp->ip_id = htons(ntohl(inner_frag_hdrp->ip6f_ident) & 0xffff);
+      int off_flags = ntohs(inner_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK) >> 3;
+      if (inner_frag_hdrp->ip6f_offlg & IP6F_MORE_FRAG)
+         off_flags |= IP_MF;
+      inner4_hdrp->ip_off = htons(off_flags);
+   } else {
+      inner4_hdrp->ip_off = htons(IP_DF);
+   }
+   inner4_hdrp->ip_ttl = inner6_hdrp->ip6_hlim;
+   inner4_hdrp->ip_p = inner_proto == IPPROTO_ICMPV6 ? IPPROTO_ICMP
+      : inner_proto;
+   inner4_hdrp->ip_sum = cksum_calc_ip4_header(inner4_hdrp);
+
+   /* The data of the original packet, truncated at a 16-bit word. */
+   int copy_len = (uint8_t *)buf + sizeof(buf) - datap;
+   if (inner_data_len <= copy_len)
+      copy_len = inner_data_len;
+   else
+      copy_len &= ~1;
+   memcpy(datap, inner_datap, copy_len);
+
+   /* The transport checksum of the original packet. */
+   int l4_len = copy_len < ICMPSUB_L4_SUM_LEN ? copy_len : ICMPSUB_L4_SUM_LEN;
+   int32_t old_l4_sum = cksum_sum_words(inner_datap, l4_len);
+   if (inner_frag_hdrp == NULL
+         || (inner_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK) == 0) {
+      int32_t addrs6_sum = cksum_sum_words(&inner6_hdrp->ip6_src,
+            2 * sizeof(struct in6_addr));
+      int32_t addrs4_sum = cksum_sum_words(&inner4_hdrp->ip_src,
+            2 * sizeof(struct in_addr));
+      icmpsub_translate_inner_l4(IPPROTO_ICMPV6, inner_proto, datap, copy_len,
+            addrs6_sum, addrs4_sum, inner_ulp_len);
+   }
+   int32_t new_l4_sum = cksum_sum_words(datap, l4_len);
+
+   /* The ICMP header. */
+   icmp4_hdrp->icmp_type = xlatep->type;
+   icmp4_hdrp->icmp_code = xlatep->code;
+   int mtu, pointer;
+   switch (xlatep->action) {
+      case ICMPSUB_ERROR_MTU:
+         mtu = ntohl(icmp6_hdrp->icmp6_mtu);
+         if (mtu < ICMPSUB_IPV6_MINMTU)
+            mtu = ICMPSUB_IPV6_MINMTU;
+         /* The same size as the generated messages. */
+         icmp4_hdrp->icmp_nextmtu = htons(mtu - IP6_FRAG6_HDR_LEN);
+         break;
+
+      case ICMPSUB_ERROR_POINTER:
+         pointer = ntohl(icmp6_hdrp->icmp6_pptr);
+         if (pointer < 0 || pointer >= (int)sizeof(icmpsub_pointer_6to4)
+               || icmpsub_pointer_6to4[pointer] == -1) {
+            /* The field has no counterpart in IPv4.  Drop it. */
+            return (0);
+         }
+         icmp4_hdrp->icmp_pptr = icmpsub_pointer_6to4[pointer];
+         break;
+   }
+
+   /* The outer IPv4 header. */
+   int icmp4_len = datap + copy_len - (uint8_t *)icmp4_hdrp;
+   ip4_hdrp->ip_v = 4;
+   ip4_hdrp->ip_hl = sizeof(struct ip) >> 2;
+   ip4_hdrp->ip_len = htons(sizeof(struct ip) + icmp4_len);
+   ip4_hdrp->ip_ttl = ip6_hdrp->ip6_hlim;
+   ip4_hdrp->ip_p = IPPROTO_ICMP;
+   ip4_hdrp->ip_sum = cksum_calc_ip4_header(ip4_hdrp);
+
+   /* The ICMP checksum, the reverse of the ICMPv6 case. */
+   struct icmp6_hdr icmp6_hdr;
+   memcpy(&icmp6_hdr, icmp6_hdrp, sizeof(struct icmp6_hdr));
+   icmp6_hdr.icmp6_cksum = 0;
+   int32_t old_sum = cksum_sum_words(&icmp6_hdr, sizeof(struct icmp6_hdr))
+      + cksum_sum_words(inner6_hdrp, inner6_hlen) + old_l4_sum
+      + cksum_sum_words(inner_datap + copy_len, inner_data_len - copy_len)
+      + cksum_sum_words(&ip6_hdrp->ip6_src, 2 * sizeof(struct in6_addr))
+      + htons(icmp6_size) + htons(IPPROTO_ICMPV6);
+   int32_t new_sum = cksum_sum_words(icmp4_hdrp, ICMP_MINLEN)
+      + cksum_sum_words(inner4_hdrp, sizeof(struct ip)) + new_l4_sum;
+   icmp4_hdrp->icmp_cksum = cksum_adjust(icmp6_hdrp->icmp6_cksum, old_sum,
+         new_sum);
+
+   struct iovec iov[2];
+   uint32_t af;
+   tun_set_af(&af, AF_INET);
+   iov[0].iov_base = &af;
+   iov[0].iov_len = sizeof(uint32_t);
+   iov[1].iov_base = buf;
+   iov[1].iov_len = sizeof(struct ip) + icmp4_len;
+   if (writev(tun_fd, iov, 2) == -1) {
+      warn("failed to write the ICMP error message to the tun device.");
+      return (-1);
    }
 
    return (0);
 }
 
+/*
+ * Adjust the transport header of the original packet in an ICMP or
+ * ICMPv6 (incoming_icmp_protocol) error message for the translated
+ * inner IP header.  The old_sum and new_sum parameters are the sums of
+ * the inner addresses before and after the translation, and the
+ * ulp_len parameter is the length of the transport data for the ICMPv6
+ * pseudo header.  Only the fields within the data_len bytes are
+ * changed, and an ICMP message other than echo is left as it is.
+ */
+   static void
+icmpsub_translate_inner_l4(int incoming_icmp_protocol, int proto,
+      uint8_t *l4p, int data_len, int32_t old_sum, int32_t new_sum,
+      int ulp_len)
+{
+   assert(l4p != NULL);
+
+   uint16_t *cksump;
+   struct icmp6_hdr *icmp46_hdrp;
+   const struct icmpsub_xlate *xlatep;
+   int32_t pheader_sum;
+   switch (proto) {
+      case IPPROTO_TCP:
+         if (data_len < ICMPSUB_TCP_SUM_OFF + (int)sizeof(uint16_t))
+            break;
+         cksump = (uint16_t *)(l4p + ICMPSUB_TCP_SUM_OFF);
+         *cksump = cksum_adjust(*cksump, old_sum, new_sum);
+         break;
+
+      case IPPROTO_UDP:
+         if (data_len < ICMPSUB_UDP_SUM_OFF + (int)sizeof(uint16_t))
+            break;
+         cksump = (uint16_t *)(l4p + ICMPSUB_UDP_SUM_OFF);
+         /* IPv4 allows no checksum.  Leave it as it is. */
+         if (*cksump != 0)
+            *cksump = cksum_adjust(*cksump, old_sum, new_sum);
+         break;
+
+      case IPPROTO_ICMP:
+      case IPPROTO_ICMPV6:
+         if (data_len < (int)sizeof(uint32_t))
+            break;
+         icmp46_hdrp = (struct icmp6_hdr *)l4p;
+         xlatep = icmpsub_lookup_xlate(incoming_icmp_protocol,
+               icmp46_hdrp->icmp6_type, icmp46_hdrp->icmp6_code);
+         if (xlatep == NULL || xlatep->action != ICMPSUB_QUERY)
+            break;
+         icmp46_hdrp->icmp6_type = xlatep->type;
+         icmp46_hdrp->icmp6_code = xlatep->code;
+         /* Only ICMPv6 counts the pseudo header. */
+         pheader_sum = htons(ulp_len) + htons(IPPROTO_ICMPV6);
+         if (incoming_icmp_protocol == IPPROTO_ICMP) {
+            icmp46_hdrp->icmp6_cksum = cksum_adjust(icmp46_hdrp->icmp6_cksum,
+                  0, xlatep->cksum_delta + new_sum + pheader_sum);
+         } else {
+            icmp46_hdrp->icmp6_cksum = cksum_adjust(icmp46_hdrp->icmp6_cksum,
+                  old_sum + pheader_sum, xlatep->cksum_delta);
+         }
+         break;
+   }
+}
+
 /*
  * Send an ICMPv4 packet with the unreach type and the needfrag code
  * to the node specidied by the remote_addrp parameter.  The source
@@ -331,6 +984,7 @@ icmpsub_send_icmp4_unreach_needfrag(int tun_fd, void *in_pktp,
    /* Calculate the ICMPv4 header checksum. */
    cksum_calc_ulp(IPPROTO_ICMP, iov);
 
+   PROBE4(icmp_error, AF_INET, ICMP_UNREACH, remote_addrp, mtu);
    if (writev(tun_fd, iov, 5) == -1) {
       warn("failed to write ICMP unreach needfrag packet to the tun device.");
       return (-1);
@@ -388,6 +1042,7 @@ icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
    /* Calculate the ICMPv6 header checksum. */
    cksum_calc_ulp(IPPROTO_ICMPV6, iov);
 
+   PROBE4(icmp_error, AF_INET6, ICMP6_PACKET_TOO_BIG, remote_addrp, mtu);
    if (writev(tun_fd, iov, 5) == -1) {
       warn("failed to write ICMPv6 packet too big message to the tun device.");
       return (-1);
@@ -397,8 +1052,77 @@ icmpsub_send_icmp6_packet_too_big(int tun_fd, void *in_pktp,
 }
 
 /*
- * ICMP <=> ICMPv6 protocol conversion.  Currently, only the echo
- * request and echo reply messages are supported.
+ * Send an ICMPv6 Time Exceeded message for an IPv6 packet whose hop
+ * limit expired in map646.  The message carries as much of the
+ * original packet of in_len bytes as fits in the minimum IPv6 MTU.
+ */
+   int
+icmpsub_send_icmp6_time_exceeded(int tun_fd, void *in_pktp, size_t in_len,
+      const struct in6_addr *local_addrp,
+      const struct in6_addr *remote_addrp)
+{
+   assert(in_pktp != NULL);
+   assert(local_addrp != NULL);
+   assert(remote_addrp != NULL);
+
+   if (icmpsub_check_sending_rate()) {
+      warnx("ICMP rate limit over.");
+      return (0);
+   }
+
+   size_t quote_len = ICMPSUB_IPV6_MINMTU - sizeof(struct ip6_hdr)
+      - sizeof(struct icmp6_hdr);
+   if (in_len < quote_len) {
+      quote_len = in_len;
+   }
+
+   struct ip6_hdr ip6_hdr;
+   memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+   ip6_hdr.ip6_vfc = IPV6_VERSION;
+   ip6_hdr.ip6_plen = htons(sizeof(struct icmp6_hdr) + quote_len);
+   ip6_hdr.ip6_nxt = IPPROTO_ICMPV6;
+   ip6_hdr.ip6_hlim = 64;
+   memcpy(&ip6_hdr.ip6_src, local_addrp, sizeof(struct in6_addr));
+   memcpy(&ip6_hdr.ip6_dst, remote_addrp, sizeof(struct in6_addr));
+
+   struct icmp6_hdr icmp6_hdr;
+   memset(&icmp6_hdr, 0, sizeof(struct icmp6_hdr));
+   icmp6_hdr.icmp6_type = ICMP6_TIME_EXCEEDED;
+   icmp6_hdr.icmp6_code = ICMP6_TIME_EXCEED_TRANSIT;
+
+   struct iovec iov[5];
+   uint32_t af;
+   tun_set_af(&af, AF_INET6);
+   iov[0].iov_base = &af;
+   iov[0].iov_len = sizeof(uint32_t);
+   iov[1].iov_base = &ip6_hdr;
+   iov[1].iov_len = sizeof(struct ip6_hdr);
+   iov[2].iov_base = NULL;
+   iov[2].iov_len = 0;
+   iov[3].iov_base = &icmp6_hdr;
+   iov[3].iov_len = sizeof(struct icmp6_hdr);
+   iov[4].iov_base = in_pktp;
+   iov[4].iov_len = quote_len;
+
+   cksum_calc_ulp(IPPROTO_ICMPV6, iov);
+
+   PROBE4(icmp_error, AF_INET6, ICMP6_TIME_EXCEEDED, remote_addrp, 0);
+   if (writev(tun_fd, iov, 5) == -1) {
+      warn("failed to write ICMPv6 time exceeded message to the tun device.");
+      return (-1);
+   }
+
+   return (0);
+}
+
+/*
+ * ICMP <=> ICMPv6 protocol conversion.  The type and the code are
+ * translated by the icmpsub_xlate_4to6[] and icmpsub_xlate_6to4[]
+ * tables, and the checksum is adjusted by the difference in the
+ * table.  The pseudo header part of the checksum is adjusted later by
+ * cksum_update_ulp().  The callers pass only the echo request and
+ * echo reply messages.  The error messages are translated by
+ * icmpsub_translate_icmp4_error() and icmpsub_translate_icmp6_error().
  *
  * The iov parameter contains the following information.
  *
@@ -414,82 +1138,33 @@ icmpsub_convert_icmp(int incoming_icmp_protocol, struct iovec *iov)
    assert(incoming_icmp_protocol == IPPROTO_ICMP
          || incoming_icmp_protocol == IPPROTO_ICMPV6);
 
-   struct ip *ip4_hdrp;
-   struct ip6_hdr *ip6_hdrp;
-   struct icmp *icmp_hdrp;
-   struct icmp6_hdr *icmp6_hdrp;
-
-   switch (incoming_icmp_protocol) {
-      case IPPROTO_ICMP:
-         icmp_hdrp = iov[3].iov_base;
-         switch (icmp_hdrp->icmp_type) {
-            case ICMP_ECHO:
-               icmp_hdrp->icmp_type = ICMP6_ECHO_REQUEST;
-               if (cksum_update_icmp_type_code(icmp_hdrp,
-                        ICMP_ECHO,
-                        icmp_hdrp->icmp_code,
-                        ICMP6_ECHO_REQUEST,
-                        icmp_hdrp->icmp_code) == -1) {
-                  warnx("Checksum update when converting ICMP Echo to ICMPv6 Echo failed.");
-                  return(-1);
-               }
-               break;
-
-            case ICMP_ECHOREPLY:
-               icmp_hdrp->icmp_type = ICMP6_ECHO_REPLY;
-               if (cksum_update_icmp_type_code(icmp_hdrp,
-                        ICMP_ECHOREPLY,
-                        icmp_hdrp->icmp_code,
-                        ICMP6_ECHO_REPLY,
-                        icmp_hdrp->icmp_code) == -1) {
-
-                  warnx("Checksum update when converting ICMP Echo Reply to ICMPv6 Echo Reply failed.");
-                  return (-1);
-               }
-               break;
-
-            default:
-               warnx("unsupported ICMP type %d.", icmp_hdrp->icmp_type);
-               return (-1);
-         }
-         ip6_hdrp = iov[1].iov_base;
-         ip6_hdrp->ip6_nxt = IPPROTO_ICMPV6;
-         break;
+   /*
+    * The type, code and checksum fields are at the same place in
+    * struct icmp{} and struct icmp6_hdr{}.
+    */
+   struct icmp6_hdr *icmp46_hdrp = iov[3].iov_base;
+   const struct icmpsub_xlate *xlatep
+      = icmpsub_lookup_xlate(incoming_icmp_protocol,
+            icmp46_hdrp->icmp6_type, icmp46_hdrp->icmp6_code);
+   if (xlatep == NULL) {
+      warnx("unsupported %s type %d code %d.",
+            incoming_icmp_protocol == IPPROTO_ICMP ? "ICMP" : "ICMPv6",
+            icmp46_hdrp->icmp6_type, icmp46_hdrp->icmp6_code);
+      return (-1);
+   }
 
-      case IPPROTO_ICMPV6:
-         icmp6_hdrp = iov[3].iov_base;
-         switch (icmp6_hdrp->icmp6_type) {
-            case ICMP6_ECHO_REQUEST:
-               icmp6_hdrp->icmp6_type = ICMP_ECHO;
-               if (cksum_update_icmp_type_code(icmp6_hdrp,
-                        ICMP6_ECHO_REQUEST,
-                        icmp6_hdrp->icmp6_code,
-                        ICMP_ECHO,
-                        icmp6_hdrp->icmp6_code) == -1) {
-                  warnx("Checksum update when converting ICMPv6 Echo to ICMP Echo failed.");
-                  return(-1);
-               }
-               break;
-
-            case ICMP6_ECHO_REPLY:
-               icmp6_hdrp->icmp6_type = ICMP_ECHOREPLY;
-               if (cksum_update_icmp_type_code(icmp6_hdrp,
-                        ICMP6_ECHO_REPLY,
-                        icmp6_hdrp->icmp6_code,
-                        ICMP_ECHOREPLY,
-                        icmp6_hdrp->icmp6_code) == -1) {
-                  warnx("Checksum update when converting ICMPv6 Echo Reply to ICMP Echo Reply failed.");
-                  return(-1);
-               }
-               break;
-
-            default:
-               warnx("unsupported ICMPv6 type %d.", icmp6_hdrp->icmp6_type);
-               return (-1);
-         }
-         ip4_hdrp = iov[1].iov_base;
-         ip4_hdrp->ip_p = IPPROTO_ICMP;
-         break;
+   icmp46_hdrp->icmp6_type = xlatep->type;
+   icmp46_hdrp->icmp6_code = xlatep->code;
+   int32_t sum = (~icmp46_hdrp->icmp6_cksum & 0xffff) + xlatep->cksum_delta;
+   sum = (sum >> 16) + (sum & 0xffff);
+   icmp46_hdrp->icmp6_cksum = ~sum & 0xffff;
+
+   if (incoming_icmp_protocol == IPPROTO_ICMP) {
+      struct ip6_hdr *ip6_hdrp = iov[1].iov_base;
+      ip6_hdrp->ip6_nxt = IPPROTO_ICMPV6;
+   } else {
+      struct ip *ip4_hdrp = iov[1].iov_base;
+      ip4_hdrp->ip_p = IPPROTO_ICMP;
    }
 
    return (0);
@@ -783,8 +1458,11 @@ icmpsub_check_sending_rate(void)
 {
    static int count = 0;
    static time_t from;
+   static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
    time_t now = time(NULL);
+   int ret = 0;
 
+   pthread_mutex_lock(&lock);
    if (now - from > 1) {
       /* Reset counter. */
       count = 0;
@@ -793,10 +1471,11 @@ icmpsub_check_sending_rate(void)
 
    if (count > ICMPSUB_RATE_LIMIT_COUNT) {
       /* Too frequent. */
-      return (-1);
+      ret = -1;
+   } else {
+      count = count + 1;
    }
+   pthread_mutex_unlock(&lock);
 
-   count = count + 1;
-
-   return (0);
+   return (ret);
 }
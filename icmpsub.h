@@ -29,12 +29,18 @@
 extern "C" {
 #endif
 
-int icmpsub_process_icmp4(int, const struct icmp *, int, int *);
-int icmpsub_process_icmp6(int, const struct icmp6_hdr *, int, int *);
+int icmpsub_process_icmp4(int, const struct ip *, const struct icmp *, int,
+			  const struct in6_addr *, const struct in6_addr *,
+			  int *);
+int icmpsub_process_icmp6(int, const struct ip6_hdr *,
+			  const struct icmp6_hdr *, int, int *);
 int icmpsub_send_icmp4_unreach_needfrag(int, void *, const struct in_addr *,
 					const struct in_addr *, int);
 int icmpsub_send_icmp6_packet_too_big(int, void *, const struct in6_addr *,
 				      const struct in6_addr *, int);
+int icmpsub_send_icmp6_time_exceeded(int, void *, size_t,
+				     const struct in6_addr *,
+				     const struct in6_addr *);
 int icmpsub_convert_icmp(int, struct iovec *);
 
 #ifdef __cplusplus
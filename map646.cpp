@@ -31,8 +31,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <iostream>
 #include <string>
+#include <sstream>
 
 #include <sys/uio.h>
 #include <sys/un.h>
@@ -40,6 +44,7 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <net/if.h>
+#include <net/ethernet.h>
 
 #include <sys/time.h>
 
@@ -49,6 +54,8 @@
 #include <netinet/ip6.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include "mapping.h"
 #include "tunif.h"
@@ -56,30 +63,141 @@
 #include "pmtudisc.h"
 #include "icmpsub.h"
 #include "stat.h"
+#include "xskif.h"
+#include "fastpath.h"
+#include "steer.h"
+#include "pipeline.h"
+#include "affinity.h"
+#include "nat64.h"
+#include "dns64.h"
+#include "flowexp.h"
+#include "capture.h"
+#include "probe.h"
+#include "perfctr.h"
 
 #if defined(__linux__)
 #define IPV6_VERSION 0x60
 #endif
 
-#define BUF_LEN 1600 /* XXX: should be bigger than the MTU size of the
-                        local interfaces used to transmit actual
-                        packets. */
+/*
+ * The busy poll spin budget is adjusted between the busy-poll-usec
+ * value and 1/BUSY_POLL_MIN_RATIO of it.  One spin returns to the
+ * caller after processing BUSY_POLL_MAX_PACKETS packets, so that the
+ * main thread serves the other descriptors.
+ */
+#define BUSY_POLL_MIN_RATIO 16
+#define BUSY_POLL_MAX_PACKETS 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+/*
+ * The result of the mapping and the path MTU lookups of a packet done
+ * in advance by lookup_batch().  The translation functions do the
+ * lookups by themselves if the valid member is 0.
+ */
+struct lookup_hint {
+   int valid;
+   int result;                  /* of the address conversion */
+   struct in_addr ip4_src, ip4_dst;
+   struct in6_addr ip6_src, ip6_dst;
+   int mtu;
+};
 
-static int send_4to6(void *, size_t);
-static int send_6to4(void *, size_t);
+#define LOOKUP_MAX_BATCH_SIZE PIPELINE_MAX_BATCH_SIZE
+
+static int send_4to6(void *, size_t, const struct lookup_hint *);
+static int send_6to4(void *, size_t, const struct lookup_hint *);
 static int send66_GtoI(void *, size_t);
 static int send66_ItoG(void *, size_t);
+static int send66_hairpin(void *, size_t);
+static void process_packet(uint8_t *, ssize_t);
+static void translate_packet(uint8_t *, ssize_t, int,
+      const struct lookup_hint *);
+static void translate_batch(uint8_t *const *, const ssize_t *, const int *,
+      unsigned int);
+static void lookup_batch(uint8_t *const *, const ssize_t *, const int *,
+      struct lookup_hint *, unsigned int);
+static int translate_fast(int, uint8_t *, size_t, const struct lookup_hint *);
+static void translate_shared(int, uint8_t *, ssize_t);
+static ssize_t output_packet(const struct iovec *, int);
+static void start_tun_workers(void);
+static void tun_worker_name(int, char *, size_t);
+static void *tun_worker_main(void *);
+static ssize_t tun_read_packet(struct tun_worker *);
+static void tun_busy_poll(struct tun_worker *);
+static uint64_t monotonic_nsec(void);
+static struct stat_shard *stat_get_shard(void);
+static void stat_merge_shards(map646_stat::stat &);
+static void stat_flush_shards(void);
+static void reload_config(void);
+static void write_perf_stats(std::ostringstream &);
+static void write_perf_thread(std::ostringstream &,
+      const struct perfctr_thread_stats *);
 
 void cleanup_sigint(int);
 void cleanup(void);
 void reload_sighup(int);
 
-int tun_fd;
-int stat_listen_fd, stat_fd;
+int tun_fd = -1;
+int xsk_fd;
+int stat_listen_fd = -1, stat_fd = -1;
 
 std::string map646_conf_path("/etc/map646.conf");
 map646_stat::stat map_stat;
 
+static bool stat_enable = true;
+
+/*
+ * The AF_XDP frame which contains the packet being processed, or NULL
+ * if the packet was read from the tun interface.
+ */
+static __thread struct xsk_frame *xsk_rx_framep;
+
+/*
+ * The tun queues.  The queue 0 (tun_fd) is served by the main thread
+ * together with the AF_XDP socket and the stat interface (or by the
+ * pipeline threads if the pipeline-workers directive is specified),
+ * and each of the other queues is served by its own worker thread.
+ */
+struct tun_worker {
+   int index;
+   int fd;
+   pthread_t thread;
+   uint8_t *buf;                /* tun_get_buffer_size() bytes */
+   uint64_t packets;
+   uint64_t poll_budget_nsec;   /* the current busy poll spin budget */
+   uint64_t poll_nsec;          /* the total time spent spinning */
+   uint64_t poll_packets;       /* the packets found while spinning */
+} __attribute__((aligned(64)));
+static struct tun_worker *tun_workers[TUN_MAX_QUEUES];
+static int tun_worker_count = 1;
+
+/* The tun queue to which the current thread writes the packets. */
+static __thread int tun_out_fd = -1;
+
+/*
+ * The statistics are counted in a shard of each thread translating
+ * packets, so that the threads don't share a lock.  The lock of a
+ * shard is taken by its thread for each packet, and by the main
+ * thread while the shard is merged into a copy or flushed for a stat
+ * command.  The copy is written to the client without any lock.
+ */
+struct stat_shard {
+   pthread_mutex_t lock;
+   map646_stat::stat stat;
+   struct stat_shard *nextp;
+};
+static struct stat_shard *stat_shards;
+static pthread_mutex_t stat_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct stat_shard *stat_shardp;
+
+/* Set by the SIGHUP handler, and the main loop reloads the file. */
+static volatile sig_atomic_t reload_requested;
+
 int main(int argc, char *argv[])
 {
 
@@ -115,6 +233,43 @@ int main(int argc, char *argv[])
       err(EXIT_FAILURE, "failed to register a SIGHUP hook.");
    }
 
+   /*
+    * Create mapping table from the configuraion file.  This must be
+    * done before creating the tun interface, since the tun-queues
+    * directive changes the way the interface is created.
+    */
+   if (mapping_create_table(map646_conf_path.c_str(), 0) == -1) {
+      errx(EXIT_FAILURE, "mapping table creation failed.");
+   }
+
+   /* Allocate the session table if the NAT64 pool is configured. */
+   if (nat64_start() == -1) {
+      errx(EXIT_FAILURE, "cannot start the NAT64.");
+   }
+
+   /*
+    * Pin the main thread, and allocate the per-queue data on the NUMA
+    * node of the thread serving each queue.
+    */
+   affinity_pin_self("main");
+   for (int q = 0; q < tun_queues; q++) {
+      char name[AFFINITY_NAME_LEN];
+      tun_worker_name(q, name, sizeof(name));
+      int node = affinity_node(name);
+      tun_workers[q] = (struct tun_worker *)affinity_alloc(
+            sizeof(struct tun_worker), node);
+      if (tun_workers[q] == NULL) {
+         errx(EXIT_FAILURE, "cannot allocate the data of the tun queue %d.", q);
+      }
+      tun_workers[q]->index = q;
+      tun_workers[q]->buf = (uint8_t *)affinity_alloc(tun_get_buffer_size(),
+            node);
+      if (tun_workers[q]->buf == NULL) {
+         errx(EXIT_FAILURE, "cannot allocate the buffer of the tun queue %d.",
+               q);
+      }
+   }
+
    /* Create a tun interface. */
    tun_fd = -1;
    strncpy(tun_if_name, TUN_DEFAULT_IF_NAME, IFNAMSIZ);
@@ -122,6 +277,41 @@ int main(int argc, char *argv[])
    if (tun_fd == -1) {
       errx(EXIT_FAILURE, "cannot open a tun internface %s.", tun_if_name);
    }
+   tun_out_fd = tun_fd;
+
+   /*
+    * Open the rest of the tun queues, and attach the program which
+    * keeps both directions of a flow on the same queue.  The kernel
+    * selects the queue by its own flow hash if the program is not
+    * available.
+    */
+   tun_workers[0]->fd = tun_fd;
+   for (int q = 1; q < tun_queues; q++) {
+      tun_workers[q]->fd = tun_alloc_queue(tun_if_name);
+      if (tun_workers[q]->fd == -1) {
+         errx(EXIT_FAILURE, "cannot open the tun queue %d.", q);
+      }
+   }
+   tun_worker_count = tun_queues;
+   if (tun_worker_count > 1 && steer_alloc(tun_fd) == -1) {
+      warnx("the tun queue steering program is not available.");
+   }
+
+   /*
+    * The busy poll mode spins on non-blocking reads.  The queue 0 is
+    * left blocking if it is read by the pipeline reader.
+    */
+   if (tun_busy_poll_usec > 0) {
+      for (int q = 0; q < tun_worker_count; q++) {
+         if (q == 0 && pipeline_workers > 0)
+            continue;
+         int flags = fcntl(tun_workers[q]->fd, F_GETFL);
+         if (flags == -1
+               || fcntl(tun_workers[q]->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            err(EXIT_FAILURE, "cannot make the tun queue %d non-blocking.", q);
+         }
+      }
+   }
 
    /* Create a stat socket */
    stat_listen_fd = -1;
@@ -142,12 +332,14 @@ int main(int argc, char *argv[])
    if((epfd = epoll_create( nfiles )) == -1)
       errx(EXIT_FAILURE, "epoll_create() failed");
 
-   epevp = new epoll_event;
-   epevp->data.fd = tun_fd;
-   epevp->events = EPOLLIN;
-   if(epoll_ctl(epfd, EPOLL_CTL_ADD, tun_fd, epevp) == -1)
-      errx(EXIT_FAILURE, "epoll_ctl() failed");
-   delete epevp;
+   if (pipeline_workers == 0) {
+      epevp = new epoll_event;
+      epevp->data.fd = tun_fd;
+      epevp->events = EPOLLIN;
+      if(epoll_ctl(epfd, EPOLL_CTL_ADD, tun_fd, epevp) == -1)
+         errx(EXIT_FAILURE, "epoll_ctl() failed");
+      delete epevp;
+   }
 
    epevp = new epoll_event;
    epevp->data.fd = stat_listen_fd;
@@ -155,10 +347,29 @@ int main(int argc, char *argv[])
    if(epoll_ctl(epfd, EPOLL_CTL_ADD, stat_listen_fd, epevp) == -1)
       errx(EXIT_FAILURE, "epoll_ctl() failed");
    delete epevp;
-   
-   /* Create mapping table from the configuraion file. */
-   if (mapping_create_table(map646_conf_path.c_str(), 0) == -1) {
-      errx(EXIT_FAILURE, "mapping table creation failed.");
+
+   /*
+    * Create an AF_XDP socket if the xdp-interface directive is
+    * specified.  The tun interface is used for all the packets if it
+    * fails.
+    */
+   xsk_fd = xsk_alloc();
+   if (xsk_fd != -1) {
+      epevp = new epoll_event;
+      epevp->data.fd = xsk_fd;
+      epevp->events = EPOLLIN;
+      if(epoll_ctl(epfd, EPOLL_CTL_ADD, xsk_fd, epevp) == -1)
+         errx(EXIT_FAILURE, "epoll_ctl() failed");
+      delete epevp;
+   }
+
+   /*
+    * Load the in-kernel fast path if the fastpath-interface directive
+    * is specified.  All the packets go through the tun interface if it
+    * fails.
+    */
+   if (fastpath_alloc() == -1) {
+      warnx("the fast path is not available.");
    }
 
    /*
@@ -170,11 +381,8 @@ int main(int argc, char *argv[])
       errx(EXIT_FAILURE, "failed to install mapped route information.");
    }
 
-   ssize_t read_len;
-   uint8_t buf[BUF_LEN];
-   uint8_t *bufp;
-   
-   bool stat_enable = true;
+   start_tun_workers();
+
 
    std::cout << std::boolalpha << "stat_enable: " << stat_enable << std::endl;
 
@@ -184,6 +392,10 @@ int main(int argc, char *argv[])
       int res;
       int timeout = -1;
       struct epoll_event events[nfiles];
+      if (reload_requested) {
+         reload_requested = 0;
+         reload_config();
+      }
       if((res = epoll_wait(epfd, events, nfiles, timeout)) == -1){
          if (errno == EINTR)
             continue;
@@ -194,34 +406,35 @@ int main(int argc, char *argv[])
          int fd = events[i].data.fd;
 
          if(fd == tun_fd){
-            read_len = read(tun_fd, (void *)buf, BUF_LEN);
-            bufp = buf;
-            int d = dispatch(bufp);
-            bufp += sizeof(uint32_t);
-
-            if(stat_enable == true){
-               if(map_stat.update(bufp, read_len, d) < 0){
-                  warnx("failed to update stat");
-               }
+            if (tun_read_packet(tun_workers[0]) > 0) {
+               tun_busy_poll(tun_workers[0]);
             }
-
-            switch (d) {
-               case FOURTOSIX:
-                  send_4to6(bufp, (size_t)read_len);
-                  break;
-               case SIXTOFOUR:
-                  send_6to4(bufp, (size_t)read_len);
-                  break;
-               case SIXTOSIX_GtoI:
-                  send66_GtoI(bufp, (size_t)read_len);
-                  break;
-               case SIXTOSIX_ItoG:
-                  send66_ItoG(bufp, (size_t)read_len);
-                  break;
-               default:
-                  warnx("unsupported mapping");
+         }else if(fd == xsk_fd){
+            struct xsk_frame frames[XSK_BATCH_SIZE];
+            uint8_t *bufps[XSK_BATCH_SIZE];
+            ssize_t lens[XSK_BATCH_SIZE];
+            int ds[XSK_BATCH_SIZE];
+            struct lookup_hint hints[XSK_BATCH_SIZE];
+            int nframes = xsk_recv(frames, XSK_BATCH_SIZE);
+            for(int j = 0; j < nframes; j++){
+               /*
+                * The last 4 bytes of the Ethernet header have the same
+                * layout as struct tun_pi{}, the ether type field at the
+                * end.  Process the frame in place, as if it were read
+                * from the tun interface.
+                */
+               bufps[j] = frames[j].datap + ETHER_HDR_LEN - sizeof(uint32_t);
+               lens[j] = frames[j].len - ETHER_HDR_LEN + sizeof(uint32_t);
+               ds[j] = dispatch(bufps[j], lens[j]);
             }
-
+            lookup_batch(bufps, lens, ds, hints, nframes);
+            for(int j = 0; j < nframes; j++){
+               xsk_rx_framep = &frames[j];
+               translate_packet(bufps[j], lens[j], ds[j], &hints[j]);
+               xsk_rx_framep = NULL;
+               xsk_release(&frames[j]);
+            }
+            xsk_flush();
          }else if(fd == stat_listen_fd){
             if((stat_fd = accept(stat_listen_fd, (sockaddr *)&caddr, &len)) < 0){
                warnx("failed to accept stat client");
@@ -233,21 +446,26 @@ int main(int argc, char *argv[])
             if(epoll_ctl(epfd, EPOLL_CTL_ADD, stat_fd, &epev) == -1)
                warnx("epoll_ctr failed()");
          }else{
-            const int COMMAND_SIZE = 10;
+            const int COMMAND_SIZE = 64;
             char command[COMMAND_SIZE];
-            std::string list("show, info, time, flush, toggle, help, stat");
+            std::string list("show, info, time, flush, toggle, help, stat, xdp, fastpath, queues, pipeline, filter, nat64, dns64, flow, capture [on [proto <n>] [addr <a>] [drop] | off | dump], perf [reset], top [<count>] [bps|pps|bytes|packets]");
             memset(command, 0, COMMAND_SIZE);
             int size;
-            if((size = read(fd, command, COMMAND_SIZE)) < 0){
+            if((size = read(fd, command, COMMAND_SIZE - 1)) < 0){
                warnx("read() faild");
             }else if(size != 0){
                if(strcmp(command, "show") == 0){
-                  map_stat.write_stat(stat_fd);
+                  map646_stat::stat merged(map_stat);
+                  stat_merge_shards(merged);
+                  merged.write_stat(stat_fd);
                }else if(strcmp(command, "info") == 0){
-                  map_stat.write_info(stat_fd);
+                  map646_stat::stat merged(map_stat);
+                  stat_merge_shards(merged);
+                  merged.write_info(stat_fd);
                }else if(strcmp(command, "time") == 0){
                   map_stat.write_last_flush_time(stat_fd);
                }else if(strcmp(command, "flush") == 0){
+                  stat_flush_shards();
                   map_stat.flush();
                   map_stat.safe_write(fd, std::string("flushed"));
                }else if(strcmp(command, "toggle") == 0){
@@ -264,6 +482,183 @@ int main(int argc, char *argv[])
                   }else{
                      map_stat.safe_write(fd, std::string("false"));
                   }
+               }else if(strncmp(command, "top", 3) == 0
+                     && (command[3] == '\0' || command[3] == ' ')){
+                  map646_stat::stat merged(map_stat);
+                  stat_merge_shards(merged);
+                  merged.write_top(fd, command + 3);
+               }else if(strcmp(command, "xdp") == 0){
+                  struct xsk_stats xstats;
+                  char xmsg[256];
+                  xsk_get_stats(&xstats);
+                  snprintf(xmsg, sizeof(xmsg),
+                        "%s rx %llu tx_zerocopy %llu tx_copy %llu tx_fallback %llu",
+                        xsk_fd == -1 ? "inactive"
+                        : (xsk_is_zerocopy() ? "zero-copy" : "copy"),
+                        (unsigned long long)xstats.rx_packets,
+                        (unsigned long long)xstats.tx_zerocopy,
+                        (unsigned long long)xstats.tx_copy,
+                        (unsigned long long)xstats.tx_fallback);
+                  map_stat.safe_write(fd, std::string(xmsg));
+               }else if(strcmp(command, "fastpath") == 0){
+                  struct fastpath_stats fstats;
+                  char fmsg[256];
+                  fastpath_get_stats(&fstats);
+                  snprintf(fmsg, sizeof(fmsg),
+                        "%s 4to6 %llu 6to4 %llu 6to6 %llu",
+                        fastpath_is_active() ? "active" : "inactive",
+                        (unsigned long long)fstats.packets[FASTPATH_STAT_4TO6],
+                        (unsigned long long)fstats.packets[FASTPATH_STAT_6TO4],
+                        (unsigned long long)fstats.packets[FASTPATH_STAT_66]);
+                  map_stat.safe_write(fd, std::string(fmsg));
+               }else if(strcmp(command, "queues") == 0){
+                  std::ostringstream qmsg;
+                  qmsg << (steer_is_active() ? "ebpf" : "kernel");
+                  for(int q = 0; q < tun_worker_count; q++){
+                     struct tun_worker *wp = tun_workers[q];
+                     qmsg << " queue" << q << " "
+                        << __atomic_load_n(&wp->packets, __ATOMIC_RELAXED);
+                     if(tun_busy_poll_usec > 0){
+                        qmsg << " spin "
+                           << __atomic_load_n(&wp->poll_budget_nsec,
+                                 __ATOMIC_RELAXED) / 1000 << "us "
+                           << __atomic_load_n(&wp->poll_nsec,
+                                 __ATOMIC_RELAXED) / 1000000 << "ms "
+                           << __atomic_load_n(&wp->poll_packets,
+                                 __ATOMIC_RELAXED);
+                     }
+                  }
+                  map_stat.safe_write(fd, qmsg.str());
+               }else if(strcmp(command, "pipeline") == 0){
+                  std::ostringstream pmsg;
+                  if(pipeline_is_active()){
+                     struct pipeline_stats pstats;
+                     pipeline_get_stats(&pstats);
+                     pmsg << "workers " << pstats.worker_count
+                        << " ring " << pstats.ring_size
+                        << " batch " << pstats.batch_size
+                        << " reader rx " << pstats.rx_packets
+                        << " drop " << pstats.rx_drops;
+                     for(int w = 0; w < pstats.worker_count; w++){
+                        struct pipeline_worker_stats *wp = &pstats.workers[w];
+                        pmsg << " worker" << w << " " << wp->packets
+                           << " in " << wp->rx_occupancy
+                           << "/" << wp->rx_max_occupancy
+                           << " out " << wp->tx_occupancy
+                           << "/" << wp->tx_max_occupancy
+                           << " drop " << wp->tx_drops;
+                     }
+                     pmsg << " writer tx " << pstats.tx_packets;
+                  }else{
+                     pmsg << "inactive";
+                  }
+                  map_stat.safe_write(fd, pmsg.str());
+               }else if(strcmp(command, "filter") == 0){
+                  struct mapping_filter_stats mstats;
+                  char mmsg[256];
+                  mapping_get_filter_stats(&mstats);
+                  uint64_t misses = mstats.negatives + mstats.false_positives;
+                  snprintf(mmsg, sizeof(mmsg),
+                        "entries %u size %zu queries %llu negatives %llu"
+                        " false_positives %llu fp_rate %.4f",
+                        mstats.entries, mstats.size,
+                        (unsigned long long)mstats.queries,
+                        (unsigned long long)mstats.negatives,
+                        (unsigned long long)mstats.false_positives,
+                        misses == 0 ? 0.0
+                        : (double)mstats.false_positives / misses);
+                  map_stat.safe_write(fd, std::string(mmsg));
+               }else if(strcmp(command, "nat64") == 0){
+                  std::ostringstream nmsg;
+                  if(nat64_is_active()){
+                     struct nat64_stats nstats;
+                     nat64_get_stats(&nstats);
+                     nmsg << "pool " << nstats.pool_size
+                        << " ports " << nstats.ports
+                        << " sessions " << nstats.sessions
+                        << "/" << nstats.max_sessions
+                        << " created " << nstats.created
+                        << " expired " << nstats.expired
+                        << " drop no_session " << nstats.no_session
+                        << " exhausted " << nstats.exhausted
+                        << " unsupported " << nstats.unsupported;
+                  }else{
+                     nmsg << "inactive";
+                  }
+                  map_stat.safe_write(fd, nmsg.str());
+               }else if(strcmp(command, "dns64") == 0){
+                  std::ostringstream dmsg;
+                  if(dns64_is_active()){
+                     struct dns64_stats dstats;
+                     dns64_get_stats(&dstats);
+                     dmsg << "queries " << dstats.queries
+                        << " cache_hits " << dstats.cache_hits
+                        << " forwarded " << dstats.forwarded
+                        << " synthesized " << dstats.synthesized
+                        << " timeouts " << dstats.timeouts
+                        << " errors " << dstats.errors
+                        << " cache " << dstats.cache_entries
+                        << "/" << dstats.cache_size;
+                  }else{
+                     dmsg << "inactive";
+                  }
+                  map_stat.safe_write(fd, dmsg.str());
+               }else if(strcmp(command, "flow") == 0){
+                  std::ostringstream fmsg;
+                  if(flowexp_is_active()){
+                     struct flowexp_stats fstats;
+                     flowexp_get_stats(&fstats);
+                     fmsg << "flows " << fstats.flows
+                        << "/" << fstats.table_size
+                        << " created " << fstats.created
+                        << " expired " << fstats.expired
+                        << " evicted " << fstats.evicted
+                        << " lost " << fstats.lost
+                        << " exported " << fstats.exported
+                        << " messages " << fstats.messages
+                        << " send_errors " << fstats.send_errors;
+                  }else{
+                     fmsg << "inactive";
+                  }
+                  map_stat.safe_write(fd, fmsg.str());
+               }else if(strncmp(command, "capture", 7) == 0
+                     && (command[7] == '\0' || command[7] == ' ')){
+                  const char *argp = command + 7;
+                  while(*argp == ' ')
+                     argp++;
+                  if(strcmp(argp, "dump") == 0){
+                     size_t dump_len = 0;
+                     uint8_t *dumpp = capture_dump(&dump_len);
+                     std::string dump;
+                     if(dumpp != NULL){
+                        dump.assign((const char *)dumpp, dump_len);
+                        free(dumpp);
+                     }
+                     map_stat.safe_write(fd, dump);
+                  }else{
+                     char cmsg[256];
+                     int result = 0;
+                     if(strncmp(argp, "on", 2) == 0
+                           && (argp[2] == '\0' || argp[2] == ' ')){
+                        result = capture_arm(argp + 2);
+                     }else if(strcmp(argp, "off") == 0){
+                        capture_disarm();
+                     }else if(*argp != '\0'){
+                        result = -1;
+                     }
+                     capture_describe(cmsg, sizeof(cmsg));
+                     std::string cstr(result == -1
+                           ? "invalid capture command: " : "");
+                     map_stat.safe_write(fd, cstr + cmsg);
+                  }
+               }else if(strcmp(command, "perf") == 0
+                     || strcmp(command, "perf reset") == 0){
+                  std::ostringstream pmsg;
+                  if(strcmp(command, "perf reset") == 0){
+                     perfctr_reset();
+                  }
+                  write_perf_stats(pmsg);
+                  map_stat.safe_write(fd, pmsg.str());
                }else if(strcmp(command, "help") == 0){
                   map_stat.safe_write(fd, list);
                }else{
@@ -321,6 +716,9 @@ cleanup(void)
    if (tun_fd != -1) {
       close(tun_fd);
    }
+   xsk_dealloc();
+   fastpath_dealloc();
+   steer_dealloc();
    if (stat_listen_fd != -1){
       close(stat_listen_fd);
    }
@@ -336,14 +734,27 @@ cleanup(void)
 }
 
 /*
- * The reload function deletes all the route information installed by
- * this program, reload the configuration file, and re-install the new
- * route information given by the configuration file.
+ * The SIGHUP handler only requests the reload, since the reload takes
+ * the locks and allocates memory, which a signal handler must not do.
+ * The epoll_wait() of the main loop is interrupted by the signal.
  */
    void
 reload_sighup(int dummy)
+{
+   reload_requested = 1;
+}
+
+/*
+ * The reload function deletes all the route information installed by
+ * this program, reload the configuration file, and re-install the new
+ * route information given by the configuration file.  It runs in the
+ * main thread between packets.
+ */
+   static void
+reload_config(void)
 {
    std::cout << "reload_sighup" << std::endl;
+   mapping_write_lock();
    /* 
     * Uninstall all the route installed when the configuration file was
     * read last time.
@@ -367,6 +778,896 @@ reload_sighup(int dummy)
    if (mapping_install_route() == -1) {
       errx(EXIT_FAILURE, "failed to install mapped route information.");
    }
+   mapping_write_unlock();
+}
+
+/*
+ * Returns the statistics shard of the current thread, which is
+ * created at the first packet.
+ */
+   static struct stat_shard *
+stat_get_shard(void)
+{
+   if (stat_shardp == NULL) {
+      struct stat_shard *shardp = new stat_shard;
+      pthread_mutex_init(&shardp->lock, NULL);
+      pthread_mutex_lock(&stat_shards_lock);
+      shardp->nextp = stat_shards;
+      stat_shards = shardp;
+      pthread_mutex_unlock(&stat_shards_lock);
+      stat_shardp = shardp;
+   }
+   return (stat_shardp);
+}
+
+/* Add the statistics of all the threads to the merged parameter. */
+   static void
+stat_merge_shards(map646_stat::stat &merged)
+{
+   pthread_mutex_lock(&stat_shards_lock);
+   for (struct stat_shard *shardp = stat_shards; shardp != NULL;
+         shardp = shardp->nextp) {
+      pthread_mutex_lock(&shardp->lock);
+      merged.merge(shardp->stat);
+      pthread_mutex_unlock(&shardp->lock);
+   }
+   pthread_mutex_unlock(&stat_shards_lock);
+}
+
+   static void
+stat_flush_shards(void)
+{
+   pthread_mutex_lock(&stat_shards_lock);
+   for (struct stat_shard *shardp = stat_shards; shardp != NULL;
+         shardp = shardp->nextp) {
+      pthread_mutex_lock(&shardp->lock);
+      shardp->stat.flush();
+      pthread_mutex_unlock(&shardp->lock);
+   }
+   pthread_mutex_unlock(&stat_shards_lock);
+}
+
+/*
+ * Start the worker threads serving the tun queues other than the
+ * queue 0, the pipeline threads serving the queue 0, and the DNS64
+ * and the flow export threads if configured.  SIGINT and SIGHUP are
+ * blocked in the workers so that the handlers always run in the main
+ * thread.
+ */
+   static void
+start_tun_workers(void)
+{
+   sigset_t set, oset;
+   sigemptyset(&set);
+   sigaddset(&set, SIGINT);
+   sigaddset(&set, SIGHUP);
+   pthread_sigmask(SIG_BLOCK, &set, &oset);
+   affinity_log("main");
+   perfctr_thread_start("main");
+   for (int q = 1; q < tun_worker_count; q++) {
+      char name[AFFINITY_NAME_LEN];
+      pthread_attr_t attr;
+      tun_worker_name(q, name, sizeof(name));
+      affinity_init_attr(name, &attr);
+      int error = pthread_create(&tun_workers[q]->thread, &attr,
+            tun_worker_main, tun_workers[q]);
+      pthread_attr_destroy(&attr);
+      if (error != 0) {
+         errno = error;
+         err(EXIT_FAILURE, "cannot start the worker of the tun queue %d.", q);
+      }
+      affinity_log(name);
+   }
+   if (pipeline_start(tun_fd, translate_batch) == -1) {
+      errx(EXIT_FAILURE, "cannot start the pipeline.");
+   }
+   if (dns64_start() == -1) {
+      errx(EXIT_FAILURE, "cannot start the DNS64.");
+   }
+   if (flowexp_start() == -1) {
+      errx(EXIT_FAILURE, "cannot start the flow export.");
+   }
+   pthread_sigmask(SIG_SETMASK, &oset, NULL);
+}
+
+/*
+ * The thread name of the tun queue used by the cpu-affinity
+ * directive.  The queue 0 is served by the main thread.
+ */
+   static void
+tun_worker_name(int q, char *name, size_t name_len)
+{
+   if (q == 0) {
+      snprintf(name, name_len, "main");
+   } else {
+      snprintf(name, name_len, "queue%d", q);
+   }
+}
+
+/*
+ * The main routine of the worker threads.  Each worker reads the
+ * packets from its own tun queue, and writes the translated packets
+ * to the same queue.
+ */
+   static void *
+tun_worker_main(void *argp)
+{
+   assert(argp != NULL);
+
+   struct tun_worker *workerp = (struct tun_worker *)argp;
+   char name[AFFINITY_NAME_LEN];
+
+   tun_worker_name(workerp->index, name, sizeof(name));
+   perfctr_thread_start(name);
+   tun_out_fd = workerp->fd;
+   while (1) {
+      if (tun_read_packet(workerp) == -1) {
+         if (errno == EAGAIN) {
+            /* Non-blocking in the busy poll mode. */
+            struct pollfd pfd;
+            pfd.fd = workerp->fd;
+            pfd.events = POLLIN;
+            (void)poll(&pfd, 1, -1);
+            continue;
+         }
+         if (errno == EINTR)
+            continue;
+         err(EXIT_FAILURE, "read from the tun queue %d failed.",
+               workerp->index);
+      }
+      tun_busy_poll(workerp);
+   }
+
+   return (NULL);
+}
+
+/*
+ * Read a packet from the tun queue into the buffer of the queue and
+ * translate it.  The worker threads other than the main thread hold
+ * the read lock of the mapping table during the translation.  Returns
+ * the result of read(2).
+ */
+   static ssize_t
+tun_read_packet(struct tun_worker *workerp)
+{
+   assert(workerp != NULL);
+
+   uint8_t *buf = workerp->buf;
+   ssize_t read_len = read(workerp->fd, (void *)buf, tun_get_buffer_size());
+   if (read_len <= 0)
+      return (read_len);
+   if (tun_is_truncated(buf)) {
+      warnx("a packet larger than the buffer size %zu is dropped.",
+            tun_get_buffer_size());
+      return (read_len);
+   }
+
+   if (workerp->index != 0)
+      mapping_read_lock();
+   process_packet(buf, read_len);
+   if (workerp->index != 0)
+      mapping_read_unlock();
+   __atomic_store_n(&workerp->packets, workerp->packets + 1,
+         __ATOMIC_RELAXED);
+
+   return (read_len);
+}
+
+/*
+ * Busy poll mode.  After a packet is processed, keep reading the tun
+ * queue without sleeping for the spin budget, which is extended each
+ * time a packet arrives.  The budget is doubled when the spin found
+ * packets, and halved when it didn't, so that an idle queue costs
+ * little CPU time while a busy queue avoids the wakeup latency of
+ * epoll_wait() and poll().
+ */
+   static void
+tun_busy_poll(struct tun_worker *workerp)
+{
+   assert(workerp != NULL);
+
+   if (tun_busy_poll_usec == 0)
+      return;
+
+   uint64_t max_budget = (uint64_t)tun_busy_poll_usec * 1000;
+   uint64_t min_budget = max_budget / BUSY_POLL_MIN_RATIO;
+   uint64_t budget = workerp->poll_budget_nsec;
+   if (budget == 0 || budget > max_budget)
+      budget = max_budget;
+
+   uint64_t start = monotonic_nsec();
+   uint64_t now = start;
+   uint64_t deadline = start + budget;
+   int found = 0;
+   while (now < deadline && found < BUSY_POLL_MAX_PACKETS) {
+      ssize_t read_len = tun_read_packet(workerp);
+      now = monotonic_nsec();
+      if (read_len > 0) {
+         found++;
+         deadline = now + budget;
+         continue;
+      }
+      if (read_len == -1 && errno != EAGAIN && errno != EINTR)
+         break;
+      cpu_relax();
+   }
+
+   if (found > 0) {
+      budget = budget * 2 > max_budget ? max_budget : budget * 2;
+   } else {
+      budget = budget / 2 < min_budget ? min_budget : budget / 2;
+   }
+   __atomic_store_n(&workerp->poll_budget_nsec, budget, __ATOMIC_RELAXED);
+   __atomic_store_n(&workerp->poll_nsec, workerp->poll_nsec + (now - start),
+         __ATOMIC_RELAXED);
+   __atomic_store_n(&workerp->poll_packets, workerp->poll_packets + found,
+         __ATOMIC_RELAXED);
+}
+
+   static uint64_t
+monotonic_nsec(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Format the performance counters of the forwarding threads, divided
+ * by the packets each thread translated, and their total divided by
+ * all the packets.  The pipeline reader and writer translate no
+ * packet, and are counted only in the total.
+ */
+   static void
+write_perf_stats(std::ostringstream &msg)
+{
+   if (!perfctr_enabled) {
+      msg << "inactive";
+      return;
+   }
+
+   struct perfctr_stats stats;
+   perfctr_get_stats(&stats);
+   if (stats.threads == 0) {
+      msg << "unavailable: "
+         << (stats.error != 0 ? strerror(stats.error)
+               : "no thread has the counters open");
+      return;
+   }
+
+   struct perfctr_thread_stats total;
+   memset(&total, 0, sizeof(total));
+   snprintf(total.name, sizeof(total.name), "total");
+   total.events = ~0U;
+   msg << (stats.user_only ? "user" : "user+kernel");
+   for (int t = 0; t < stats.threads; t++) {
+      const struct perfctr_thread_stats *threadp = &stats.thread[t];
+      write_perf_thread(msg, threadp);
+      total.packets += threadp->packets;
+      total.events &= threadp->events;
+      for (int e = 0; e < PERFCTR_EVENTS; e++) {
+         total.values[e] += threadp->values[e];
+      }
+   }
+   write_perf_thread(msg, &total);
+}
+
+   static void
+write_perf_thread(std::ostringstream &msg,
+      const struct perfctr_thread_stats *threadp)
+{
+   assert(threadp != NULL);
+
+   static const char *const names[PERFCTR_EVENTS] = {
+      "cycles", "instructions", "llc_misses", "branch_misses", "task_ns"
+   };
+   char value[32];
+
+   msg << " " << threadp->name << " packets " << threadp->packets;
+   for (int e = 0; e < PERFCTR_EVENTS; e++) {
+      if ((threadp->events & (1U << e)) == 0)
+         continue;
+      if (threadp->packets == 0) {
+         snprintf(value, sizeof(value), "-");
+      } else {
+         snprintf(value, sizeof(value), "%.1f",
+               (double)threadp->values[e] / threadp->packets);
+      }
+      msg << " " << names[e] << " " << value;
+   }
+   unsigned int ipc_events
+      = (1U << PERFCTR_CYCLES) | (1U << PERFCTR_INSTRUCTIONS);
+   if ((threadp->events & ipc_events) == ipc_events
+         && threadp->values[PERFCTR_CYCLES] != 0) {
+      snprintf(value, sizeof(value), "%.2f",
+            (double)threadp->values[PERFCTR_INSTRUCTIONS]
+            / threadp->values[PERFCTR_CYCLES]);
+      msg << " ipc " << value;
+   }
+}
+
+/*
+ * Translate a packet read from the tun interface or the AF_XDP
+ * socket.  The bufp parameter points the address family information
+ * (see tun_get_af()) followed by the IP packet.
+ */
+   static void
+process_packet(uint8_t *bufp, ssize_t read_len)
+{
+   assert(bufp != NULL);
+
+   translate_packet(bufp, read_len, dispatch(bufp, read_len), NULL);
+}
+
+/*
+ * Translate a batch of packets.  This is called by the pipeline
+ * workers, which get the directions from the pipeline reader.
+ */
+   static void
+translate_batch(uint8_t *const *bufps, const ssize_t *lens, const int *ds,
+      unsigned int count)
+{
+   assert(bufps != NULL);
+   assert(lens != NULL);
+   assert(ds != NULL);
+
+   struct lookup_hint hints[LOOKUP_MAX_BATCH_SIZE];
+   assert(count <= LOOKUP_MAX_BATCH_SIZE);
+
+   lookup_batch(bufps, lens, ds, hints, count);
+   for (unsigned int i = 0; i < count; i++) {
+      translate_packet(bufps[i], lens[i], ds[i], &hints[i]);
+   }
+}
+
+/*
+ * Do the mapping and the path MTU lookups of the 4-to-6 and 6-to-4
+ * packets of a batch together (see mapping_convert_addrs_4to6_batch()
+ * and pmtudisc_get_path_mtu_size_batch()), so that the cache misses
+ * of the packets overlap.  The results are stored in the hints array
+ * and used by translate_packet().  The 6-to-6 packets are looked up
+ * one by one in the translation.  A path MTU learned from an ICMP
+ * error in a batch takes effect from the next batch.
+ */
+   static void
+lookup_batch(uint8_t *const *bufps, const ssize_t *lens, const int *ds,
+      struct lookup_hint *hints, unsigned int count)
+{
+   assert(bufps != NULL);
+   assert(lens != NULL);
+   assert(ds != NULL);
+   assert(hints != NULL);
+   assert(count <= LOOKUP_MAX_BATCH_SIZE);
+
+   struct in_addr ip4_srcs[LOOKUP_MAX_BATCH_SIZE];
+   struct in_addr ip4_dsts[LOOKUP_MAX_BATCH_SIZE];
+   struct in6_addr ip6_srcs[LOOKUP_MAX_BATCH_SIZE];
+   struct in6_addr ip6_dsts[LOOKUP_MAX_BATCH_SIZE];
+   int results[LOOKUP_MAX_BATCH_SIZE];
+   int mtus[LOOKUP_MAX_BATCH_SIZE];
+   unsigned int indexes[LOOKUP_MAX_BATCH_SIZE];
+   unsigned int i, n;
+
+   for (i = 0; i < count; i++) {
+      hints[i].valid = 0;
+   }
+
+   /* 4-to-6: the destination is looked up in the 4to6 table. */
+   for (i = 0, n = 0; i < count; i++) {
+      if (ds[i] != FOURTOSIX
+            || lens[i] < (ssize_t)(sizeof(uint32_t) + sizeof(struct ip)))
+         continue;
+      const struct ip *ip4_hdrp
+         = (const struct ip *)(bufps[i] + sizeof(uint32_t));
+      memcpy(&ip4_srcs[n], &ip4_hdrp->ip_src, sizeof(struct in_addr));
+      memcpy(&ip4_dsts[n], &ip4_hdrp->ip_dst, sizeof(struct in_addr));
+      indexes[n++] = i;
+   }
+   if (n > 0) {
+      mapping_convert_addrs_4to6_batch(ip4_srcs, ip4_dsts, ip6_srcs,
+            ip6_dsts, results, n);
+      pmtudisc_get_path_mtu_size_batch(AF_INET6, ip6_dsts, mtus, n);
+      for (unsigned int j = 0; j < n; j++) {
+         struct lookup_hint *hintp = &hints[indexes[j]];
+         hintp->valid = 1;
+         hintp->result = results[j];
+         hintp->ip6_src = ip6_srcs[j];
+         hintp->ip6_dst = ip6_dsts[j];
+         hintp->mtu = mtus[j];
+      }
+   }
+
+   /* 6-to-4: the source is looked up in the 6to4 table. */
+   for (i = 0, n = 0; i < count; i++) {
+      if (ds[i] != SIXTOFOUR
+            || lens[i] < (ssize_t)(sizeof(uint32_t) + sizeof(struct ip6_hdr)))
+         continue;
+      const struct ip6_hdr *ip6_hdrp
+         = (const struct ip6_hdr *)(bufps[i] + sizeof(uint32_t));
+      memcpy(&ip6_srcs[n], &ip6_hdrp->ip6_src, sizeof(struct in6_addr));
+      memcpy(&ip6_dsts[n], &ip6_hdrp->ip6_dst, sizeof(struct in6_addr));
+      indexes[n++] = i;
+   }
+   if (n > 0) {
+      mapping_convert_addrs_6to4_batch(ip6_srcs, ip6_dsts, ip4_srcs,
+            ip4_dsts, results, n);
+      pmtudisc_get_path_mtu_size_batch(AF_INET, ip4_dsts, mtus, n);
+      for (unsigned int j = 0; j < n; j++) {
+         struct lookup_hint *hintp = &hints[indexes[j]];
+         hintp->valid = 1;
+         hintp->result = results[j];
+         hintp->ip4_src = ip4_srcs[j];
+         hintp->ip4_dst = ip4_dsts[j];
+         hintp->mtu = mtus[j];
+      }
+   }
+}
+
+/*
+ * Translate a packet in the direction d returned by the dispatch()
+ * function.  The hintp parameter is the result of lookup_batch(), or
+ * NULL.
+ */
+   static void
+translate_packet(uint8_t *bufp, ssize_t read_len, int d,
+      const struct lookup_hint *hintp)
+{
+   assert(bufp != NULL);
+
+   bufp += sizeof(uint32_t);
+   PROBE3(dispatch, d, bufp, read_len - sizeof(uint32_t));
+   perfctr_count();
+
+   if(stat_enable == true){
+      struct stat_shard *shardp = stat_get_shard();
+      pthread_mutex_lock(&shardp->lock);
+      if(shardp->stat.update(bufp, read_len, d) < 0){
+         warnx("failed to update stat");
+      }
+      pthread_mutex_unlock(&shardp->lock);
+   }
+   if (flowexp_is_active()) {
+      flowexp_record(bufp, read_len - sizeof(uint32_t));
+   }
+   int captured = capture_is_armed();
+   if (captured) {
+      capture_pre(bufp, read_len - sizeof(uint32_t));
+   }
+
+   switch (d) {
+      case FOURTOSIX:
+         if (translate_fast(d, bufp, read_len - sizeof(uint32_t), hintp) == 0)
+            break;
+         send_4to6(bufp, (size_t)read_len, hintp);
+         break;
+      case SIXTOFOUR:
+         if (translate_fast(d, bufp, read_len - sizeof(uint32_t), hintp) == 0)
+            break;
+         send_6to4(bufp, (size_t)read_len, hintp);
+         break;
+      case FOURTOSIX_NAT:
+      case SIXTOFOUR_NAT:
+      case FOURTOSIX_MAP:
+      case SIXTOFOUR_MAP:
+      case FOURTOSIX_PORT:
+      case SIXTOFOUR_PORT:
+      case FOURTOSIX_POOL:
+         translate_shared(d, bufp, read_len);
+         break;
+      case SIXTOSIX_GtoI:
+         send66_GtoI(bufp, (size_t)read_len);
+         break;
+      case SIXTOSIX_ItoG:
+         send66_ItoG(bufp, (size_t)read_len);
+         break;
+      case SIXTOSIX_HAIRPIN:
+         send66_hairpin(bufp, (size_t)read_len);
+         break;
+      default:
+         warnx("unsupported mapping");
+         PROBE3(drop, PROBE_DROP_UNSUPPORTED, bufp,
+               read_len - sizeof(uint32_t));
+   }
+   if (captured) {
+      capture_end();
+   }
+}
+
+/*
+ * Translate a packet whose IPv4 address is shared by the ports: a
+ * packet of the stateful NAT64, of a MAP-T mapping rule, of a port
+ * mapping or to a backend pool.  The NAT64 translates the ports with
+ * its session, and the others derive the addresses from the ports.
+ * The addresses are given to the same translators as the statically
+ * mapped packets as a lookup hint.  The bufp parameter points the IP
+ * header.
+ */
+   static void
+translate_shared(int d, uint8_t *bufp, ssize_t read_len)
+{
+   assert(bufp != NULL);
+
+   size_t data_len = read_len - sizeof(uint32_t);
+   struct lookup_hint hint;
+   hint.valid = 1;
+   hint.result = 0;
+   if (d == FOURTOSIX_NAT || d == FOURTOSIX_MAP || d == FOURTOSIX_PORT
+         || d == FOURTOSIX_POOL) {
+      int result;
+      if (d == FOURTOSIX_NAT)
+         result = nat64_translate_4to6(bufp, data_len, &hint.ip6_src,
+               &hint.ip6_dst);
+      else if (d == FOURTOSIX_PORT)
+         result = mapping_port_convert_4to6(bufp, data_len, &hint.ip6_src,
+               &hint.ip6_dst);
+      else if (d == FOURTOSIX_POOL)
+         result = mapping_pool_convert_4to6(bufp, data_len, &hint.ip6_src,
+               &hint.ip6_dst);
+      else
+         result = mapping_rule_convert_4to6(bufp, data_len, &hint.ip6_src,
+               &hint.ip6_dst);
+      if (result == -1) {
+         PROBE3(drop, PROBE_DROP_NO_MAPPING, bufp, data_len);
+         return;
+      }
+      hint.mtu = pmtudisc_get_path_mtu_size(AF_INET6, &hint.ip6_dst);
+      if (translate_fast(FOURTOSIX, bufp, data_len, &hint) == 0)
+         return;
+      send_4to6(bufp, (size_t)read_len, &hint);
+   } else {
+      int result;
+      if (d == SIXTOFOUR_NAT)
+         result = nat64_translate_6to4(bufp, data_len, &hint.ip4_src,
+               &hint.ip4_dst);
+      else if (d == SIXTOFOUR_PORT)
+         result = mapping_port_convert_6to4(bufp, data_len, &hint.ip4_src,
+               &hint.ip4_dst);
+      else
+         result = mapping_rule_convert_6to4(bufp, data_len, &hint.ip4_src,
+               &hint.ip4_dst);
+      if (result == -1) {
+         PROBE3(drop, PROBE_DROP_NO_MAPPING, bufp, data_len);
+         return;
+      }
+      hint.mtu = pmtudisc_get_path_mtu_size(AF_INET, &hint.ip4_dst);
+      if (translate_fast(SIXTOFOUR, bufp, data_len, &hint) == 0)
+         return;
+      send_6to4(bufp, (size_t)read_len, &hint);
+   }
+}
+
+/*
+ * Send a translated packet.  The packet is sent back through the
+ * AF_XDP socket if it was received from there, passed to the writer
+ * if translated by a pipeline worker, otherwise (or if the socket has
+ * no room) it is written to the tun interface.
+ */
+   static ssize_t
+output_packet(const struct iovec *iov, int iovcnt)
+{
+   assert(iov != NULL);
+
+   /* The first vector is the address family header. */
+   size_t ip_len = 0;
+   for (int i = 1; i < iovcnt; i++) {
+      ip_len += iov[i].iov_len;
+   }
+   PROBE2(send, iov[1].iov_base, ip_len);
+   if (capture_is_armed()) {
+      capture_post(iov + 1, iovcnt - 1);
+   }
+
+   if (xsk_rx_framep != NULL) {
+      ssize_t write_len = xsk_writev(xsk_rx_framep, iov, iovcnt);
+      if (write_len != -1) {
+         return (write_len);
+      }
+   }
+
+   if (pipeline_in_worker()) {
+      return (pipeline_output(iov, iovcnt));
+   }
+
+   return (writev(tun_out_fd, iov, iovcnt));
+}
+
+/*
+ * The first word of the IPv6 header translated from the IPv4 packet:
+ * the version and the flow label (RFC 6437).  The label is a keyed
+ * hash of the addresses, the protocol and, for a TCP or UDP packet
+ * which is not a fragment, the ports.  The fragments are hashed
+ * without the ports, so that all of them get the same label.  The
+ * words are hashed as they are in the packet, the same way as the
+ * fast path program does.  The label is 0 if the flow label is off.
+ */
+   static inline uint32_t
+flow_label_4to6(const struct ip *ip4_hdrp, const uint8_t *l4p,
+      size_t l4_len)
+{
+   uint32_t key = mapping_flow_key;
+   if (key == 0)
+      return (htonl(IPV6_VERSION << 24));
+
+   uint32_t ports = 0;
+   if ((ip4_hdrp->ip_p == IPPROTO_TCP || ip4_hdrp->ip_p == IPPROTO_UDP)
+         && (ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) == 0
+         && l4_len >= sizeof(uint32_t))
+      memcpy(&ports, l4p, sizeof(uint32_t));
+
+   uint32_t hash = (key ^ ip4_hdrp->ip_src.s_addr) * MAPPING_FLOW_MUL1;
+   hash = (hash ^ ip4_hdrp->ip_dst.s_addr ^ ip4_hdrp->ip_p)
+      * MAPPING_FLOW_MUL2;
+   hash = (hash ^ ports) * MAPPING_FLOW_MUL3;
+   hash = (hash ^ (hash >> 12)) & MAPPING_FLOW_LABEL_MASK;
+
+   return (htonl((IPV6_VERSION << 24) | hash));
+}
+
+/*
+ * The translators specialized for the common case: a TCP or UDP
+ * packet which has no IPv4 options, IPv6 extension headers or
+ * fragment information, and which fits in the path MTU.  The direction
+ * and the transport protocol are template parameters, so the header
+ * lengths, the checksum offset and the address sizes are constants,
+ * and the branches of the generic send_4to6() and send_6to4() for
+ * ICMP, fragments and debugging are not compiled in.
+ *
+ * translate<Dir, Proto>() returns 0 if the packet is translated, or 1
+ * if the packet is not in the common case (or has no mapping entry),
+ * in which case the caller falls back to the generic function.  The
+ * output is the same as that of the generic function.
+ */
+struct Tcp {
+   static const uint8_t proto = IPPROTO_TCP;
+   static const size_t hdr_len = sizeof(struct tcphdr);
+   static const size_t cksum_off = 16;
+};
+
+struct Udp {
+   static const uint8_t proto = IPPROTO_UDP;
+   static const size_t hdr_len = sizeof(struct udphdr);
+   static const size_t cksum_off = 6;
+};
+
+/* Sum the 16-bit words of the source and destination addresses. */
+template <size_t AddrLen>
+   static inline int32_t
+sum_addrs(const void *srcp, const void *dstp)
+{
+   const uint16_t *src_words = (const uint16_t *)srcp;
+   const uint16_t *dst_words = (const uint16_t *)dstp;
+   int32_t sum = 0;
+   for (size_t i = 0; i < AddrLen / 2; i++) {
+      sum += src_words[i];
+      sum += dst_words[i];
+   }
+
+   return (sum);
+}
+
+/*
+ * Update the transport checksum for the change of the addresses in
+ * the pseudo header, the same way as cksum_update_ulp() does.
+ */
+template <class Proto>
+   static inline void
+update_l4_cksum(uint8_t *l4p, int32_t old_sum, int32_t new_sum)
+{
+   uint16_t *cksump = (uint16_t *)(l4p + Proto::cksum_off);
+   int32_t sum = ~*cksump & 0xffff;
+   sum -= old_sum + htons(Proto::proto);
+   sum += new_sum + htons(Proto::proto);
+   while (sum >> 16) {
+      sum = (sum >> 16) + (sum & 0xffff);
+   }
+   *cksump = ~sum & 0xffff;
+}
+
+struct FourToSix {
+   static uint8_t
+   l4_proto(const uint8_t *packetp)
+   {
+      return (((const struct ip *)packetp)->ip_p);
+   }
+
+   template <class Proto>
+   static int
+   translate(uint8_t *packetp, size_t data_len,
+         const struct lookup_hint *hintp)
+   {
+      const struct ip *ip4_hdrp = (const struct ip *)packetp;
+      if (data_len < sizeof(struct ip) + Proto::hdr_len
+            || ip4_hdrp->ip_hl << 2 != sizeof(struct ip)
+            || (ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+         return (1);
+      size_t tlen = ntohs(ip4_hdrp->ip_len);
+      if (tlen > data_len || tlen < sizeof(struct ip) + Proto::hdr_len)
+         return (1);
+      size_t plen = tlen - sizeof(struct ip);
+
+      struct ip6_hdr ip6_hdr;
+      memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
+      int mtu;
+      if (hintp != NULL && hintp->valid) {
+         if (hintp->result == -1)
+            return (1);
+         ip6_hdr.ip6_src = hintp->ip6_src;
+         ip6_hdr.ip6_dst = hintp->ip6_dst;
+         mtu = hintp->mtu;
+      } else {
+         if (mapping_convert_addrs_4to6(&ip4_hdrp->ip_src, &ip4_hdrp->ip_dst,
+                  &ip6_hdr.ip6_src, &ip6_hdr.ip6_dst) == -1)
+            return (1);
+         mtu = pmtudisc_get_path_mtu_size(AF_INET6, &ip6_hdr.ip6_dst);
+      }
+      /* The same threshold as send_4to6(). */
+      if (plen > mtu - (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag)))
+         return (1);
+
+      uint8_t *l4p = packetp + sizeof(struct ip);
+      ip6_hdr.ip6_flow = flow_label_4to6(ip4_hdrp, l4p, plen);
+      ip6_hdr.ip6_plen = htons(plen);
+      ip6_hdr.ip6_nxt = Proto::proto;
+      ip6_hdr.ip6_hlim = ip4_hdrp->ip_ttl;
+
+      update_l4_cksum<Proto>(l4p,
+            sum_addrs<sizeof(struct in_addr)>(&ip4_hdrp->ip_src,
+               &ip4_hdrp->ip_dst),
+            sum_addrs<sizeof(struct in6_addr)>(&ip6_hdr.ip6_src,
+               &ip6_hdr.ip6_dst));
+
+      struct iovec iov[4];
+      uint32_t af;
+      tun_set_af(&af, AF_INET6);
+      iov[0].iov_base = &af;
+      iov[0].iov_len = sizeof(uint32_t);
+      iov[1].iov_base = &ip6_hdr;
+      iov[1].iov_len = sizeof(struct ip6_hdr);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = l4p;
+      iov[3].iov_len = plen;
+      if (output_packet(iov, 4) == -1) {
+         warn("sending an IPv6 packet failed.");
+      }
+
+      return (0);
+   }
+};
+
+struct SixToFour {
+   static uint8_t
+   l4_proto(const uint8_t *packetp)
+   {
+      return (((const struct ip6_hdr *)packetp)->ip6_nxt);
+   }
+
+   template <class Proto>
+   static int
+   translate(uint8_t *packetp, size_t data_len,
+         const struct lookup_hint *hintp)
+   {
+      const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+      if (data_len < sizeof(struct ip6_hdr) + Proto::hdr_len)
+         return (1);
+      size_t plen = ntohs(ip6_hdrp->ip6_plen);
+      if (plen + sizeof(struct ip6_hdr) > data_len || plen < Proto::hdr_len)
+         return (1);
+
+      struct ip ip4_hdr;
+      memset(&ip4_hdr, 0, sizeof(struct ip));
+      int mtu;
+      if (hintp != NULL && hintp->valid) {
+         if (hintp->result == -1)
+            return (1);
+         ip4_hdr.ip_src = hintp->ip4_src;
+         ip4_hdr.ip_dst = hintp->ip4_dst;
+         mtu = hintp->mtu;
+      } else {
+         if (mapping_convert_addrs_6to4(&ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst,
+                  &ip4_hdr.ip_src, &ip4_hdr.ip_dst) == -1)
+            return (1);
+         mtu = pmtudisc_get_path_mtu_size(AF_INET, &ip4_hdr.ip_dst);
+      }
+      /* The same threshold as send_6to4(). */
+      if (plen > mtu - sizeof(struct ip))
+         return (1);
+
+      ip4_hdr.ip_v = IPVERSION;
+      ip4_hdr.ip_hl = sizeof(struct ip) >> 2;
+      ip4_hdr.ip_len = htons(sizeof(struct ip) + plen);
+      ip4_hdr.ip_off = htons(IP_DF);
+      ip4_hdr.ip_ttl = ip6_hdrp->ip6_hlim;
+      ip4_hdr.ip_p = Proto::proto;
+      ip4_hdr.ip_sum = cksum_calc_ip4_header(&ip4_hdr);
+
+      uint8_t *l4p = packetp + sizeof(struct ip6_hdr);
+      update_l4_cksum<Proto>(l4p,
+            sum_addrs<sizeof(struct in6_addr)>(&ip6_hdrp->ip6_src,
+               &ip6_hdrp->ip6_dst),
+            sum_addrs<sizeof(struct in_addr)>(&ip4_hdr.ip_src,
+               &ip4_hdr.ip_dst));
+
+      struct iovec iov[4];
+      uint32_t af = 0;
+      tun_set_af(&af, AF_INET);
+      iov[0].iov_base = &af;
+      iov[0].iov_len = sizeof(uint32_t);
+      iov[1].iov_base = &ip4_hdr;
+      iov[1].iov_len = sizeof(struct ip);
+      iov[2].iov_base = NULL;
+      iov[2].iov_len = 0;
+      iov[3].iov_base = l4p;
+      iov[3].iov_len = plen;
+      if (output_packet(iov, 4) == -1) {
+         warn("sending an IPv4 packet failed.");
+      }
+
+      return (0);
+   }
+};
+
+template <class Dir, class Proto>
+   static int
+translate(uint8_t *packetp, size_t data_len, const struct lookup_hint *hintp)
+{
+   return (Dir::template translate<Proto>(packetp, data_len, hintp));
+}
+
+typedef int (*translator_t)(uint8_t *, size_t, const struct lookup_hint *);
+
+/* The specialized translators indexed by the direction and protocol. */
+enum { FAST_4TO6, FAST_6TO4, FAST_DIRS };
+enum { FAST_TCP, FAST_UDP, FAST_PROTOS };
+static const translator_t fast_translators[FAST_DIRS][FAST_PROTOS] = {
+   { translate<FourToSix, Tcp>, translate<FourToSix, Udp> },
+   { translate<SixToFour, Tcp>, translate<SixToFour, Udp> },
+};
+
+/*
+ * Translate the packet with the specialized translator for the
+ * direction d and the transport protocol of the packet.  The packetp
+ * parameter points the IP header.  Returns 1 if the packet must be
+ * translated by the generic functions.
+ */
+   static int
+translate_fast(int d, uint8_t *packetp, size_t data_len,
+      const struct lookup_hint *hintp)
+{
+   assert(packetp != NULL);
+
+#ifdef DEBUG
+   /* Use the generic functions, which print the packet contents. */
+   return (1);
+#endif
+
+   int dir;
+   uint8_t proto;
+   switch (d) {
+      case FOURTOSIX:
+         if (data_len < sizeof(struct ip))
+            return (1);
+         dir = FAST_4TO6;
+         proto = FourToSix::l4_proto(packetp);
+         break;
+      case SIXTOFOUR:
+         if (data_len < sizeof(struct ip6_hdr))
+            return (1);
+         dir = FAST_6TO4;
+         proto = SixToFour::l4_proto(packetp);
+         break;
+      default:
+         return (1);
+   }
+
+   switch (proto) {
+      case IPPROTO_TCP:
+         return (fast_translators[dir][FAST_TCP](packetp, data_len, hintp));
+      case IPPROTO_UDP:
+         return (fast_translators[dir][FAST_UDP](packetp, data_len, hintp));
+      default:
+         return (1);
+   }
 }
 
 /*
@@ -374,7 +1675,7 @@ reload_sighup(int dummy)
  * send it.
  */
    static int
-send_4to6(void *datap, size_t data_len)
+send_4to6(void *datap, size_t data_len, const struct lookup_hint *hintp)
 {
    assert (datap != NULL);
 
@@ -389,6 +1690,7 @@ send_4to6(void *datap, size_t data_len)
    if (ip4_hdrp->ip_hl << 2 != sizeof(struct ip)) {
       /* IPv4 options are not supported. Just drop it. */
       warnx("IPv4 options are not supported.");
+      PROBE3(drop, PROBE_DROP_IP_OPTIONS, datap, data_len);
       return (0);
    }
    memcpy((void *)&ip4_src, (const void *)&ip4_hdrp->ip_src,
@@ -406,6 +1708,7 @@ send_4to6(void *datap, size_t data_len)
       /* Data is too short.  Drop it. */
       warnx("Insufficient data supplied (%d), while IP header says (%d)",
             data_len, ip4_tlen);
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
       return (-1);
    }
 
@@ -434,10 +1737,14 @@ send_4to6(void *datap, size_t data_len)
    /* ICMP error handling. */
    if (ip4_proto == IPPROTO_ICMP) {
       int discard_ok = 0;
-      if (icmpsub_process_icmp4(tun_fd, (const struct icmp *)packetp,
-               data_len - sizeof(ip4_hlen),
+      int looked_up = hintp != NULL && hintp->valid && hintp->result == 0;
+      if (icmpsub_process_icmp4(tun_fd, ip4_hdrp,
+               (const struct icmp *)packetp, ip4_plen,
+               looked_up ? &hintp->ip6_src : NULL,
+               looked_up ? &hintp->ip6_dst : NULL,
                &discard_ok)
             == -1) {
+         PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
          return (0);
       }
       if (discard_ok)
@@ -446,16 +1753,26 @@ send_4to6(void *datap, size_t data_len)
 
    /* Convert IP addresses. */
    struct in6_addr ip6_src, ip6_dst;
-   if (mapping_convert_addrs_4to6(&ip4_src, &ip4_dst,
+   if (hintp != NULL && hintp->valid) {
+      if (hintp->result == -1) {
+         warnx("no mapping entry found for %s.", inet_ntoa(ip4_dst));
+         warnx("no mapping available. packet is dropped.");
+         PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
+         return (0);
+      }
+      ip6_src = hintp->ip6_src;
+      ip6_dst = hintp->ip6_dst;
+   } else if (mapping_convert_addrs_4to6(&ip4_src, &ip4_dst,
             &ip6_src, &ip6_dst) == -1) {
       warnx("no mapping available. packet is dropped.");
+      PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
       return (0);
    }
 
    /* Prepare an IPv6 header template. */
    struct ip6_hdr ip6_hdr;
    memset(&ip6_hdr, 0, sizeof(struct ip6_hdr));
-   ip6_hdr.ip6_vfc = IPV6_VERSION;
+   ip6_hdr.ip6_flow = flow_label_4to6(ip4_hdrp, packetp, ip4_plen);
    ip6_hdr.ip6_plen = htons(ip4_plen);
    ip6_hdr.ip6_nxt = ip4_proto;
    ip6_hdr.ip6_hlim = ip4_ttl;
@@ -474,10 +1791,12 @@ send_4to6(void *datap, size_t data_len)
 #endif
 
    /* Fragment processing. */
-   int mtu = pmtudisc_get_path_mtu_size(AF_INET6, &ip6_dst);
+   int mtu = (hintp != NULL && hintp->valid) ? hintp->mtu
+      : pmtudisc_get_path_mtu_size(AF_INET6, &ip6_dst);
 #define IP6_FRAG6_HDR_LEN (sizeof(struct ip6_hdr) + sizeof(struct ip6_frag))
    if (ip4_plen > mtu - IP6_FRAG6_HDR_LEN) {
       /* Fragment is needed for this packet. */
+      PROBE4(fragment, AF_INET6, datap, ip4_plen, mtu);
 
       /*
        * Send an ICMP error message with the unreach type and the
@@ -575,6 +1894,7 @@ send_4to6(void *datap, size_t data_len)
                /* Convert the ICMP type/code to those of ICMPv6. */
                if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
                   /* ICMP to ICMPv6 conversion failed. */
+                  PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
                   return (0);
                }
             }
@@ -600,7 +1920,7 @@ send_4to6(void *datap, size_t data_len)
 
          /* Send this fragment. */
          ssize_t write_len;
-         write_len = writev(tun_fd, iov, 4);
+         write_len = output_packet(iov, 4);
          if (write_len == -1) {
             warn("sending an IPv6 packet failed.");
          }
@@ -626,6 +1946,7 @@ send_4to6(void *datap, size_t data_len)
          if (ip4_proto == IPPROTO_ICMP) {
             warnx("ICMP fragment packets are not supported.");
             /* Just drop it. */
+            PROBE3(drop, PROBE_DROP_ICMP_FRAGMENT, datap, data_len);
             return (0);
          }
 
@@ -680,6 +2001,7 @@ send_4to6(void *datap, size_t data_len)
             /* Convert the ICMP type/code to those of ICMPv6. */
             if (icmpsub_convert_icmp(IPPROTO_ICMP, iov) == -1) {
                /* ICMP to ICMPv6 conversion failed. */
+               PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
                return (0);
             }
          }
@@ -698,7 +2020,7 @@ send_4to6(void *datap, size_t data_len)
 
       /* Send this (fragmented) packet. */
       ssize_t write_len;
-      write_len = writev(tun_fd, iov, 4);
+      write_len = output_packet(iov, 4);
       if (write_len == -1) {
          warn("sending an IPv6 packet failed.");
       }
@@ -712,7 +2034,7 @@ send_4to6(void *datap, size_t data_len)
  * send it.
  */
    static int
-send_6to4(void *datap, size_t data_len)
+send_6to4(void *datap, size_t data_len, const struct lookup_hint *hintp)
 {
    assert(datap != NULL);
 
@@ -729,10 +2051,14 @@ send_6to4(void *datap, size_t data_len)
    /* XXX: we don't handle fragmented ICMPv6 messages. */
    if (ip6_next_header == IPPROTO_ICMPV6) {
       int discard_ok = 0;
-      if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
-               data_len - sizeof(ip6_hdr),
+      size_t icmp6_len = ntohs(ip6_hdrp->ip6_plen);
+      if (icmp6_len > data_len - sizeof(struct ip6_hdr))
+         icmp6_len = data_len - sizeof(struct ip6_hdr);
+      if (icmpsub_process_icmp6(tun_fd, ip6_hdrp,
+               (const struct icmp6_hdr *)packetp, icmp6_len,
                &discard_ok)
             == -1) {
+         PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
          return (0);
       }
       if (discard_ok)
@@ -761,6 +2087,7 @@ send_6to4(void *datap, size_t data_len)
          && ip6_next_header != IPPROTO_TCP
          && ip6_next_header != IPPROTO_UDP) {
       warnx("Extention header %d is not supported.", ip6_next_header);
+      PROBE3(drop, PROBE_DROP_EXT_HEADER, datap, data_len);
       return (0);
    }
 
@@ -783,6 +2110,7 @@ send_6to4(void *datap, size_t data_len)
       /* Data is too short.  Drop it. */
       warnx("Insufficient data supplied (%d), while IP header says (%d)",
             data_len, ip6_payload_len + sizeof(struct ip6_hdr));
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
       return (-1);
    }
 
@@ -799,9 +2127,21 @@ send_6to4(void *datap, size_t data_len)
 
    /* Convert IP addresses. */
    struct in_addr ip4_src, ip4_dst;
-   if (mapping_convert_addrs_6to4(&ip6_src, &ip6_dst,
+   if (hintp != NULL && hintp->valid) {
+      if (hintp->result == -1) {
+         char addr_str[64];
+         warnx("no mapping entry found for %s.",
+               inet_ntop(AF_INET6, &ip6_src, addr_str, sizeof(addr_str)));
+         warnx("no mapping available. packet is dropped.");
+         PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
+         return (-1);
+      }
+      ip4_src = hintp->ip4_src;
+      ip4_dst = hintp->ip4_dst;
+   } else if (mapping_convert_addrs_6to4(&ip6_src, &ip6_dst,
             &ip4_src, &ip4_dst) == -1) {
       warnx("no mapping available. packet is dropped.");
+      PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
       return (-1);
    }
 
@@ -828,9 +2168,11 @@ send_6to4(void *datap, size_t data_len)
 #endif
 
    /* Fragment processing. */
-   int mtu = pmtudisc_get_path_mtu_size(AF_INET, &ip4_dst);
+   int mtu = (hintp != NULL && hintp->valid) ? hintp->mtu
+      : pmtudisc_get_path_mtu_size(AF_INET, &ip4_dst);
    if (ip6_payload_len > mtu - sizeof(struct ip)) {
       /* Fragment is needed for this packet. */
+      PROBE4(fragment, AF_INET, datap, ip6_payload_len, mtu);
 
       /*
        * Send an ICMPv6 Packet Too Big message.  ICMP error message
@@ -905,6 +2247,7 @@ send_6to4(void *datap, size_t data_len)
                /* Convert the ICMPv6 type/code to those of ICMP. */
                if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
                   /* ICMPv6 to ICMP conversion failed. */
+                  PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
                   return (0);
                }
             }
@@ -929,7 +2272,7 @@ send_6to4(void *datap, size_t data_len)
 
          /* Send this fragment. */
          ssize_t write_len;
-         write_len = writev(tun_fd, iov, 4);
+         write_len = output_packet(iov, 4);
          if (write_len == -1) {
             warn("sending an IPv4 packet failed.");
          }
@@ -949,6 +2292,7 @@ send_6to4(void *datap, size_t data_len)
          if (ip6_next_header == IPPROTO_ICMPV6) {
             warnx("ICMPv6 fragment packets are not supported.");
             /* Just drop it. */
+            PROBE3(drop, PROBE_DROP_ICMP_FRAGMENT, datap, data_len);
             return (0);
          }
 
@@ -1007,6 +2351,7 @@ send_6to4(void *datap, size_t data_len)
             /* Convert the ICMPv6 type/code to those of ICMP. */
             if (icmpsub_convert_icmp(IPPROTO_ICMPV6, iov) == -1) {
                /* ICMPv6 to ICMP conversion failed. */
+               PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
                return (0);
             }
          }
@@ -1027,7 +2372,7 @@ send_6to4(void *datap, size_t data_len)
 
       /* Send this (fragmented) packet. */
       ssize_t write_len;
-      write_len = writev(tun_fd, iov, 4);
+      write_len = output_packet(iov, 4);
       if (write_len == -1) {
          warn("sending an IPv4 packet failed.");
       }
@@ -1059,10 +2404,12 @@ send66_ItoG(void *datap, size_t data_len)
    /* XXX: we don't handle fragmented ICMPv6 messages. */
    if (ip6_next_header == IPPROTO_ICMPV6) {
       int discard_ok = 0;
-      if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
+      if (icmpsub_process_icmp6(tun_fd, NULL,
+               (const struct icmp6_hdr *)packetp,
                data_len - sizeof(ip6_hdr),
                &discard_ok)
             == -1) {
+         PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
          return (0);
       }
       if (discard_ok)
@@ -1091,6 +2438,7 @@ send66_ItoG(void *datap, size_t data_len)
          && ip6_next_header != IPPROTO_TCP
          && ip6_next_header != IPPROTO_UDP) {
       warnx("Extention header %d is not supported.", ip6_next_header);
+      PROBE3(drop, PROBE_DROP_EXT_HEADER, datap, data_len);
       return (0);
    }
 
@@ -1113,6 +2461,7 @@ send66_ItoG(void *datap, size_t data_len)
       /* Data is too short.  Drop it. */
       warnx("Insufficient data supplied (%d), while IP header says (%d)",
             data_len, ip6_payload_len + sizeof(struct ip6_hdr));
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
       return (-1);
    }
 
@@ -1132,6 +2481,7 @@ send66_ItoG(void *datap, size_t data_len)
    if (mapping66_convert_addrs_ItoG(&ip6_before_src, &ip6_before_dst,
             &ip6_after_src, &ip6_after_dst) == -1) {
       warnx("no mapping available. packet is dropped.");
+      PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
       return (-1);
    }
 
@@ -1171,7 +2521,129 @@ send66_ItoG(void *datap, size_t data_len)
    cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
 
    ssize_t write_len;
-   write_len = writev(tun_fd, iov, 4);
+   write_len = output_packet(iov, 4);
+   if (write_len == -1) {
+      warn("sending an IPv6 packet failed.");
+   }
+
+   return (0);
+}
+
+/*
+ * Translate an IPv6 packet from a mapped server to the IPv4 address of
+ * another mapped server directly into an IPv6 packet to that server.
+ * The IPv4 packet made by send_6to4() would be routed back to the tun
+ * interface and translated again by send_4to6(), so the addresses are
+ * the ones that round trip would give: the mapping prefix with the
+ * IPv4 address of the source server, and the IPv6 address of the
+ * destination server.  The hop limit is decremented for the IPv4 hop
+ * which is skipped.
+ */
+   static int
+send66_hairpin(void *datap, size_t data_len)
+{
+   assert(datap != NULL);
+
+   char *packetp = (char *)datap;
+
+   struct ip6_hdr *ip6_hdrp;
+   uint8_t ip6_next_header;
+   ip6_hdrp = (struct ip6_hdr *)packetp;
+   ip6_next_header = ip6_hdrp->ip6_nxt;
+   packetp += sizeof(struct ip6_hdr);
+
+   /* The headers are checked against the length before being read. */
+   uint16_t ip6_payload_len = ntohs(ip6_hdrp->ip6_plen);
+   if (ip6_payload_len + sizeof(struct ip6_hdr) > data_len) {
+      warnx("Insufficient data supplied (%zu), while IP header says (%zu)",
+            data_len, ip6_payload_len + sizeof(struct ip6_hdr));
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
+      return (-1);
+   }
+
+   struct ip6_frag *ip6_frag_hdrp = NULL;
+   int ip6_offset = 0;
+   if (ip6_next_header == IPPROTO_FRAGMENT) {
+      if (ip6_payload_len < sizeof(struct ip6_frag)) {
+         PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
+         return (-1);
+      }
+      ip6_frag_hdrp = (struct ip6_frag *)packetp;
+      ip6_next_header = ip6_frag_hdrp->ip6f_nxt;
+      ip6_offset = ntohs(ip6_frag_hdrp->ip6f_offlg & IP6F_OFF_MASK);
+      packetp += sizeof(struct ip6_frag);
+      ip6_payload_len -= sizeof(struct ip6_frag);
+   }
+   if (ip6_next_header == IPPROTO_ICMPV6 && ip6_offset == 0
+         && ip6_payload_len < sizeof(struct icmp6_hdr)) {
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
+      return (-1);
+   }
+
+   /*
+    * The ICMPv6 errors carry the original packet whose addresses are
+    * translated too, and the other headers are not supported.  They
+    * take the usual way.
+    */
+   if ((ip6_next_header == IPPROTO_ICMPV6 && ip6_offset == 0
+            && (((struct icmp6_hdr *)packetp)->icmp6_type
+               & ICMP6_INFOMSG_MASK) == 0)
+         || (ip6_next_header != IPPROTO_ICMPV6
+            && ip6_next_header != IPPROTO_TCP
+            && ip6_next_header != IPPROTO_UDP)) {
+      return (send_6to4(datap, data_len, NULL));
+   }
+
+   if (ip6_hdrp->ip6_hlim <= 1) {
+      /* The hairpin is a hop, which the sender learns by traceroute. */
+      PROBE3(drop, PROBE_DROP_HOP_LIMIT, datap, data_len);
+      if (icmpsub_send_icmp6_time_exceeded(tun_fd, datap,
+               sizeof(struct ip6_hdr) + ntohs(ip6_hdrp->ip6_plen),
+               &ip6_hdrp->ip6_dst, &ip6_hdrp->ip6_src) == -1) {
+         warnx("sending ICMPv6 Time Exceeded failed.");
+      }
+      return (-1);
+   }
+
+   /* Convert IP addresses through the IPv4 addresses. */
+   struct in_addr ip4_src, ip4_dst;
+   struct in6_addr ip6_src, ip6_dst;
+   if (mapping_convert_addrs_6to4(&ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst,
+            &ip4_src, &ip4_dst) == -1
+         || mapping_convert_addrs_4to6(&ip4_src, &ip4_dst, &ip6_src,
+            &ip6_dst) == -1) {
+      warnx("no mapping available. packet is dropped.");
+      PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
+      return (-1);
+   }
+
+   /* The traffic class and the flow label are kept. */
+   struct ip6_hdr ip6_hdr;
+   memcpy(&ip6_hdr, ip6_hdrp, sizeof(struct ip6_hdr));
+   ip6_hdr.ip6_hlim--;
+   memcpy(&ip6_hdr.ip6_src, &ip6_src, sizeof(struct in6_addr));
+   memcpy(&ip6_hdr.ip6_dst, &ip6_dst, sizeof(struct in6_addr));
+
+   struct iovec iov[4];
+   uint32_t af;
+
+   tun_set_af(&af, AF_INET6);
+   iov[0].iov_base = &af;
+   iov[0].iov_len = sizeof(uint32_t);
+   iov[1].iov_base = &ip6_hdr;
+   iov[1].iov_len = sizeof(struct ip6_hdr);
+   iov[2].iov_base = ip6_frag_hdrp;
+   iov[2].iov_len = ip6_frag_hdrp ? sizeof(struct ip6_frag) : 0;
+   iov[3].iov_base = packetp;
+   iov[3].iov_len = ip6_payload_len;
+
+   /* Only the first fragment has the upper layer header. */
+   if (ip6_offset == 0) {
+      cksum66_update_ulp(ip6_next_header, ip6_hdrp, iov);
+   }
+
+   ssize_t write_len;
+   write_len = output_packet(iov, 4);
    if (write_len == -1) {
       warn("sending an IPv6 packet failed.");
    }
@@ -1201,10 +2673,12 @@ send66_GtoI(void *datap, size_t data_len)
    /* XXX: we don't handle fragmented ICMPv6 messages. */
    if (ip6_next_header == IPPROTO_ICMPV6) {
       int discard_ok = 0;
-      if (icmpsub_process_icmp6(tun_fd, (const struct icmp6_hdr *)packetp,
+      if (icmpsub_process_icmp6(tun_fd, NULL,
+               (const struct icmp6_hdr *)packetp,
                data_len - sizeof(ip6_hdr),
                &discard_ok)
             == -1) {
+         PROBE3(drop, PROBE_DROP_ICMP, datap, data_len);
          return (0);
       }
       if (discard_ok)
@@ -1233,6 +2707,7 @@ send66_GtoI(void *datap, size_t data_len)
          && ip6_next_header != IPPROTO_TCP
          && ip6_next_header != IPPROTO_UDP) {
       warnx("Extention header %d is not supported.", ip6_next_header);
+      PROBE3(drop, PROBE_DROP_EXT_HEADER, datap, data_len);
       return (0);
    }
 
@@ -1255,6 +2730,7 @@ send66_GtoI(void *datap, size_t data_len)
       /* Data is too short.  Drop it. */
       warnx("Insufficient data supplied (%d), while IP header says (%d)",
             data_len, ip6_payload_len + sizeof(struct ip6_hdr));
+      PROBE3(drop, PROBE_DROP_TRUNCATED, datap, data_len);
       return (-1);
    }
 
@@ -1274,6 +2750,7 @@ send66_GtoI(void *datap, size_t data_len)
    if (mapping66_convert_addrs_GtoI(&ip6_before_src, &ip6_before_dst,
             &ip6_after_src, &ip6_after_dst) == -1) {
       warnx("no mapping available. packet is dropped.");
+      PROBE3(drop, PROBE_DROP_NO_MAPPING, datap, data_len);
       return (-1);
    }
 
@@ -1313,7 +2790,7 @@ send66_GtoI(void *datap, size_t data_len)
    cksum66_update_ulp(ip6_hdr.ip6_nxt, ip6_hdrp, iov);
 
    ssize_t write_len;
-   write_len = writev(tun_fd, iov, 4);
+   write_len = output_packet(iov, 4);
    if (write_len == -1) {
       warn("sending an IPv6 packet failed.");
    }
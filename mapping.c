@@ -22,20 +22,24 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdlib.h>
 #if !defined(__linux__)
 #define _WITH_GETLINE
 #else
 #define _GNU_SOURCE
 #endif
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/queue.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <net/if.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -48,6 +52,19 @@
 
 #include "mapping.h"
 #include "tunif.h"
+#include "pmtudisc.h"
+#include "xskif.h"
+#include "fastpath.h"
+#include "steer.h"
+#include "pipeline.h"
+#include "affinity.h"
+#include "pktbuf.h"
+#include "nat64.h"
+#include "dns64.h"
+#include "flowexp.h"
+#include "capture.h"
+#include "probe.h"
+#include "perfctr.h"
 
 /*
  * The mapping structure between the global IPv4 address and the
@@ -57,6 +74,28 @@ struct mapping {
    SLIST_ENTRY(mapping) entries;
    struct in_addr addr4;
    struct in6_addr addr6;
+   struct mapping_pool *poolp;  /* the backend pool of addr4, if any */
+   int hairpin;                 /* addr4 can be translated in place */
+};
+
+/*
+ * The pool of the IPv6 backends sharing one global IPv4 address.  Each
+ * backend has its own mapping{} entry for the reverse direction, and
+ * the backend of an IPv4 flow is selected by the Maglev lookup table,
+ * which is indexed by the hash of the 5-tuple.  The table is filled by
+ * the preference lists of the backends in turn, so every backend gets
+ * almost the same number of the entries, and adding or removing a
+ * backend moves only a few of the flows of the other backends.
+ */
+#define MAPPING_POOL_MAX_BACKENDS 256
+#define MAPPING_POOL_TABLE_SIZE 65537   /* a prime */
+
+struct mapping_pool {
+   SLIST_ENTRY(mapping_pool) entries;
+   struct in_addr addr4;
+   int backend_count;
+   struct in6_addr *backends;
+   uint8_t lookup[MAPPING_POOL_TABLE_SIZE];
 };
 
 struct mapping66 {
@@ -65,6 +104,37 @@ struct mapping66 {
    struct in6_addr intra;
 };
 
+/*
+ * The port mapping between a TCP or UDP port of a global IPv4 address
+ * and an internal IPv6 address.  An entry is linked to the hash chains
+ * of both directions directly.
+ */
+struct mapping_port {
+   SLIST_ENTRY(mapping_port) entries;
+   SLIST_ENTRY(mapping_port) hash4_entries;
+   SLIST_ENTRY(mapping_port) hash6_entries;
+   struct in_addr addr4;
+   struct in6_addr addr6;
+   uint16_t port;                /* in network byte order */
+   uint8_t proto;
+   uint8_t route;                /* the first entry of addr4 */
+};
+
+/* The hash keys of the port mappings.  The padding must be 0. */
+struct mapping_port_key4 {
+   struct in_addr addr;
+   uint16_t port;
+   uint8_t proto;
+   uint8_t pad;
+};
+
+struct mapping_port_key6 {
+   struct in6_addr addr;
+   uint16_t port;
+   uint8_t proto;
+   uint8_t pad;
+};
+
 struct mapping_hash {
    SLIST_ENTRY(mapping_hash) entries;
    struct mapping *mappingp;
@@ -76,12 +146,27 @@ struct mapping66_hash {
 };
 
 #define MAPPING_TABLE_HASH_SIZE 1009
+#define MAPPING_BATCH_CHUNK 32
+#define MAPPING_MAX_RULES 64
+#define MAPPING_DEFAULT_PSID_OFFSET 6
 
 SLIST_HEAD(mapping_listhead, mapping);
 SLIST_HEAD(mapping66_listhead, mapping66);
 struct mapping_listhead mapping_head;
 struct mapping66_listhead mapping66_head;
 
+SLIST_HEAD(mapping_pool_listhead, mapping_pool);
+static struct mapping_pool_listhead mapping_pool_head;
+static unsigned int mapping_pool_count;
+
+SLIST_HEAD(mapping_port_listhead, mapping_port);
+static struct mapping_port_listhead mapping_port_head;
+static struct mapping_port_listhead
+   mapping_port_hash_4to6_heads[MAPPING_TABLE_HASH_SIZE];
+static struct mapping_port_listhead
+   mapping_port_hash_6to4_heads[MAPPING_TABLE_HASH_SIZE];
+static unsigned int mapping_port_count;
+
 SLIST_HEAD(mapping_hash_listhead, mapping_hash);
 SLIST_HEAD(mapping66_hash_listhead, mapping66_hash);
 
@@ -95,7 +180,108 @@ struct mapping66_hash_listhead mapping66_hash_GtoI_heads[MAPPING_TABLE_HASH_SIZE
 
 static struct in6_addr mapping_prefix;
 
+/*
+ * The basic mapping rules of MAP-T (RFC 7599).  An IPv6 address
+ * under the rule IPv6 prefix has the embedded address (EA) bits right
+ * after the prefix: the suffix of the IPv4 address under the rule IPv4
+ * prefix, followed by the port set ID (PSID).  The hosts sharing an
+ * IPv4 address use the disjoint port sets selected by the PSID.  The
+ * addresses and the port are converted by the bit operations only.
+ */
+struct mapping_rule {
+   uint64_t prefix6;       /* the upper 64 bits in host byte order */
+   uint64_t mask6;
+   int prefix6_len;
+   uint32_t prefix4;       /* in host byte order */
+   uint32_t mask4;
+   int prefix4_len;
+   int ea_len;
+   int psid_offset;
+   int psid_len;
+};
+static struct mapping_rule mapping_rules[MAPPING_MAX_RULES];
+static int mapping_rule_count;
+
+/*
+ * The negative lookup filter over the internal IPv6 addresses (the
+ * addr6 of the map entries and the intra of the map66 entries).  It
+ * is a blocked Bloom filter: every address sets MAPPING_FILTER_K bits
+ * in a single 64 byte block, so that the dispatch() function can
+ * answer the common miss, a packet from the Internet, by reading one
+ * cache line instead of walking two hash chains to the end.  The
+ * filter is rebuilt every time the mapping table is created.
+ */
+#define MAPPING_FILTER_BLOCK_WORDS 8
+#define MAPPING_FILTER_BLOCK_BITS (MAPPING_FILTER_BLOCK_WORDS * 64)
+#define MAPPING_FILTER_K 4
+#define MAPPING_FILTER_BITS_PER_ENTRY 16
+
+struct mapping_filter_block {
+   uint64_t words[MAPPING_FILTER_BLOCK_WORDS];
+} __attribute__((aligned(64)));
+
+static struct mapping_filter_block *mapping_filter_blocks;
+static uint32_t mapping_filter_mask;    /* the number of blocks - 1 */
+static unsigned int mapping_filter_entries;
+
+/*
+ * The filter counters of each thread calling the dispatch() function.
+ * They are linked to the list at the first use so that the
+ * mapping_get_filter_stats() function can sum them up.
+ */
+struct mapping_filter_counters {
+   SLIST_ENTRY(mapping_filter_counters) entries;
+   uint64_t queries;
+   uint64_t negatives;
+   uint64_t false_positives;
+} __attribute__((aligned(64)));
+SLIST_HEAD(mapping_filter_counters_listhead, mapping_filter_counters);
+static struct mapping_filter_counters_listhead mapping_filter_counters_head
+   = SLIST_HEAD_INITIALIZER(mapping_filter_counters_head);
+static pthread_mutex_t mapping_filter_counters_lock =
+   PTHREAD_MUTEX_INITIALIZER;
+static __thread struct mapping_filter_counters *mapping_filter_countersp;
+
+/*
+ * The bitmap of the hashed IPv4 addresses of the map-static entries.
+ * An IPv6 packet to the mapping prefix is looked up in the mapping
+ * table for hairpinning only if its bit is set, so the other packets
+ * don't pay for the lookup.
+ */
+#define MAPPING_HAIRPIN_BITS 65536
+static uint64_t mapping_hairpin_bits[MAPPING_HAIRPIN_BITS / 64];
+
+/*
+ * The key of the flow label hash.  mapping_flow_key is the key in use,
+ * or 0 if the flow-label directive turns the flow label off.  The key
+ * is chosen once at startup, so the labels don't change on reload.
+ */
+static uint32_t mapping_flow_seed;
+uint32_t mapping_flow_key;
+
+/*
+ * Set once the configuration file is read at startup.  The directives
+ * which size the buffers, the queues and the threads are ignored when
+ * the file is reloaded.
+ */
+static int mapping_started;
+
+/*
+ * The worker threads hold the lock for reading while translating a
+ * packet, and the reload holds it for writing.  The main thread
+ * doesn't take the read lock since it runs the reload itself between
+ * packets.  Writers are preferred so that the reload is not starved
+ * under load.
+ */
+static pthread_rwlock_t mapping_lock =
+   PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
 static int mapping_get_hash_index(const void *, int);
+static void mapping_prefetch_buckets(struct mapping_hash_listhead **, int);
+static const struct mapping *mapping_find_in_bucket4(const struct
+      mapping_hash_listhead *, const struct in_addr *);
+static const struct mapping *mapping_find_in_bucket6(const struct
+      mapping_hash_listhead *, const struct in6_addr *);
 static const struct mapping *mapping_find_mapping_with_ip4_addr(const struct
       in_addr *);
 static const struct mapping *mapping_find_mapping_with_ip6_addr(const struct
@@ -108,17 +294,65 @@ static const struct mapping66 *mapping66_find_mapping_with_G_addr(const struct
 static int mapping_insert_mapping(struct mapping *);
 static int mapping66_insert_mapping(struct mapping66 *);
 
+static uint64_t mapping_filter_hash(const struct in6_addr *);
+static int mapping_filter_build(void);
+static void mapping_filter_add(const struct in6_addr *);
+static int mapping_filter_may_contain(const struct in6_addr *);
+static struct mapping_filter_counters *mapping_filter_get_counters(void);
+static uint8_t dispatch_unmapped(const struct ip6_hdr *);
+static int mapping_startup_only(const char *, int);
+static int mapping_parse_prefix(int, const char *, void *, int *);
+static int mapping_add_rule(const char *, const char *, const char *,
+      const char *);
+static const struct mapping_rule *mapping_find_rule_with_ip4_addr(const
+      struct in_addr *);
+static const struct mapping_rule *mapping_find_rule_with_ip6_addr(const
+      struct in6_addr *);
+static int mapping_get_port(const uint8_t *, size_t, uint8_t, int);
+static int mapping_get_psid_port(const uint8_t *, size_t, uint8_t, int, int);
+static int mapping_add_port(const char *, const char *, const char *,
+      const char *);
+static const struct mapping_port *mapping_find_port_with_ip4(const
+      struct in_addr *, uint8_t, uint16_t);
+static const struct mapping_port *mapping_find_port_with_ip6(const
+      struct in6_addr *, uint8_t, uint16_t);
+static const struct mapping_port *mapping_find_port_of_packet(const
+      uint8_t *, size_t, int);
+static int mapping_is_port_mapped(const struct mapping *);
+static int mapping_port_has_ip6_addr(const struct in6_addr *);
+static int mapping_add_pool(char *);
+static void mapping_hairpin_build(void);
+static int mapping_hairpin_bit(const struct in_addr *);
+static uint64_t mapping_pool_hash(const void *, size_t, uint64_t);
+static void mapping_pool_populate(struct mapping_pool *);
+
 
    int
 mapping_initialize(void)
 {
    memset(&mapping_prefix, 0, sizeof(struct in6_addr));
 
+   /*
+    * The seed is drawn from the kernel so that the flow hashes can't
+    * be predicted by a sender.
+    */
+   if (getrandom(&mapping_flow_seed, sizeof(mapping_flow_seed), 0)
+         != sizeof(mapping_flow_seed)) {
+      warn("cannot get the flow hash seed.");
+      return (-1);
+   }
+   mapping_flow_seed |= 1;
+   mapping_flow_key = mapping_flow_seed;
+
    SLIST_INIT(&mapping_head);
    SLIST_INIT(&mapping66_head);
+   SLIST_INIT(&mapping_port_head);
+   SLIST_INIT(&mapping_pool_head);
 
    int count = MAPPING_TABLE_HASH_SIZE;
    while (count--) {
+      SLIST_INIT(&mapping_port_hash_4to6_heads[count]);
+      SLIST_INIT(&mapping_port_hash_6to4_heads[count]);
       SLIST_INIT(&mapping_hash_4to6_heads[count]);
       SLIST_INIT(&mapping_hash_6to4_heads[count]);
       SLIST_INIT(&mapping66_hash_ItoG_heads[count]);
@@ -145,7 +379,8 @@ mapping_create_table(const char *map646_conf_path, int depth)
    char *line;
    size_t line_cap = 0;
 #define TERMLEN 256
-   char op[TERMLEN], addr1[TERMLEN], addr2[TERMLEN];
+   char op[TERMLEN], addr1[TERMLEN], addr2[TERMLEN], addr3[TERMLEN];
+   char addr4[TERMLEN];
 
    conf_fp = fopen(map646_conf_path, "r");
    if (conf_fp == NULL) {
@@ -156,13 +391,24 @@ mapping_create_table(const char *map646_conf_path, int depth)
    int line_count = 0;
    while (getline(&line, &line_cap, conf_fp) > 0) {
       line_count++;
-      if (sscanf(line, "%255s %255s %255s", op, addr1, addr2) == -1) {
+      int nterms = sscanf(line, "%255s %255s %255s %255s %255s", op, addr1,
+            addr2, addr3, addr4);
+      if (nterms == -1) {
          warn("line %d: syntax error.", line_count);
       }
 
       if (strcmp(op, "map-static") == 0) {
+         if (nterms >= 4 && addr3[0] != '#') {
+            /* More than one IPv6 address is a backend pool. */
+            if (mapping_add_pool(line) == -1) {
+               warnx("line %d: invalid backend pool.", line_count);
+            }
+            continue;
+         }
          struct mapping *mappingp;
          mappingp = (struct mapping *)malloc(sizeof(struct mapping));
+         mappingp->poolp = NULL;
+         mappingp->hairpin = 0;
          if (inet_pton(AF_INET, addr1, &mappingp->addr4) != 1) {
             warn("line %d: invalid address %s.", line_count, addr1);
             free(mappingp);
@@ -186,6 +432,11 @@ mapping_create_table(const char *map646_conf_path, int depth)
          if (mapping_insert_mapping(mappingp) == -1) {
             err(EXIT_FAILURE, "inserting a mapping entry failed.");
          }
+      } else if (strcmp(op, "map-static-port") == 0) {
+         if (nterms < 5 || mapping_add_port(addr1, addr2, addr3, addr4)
+               == -1) {
+            warnx("line %d: invalid port mapping entry.", line_count);
+         }
       } else if (strcmp(op, "map66-static") == 0) {
          struct mapping66 *mappingp;
          mappingp = (struct mapping66 *)malloc(sizeof(struct mapping66));
@@ -216,6 +467,243 @@ mapping_create_table(const char *map646_conf_path, int depth)
          if (inet_pton(AF_INET6, addr1, &mapping_prefix) != 1) {
             warn("line %d: invalid address %s.\n", line_count, addr1);
          }
+      } else if (strcmp(op, "map-rule") == 0) {
+         if (nterms < 4 || mapping_add_rule(addr1, addr2, addr3,
+                  nterms >= 5 ? addr4 : NULL) == -1) {
+            warnx("line %d: invalid mapping rule.", line_count);
+         }
+      } else if (strcmp(op, "xdp-interface") == 0) {
+         if (strlen(addr1) >= IFNAMSIZ) {
+            warnx("line %d: invalid interface name %s.", line_count, addr1);
+            continue;
+         }
+         strncpy(xsk_if_name, addr1, IFNAMSIZ);
+         xsk_queue_id = 0;
+         if (nterms >= 3) {
+            xsk_queue_id = atoi(addr2);
+         }
+      } else if (strcmp(op, "xdp-mode") == 0) {
+         if (strcmp(addr1, "auto") == 0) {
+            xsk_mode = XSK_MODE_AUTO;
+         } else if (strcmp(addr1, "native") == 0) {
+            xsk_mode = XSK_MODE_NATIVE;
+         } else if (strcmp(addr1, "skb") == 0) {
+            xsk_mode = XSK_MODE_SKB;
+         } else {
+            warnx("line %d: unknown XDP mode %s.", line_count, addr1);
+         }
+      } else if (strcmp(op, "xdp-nexthop") == 0) {
+         int af = 0;
+         if (strcmp(addr1, "ipv4") == 0) {
+            af = AF_INET;
+         } else if (strcmp(addr1, "ipv6") == 0) {
+            af = AF_INET6;
+         }
+         if (af == 0 || nterms < 3 || xsk_set_nexthop(af, addr2) == -1) {
+            warnx("line %d: invalid XDP nexthop %s %s.", line_count, addr1,
+                  addr2);
+         }
+      } else if (strcmp(op, "tun-queues") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int queues = atoi(addr1);
+         if (queues < 1 || queues > TUN_MAX_QUEUES) {
+            warnx("line %d: the number of tun queues must be 1 to %d.",
+                  line_count, TUN_MAX_QUEUES);
+            continue;
+         }
+         tun_queues = queues;
+      } else if (strcmp(op, "busy-poll-usec") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int usec = atoi(addr1);
+         if (usec < 0 || usec > TUN_MAX_BUSY_POLL_USEC) {
+            warnx("line %d: the busy poll time must be 0 to %d.",
+                  line_count, TUN_MAX_BUSY_POLL_USEC);
+            continue;
+         }
+         tun_busy_poll_usec = usec;
+      } else if (strcmp(op, "tun-mtu") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int mtu = atoi(addr1);
+         if (mtu < TUN_MIN_MTU || mtu > TUN_MAX_MTU) {
+            warnx("line %d: the tun MTU must be %d to %d.",
+                  line_count, TUN_MIN_MTU, TUN_MAX_MTU);
+            continue;
+         }
+         tun_mtu = mtu;
+      } else if (strcmp(op, "buffer-size") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int size = atoi(addr1);
+         if (size < TUN_DEFAULT_BUFFER_SIZE || size > TUN_MAX_BUFFER_SIZE) {
+            warnx("line %d: the buffer size must be %d to %d.",
+                  line_count, TUN_DEFAULT_BUFFER_SIZE, TUN_MAX_BUFFER_SIZE);
+            continue;
+         }
+         tun_buffer_size = size;
+      } else if (strcmp(op, "default-path-mtu") == 0) {
+         int mtu = atoi(addr1);
+         if (mtu < PMTUDISC_MIN_MTU || mtu > PMTUDISC_MAX_MTU) {
+            warnx("line %d: the default path MTU must be %d to %d.",
+                  line_count, PMTUDISC_MIN_MTU, PMTUDISC_MAX_MTU);
+            continue;
+         }
+         pmtudisc_default_mtu = mtu;
+      } else if (strcmp(op, "cpu-affinity") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         if (nterms < 3 || affinity_set(addr1, addr2) == -1) {
+            warnx("line %d: invalid CPU affinity %s %s.", line_count, addr1,
+                  nterms >= 3 ? addr2 : "");
+         }
+      } else if (strcmp(op, "pipeline-workers") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int workers = atoi(addr1);
+         if (workers < 0 || workers > PIPELINE_MAX_WORKERS) {
+            warnx("line %d: the number of pipeline workers must be 0 to %d.",
+                  line_count, PIPELINE_MAX_WORKERS);
+            continue;
+         }
+         pipeline_workers = workers;
+      } else if (strcmp(op, "pipeline-ring-size") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int size = atoi(addr1);
+         if (size < 2 || size > PIPELINE_MAX_RING_SIZE
+               || (size & (size - 1)) != 0) {
+            warnx("line %d: the pipeline ring size must be a power of 2 up to %d.",
+                  line_count, PIPELINE_MAX_RING_SIZE);
+            continue;
+         }
+         pipeline_ring_size = size;
+      } else if (strcmp(op, "pipeline-batch") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int size = atoi(addr1);
+         if (size < 1 || size > PIPELINE_MAX_BATCH_SIZE) {
+            warnx("line %d: the pipeline batch size must be 1 to %d.",
+                  line_count, PIPELINE_MAX_BATCH_SIZE);
+            continue;
+         }
+         pipeline_batch_size = size;
+      } else if (strcmp(op, "pktbuf-count") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int count = atoi(addr1);
+         if (count < 1 || count > PKTBUF_MAX_COUNT) {
+            warnx("line %d: the number of the packet buffers must be 1 to %d.",
+                  line_count, PKTBUF_MAX_COUNT);
+            continue;
+         }
+         pktbuf_count = count;
+      } else if (strcmp(op, "pktbuf-headroom") == 0) {
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         int headroom = atoi(addr1);
+         if (headroom < 0 || headroom > PKTBUF_MAX_HEADROOM) {
+            warnx("line %d: the packet buffer headroom must be 0 to %d.",
+                  line_count, PKTBUF_MAX_HEADROOM);
+            continue;
+         }
+         pktbuf_headroom = headroom;
+      } else if (strcmp(op, "nat64-pool") == 0) {
+         if (nat64_set_pool(addr1) == -1) {
+            warnx("line %d: invalid NAT64 pool %s.", line_count, addr1);
+         }
+      } else if (strcmp(op, "nat64-ports") == 0) {
+         if (nterms < 3 || nat64_set_ports(atoi(addr1), atoi(addr2)) == -1) {
+            warnx("line %d: invalid NAT64 port range.", line_count);
+         }
+      } else if (strcmp(op, "nat64-max-sessions") == 0) {
+         int sessions = atoi(addr1);
+         if (sessions < 1 || sessions > NAT64_MAX_SESSIONS) {
+            warnx("line %d: the number of NAT64 sessions must be 1 to %d.",
+                  line_count, NAT64_MAX_SESSIONS);
+            continue;
+         }
+         nat64_max_sessions = sessions;
+      } else if (strcmp(op, "nat64-timeout") == 0) {
+         if (nterms < 3 || nat64_set_timeout(addr1, atoi(addr2)) == -1) {
+            warnx("line %d: invalid NAT64 timeout.", line_count);
+         }
+      } else if (strcmp(op, "dns64-listen") == 0) {
+         if (dns64_set_listen(addr1, nterms >= 3 ? addr2 : NULL) == -1) {
+            warnx("line %d: invalid DNS64 address.", line_count);
+         }
+      } else if (strcmp(op, "dns64-upstream") == 0) {
+         if (dns64_set_upstream(addr1, nterms >= 3 ? addr2 : NULL) == -1) {
+            warnx("line %d: invalid DNS64 upstream address.", line_count);
+         }
+      } else if (strcmp(op, "dns64-cache-size") == 0) {
+         int entries = atoi(addr1);
+         if (entries < 1 || entries > DNS64_MAX_CACHE_SIZE) {
+            warnx("line %d: the DNS64 cache size must be 1 to %d.",
+                  line_count, DNS64_MAX_CACHE_SIZE);
+            continue;
+         }
+         dns64_cache_size = entries;
+      } else if (strcmp(op, "flow-export") == 0) {
+         if (flowexp_set_collector(addr1, nterms >= 3 ? addr2 : NULL) == -1) {
+            warnx("line %d: invalid flow collector address.", line_count);
+         }
+      } else if (strcmp(op, "flow-table-size") == 0) {
+         int entries = atoi(addr1);
+         if (entries < 1 || entries > FLOWEXP_MAX_TABLE_SIZE) {
+            warnx("line %d: the flow table size must be 1 to %d.",
+                  line_count, FLOWEXP_MAX_TABLE_SIZE);
+            continue;
+         }
+         flowexp_table_size = entries;
+      } else if (strcmp(op, "capture-ring-size") == 0) {
+         int packets = atoi(addr1);
+         if (packets < 1 || packets > CAPTURE_MAX_RING_SIZE) {
+            warnx("line %d: the capture ring size must be 1 to %d.",
+                  line_count, CAPTURE_MAX_RING_SIZE);
+            continue;
+         }
+         capture_ring_size = packets;
+      } else if (strcmp(op, "flow-timeout") == 0) {
+         if (nterms < 3 || flowexp_set_timeout(addr1, atoi(addr2)) == -1) {
+            warnx("line %d: invalid flow timeout.", line_count);
+         }
+      } else if (strcmp(op, "flow-label") == 0) {
+         if (strcmp(addr1, "on") == 0) {
+            mapping_flow_key = mapping_flow_seed;
+         } else if (strcmp(addr1, "off") == 0) {
+            mapping_flow_key = 0;
+         } else {
+            warnx("line %d: the flow label must be on or off.", line_count);
+         }
+      } else if (strcmp(op, "perf-counters") == 0) {
+         /* The counters are opened when the threads start. */
+         if (mapping_startup_only(op, line_count)) {
+            continue;
+         }
+         if (strcmp(addr1, "on") == 0) {
+            perfctr_enabled = 1;
+         } else if (strcmp(addr1, "off") == 0) {
+            perfctr_enabled = 0;
+         } else {
+            warnx("line %d: the perf counters must be on or off.", line_count);
+         }
+      } else if (strcmp(op, "fastpath-interface") == 0) {
+         if (fastpath_add_interface(addr1) == -1) {
+            warnx("line %d: cannot use %s for the fast path.", line_count,
+                  addr1);
+         }
       } else if (strcmp(op, "include") == 0) {
          struct stat sub_conf_stat;
          memset(&sub_conf_stat, 0, sizeof(struct stat));
@@ -229,9 +717,63 @@ mapping_create_table(const char *map646_conf_path, int depth)
          warnx("line %d: unknown operand %s.\n", line_count, op);
       }
    }
+
+   /* Build the filters once all the included files are read. */
+   if (depth == 0 && mapping_filter_build() == -1) {
+      return (-1);
+   }
+   if (depth == 0) {
+      mapping_hairpin_build();
+      mapping_started = 1;
+   }
    return (0);
 }
 
+/*
+ * Returns 1 if the configuration file is being reloaded, in which
+ * case the directive op, which is read only at startup, is ignored.
+ * The buffers and the threads sized by such a directive are in use.
+ */
+   static int
+mapping_startup_only(const char *op, int line_count)
+{
+   assert(op != NULL);
+
+   if (!mapping_started) {
+      return (0);
+   }
+   warnx("line %d: %s is read only at startup, ignored.", line_count, op);
+   return (1);
+}
+
+/*
+ * Lock the mapping table.  The read lock must be held while using the
+ * table from the threads other than the main thread.
+ */
+   void
+mapping_read_lock(void)
+{
+   pthread_rwlock_rdlock(&mapping_lock);
+}
+
+   void
+mapping_read_unlock(void)
+{
+   pthread_rwlock_unlock(&mapping_lock);
+}
+
+   void
+mapping_write_lock(void)
+{
+   pthread_rwlock_wrlock(&mapping_lock);
+}
+
+   void
+mapping_write_unlock(void)
+{
+   pthread_rwlock_unlock(&mapping_lock);
+}
+
 /* Destroy the mapping table. */
    void
 mapping_destroy_table(void)
@@ -239,6 +781,43 @@ mapping_destroy_table(void)
    /* Clear the IPv6 pseudo prefix information. */
    memset(&mapping_prefix, 0, sizeof(struct in6_addr));
 
+   /* Clear the mapping rules. */
+   mapping_rule_count = 0;
+
+   /* The flow label is on unless the new table turns it off. */
+   mapping_flow_key = mapping_flow_seed;
+
+   /* Clear the port mappings. */
+   int index;
+   for (index = 0; index < MAPPING_TABLE_HASH_SIZE; index++) {
+      SLIST_INIT(&mapping_port_hash_4to6_heads[index]);
+      SLIST_INIT(&mapping_port_hash_6to4_heads[index]);
+   }
+   while (!SLIST_EMPTY(&mapping_port_head)) {
+      struct mapping_port *mpp = SLIST_FIRST(&mapping_port_head);
+      SLIST_REMOVE_HEAD(&mapping_port_head, entries);
+      free(mpp);
+   }
+   mapping_port_count = 0;
+
+   /* Clear the backend pools. */
+   while (!SLIST_EMPTY(&mapping_pool_head)) {
+      struct mapping_pool *mpp = SLIST_FIRST(&mapping_pool_head);
+      SLIST_REMOVE_HEAD(&mapping_pool_head, entries);
+      free(mpp->backends);
+      free(mpp);
+   }
+   mapping_pool_count = 0;
+
+   /* Clear the hairpin bitmap. */
+   memset(mapping_hairpin_bits, 0, sizeof(mapping_hairpin_bits));
+
+   /* Clear the negative lookup filter. */
+   free(mapping_filter_blocks);
+   mapping_filter_blocks = NULL;
+   mapping_filter_mask = 0;
+   mapping_filter_entries = 0;
+
    /* Clear all the hash entries for the mapping{} structure instances. */
    int count = MAPPING_TABLE_HASH_SIZE;
    while (count--) {
@@ -307,6 +886,7 @@ mapping_convert_addrs_4to6(const struct in_addr *ip4_src,
       = mapping_find_mapping_with_ip4_addr(ip4_dst);
    if (mappingp == NULL) {
       /* not found. */
+      PROBE2(mapping_miss, AF_INET, ip4_dst);
       warnx("no mapping entry found for %s.", inet_ntoa(*ip4_dst));
       return (-1);
    }
@@ -359,6 +939,7 @@ mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
       = mapping_find_mapping_with_ip6_addr(ip6_src);
    if (mappingp == NULL) {
       /* not found. */
+      PROBE2(mapping_miss, AF_INET6, ip6_src);
       char addr_str[64];
       warnx("no mapping entry found for %s.",
             inet_ntop(AF_INET6, ip6_src, addr_str, 64));
@@ -370,6 +951,119 @@ mapping_convert_addrs_6to4(const struct in6_addr *ip6_src,
    return (0);
 }
 
+/*
+ * The batch version of mapping_convert_addrs_4to6().  The addresses
+ * of count packets are given as arrays, and the result of each
+ * conversion (0 or -1) is stored in the results array.  No warning is
+ * printed for the missing entries.
+ *
+ * The lookups are done in stages: the hash indexes of all the packets
+ * are computed and their buckets are prefetched, then the hash and the
+ * mapping entries (see mapping_prefetch_buckets()), and finally the
+ * buckets are searched.  The cache misses of the packets in a batch
+ * are overlapped instead of being serialized.
+ */
+   void
+mapping_convert_addrs_4to6_batch(const struct in_addr *ip4_srcs,
+      const struct in_addr *ip4_dsts,
+      struct in6_addr *ip6_srcs,
+      struct in6_addr *ip6_dsts,
+      int *results,
+      int count)
+{
+   assert(ip4_srcs != NULL);
+   assert(ip4_dsts != NULL);
+   assert(ip6_srcs != NULL);
+   assert(ip6_dsts != NULL);
+   assert(results != NULL);
+
+   struct mapping_hash_listhead *heads[MAPPING_BATCH_CHUNK];
+   int base;
+   for (base = 0; base < count; base += MAPPING_BATCH_CHUNK) {
+      int chunk = count - base;
+      if (chunk > MAPPING_BATCH_CHUNK)
+         chunk = MAPPING_BATCH_CHUNK;
+
+      int index;
+      for (index = 0; index < chunk; index++) {
+         int hash_index = mapping_get_hash_index(&ip4_dsts[base + index],
+               sizeof(struct in_addr));
+         heads[index] = &mapping_hash_4to6_heads[hash_index];
+         __builtin_prefetch(heads[index]);
+      }
+      mapping_prefetch_buckets(heads, chunk);
+
+      for (index = 0; index < chunk; index++) {
+         const struct mapping *mappingp
+            = mapping_find_in_bucket4(heads[index], &ip4_dsts[base + index]);
+         if (mappingp == NULL) {
+            PROBE2(mapping_miss, AF_INET, &ip4_dsts[base + index]);
+            results[base + index] = -1;
+            continue;
+         }
+         memcpy((void *)&ip6_dsts[base + index],
+               (const void *)&mappingp->addr6, sizeof(struct in6_addr));
+         memcpy((void *)&ip6_srcs[base + index],
+               (const void *)&mapping_prefix, sizeof(struct in6_addr));
+         memcpy((void *)&ip6_srcs[base + index].s6_addr[12],
+               (const void *)&ip4_srcs[base + index], sizeof(struct in_addr));
+         results[base + index] = 0;
+      }
+   }
+}
+
+/*
+ * The batch version of mapping_convert_addrs_6to4().  See
+ * mapping_convert_addrs_4to6_batch().
+ */
+   void
+mapping_convert_addrs_6to4_batch(const struct in6_addr *ip6_srcs,
+      const struct in6_addr *ip6_dsts,
+      struct in_addr *ip4_srcs,
+      struct in_addr *ip4_dsts,
+      int *results,
+      int count)
+{
+   assert(ip6_srcs != NULL);
+   assert(ip6_dsts != NULL);
+   assert(ip4_srcs != NULL);
+   assert(ip4_dsts != NULL);
+   assert(results != NULL);
+
+   struct mapping_hash_listhead *heads[MAPPING_BATCH_CHUNK];
+   int base;
+   for (base = 0; base < count; base += MAPPING_BATCH_CHUNK) {
+      int chunk = count - base;
+      if (chunk > MAPPING_BATCH_CHUNK)
+         chunk = MAPPING_BATCH_CHUNK;
+
+      int index;
+      for (index = 0; index < chunk; index++) {
+         int hash_index = mapping_get_hash_index(&ip6_srcs[base + index],
+               sizeof(struct in6_addr));
+         heads[index] = &mapping_hash_6to4_heads[hash_index];
+         __builtin_prefetch(heads[index]);
+      }
+      mapping_prefetch_buckets(heads, chunk);
+
+      for (index = 0; index < chunk; index++) {
+         memcpy((void *)&ip4_dsts[base + index],
+               (const void *)&ip6_dsts[base + index].s6_addr[12],
+               sizeof(struct in_addr));
+         const struct mapping *mappingp
+            = mapping_find_in_bucket6(heads[index], &ip6_srcs[base + index]);
+         if (mappingp == NULL) {
+            PROBE2(mapping_miss, AF_INET6, &ip6_srcs[base + index]);
+            results[base + index] = -1;
+            continue;
+         }
+         memcpy((void *)&ip4_srcs[base + index],
+               (const void *)&mappingp->addr4, sizeof(struct in_addr));
+         results[base + index] = 0;
+      }
+   }
+}
+
 /*
  * Converts IPv6 addresses to corresponding IPv4 addresses, based on
  * the IPv6 address information (specified as the first 2 arguments)
@@ -467,8 +1161,15 @@ mapping66_convert_addrs_ItoG(const struct in6_addr *ip6_before_src,
 mapping_install_route(void)
 {
 
+   /*
+    * The backends of a pool share the IPv4 address, whose route is
+    * installed for the entry found by the address.
+    */
    struct mapping *mappingp;
    SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      if (mappingp->poolp != NULL
+            && mapping_find_mapping_with_ip4_addr(&mappingp->addr4) != mappingp)
+         continue;
       if (tun_add_route(AF_INET, &mappingp->addr4, 32) == -1) {
          warnx("IPv4 host %s route entry addition failed.",
                inet_ntoa(mappingp->addr4));
@@ -482,6 +1183,97 @@ mapping_install_route(void)
       return (-1);
    }
 
+   /*
+    * Steer the same destinations to the AF_XDP socket, if it is
+    * active.  The route entries above are still necessary for the
+    * packets which don't come through the XDP interface.
+    */
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      if (mappingp->poolp != NULL
+            && mapping_find_mapping_with_ip4_addr(&mappingp->addr4) != mappingp)
+         continue;
+      if (xsk_add_addr4(&mappingp->addr4) == -1) {
+         warnx("IPv4 host %s XDP steering entry addition failed.",
+               inet_ntoa(mappingp->addr4));
+      }
+   }
+   if (xsk_set_prefix6(&mapping_prefix) == -1) {
+      warnx("IPv6 pseudo mapping prefix XDP steering entry addition failed.");
+   }
+
+   /*
+    * The global IPv4 addresses of the port mappings.  An address may
+    * also have a map-static entry as the fallback.
+    */
+   struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_head, entries) {
+      if (!mapping_portp->route
+            || mapping_find_mapping_with_ip4_addr(&mapping_portp->addr4))
+         continue;
+      if (tun_add_route(AF_INET, &mapping_portp->addr4, 32) == -1) {
+         warnx("IPv4 host %s route entry addition failed.",
+               inet_ntoa(mapping_portp->addr4));
+      }
+      if (xsk_add_addr4(&mapping_portp->addr4) == -1) {
+         warnx("IPv4 host %s XDP steering entry addition failed.",
+               inet_ntoa(mapping_portp->addr4));
+      }
+   }
+
+   /*
+    * Same for the in-kernel fast path.  The fast path doesn't know
+    * the ports or the backend pools, so the addresses of the port
+    * mappings and the pools are left to the daemon.
+    */
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      if (mappingp->poolp != NULL || mapping_is_port_mapped(mappingp))
+         continue;
+      if (fastpath_add_mapping(&mappingp->addr4, &mappingp->addr6) == -1) {
+         warnx("IPv4 host %s fast path entry addition failed.",
+               inet_ntoa(mappingp->addr4));
+      }
+   }
+   if (fastpath_set_prefix(&mapping_prefix, mapping_flow_key) == -1) {
+      warnx("IPv6 pseudo mapping prefix fast path entry addition failed.");
+   }
+
+   /* And for the tun queue steering program. */
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      if (mappingp->poolp != NULL)
+         continue;
+      if (steer_add_mapping(&mappingp->addr4, &mappingp->addr6) == -1) {
+         warnx("IPv4 host %s queue steering entry addition failed.",
+               inet_ntoa(mappingp->addr4));
+      }
+   }
+
+   /* The IPv4 prefixes of the mapping rules. */
+   int rule_index;
+   for (rule_index = 0; rule_index < mapping_rule_count; rule_index++) {
+      const struct mapping_rule *rulep = &mapping_rules[rule_index];
+      struct in_addr prefix4;
+      prefix4.s_addr = htonl(rulep->prefix4);
+      if (tun_add_route(AF_INET, &prefix4, rulep->prefix4_len) == -1) {
+         warnx("IPv4 rule prefix %s/%d route entry addition failed.",
+               inet_ntoa(prefix4), rulep->prefix4_len);
+      }
+      uint32_t suffix;
+      for (suffix = 0; suffix <= ~rulep->mask4; suffix++) {
+         struct in_addr addr4;
+         addr4.s_addr = htonl(rulep->prefix4 | suffix);
+         if (xsk_add_addr4(&addr4) == -1) {
+            warnx("IPv4 host %s XDP steering entry addition failed.",
+                  inet_ntoa(addr4));
+            break;
+         }
+      }
+   }
+
+   /* The pool of the stateful NAT64. */
+   if (nat64_install_route() == -1) {
+      warnx("NAT64 pool route entry addition failed.");
+   }
+
    if(tun_create_policy_table() == -1){
    warnx("failed to create policy table");
    return(-1);
@@ -500,6 +1292,20 @@ mapping_install_route(void)
          warnx("IPv6 host %s policy route entry addition failed.",
          inet_ntop(AF_INET6, &mapping66p->intra, addr_name, 64));
       }
+
+      if (fastpath_add_mapping66(&mapping66p->global, &mapping66p->intra)
+            == -1) {
+         char addr_name[64];
+         warnx("IPv6 host %s fast path entry addition failed.",
+               inet_ntop(AF_INET6, &mapping66p->global, addr_name, 64));
+      }
+
+      if (steer_add_mapping66(&mapping66p->global, &mapping66p->intra)
+            == -1) {
+         char addr_name[64];
+         warnx("IPv6 host %s queue steering entry addition failed.",
+               inet_ntop(AF_INET6, &mapping66p->global, addr_name, 64));
+      }
    }
 
    return (0);
@@ -514,6 +1320,9 @@ mapping_uninstall_route(void)
 {
    struct mapping *mappingp;
    SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      if (mappingp->poolp != NULL
+            && mapping_find_mapping_with_ip4_addr(&mappingp->addr4) != mappingp)
+         continue;
       if (tun_delete_route(AF_INET, &mappingp->addr4, 32) == -1) {
          warnx("IPv4 host %s route entry deletion failed.",
                inet_ntoa(mappingp->addr4));
@@ -528,6 +1337,34 @@ mapping_uninstall_route(void)
    }
    
    tun_delete_policy();
+
+   struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_head, entries) {
+      if (!mapping_portp->route
+            || mapping_find_mapping_with_ip4_addr(&mapping_portp->addr4))
+         continue;
+      if (tun_delete_route(AF_INET, &mapping_portp->addr4, 32) == -1) {
+         warnx("IPv4 host %s route entry deletion failed.",
+               inet_ntoa(mapping_portp->addr4));
+      }
+   }
+
+   int rule_index;
+   for (rule_index = 0; rule_index < mapping_rule_count; rule_index++) {
+      const struct mapping_rule *rulep = &mapping_rules[rule_index];
+      struct in_addr prefix4;
+      prefix4.s_addr = htonl(rulep->prefix4);
+      if (tun_delete_route(AF_INET, &prefix4, rulep->prefix4_len) == -1) {
+         warnx("IPv4 rule prefix %s/%d route entry deletion failed.",
+               inet_ntoa(prefix4), rulep->prefix4_len);
+      }
+   }
+
+   nat64_uninstall_route();
+
+   xsk_clear_addrs();
+   fastpath_clear();
+   steer_clear();
    
    return (0);
 }
@@ -568,17 +1405,8 @@ mapping_find_mapping_with_ip4_addr(const struct in_addr *addrp)
 
    int hash_index = mapping_get_hash_index(addrp, sizeof(struct in_addr));
 
-   struct mapping_hash *mapping_hashp = NULL;
-   struct mapping *mappingp = NULL;
-   SLIST_FOREACH(mapping_hashp, &mapping_hash_4to6_heads[hash_index], entries) {
-      mappingp = mapping_hashp->mappingp;
-      if (memcmp((const void *)addrp, (const void *)&mappingp->addr4,
-               sizeof(struct in_addr)) == 0)
-         /* Found. */
-         return (mappingp);
-   }
-
-   return (NULL);
+   return (mapping_find_in_bucket4(&mapping_hash_4to6_heads[hash_index],
+            addrp));
 }
 
 /*
@@ -592,11 +1420,50 @@ mapping_find_mapping_with_ip6_addr(const struct in6_addr *addrp)
 
    int hash_index = mapping_get_hash_index(addrp, sizeof(struct in6_addr));
 
+   return (mapping_find_in_bucket6(&mapping_hash_6to4_heads[hash_index],
+            addrp));
+}
+
+/*
+ * Find the mapping{} instance which has the IPv4 address in the
+ * bucket of the 4to6 hash table.
+ */
+   static const struct mapping *
+mapping_find_in_bucket4(const struct mapping_hash_listhead *headp,
+      const struct in_addr *addrp)
+{
+   assert(headp != NULL);
+   assert(addrp != NULL);
+
    struct mapping_hash *mapping_hashp = NULL;
    struct mapping *mappingp = NULL;
-   SLIST_FOREACH(mapping_hashp, &mapping_hash_6to4_heads[hash_index], entries) {
+   SLIST_FOREACH(mapping_hashp, headp, entries) {
       mappingp = mapping_hashp->mappingp;
-      if (memcmp((const void *)addrp, (const void *)&mappingp->addr6,
+      if (memcmp((const void *)addrp, (const void *)&mappingp->addr4,
+               sizeof(struct in_addr)) == 0)
+         /* Found. */
+         return (mappingp);
+   }
+
+   return (NULL);
+}
+
+/*
+ * Find the mapping{} instance which has the IPv6 address in the
+ * bucket of the 6to4 hash table.
+ */
+   static const struct mapping *
+mapping_find_in_bucket6(const struct mapping_hash_listhead *headp,
+      const struct in6_addr *addrp)
+{
+   assert(headp != NULL);
+   assert(addrp != NULL);
+
+   struct mapping_hash *mapping_hashp = NULL;
+   struct mapping *mappingp = NULL;
+   SLIST_FOREACH(mapping_hashp, headp, entries) {
+      mappingp = mapping_hashp->mappingp;
+      if (memcmp((const void *)addrp, (const void *)&mappingp->addr6,
                sizeof(struct in6_addr)) == 0)
          /* Found. */
          return (mappingp);
@@ -605,6 +1472,31 @@ mapping_find_mapping_with_ip6_addr(const struct in6_addr *addrp)
    return (NULL);
 }
 
+/*
+ * Prefetch the first hash entry of each bucket, and then the mapping
+ * entry it points.  The bucket heads must have been prefetched.  Each
+ * stage touches the lines prefetched by the previous stage only after
+ * issuing the prefetches for all the buckets, so the cache misses of
+ * the different buckets are overlapped.
+ */
+   static void
+mapping_prefetch_buckets(struct mapping_hash_listhead **heads, int count)
+{
+   assert(heads != NULL);
+
+   int index;
+   for (index = 0; index < count; index++) {
+      struct mapping_hash *mapping_hashp = SLIST_FIRST(heads[index]);
+      if (mapping_hashp != NULL)
+         __builtin_prefetch(mapping_hashp);
+   }
+   for (index = 0; index < count; index++) {
+      struct mapping_hash *mapping_hashp = SLIST_FIRST(heads[index]);
+      if (mapping_hashp != NULL)
+         __builtin_prefetch(mapping_hashp->mappingp);
+   }
+}
+
 /*
  * Find the instance of the mapping{} structure which has the
  * specified IPv6 address in its mapping information.
@@ -771,19 +1663,71 @@ mapping66_insert_mapping(struct mapping66 *new_mappingp)
    return (0);
 }
 
-uint8_t dispatch(uint8_t *bufp){
+/*
+ * The direction of an IPv6 packet from an unmapped source: if it is
+ * destined to the mapping prefix, to a mapping rule covering the
+ * source or to the stateful NAT64, otherwise from the global side of
+ * the map66 entries.
+ */
+   static uint8_t
+dispatch_unmapped(const struct ip6_hdr *ip6_hdrp)
+{
+   if (memcmp(&ip6_hdrp->ip6_dst, &mapping_prefix, 8) == 0) {
+      if (mapping_rule_count > 0
+            && mapping_find_rule_with_ip6_addr(&ip6_hdrp->ip6_src))
+         return SIXTOFOUR_MAP;
+      if (nat64_is_active())
+         return SIXTOFOUR_NAT;
+   }
+   return SIXTOSIX_GtoI;
+}
+
+uint8_t dispatch(uint8_t *bufp, ssize_t read_len){
    assert(bufp != NULL);
    uint32_t af = 0;
    af = tun_get_af(bufp);
    bufp += sizeof(uint32_t);
+   /* The bytes read, which the lengths in the IP header may exceed. */
+   size_t data_len = read_len - sizeof(uint32_t);
+   PROBE3(receive, af, bufp, data_len);
 #ifdef DEBUG
          fprintf(stderr, "af = %d\n", af);
 #endif
    
    if(af == AF_INET){
+      struct ip *ip4_hdrp = (struct ip *)bufp;
+      if(mapping_port_count > 0
+            && mapping_find_port_of_packet(bufp, data_len, AF_INET))
+         return FOURTOSIX_PORT;
+      if(mapping_pool_count > 0) {
+         const struct mapping *mappingp
+            = mapping_find_mapping_with_ip4_addr(&ip4_hdrp->ip_dst);
+         if(mappingp && mappingp->poolp)
+            return FOURTOSIX_POOL;
+      }
+      if(mapping_rule_count > 0
+            && mapping_find_rule_with_ip4_addr(&ip4_hdrp->ip_dst))
+         return FOURTOSIX_MAP;
+      if(nat64_is_pool_addr(&ip4_hdrp->ip_dst))
+         return FOURTOSIX_NAT;
       return FOURTOSIX;
    }else if(af == AF_INET6){
       struct ip6_hdr *ip6_hdrp = (struct ip6_hdr *)bufp;
+      struct mapping_filter_counters *countersp
+         = mapping_filter_get_counters();
+
+      __atomic_store_n(&countersp->queries, countersp->queries + 1,
+            __ATOMIC_RELAXED);
+      if(!mapping_filter_may_contain(&ip6_hdrp->ip6_src)){
+         __atomic_store_n(&countersp->negatives, countersp->negatives + 1,
+               __ATOMIC_RELAXED);
+         return dispatch_unmapped(ip6_hdrp);
+      }
+
+      if(mapping_port_count > 0
+            && memcmp(&ip6_hdrp->ip6_dst, &mapping_prefix, 8) == 0
+            && mapping_find_port_of_packet(bufp, data_len, AF_INET6))
+         return SIXTOFOUR_PORT;
 
       const struct mapping66 *mapping66p 
          = mapping66_find_mapping_with_I_addr(&ip6_hdrp->ip6_src);
@@ -791,11 +1735,28 @@ uint8_t dispatch(uint8_t *bufp){
          = mapping_find_mapping_with_ip6_addr(&ip6_hdrp->ip6_src);
 
       if(!mapping66p && !mappingp){
-         return SIXTOSIX_GtoI;
+         /*
+          * A port mapped source whose port has no mapping is in the
+          * filter, so it is not a false positive.
+          */
+         if(mapping_port_count == 0
+               || !mapping_port_has_ip6_addr(&ip6_hdrp->ip6_src))
+            __atomic_store_n(&countersp->false_positives,
+                  countersp->false_positives + 1, __ATOMIC_RELAXED);
+         return dispatch_unmapped(ip6_hdrp);
       }else{
-         if(memcmp(&ip6_hdrp->ip6_dst, &mapping_prefix, 8) == 0)
+         if(memcmp(&ip6_hdrp->ip6_dst, &mapping_prefix, 8) == 0){
+            /* To another mapped server through its IPv4 address. */
+            const struct in_addr *ip4_dstp
+               = (const struct in_addr *)&ip6_hdrp->ip6_dst.s6_addr[12];
+            if(mappingp && mapping_hairpin_bit(ip4_dstp)){
+               const struct mapping *dst_mappingp
+                  = mapping_find_mapping_with_ip4_addr(ip4_dstp);
+               if(dst_mappingp && dst_mappingp->hairpin)
+                  return SIXTOSIX_HAIRPIN;
+            }
             return SIXTOFOUR;
-         else
+         }else
             return SIXTOSIX_ItoG;
       }
    }
@@ -803,3 +1764,1058 @@ uint8_t dispatch(uint8_t *bufp){
    return 0;
 
 }
+
+/*
+ * Hash an IPv6 address for the negative lookup filter.  The lower
+ * bits select the block and the upper bits select the bits in the
+ * block.
+ */
+   static uint64_t
+mapping_filter_hash(const struct in6_addr *addrp)
+{
+   assert(addrp != NULL);
+
+   uint64_t hi, lo;
+   memcpy(&hi, &addrp->s6_addr[0], sizeof(uint64_t));
+   memcpy(&lo, &addrp->s6_addr[8], sizeof(uint64_t));
+
+   uint64_t h = hi * 0x9e3779b97f4a7c15ULL ^ lo;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return (h);
+}
+
+/*
+ * Build the negative lookup filter from the mapping table.  The
+ * number of the blocks is rounded up to a power of 2 so that the
+ * block is selected by a mask.
+ */
+   static int
+mapping_filter_build(void)
+{
+   unsigned int entries = 0;
+   struct mapping *mappingp;
+   struct mapping66 *mapping66p;
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      entries++;
+   }
+   SLIST_FOREACH(mapping66p, &mapping66_head, entries) {
+      entries++;
+   }
+   entries += mapping_port_count;
+
+   uint64_t bits = (uint64_t)entries * MAPPING_FILTER_BITS_PER_ENTRY;
+   uint64_t blocks = 1;
+   while (blocks * MAPPING_FILTER_BLOCK_BITS < bits) {
+      blocks <<= 1;
+   }
+
+   free(mapping_filter_blocks);
+   mapping_filter_blocks = aligned_alloc(sizeof(struct mapping_filter_block),
+         blocks * sizeof(struct mapping_filter_block));
+   if (mapping_filter_blocks == NULL) {
+      warn("failed to allocate the negative lookup filter.");
+      return (-1);
+   }
+   memset(mapping_filter_blocks, 0,
+         blocks * sizeof(struct mapping_filter_block));
+   mapping_filter_mask = blocks - 1;
+   mapping_filter_entries = entries;
+
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      mapping_filter_add(&mappingp->addr6);
+   }
+   SLIST_FOREACH(mapping66p, &mapping66_head, entries) {
+      mapping_filter_add(&mapping66p->intra);
+   }
+   struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_head, entries) {
+      mapping_filter_add(&mapping_portp->addr6);
+   }
+
+   return (0);
+}
+
+   static void
+mapping_filter_add(const struct in6_addr *addrp)
+{
+   uint64_t h = mapping_filter_hash(addrp);
+   struct mapping_filter_block *blockp
+      = &mapping_filter_blocks[h & mapping_filter_mask];
+
+   h >>= 28;
+   int k;
+   for (k = 0; k < MAPPING_FILTER_K; k++) {
+      unsigned int bit = h % MAPPING_FILTER_BLOCK_BITS;
+      blockp->words[bit / 64] |= 1ULL << (bit % 64);
+      h >>= 9;
+   }
+}
+
+/*
+ * Returns 0 if the address is definitely not an internal IPv6
+ * address, otherwise 1.  Without the filter (the table is not built
+ * yet), every address may be contained.
+ */
+   static int
+mapping_filter_may_contain(const struct in6_addr *addrp)
+{
+   if (mapping_filter_blocks == NULL) {
+      return (1);
+   }
+
+   uint64_t h = mapping_filter_hash(addrp);
+   const struct mapping_filter_block *blockp
+      = &mapping_filter_blocks[h & mapping_filter_mask];
+
+   h >>= 28;
+   int k;
+   for (k = 0; k < MAPPING_FILTER_K; k++) {
+      unsigned int bit = h % MAPPING_FILTER_BLOCK_BITS;
+      if (!(blockp->words[bit / 64] & (1ULL << (bit % 64)))) {
+         return (0);
+      }
+      h >>= 9;
+   }
+   return (1);
+}
+
+   static struct mapping_filter_counters *
+mapping_filter_get_counters(void)
+{
+   if (mapping_filter_countersp != NULL) {
+      return (mapping_filter_countersp);
+   }
+
+   struct mapping_filter_counters *countersp;
+   countersp = aligned_alloc(sizeof(struct mapping_filter_counters),
+         sizeof(struct mapping_filter_counters));
+   if (countersp == NULL) {
+      err(EXIT_FAILURE, "failed to allocate the filter counters.");
+   }
+   memset(countersp, 0, sizeof(struct mapping_filter_counters));
+
+   pthread_mutex_lock(&mapping_filter_counters_lock);
+   SLIST_INSERT_HEAD(&mapping_filter_counters_head, countersp, entries);
+   pthread_mutex_unlock(&mapping_filter_counters_lock);
+   mapping_filter_countersp = countersp;
+   return (countersp);
+}
+
+/*
+ * Sum up the negative lookup filter counters of all the threads.  The
+ * counters are read without synchronization, so they may be slightly
+ * behind.
+ */
+   void
+mapping_get_filter_stats(struct mapping_filter_stats *statsp)
+{
+   assert(statsp != NULL);
+
+   memset(statsp, 0, sizeof(struct mapping_filter_stats));
+   statsp->entries = mapping_filter_entries;
+   statsp->size = (mapping_filter_blocks == NULL) ? 0
+      : ((size_t)mapping_filter_mask + 1) * sizeof(struct mapping_filter_block);
+
+   struct mapping_filter_counters *countersp;
+   pthread_mutex_lock(&mapping_filter_counters_lock);
+   SLIST_FOREACH(countersp, &mapping_filter_counters_head, entries) {
+      statsp->queries += __atomic_load_n(&countersp->queries,
+            __ATOMIC_RELAXED);
+      statsp->negatives += __atomic_load_n(&countersp->negatives,
+            __ATOMIC_RELAXED);
+      statsp->false_positives += __atomic_load_n(&countersp->false_positives,
+            __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&mapping_filter_counters_lock);
+}
+
+/*
+ * Mark the map-static entries whose IPv4 address is translated by the
+ * address alone: not a backend pool, and without port mappings.
+ */
+   static void
+mapping_hairpin_build(void)
+{
+   struct mapping *mappingp;
+   SLIST_FOREACH(mappingp, &mapping_head, entries) {
+      mappingp->hairpin = mappingp->poolp == NULL
+         && !mapping_is_port_mapped(mappingp);
+      if (mappingp->hairpin) {
+         uint32_t bit = (mappingp->addr4.s_addr * 0x9e3779b1U) >> 16;
+         mapping_hairpin_bits[bit / 64] |= 1ULL << (bit % 64);
+      }
+   }
+}
+
+   static int
+mapping_hairpin_bit(const struct in_addr *addrp)
+{
+   uint32_t bit = (addrp->s_addr * 0x9e3779b1U) >> 16;
+   return ((mapping_hairpin_bits[bit / 64] >> (bit % 64)) & 1);
+}
+
+/* Copy the mapping prefix.  The caller holds the read lock. */
+   void
+mapping_get_prefix(struct in6_addr *prefixp)
+{
+   assert(prefixp != NULL);
+
+   memcpy(prefixp, &mapping_prefix, sizeof(struct in6_addr));
+}
+
+/*
+ * Parse a prefix in the form of address/length.  The bits after the
+ * prefix length must be 0.
+ */
+   static int
+mapping_parse_prefix(int af, const char *prefix, void *addrp, int *lenp)
+{
+   assert(prefix != NULL);
+   assert(addrp != NULL);
+   assert(lenp != NULL);
+
+   char addr_str[INET6_ADDRSTRLEN];
+   const char *slashp = strchr(prefix, '/');
+   if (slashp == NULL || (size_t)(slashp - prefix) >= sizeof(addr_str)) {
+      return (-1);
+   }
+   memcpy(addr_str, prefix, slashp - prefix);
+   addr_str[slashp - prefix] = '\0';
+   if (inet_pton(af, addr_str, addrp) != 1) {
+      return (-1);
+   }
+
+   char *endp;
+   int len = strtol(slashp + 1, &endp, 10);
+   int max_len = (af == AF_INET) ? 32 : 128;
+   if (*(slashp + 1) == '\0' || *endp != '\0' || len < 0 || len > max_len) {
+      return (-1);
+   }
+
+   const uint8_t *bytes = (const uint8_t *)addrp;
+   int bit;
+   for (bit = len; bit < max_len; bit++) {
+      if (bytes[bit / 8] & (0x80 >> (bit % 8))) {
+         return (-1);
+      }
+   }
+   *lenp = len;
+
+   return (0);
+}
+
+/*
+ * Add a basic mapping rule: the IPv6 prefix, the IPv4 prefix, the
+ * length of the EA bits, and optionally the PSID offset (the number
+ * of the upper bits of a port excluded from the port sets, 6 by
+ * default to exclude the ports 0 to 1023).
+ */
+   static int
+mapping_add_rule(const char *prefix6_str, const char *prefix4_str,
+      const char *ea_len_str, const char *psid_offset_str)
+{
+   if (mapping_rule_count == MAPPING_MAX_RULES) {
+      warnx("too many mapping rules.");
+      return (-1);
+   }
+
+   struct in6_addr prefix6;
+   struct in_addr prefix4;
+   int prefix6_len, prefix4_len;
+   if (mapping_parse_prefix(AF_INET6, prefix6_str, &prefix6, &prefix6_len)
+         == -1) {
+      warnx("invalid rule IPv6 prefix %s.", prefix6_str);
+      return (-1);
+   }
+   if (mapping_parse_prefix(AF_INET, prefix4_str, &prefix4, &prefix4_len)
+         == -1) {
+      warnx("invalid rule IPv4 prefix %s.", prefix4_str);
+      return (-1);
+   }
+   int ea_len = atoi(ea_len_str);
+   int psid_offset = MAPPING_DEFAULT_PSID_OFFSET;
+   if (psid_offset_str != NULL) {
+      psid_offset = atoi(psid_offset_str);
+   }
+   int psid_len = ea_len - (32 - prefix4_len);
+
+   /*
+    * The EA bits must cover the IPv4 suffix, and the address must
+    * fit in the upper 64 bits.  The interface ID has the IPv4 address
+    * and the PSID.
+    */
+   if (prefix4_len < 16) {
+      warnx("the rule IPv4 prefix must be /16 or longer.");
+      return (-1);
+   }
+   if (prefix6_len < 1 || ea_len < 1 || prefix6_len + ea_len > 64) {
+      warnx("the rule IPv6 prefix and the EA bits must be 1 to 64 bits.");
+      return (-1);
+   }
+   if (psid_len < 0 || psid_offset < 0 || psid_offset + psid_len > 16) {
+      warnx("the EA bits must be the IPv4 suffix and a PSID of at most"
+            " %d bits.", 16 - psid_offset);
+      return (-1);
+   }
+
+   struct mapping_rule *rulep = &mapping_rules[mapping_rule_count];
+   uint64_t upper;
+   memcpy(&upper, &prefix6, sizeof(uint64_t));
+   rulep->prefix6 = be64toh(upper);
+   rulep->mask6 = ~0ULL << (64 - prefix6_len);
+   rulep->prefix6_len = prefix6_len;
+   rulep->prefix4 = ntohl(prefix4.s_addr);
+   rulep->mask4 = prefix4_len == 32 ? 0xffffffffU
+      : ~(0xffffffffU >> prefix4_len);
+   rulep->prefix4_len = prefix4_len;
+   rulep->ea_len = ea_len;
+   rulep->psid_offset = psid_offset;
+   rulep->psid_len = psid_len;
+   mapping_rule_count++;
+
+   return (0);
+}
+
+   static const struct mapping_rule *
+mapping_find_rule_with_ip4_addr(const struct in_addr *addrp)
+{
+   uint32_t addr = ntohl(addrp->s_addr);
+   int index;
+   for (index = 0; index < mapping_rule_count; index++) {
+      const struct mapping_rule *rulep = &mapping_rules[index];
+      if ((addr & rulep->mask4) == rulep->prefix4) {
+         return (rulep);
+      }
+   }
+   return (NULL);
+}
+
+   static const struct mapping_rule *
+mapping_find_rule_with_ip6_addr(const struct in6_addr *addrp)
+{
+   uint64_t upper;
+   memcpy(&upper, addrp, sizeof(uint64_t));
+   upper = be64toh(upper);
+   int index;
+   for (index = 0; index < mapping_rule_count; index++) {
+      const struct mapping_rule *rulep = &mapping_rules[index];
+      if ((upper & rulep->mask6) == rulep->prefix6) {
+         return (rulep);
+      }
+   }
+   return (NULL);
+}
+
+/*
+ * Returns the source (dir 0) or destination (dir 1) port of a TCP or
+ * UDP packet in host byte order, or -1 if the packet has no port.
+ * The l4p parameter points the transport header.
+ */
+   static int
+mapping_get_port(const uint8_t *l4p, size_t l4_len, uint8_t proto,
+      int dir)
+{
+   if (proto != IPPROTO_TCP && proto != IPPROTO_UDP) {
+      return (-1);
+   }
+   if (l4_len < 2 * sizeof(uint16_t)) {
+      return (-1);
+   }
+   return (ntohs(((const uint16_t *)l4p)[dir]));
+}
+
+/*
+ * Returns the port of a packet to (dir 1) or from (dir 0) a customer
+ * edge sharing its IPv4 address, which selects the PSID (RFC 7597
+ * section 8): the port of a TCP or UDP packet, or the identifier of
+ * an ICMP echo message.  The identifier is chosen by the customer
+ * edge, so only the requests from it and the replies to it have one.
+ * An ICMP error is selected by the original packet it carries, which
+ * was sent in the other direction.  Returns -1 if the packet has no
+ * port.
+ */
+   static int
+mapping_get_psid_port(const uint8_t *l4p, size_t l4_len, uint8_t proto,
+      int dir, int inner)
+{
+   if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+      return (mapping_get_port(l4p, l4_len, proto, dir));
+   }
+   if ((proto != IPPROTO_ICMP && proto != IPPROTO_ICMPV6)
+         || l4_len < ICMP_MINLEN) {
+      return (-1);
+   }
+
+   uint8_t type = l4p[0];
+   uint8_t echo_type;
+   if (proto == IPPROTO_ICMP) {
+      echo_type = dir == 0 ? ICMP_ECHO : ICMP_ECHOREPLY;
+   } else {
+      echo_type = dir == 0 ? ICMP6_ECHO_REQUEST : ICMP6_ECHO_REPLY;
+   }
+   if (type == echo_type) {
+      return (ntohs(((const uint16_t *)l4p)[2]));
+   }
+   if (inner) {
+      return (-1);
+   }
+
+   const uint8_t *originalp = l4p + ICMP_MINLEN;
+   size_t original_len = l4_len - ICMP_MINLEN;
+   if (proto == IPPROTO_ICMP) {
+      if (type != ICMP_UNREACH && type != ICMP_TIMXCEED
+            && type != ICMP_PARAMPROB) {
+         return (-1);
+      }
+      const struct ip *ip4_hdrp = (const struct ip *)originalp;
+      if (original_len < sizeof(struct ip)) {
+         return (-1);
+      }
+      size_t hlen = ip4_hdrp->ip_hl << 2;
+      if ((ntohs(ip4_hdrp->ip_off) & IP_OFFMASK) != 0
+            || original_len < hlen) {
+         return (-1);
+      }
+      return (mapping_get_psid_port(originalp + hlen, original_len - hlen,
+               ip4_hdrp->ip_p, !dir, 1));
+   } else {
+      if ((type & ICMP6_INFOMSG_MASK) != 0
+            || original_len < sizeof(struct ip6_hdr)) {
+         return (-1);
+      }
+      const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)originalp;
+      return (mapping_get_psid_port(originalp + sizeof(struct ip6_hdr),
+               original_len - sizeof(struct ip6_hdr), ip6_hdrp->ip6_nxt,
+               !dir, 1));
+   }
+}
+
+/*
+ * Convert the addresses of an IPv4 packet destined to a mapping rule.
+ * The PSID is taken from the destination port (see
+ * mapping_get_psid_port()), so a packet without a port (a fragment,
+ * or an ICMP message other than an echo reply or an error) is
+ * translated only if the rule doesn't share the addresses.  The
+ * packetp parameter points the IPv4 header.  Returns -1 if the packet
+ * must be dropped.
+ */
+   int
+mapping_rule_convert_4to6(const uint8_t *packetp, size_t data_len,
+      struct in6_addr *ip6_src, struct in6_addr *ip6_dst)
+{
+   assert(packetp != NULL);
+   assert(ip6_src != NULL);
+   assert(ip6_dst != NULL);
+
+   const struct ip *ip4_hdrp = (const struct ip *)packetp;
+   const struct mapping_rule *rulep
+      = mapping_find_rule_with_ip4_addr(&ip4_hdrp->ip_dst);
+   if (rulep == NULL) {
+      return (-1);
+   }
+
+   uint32_t addr4 = ntohl(ip4_hdrp->ip_dst.s_addr);
+   uint32_t psid = 0;
+   if (rulep->psid_len > 0) {
+      size_t hlen = ip4_hdrp->ip_hl << 2;
+      if ((ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) != 0
+            || data_len < hlen) {
+         return (-1);
+      }
+      int port = mapping_get_psid_port(packetp + hlen, data_len - hlen,
+            ip4_hdrp->ip_p, 1, 0);
+      if (port == -1) {
+         return (-1);
+      }
+      /* The ports with the upper offset bits all 0 are not shared. */
+      if (rulep->psid_offset > 0 && (port >> (16 - rulep->psid_offset)) == 0) {
+         return (-1);
+      }
+      psid = (port >> (16 - rulep->psid_offset - rulep->psid_len))
+         & ((1U << rulep->psid_len) - 1);
+   }
+
+   uint64_t ea = ((uint64_t)(addr4 & ~rulep->mask4) << rulep->psid_len)
+      | psid;
+   uint64_t upper = rulep->prefix6
+      | (ea << (64 - rulep->prefix6_len - rulep->ea_len));
+   uint64_t lower = ((uint64_t)addr4 << 16) | psid;
+   upper = htobe64(upper);
+   lower = htobe64(lower);
+   memcpy(&ip6_dst->s6_addr[0], &upper, sizeof(uint64_t));
+   memcpy(&ip6_dst->s6_addr[8], &lower, sizeof(uint64_t));
+
+   memcpy(ip6_src, &mapping_prefix, sizeof(struct in6_addr));
+   memcpy(&ip6_src->s6_addr[12], &ip4_hdrp->ip_src, sizeof(struct in_addr));
+
+   return (0);
+}
+
+/*
+ * Convert the addresses of an IPv6 packet from an address under a
+ * mapping rule.  The interface ID must have the IPv4 address and the
+ * PSID derived from the EA bits, and the source port of a TCP or UDP
+ * packet, or the identifier of an ICMPv6 echo request, must be in the
+ * port set of the PSID (see mapping_get_psid_port()).  The packetp
+ * parameter points the IPv6 header.  Returns -1 if the packet must be
+ * dropped.
+ */
+   int
+mapping_rule_convert_6to4(const uint8_t *packetp, size_t data_len,
+      struct in_addr *ip4_src, struct in_addr *ip4_dst)
+{
+   assert(packetp != NULL);
+   assert(ip4_src != NULL);
+   assert(ip4_dst != NULL);
+
+   const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+   const struct mapping_rule *rulep
+      = mapping_find_rule_with_ip6_addr(&ip6_hdrp->ip6_src);
+   if (rulep == NULL) {
+      return (-1);
+   }
+
+   uint64_t upper, lower;
+   memcpy(&upper, &ip6_hdrp->ip6_src.s6_addr[0], sizeof(uint64_t));
+   memcpy(&lower, &ip6_hdrp->ip6_src.s6_addr[8], sizeof(uint64_t));
+   upper = be64toh(upper);
+   lower = be64toh(lower);
+   uint64_t ea = (upper << rulep->prefix6_len) >> (64 - rulep->ea_len);
+   uint32_t psid = ea & ((1U << rulep->psid_len) - 1);
+   uint32_t addr4 = rulep->prefix4 | (uint32_t)(ea >> rulep->psid_len);
+   if (lower != (((uint64_t)addr4 << 16) | psid)) {
+      return (-1);
+   }
+
+   if (rulep->psid_len > 0 && data_len >= sizeof(struct ip6_hdr)) {
+      int port = mapping_get_psid_port(packetp + sizeof(struct ip6_hdr),
+            data_len - sizeof(struct ip6_hdr), ip6_hdrp->ip6_nxt, 0, 0);
+      if (port != -1
+            && ((rulep->psid_offset > 0
+                  && (port >> (16 - rulep->psid_offset)) == 0)
+               || ((port >> (16 - rulep->psid_offset - rulep->psid_len))
+                  & ((1U << rulep->psid_len) - 1)) != psid)) {
+         return (-1);
+      }
+   }
+
+   ip4_src->s_addr = htonl(addr4);
+   memcpy(ip4_dst, &ip6_hdrp->ip6_dst.s6_addr[12], sizeof(struct in_addr));
+
+   return (0);
+}
+
+/*
+ * Add a port mapping: the global IPv4 address, the protocol (tcp or
+ * udp), the port, and the internal IPv6 address.
+ */
+   static int
+mapping_add_port(const char *addr4_str, const char *proto_str,
+      const char *port_str, const char *addr6_str)
+{
+   struct mapping_port *mapping_portp;
+   mapping_portp = (struct mapping_port *)malloc(sizeof(struct mapping_port));
+   if (mapping_portp == NULL) {
+      warnx("memory allocation failed for struct mapping_port{}.");
+      return (-1);
+   }
+   memset(mapping_portp, 0, sizeof(struct mapping_port));
+
+   if (inet_pton(AF_INET, addr4_str, &mapping_portp->addr4) != 1) {
+      warnx("invalid address %s.", addr4_str);
+      free(mapping_portp);
+      return (-1);
+   }
+   if (strcmp(proto_str, "tcp") == 0) {
+      mapping_portp->proto = IPPROTO_TCP;
+   } else if (strcmp(proto_str, "udp") == 0) {
+      mapping_portp->proto = IPPROTO_UDP;
+   } else {
+      warnx("unsupported protocol %s.", proto_str);
+      free(mapping_portp);
+      return (-1);
+   }
+   int port = atoi(port_str);
+   if (port < 1 || port > 65535) {
+      warnx("invalid port %s.", port_str);
+      free(mapping_portp);
+      return (-1);
+   }
+   mapping_portp->port = htons(port);
+   if (inet_pton(AF_INET6, addr6_str, &mapping_portp->addr6) != 1) {
+      warnx("invalid address %s.", addr6_str);
+      free(mapping_portp);
+      return (-1);
+   }
+
+   /*
+    * The reverse direction is looked up with the source port of the
+    * server, so an internal address can serve a port only for one
+    * global address.
+    */
+   if (mapping_find_port_with_ip4(&mapping_portp->addr4,
+            mapping_portp->proto, mapping_portp->port)) {
+      warnx("duplicate entry for %s %s %d.", addr4_str, proto_str, port);
+      free(mapping_portp);
+      return (-1);
+   }
+   if (mapping_find_port_with_ip6(&mapping_portp->addr6,
+            mapping_portp->proto, mapping_portp->port)) {
+      warnx("duplicate entry for %s %s %d.", addr6_str, proto_str, port);
+      free(mapping_portp);
+      return (-1);
+   }
+
+   /* The first entry of an address installs its route. */
+   mapping_portp->route = 1;
+   const struct mapping_port *otherp;
+   SLIST_FOREACH(otherp, &mapping_port_head, entries) {
+      if (otherp->addr4.s_addr == mapping_portp->addr4.s_addr) {
+         mapping_portp->route = 0;
+         break;
+      }
+   }
+
+   struct mapping_port_key4 key4;
+   memset(&key4, 0, sizeof(key4));
+   key4.addr = mapping_portp->addr4;
+   key4.port = mapping_portp->port;
+   key4.proto = mapping_portp->proto;
+   SLIST_INSERT_HEAD(&mapping_port_hash_4to6_heads[
+         mapping_get_hash_index(&key4, sizeof(key4))], mapping_portp,
+         hash4_entries);
+
+   struct mapping_port_key6 key6;
+   memset(&key6, 0, sizeof(key6));
+   key6.addr = mapping_portp->addr6;
+   key6.port = mapping_portp->port;
+   key6.proto = mapping_portp->proto;
+   SLIST_INSERT_HEAD(&mapping_port_hash_6to4_heads[
+         mapping_get_hash_index(&key6, sizeof(key6))], mapping_portp,
+         hash6_entries);
+
+   SLIST_INSERT_HEAD(&mapping_port_head, mapping_portp, entries);
+   mapping_port_count++;
+
+   return (0);
+}
+
+/*
+ * Find the port mapping of the global IPv4 address, the protocol and
+ * the port (in network byte order).
+ */
+   static const struct mapping_port *
+mapping_find_port_with_ip4(const struct in_addr *addrp, uint8_t proto,
+      uint16_t port)
+{
+   assert(addrp != NULL);
+
+   struct mapping_port_key4 key;
+   memset(&key, 0, sizeof(key));
+   key.addr = *addrp;
+   key.port = port;
+   key.proto = proto;
+   int hash_index = mapping_get_hash_index(&key, sizeof(key));
+
+   const struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_hash_4to6_heads[hash_index],
+         hash4_entries) {
+      if (mapping_portp->addr4.s_addr == addrp->s_addr
+            && mapping_portp->port == port && mapping_portp->proto == proto) {
+         return (mapping_portp);
+      }
+   }
+   return (NULL);
+}
+
+/*
+ * Find the port mapping of the internal IPv6 address, the protocol
+ * and the port (in network byte order).
+ */
+   static const struct mapping_port *
+mapping_find_port_with_ip6(const struct in6_addr *addrp, uint8_t proto,
+      uint16_t port)
+{
+   assert(addrp != NULL);
+
+   struct mapping_port_key6 key;
+   memset(&key, 0, sizeof(key));
+   key.addr = *addrp;
+   key.port = port;
+   key.proto = proto;
+   int hash_index = mapping_get_hash_index(&key, sizeof(key));
+
+   const struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_hash_6to4_heads[hash_index],
+         hash6_entries) {
+      if (IN6_ARE_ADDR_EQUAL(&mapping_portp->addr6, addrp)
+            && mapping_portp->port == port && mapping_portp->proto == proto) {
+         return (mapping_portp);
+      }
+   }
+   return (NULL);
+}
+
+/*
+ * Find the port mapping of a packet: by the destination address and
+ * port of an IPv4 packet, or by the source address and port of an
+ * IPv6 packet.  IPv4 fragments and the packets with IPv6 extension
+ * headers have no port, and are left to the map-static entries.  The
+ * packetp parameter points the IP header, and data_len is the number
+ * of the bytes read.
+ */
+   static const struct mapping_port *
+mapping_find_port_of_packet(const uint8_t *packetp, size_t data_len, int af)
+{
+   assert(packetp != NULL);
+
+   if (af == AF_INET) {
+      const struct ip *ip4_hdrp = (const struct ip *)packetp;
+      if (data_len < sizeof(struct ip)) {
+         return (NULL);
+      }
+      size_t hlen = ip4_hdrp->ip_hl << 2;
+      if ((ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) != 0
+            || data_len < hlen) {
+         return (NULL);
+      }
+      int port = mapping_get_port(packetp + hlen, data_len - hlen,
+            ip4_hdrp->ip_p, 1);
+      if (port == -1) {
+         return (NULL);
+      }
+      return (mapping_find_port_with_ip4(&ip4_hdrp->ip_dst, ip4_hdrp->ip_p,
+               htons(port)));
+   } else {
+      const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+      if (data_len < sizeof(struct ip6_hdr)) {
+         return (NULL);
+      }
+      int port = mapping_get_port(packetp + sizeof(struct ip6_hdr),
+            data_len - sizeof(struct ip6_hdr), ip6_hdrp->ip6_nxt, 0);
+      if (port == -1) {
+         return (NULL);
+      }
+      return (mapping_find_port_with_ip6(&ip6_hdrp->ip6_src,
+               ip6_hdrp->ip6_nxt, htons(port)));
+   }
+}
+
+/*
+ * Returns 1 if any port mapping has the internal IPv6 address.  This
+ * walks the list, and is used only when no other mapping has the
+ * address.
+ */
+   static int
+mapping_port_has_ip6_addr(const struct in6_addr *addrp)
+{
+   const struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_head, entries) {
+      if (IN6_ARE_ADDR_EQUAL(&mapping_portp->addr6, addrp)) {
+         return (1);
+      }
+   }
+   return (0);
+}
+
+/* Returns 1 if either address of the map-static entry is port mapped. */
+   static int
+mapping_is_port_mapped(const struct mapping *mappingp)
+{
+   const struct mapping_port *mapping_portp;
+   SLIST_FOREACH(mapping_portp, &mapping_port_head, entries) {
+      if (mapping_portp->addr4.s_addr == mappingp->addr4.s_addr
+            || IN6_ARE_ADDR_EQUAL(&mapping_portp->addr6, &mappingp->addr6)) {
+         return (1);
+      }
+   }
+   return (0);
+}
+
+/*
+ * Convert the addresses of an IPv4 packet destined to a port mapping.
+ * The IPv6 destination is the internal address of the port mapping,
+ * and the source is made from the mapping prefix as usual.  The
+ * packetp parameter points the IPv4 header.  Returns -1 if the packet
+ * has no port mapping.
+ */
+   int
+mapping_port_convert_4to6(const uint8_t *packetp, size_t data_len,
+      struct in6_addr *ip6_src, struct in6_addr *ip6_dst)
+{
+   assert(packetp != NULL);
+   assert(ip6_src != NULL);
+   assert(ip6_dst != NULL);
+
+   const struct mapping_port *mapping_portp
+      = mapping_find_port_of_packet(packetp, data_len, AF_INET);
+   if (mapping_portp == NULL) {
+      return (-1);
+   }
+
+   const struct ip *ip4_hdrp = (const struct ip *)packetp;
+   memcpy(ip6_dst, &mapping_portp->addr6, sizeof(struct in6_addr));
+   memcpy(ip6_src, &mapping_prefix, sizeof(struct in6_addr));
+   memcpy(&ip6_src->s6_addr[12], &ip4_hdrp->ip_src, sizeof(struct in_addr));
+
+   return (0);
+}
+
+/*
+ * Convert the addresses of an IPv6 packet from a port mapping.  The
+ * IPv4 source is restored to the global address of the port mapping.
+ * The packetp parameter points the IPv6 header.  Returns -1 if the
+ * packet has no port mapping.
+ */
+   int
+mapping_port_convert_6to4(const uint8_t *packetp, size_t data_len,
+      struct in_addr *ip4_src, struct in_addr *ip4_dst)
+{
+   assert(packetp != NULL);
+   assert(ip4_src != NULL);
+   assert(ip4_dst != NULL);
+
+   const struct mapping_port *mapping_portp
+      = mapping_find_port_of_packet(packetp, data_len, AF_INET6);
+   if (mapping_portp == NULL) {
+      return (-1);
+   }
+
+   const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+   memcpy(ip4_src, &mapping_portp->addr4, sizeof(struct in_addr));
+   memcpy(ip4_dst, &ip6_hdrp->ip6_dst.s6_addr[12], sizeof(struct in_addr));
+
+   return (0);
+}
+
+/*
+ * Add a backend pool from a map-static line which has more than one
+ * IPv6 address.  The line is modified.
+ */
+   static int
+mapping_add_pool(char *line)
+{
+   assert(line != NULL);
+
+   char *savep;
+   strtok_r(line, " \t\n", &savep);
+   const char *addr4_str = strtok_r(NULL, " \t\n", &savep);
+   struct in_addr addr4;
+   if (addr4_str == NULL || inet_pton(AF_INET, addr4_str, &addr4) != 1) {
+      warnx("invalid address %s.", addr4_str ? addr4_str : "");
+      return (-1);
+   }
+   if (mapping_find_mapping_with_ip4_addr(&addr4)) {
+      warnx("duplicate entry for address %s.", addr4_str);
+      return (-1);
+   }
+
+   struct mapping_pool *poolp;
+   poolp = (struct mapping_pool *)malloc(sizeof(struct mapping_pool));
+   if (poolp == NULL) {
+      warnx("memory allocation failed for struct mapping_pool{}.");
+      return (-1);
+   }
+   memset(poolp, 0, sizeof(struct mapping_pool));
+   poolp->addr4 = addr4;
+   poolp->backends = (struct in6_addr *)malloc(sizeof(struct in6_addr)
+         * MAPPING_POOL_MAX_BACKENDS);
+   if (poolp->backends == NULL) {
+      warnx("memory allocation failed for the backends.");
+      free(poolp);
+      return (-1);
+   }
+
+   /* All the backends are checked before any of them is inserted. */
+   const char *addr6_str;
+   while ((addr6_str = strtok_r(NULL, " \t\n", &savep)) != NULL) {
+      if (*addr6_str == '#') {
+         break;
+      }
+      if (poolp->backend_count == MAPPING_POOL_MAX_BACKENDS) {
+         warnx("too many backends (max %d).", MAPPING_POOL_MAX_BACKENDS);
+         goto fail;
+      }
+      struct in6_addr *addr6p = &poolp->backends[poolp->backend_count];
+      if (inet_pton(AF_INET6, addr6_str, addr6p) != 1) {
+         warnx("invalid address %s.", addr6_str);
+         goto fail;
+      }
+      int index;
+      for (index = 0; index < poolp->backend_count; index++) {
+         if (IN6_ARE_ADDR_EQUAL(&poolp->backends[index], addr6p)) {
+            break;
+         }
+      }
+      if (index < poolp->backend_count
+            || mapping_find_mapping_with_ip6_addr(addr6p)) {
+         warnx("duplicate entry for address %s.", addr6_str);
+         goto fail;
+      }
+      poolp->backend_count++;
+   }
+
+   int index;
+   for (index = 0; index < poolp->backend_count; index++) {
+      struct mapping *mappingp;
+      mappingp = (struct mapping *)malloc(sizeof(struct mapping));
+      if (mappingp == NULL) {
+         err(EXIT_FAILURE, "inserting a mapping entry failed.");
+      }
+      mappingp->addr4 = addr4;
+      mappingp->addr6 = poolp->backends[index];
+      mappingp->poolp = poolp;
+      mappingp->hairpin = 0;
+      if (mapping_insert_mapping(mappingp) == -1) {
+         err(EXIT_FAILURE, "inserting a mapping entry failed.");
+      }
+   }
+
+   mapping_pool_populate(poolp);
+   SLIST_INSERT_HEAD(&mapping_pool_head, poolp, entries);
+   mapping_pool_count++;
+
+   return (0);
+
+ fail:
+   free(poolp->backends);
+   free(poolp);
+   return (-1);
+}
+
+/*
+ * FNV-1a with a seed, followed by a finalizer to mix the upper bits
+ * into the lower bits.
+ */
+   static uint64_t
+mapping_pool_hash(const void *data, size_t data_len, uint64_t seed)
+{
+   const uint8_t *bytes = (const uint8_t *)data;
+   uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+   while (data_len--) {
+      h ^= *bytes++;
+      h *= 0x100000001b3ULL;
+   }
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return (h);
+}
+
+/*
+ * Fill the Maglev lookup table.  Each backend has a permutation of
+ * the table entries made from an offset and a skip derived from its
+ * address, and takes the next free entry in its permutation in turn
+ * until the table is full.
+ */
+   static void
+mapping_pool_populate(struct mapping_pool *poolp)
+{
+   assert(poolp != NULL);
+
+   int count = poolp->backend_count;
+   if (count == 0) {
+      memset(poolp->lookup, 0, sizeof(poolp->lookup));
+      return;
+   }
+
+   uint32_t offsets[MAPPING_POOL_MAX_BACKENDS];
+   uint32_t skips[MAPPING_POOL_MAX_BACKENDS];
+   uint32_t nexts[MAPPING_POOL_MAX_BACKENDS];
+   int index;
+   for (index = 0; index < count; index++) {
+      const struct in6_addr *addr6p = &poolp->backends[index];
+      offsets[index] = mapping_pool_hash(addr6p, sizeof(struct in6_addr), 0)
+         % MAPPING_POOL_TABLE_SIZE;
+      skips[index] = mapping_pool_hash(addr6p, sizeof(struct in6_addr), 1)
+         % (MAPPING_POOL_TABLE_SIZE - 1) + 1;
+      nexts[index] = 0;
+   }
+
+   /* The filled entries, since every backend index is valid. */
+   uint8_t *filled = calloc(MAPPING_POOL_TABLE_SIZE, sizeof(uint8_t));
+   if (filled == NULL) {
+      err(EXIT_FAILURE, "memory allocation failed for the lookup table.");
+   }
+   int remaining = MAPPING_POOL_TABLE_SIZE;
+   while (remaining > 0) {
+      for (index = 0; index < count && remaining > 0; index++) {
+         uint32_t entry;
+         do {
+            entry = (offsets[index]
+                  + (uint64_t)nexts[index] * skips[index])
+               % MAPPING_POOL_TABLE_SIZE;
+            nexts[index]++;
+         } while (filled[entry]);
+         filled[entry] = 1;
+         poolp->lookup[entry] = index;
+         remaining--;
+      }
+   }
+   free(filled);
+}
+
+/*
+ * Convert the addresses of an IPv4 packet destined to a backend pool.
+ * The backend is selected by the hash of the source and destination
+ * addresses, the protocol, and the ports of a TCP packet.  The UDP
+ * packets are hashed without the ports, since the fragments of a
+ * datagram don't have them except the first one and all of them must
+ * go to the same backend.  The TCP segments are sent with the DF bit
+ * set and are not fragmented.  The packetp parameter points the IPv4
+ * header.
+ * Returns -1 if the destination has no pool.
+ */
+   int
+mapping_pool_convert_4to6(const uint8_t *packetp, size_t data_len,
+      struct in6_addr *ip6_src, struct in6_addr *ip6_dst)
+{
+   assert(packetp != NULL);
+   assert(ip6_src != NULL);
+   assert(ip6_dst != NULL);
+
+   const struct ip *ip4_hdrp = (const struct ip *)packetp;
+   const struct mapping *mappingp
+      = mapping_find_mapping_with_ip4_addr(&ip4_hdrp->ip_dst);
+   if (mappingp == NULL || mappingp->poolp == NULL
+         || mappingp->poolp->backend_count == 0) {
+      return (-1);
+   }
+   const struct mapping_pool *poolp = mappingp->poolp;
+
+   struct {
+      struct in_addr src;
+      struct in_addr dst;
+      uint16_t ports[2];
+      uint32_t proto;
+   } tuple;
+   memset(&tuple, 0, sizeof(tuple));
+   tuple.src = ip4_hdrp->ip_src;
+   tuple.dst = ip4_hdrp->ip_dst;
+   tuple.proto = ip4_hdrp->ip_p;
+   size_t hlen = ip4_hdrp->ip_hl << 2;
+   if (ip4_hdrp->ip_p == IPPROTO_TCP
+         && (ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) == 0
+         && data_len >= hlen) {
+      int port = mapping_get_port(packetp + hlen, data_len - hlen,
+            ip4_hdrp->ip_p, 0);
+      if (port != -1) {
+         tuple.ports[0] = port;
+         tuple.ports[1] = mapping_get_port(packetp + hlen, data_len - hlen,
+               ip4_hdrp->ip_p, 1);
+      }
+   }
+   uint32_t h = mapping_pool_hash(&tuple, sizeof(tuple), 0);
+   uint32_t entry = ((uint64_t)h * MAPPING_POOL_TABLE_SIZE) >> 32;
+
+   memcpy(ip6_dst, &poolp->backends[poolp->lookup[entry]],
+         sizeof(struct in6_addr));
+   memcpy(ip6_src, &mapping_prefix, sizeof(struct in6_addr));
+   memcpy(&ip6_src->s6_addr[12], &ip4_hdrp->ip_src, sizeof(struct in_addr));
+
+   return (0);
+}
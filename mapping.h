@@ -33,10 +33,45 @@ extern "C" {
 #define SIXTOSIX_GtoI 2
 #define SIXTOFOUR 3
 #define FOURTOSIX 4
+#define SIXTOFOUR_NAT 5
+#define FOURTOSIX_NAT 6
+#define SIXTOFOUR_MAP 7
+#define FOURTOSIX_MAP 8
+#define SIXTOFOUR_PORT 9
+#define FOURTOSIX_PORT 10
+#define FOURTOSIX_POOL 11
+#define SIXTOSIX_HAIRPIN 12
+
+/* The counters of the negative lookup filter used by dispatch(). */
+struct mapping_filter_stats {
+  unsigned int entries;		/* the internal IPv6 addresses */
+  size_t size;			/* the filter size in bytes */
+  uint64_t queries;		/* the IPv6 packets dispatched */
+  uint64_t negatives;		/* answered by the filter alone */
+  uint64_t false_positives;	/* passed the filter, but not mapped */
+};
+
+/*
+ * The multipliers of the hash which gives the IPv6 flow label of a
+ * packet translated from IPv4.  flow_label_4to6() in map646.cpp and
+ * the fast path program compute the same hash, so that a flow has the
+ * same label on both paths.
+ */
+#define MAPPING_FLOW_MUL1 0x9e3779b1U
+#define MAPPING_FLOW_MUL2 0x85ebca6bU
+#define MAPPING_FLOW_MUL3 0xc2b2ae35U
+#define MAPPING_FLOW_LABEL_MASK 0x000fffffU
+
+/* The key of the flow label hash, or 0 if the flow label is off. */
+extern uint32_t mapping_flow_key;
 
 int mapping_initialize(void);
 int mapping_create_table(const char *, int);
 void mapping_destroy_table(void);
+void mapping_read_lock(void);
+void mapping_read_unlock(void);
+void mapping_write_lock(void);
+void mapping_write_unlock(void);
 int mapping_convert_addrs_4to6(const struct in_addr *,
 			       const struct in_addr *,
 			       struct in6_addr *,
@@ -45,6 +80,28 @@ int mapping_convert_addrs_6to4(const struct in6_addr *,
 			       const struct in6_addr *,
 			       struct in_addr *,
 			       struct in_addr *);
+void mapping_convert_addrs_4to6_batch(const struct in_addr *,
+				      const struct in_addr *,
+				      struct in6_addr *,
+				      struct in6_addr *,
+				      int *,
+				      int);
+void mapping_convert_addrs_6to4_batch(const struct in6_addr *,
+				      const struct in6_addr *,
+				      struct in_addr *,
+				      struct in_addr *,
+				      int *,
+				      int);
+int mapping_rule_convert_4to6(const uint8_t *, size_t,
+			      struct in6_addr *, struct in6_addr *);
+int mapping_rule_convert_6to4(const uint8_t *, size_t,
+			      struct in_addr *, struct in_addr *);
+int mapping_port_convert_4to6(const uint8_t *, size_t,
+			      struct in6_addr *, struct in6_addr *);
+int mapping_port_convert_6to4(const uint8_t *, size_t,
+			      struct in_addr *, struct in_addr *);
+int mapping_pool_convert_4to6(const uint8_t *, size_t,
+			      struct in6_addr *, struct in6_addr *);
 int mapping66_convert_addrs_ItoG(const struct in6_addr *,
 			       const struct in6_addr *,
 			       struct in6_addr *,
@@ -54,7 +111,9 @@ int mapping66_convert_addrs_GtoI(const struct in6_addr *,
 			       struct in6_addr *,
 			       struct in6_addr *);
 int dispatch_6(const struct in6_addr *, const struct in6_addr *);
-uint8_t dispatch(uint8_t *);
+uint8_t dispatch(uint8_t *, ssize_t);
+void mapping_get_filter_stats(struct mapping_filter_stats *);
+void mapping_get_prefix(struct in6_addr *);
 int mapping_install_route(void);
 int mapping_uninstall_route(void);
 
@@ -0,0 +1,968 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "nat64.h"
+#include "tunif.h"
+#include "xskif.h"
+#include "affinity.h"
+
+/*
+ * The stateful NAT64 (NAPT64).  The IPv6 hosts which have no map-static
+ * entry share the addresses and the ports of the IPv4 pool.  A session
+ * is created by an outgoing TCP SYN or UDP packet, and is found by
+ * both the IPv6 5-tuple of the outgoing packets and the IPv4 5-tuple
+ * of the incoming packets.  The incoming packets from the other IPv4
+ * peers or ports are dropped.
+ *
+ * The sessions are stored in an array allocated at startup, so the
+ * memory is bounded by nat64_max_sessions.  Both keys of a session are
+ * stored in one open addressing hash table with linear probing, which
+ * has 4 slots for each session so that it is at most half full.  A
+ * slot has the hash value and the index of the session, and the lowest
+ * bit of the index tells which key of the session the slot is for.
+ *
+ * The sessions are expired by a timer wheel of one second ticks.  A
+ * session refreshed by a packet just gets a new expiry time, and is
+ * moved to the right slot of the wheel when its old slot comes.  It
+ * is moved immediately only when its timeout becomes shorter, such as
+ * when a TCP connection is closed.
+ */
+struct nat64_session {
+  struct in6_addr ip6_src;	/* the IPv6 host */
+  struct in6_addr ip6_dst;	/* the IPv4 peer in the mapping prefix */
+  struct in_addr ip4_src;	/* the pool address */
+  uint16_t port6;		/* the port of the IPv6 host */
+  uint16_t port4;		/* the port of the pool address */
+  uint16_t dport;		/* the port of the IPv4 peer */
+  uint8_t proto;
+  uint8_t state;		/* NAT64_TCP_* flags */
+  uint32_t expire;
+  uint32_t prev;		/* the wheel list, or the free list */
+  uint32_t next;
+  uint16_t slot;		/* the wheel slot */
+} __attribute__((aligned(64)));
+
+/* The TCP state flags of a session. */
+#define NAT64_TCP_SYN6 0x01
+#define NAT64_TCP_SYN4 0x02
+#define NAT64_TCP_FIN6 0x04
+#define NAT64_TCP_FIN4 0x08
+#define NAT64_TCP_RST 0x10
+
+struct nat64_slot {
+  uint32_t hash;
+  uint32_t ref;			/* (session index << 1) | key, 0 if empty */
+};
+#define NAT64_KEY6 0
+#define NAT64_KEY4 1
+
+/*
+ * A pool address.  The ports are handed out in order from a random
+ * start, and the released ports are queued in the ring and reused in
+ * the order of the release, so a port is not reused soon.
+ */
+struct nat64_pool_addr {
+  struct in_addr addr;
+  uint16_t *ring;
+  uint32_t head;
+  uint32_t count;
+  uint32_t fresh;		/* the ports never used */
+  uint32_t start;
+};
+
+#define NAT64_WHEEL_SIZE 4096
+
+int nat64_max_sessions = NAT64_DEFAULT_MAX_SESSIONS;
+
+static struct in_addr nat64_pool_base;
+static int nat64_pool_plen = -1;
+static uint32_t nat64_pool_mask;
+static unsigned int nat64_pool_size;
+static int nat64_min_port = NAT64_DEFAULT_MIN_PORT;
+static int nat64_max_port = NAT64_DEFAULT_MAX_PORT;
+static int nat64_udp_timeout = NAT64_DEFAULT_UDP_TIMEOUT;
+static int nat64_tcp_established_timeout
+  = NAT64_DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+static int nat64_tcp_transitory_timeout
+  = NAT64_DEFAULT_TCP_TRANSITORY_TIMEOUT;
+
+/* All the following are protected by nat64_lock. */
+static int nat64_active;
+static struct nat64_pool_addr *nat64_pool;
+static unsigned int nat64_ports;
+static struct nat64_session *nat64_sessions;	/* 1 origin */
+static uint32_t nat64_session_used;	/* never used above this */
+static uint32_t nat64_session_limit;	/* the size of nat64_sessions */
+static uint32_t nat64_free_list;
+static struct nat64_slot *nat64_slots;
+static uint32_t nat64_slot_mask;
+static uint32_t nat64_wheel[NAT64_WHEEL_SIZE];
+static uint32_t nat64_wheel_time;
+static uint64_t nat64_hash_seed;
+static struct nat64_stats nat64_counters;
+static pthread_mutex_t nat64_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t nat64_now(void);
+static uint32_t nat64_hash(const uint64_t *, int);
+static uint32_t nat64_hash6(const struct in6_addr *, const struct in6_addr *,
+			    uint16_t, uint16_t, uint8_t);
+static uint32_t nat64_hash4(const struct in_addr *, const struct in_addr *,
+			    uint16_t, uint16_t, uint8_t);
+static uint32_t nat64_find6(const struct in6_addr *, const struct in6_addr *,
+			    uint16_t, uint16_t, uint8_t);
+static uint32_t nat64_find4(const struct in_addr *, const struct in_addr *,
+			    uint16_t, uint16_t, uint8_t);
+static void nat64_slot_insert(uint32_t, uint32_t);
+static void nat64_slot_remove(uint32_t, uint32_t);
+static uint32_t nat64_create(const struct in6_addr *, const struct in6_addr *,
+			     uint16_t, uint16_t, uint8_t, uint32_t);
+static void nat64_destroy(uint32_t);
+static int nat64_port_alloc(struct nat64_pool_addr *);
+static void nat64_port_free(struct nat64_pool_addr *, uint16_t);
+static void nat64_wheel_link(uint32_t, uint32_t);
+static void nat64_wheel_unlink(uint32_t);
+static void nat64_refresh(uint32_t, uint32_t);
+static void nat64_expire(uint32_t);
+static void nat64_update_port(uint8_t *, uint8_t, int, uint16_t);
+static void nat64_count_unsupported(void);
+
+/*
+ * Set the IPv4 pool as a prefix (a.b.c.d/len).  The pool can be set
+ * only once, and is ignored when the configuration is reloaded.
+ */
+int
+nat64_set_pool(const char *prefix)
+{
+  assert(prefix != NULL);
+
+  char addr_str[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  int plen = 32;
+  const char *slashp = strchr(prefix, '/');
+  size_t addr_len = slashp ? (size_t)(slashp - prefix) : strlen(prefix);
+  if (addr_len >= sizeof(addr_str)) {
+    warnx("invalid pool %s.", prefix);
+    return (-1);
+  }
+  memcpy(addr_str, prefix, addr_len);
+  addr_str[addr_len] = '\0';
+  if (inet_pton(AF_INET, addr_str, &addr) != 1) {
+    warnx("invalid pool address %s.", addr_str);
+    return (-1);
+  }
+  if (slashp != NULL) {
+    char *endp;
+    plen = strtol(slashp + 1, &endp, 10);
+    if (*(slashp + 1) == '\0' || *endp != '\0' || plen < 0 || plen > 32) {
+      warnx("invalid pool prefix length %s.", slashp + 1);
+      return (-1);
+    }
+  }
+  uint32_t mask = plen == 0 ? 0 : 0xffffffffU << (32 - plen);
+  if ((uint64_t)(~mask) + 1 > NAT64_MAX_POOL_SIZE) {
+    warnx("the pool must have at most %d addresses.", NAT64_MAX_POOL_SIZE);
+    return (-1);
+  }
+  addr.s_addr = htonl(ntohl(addr.s_addr) & mask);
+
+  if (nat64_pool_plen != -1) {
+    if (nat64_pool_plen != plen
+	|| nat64_pool_base.s_addr != addr.s_addr) {
+      warnx("the pool is already set.");
+      return (-1);
+    }
+    /* The same pool (e.g. reloaded). */
+    return (0);
+  }
+  nat64_pool_base = addr;
+  nat64_pool_plen = plen;
+  nat64_pool_mask = mask;
+  nat64_pool_size = ~mask + 1;
+
+  return (0);
+}
+
+/* Set the range of the ports of the pool addresses. */
+int
+nat64_set_ports(int min_port, int max_port)
+{
+  if (min_port < 1 || max_port > 65535 || min_port > max_port) {
+    warnx("invalid port range %d-%d.", min_port, max_port);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&nat64_lock);
+  if (!nat64_active) {
+    nat64_min_port = min_port;
+    nat64_max_port = max_port;
+  }
+  pthread_mutex_unlock(&nat64_lock);
+
+  return (0);
+}
+
+/*
+ * Set the idle timeout in seconds of "udp", "tcp-established" or
+ * "tcp-transitory" sessions.  The new timeout applies from the next
+ * packet of each session.
+ */
+int
+nat64_set_timeout(const char *name, int timeout)
+{
+  assert(name != NULL);
+
+  if (timeout < 1 || timeout > NAT64_MAX_TIMEOUT) {
+    warnx("the timeout must be 1 to %d seconds.", NAT64_MAX_TIMEOUT);
+    return (-1);
+  }
+
+  int *timeoutp;
+  if (strcmp(name, "udp") == 0) {
+    timeoutp = &nat64_udp_timeout;
+  } else if (strcmp(name, "tcp-established") == 0) {
+    timeoutp = &nat64_tcp_established_timeout;
+  } else if (strcmp(name, "tcp-transitory") == 0) {
+    timeoutp = &nat64_tcp_transitory_timeout;
+  } else {
+    warnx("unknown timeout %s.", name);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&nat64_lock);
+  *timeoutp = timeout;
+  pthread_mutex_unlock(&nat64_lock);
+
+  return (0);
+}
+
+/*
+ * Allocate the session table and the port allocators.  Returns 0
+ * without doing anything if the pool is not configured.
+ */
+int
+nat64_start(void)
+{
+  if (nat64_pool_plen == -1) {
+    /* Not configured. */
+    return (0);
+  }
+  if (nat64_active) {
+    return (0);
+  }
+
+  nat64_ports = nat64_max_port - nat64_min_port + 1;
+  nat64_pool = calloc(nat64_pool_size, sizeof(struct nat64_pool_addr));
+  if (nat64_pool == NULL) {
+    warn("cannot allocate the pool.");
+    return (-1);
+  }
+
+  /*
+   * The port rings and the tables are mapped at once, but the pages
+   * are touched only when used.
+   */
+  uint16_t *rings = affinity_alloc((size_t)nat64_pool_size * nat64_ports
+				   * sizeof(uint16_t), -1);
+  if (rings == NULL) {
+    return (-1);
+  }
+  unsigned int index;
+  for (index = 0; index < nat64_pool_size; index++) {
+    struct nat64_pool_addr *pap = &nat64_pool[index];
+    pap->addr.s_addr = htonl(ntohl(nat64_pool_base.s_addr) + index);
+    pap->ring = rings + (size_t)index * nat64_ports;
+    /* The first ports given out can't be guessed across restarts. */
+    uint32_t start;
+    if (getrandom(&start, sizeof(start), 0) != sizeof(start)) {
+      warn("cannot get the start of the port range.");
+      return (-1);
+    }
+    pap->start = start % nat64_ports;
+  }
+
+  /*
+   * The tables are sized for the limit at startup.  A limit changed
+   * by reloading the configuration is not used.
+   */
+  nat64_session_limit = nat64_max_sessions;
+  nat64_sessions = affinity_alloc(((size_t)nat64_session_limit + 1)
+				  * sizeof(struct nat64_session), -1);
+  if (nat64_sessions == NULL) {
+    return (-1);
+  }
+  uint64_t slots = 1;
+  while (slots < (uint64_t)nat64_session_limit * 4) {
+    slots <<= 1;
+  }
+  nat64_slots = affinity_alloc(slots * sizeof(struct nat64_slot), -1);
+  if (nat64_slots == NULL) {
+    return (-1);
+  }
+  nat64_slot_mask = slots - 1;
+  /* A predictable seed would let a sender fill one chain of slots. */
+  if (getrandom(&nat64_hash_seed, sizeof(nat64_hash_seed), 0)
+      != sizeof(nat64_hash_seed)) {
+    warn("cannot get the session hash seed.");
+    return (-1);
+  }
+  nat64_wheel_time = nat64_now();
+  nat64_counters.pool_size = nat64_pool_size;
+  nat64_counters.ports = nat64_ports;
+  nat64_counters.max_sessions = nat64_session_limit;
+
+  pthread_mutex_lock(&nat64_lock);
+  nat64_active = 1;
+  pthread_mutex_unlock(&nat64_lock);
+
+  warnx("NAT64 pool: %s/%d ports %d-%d, up to %d sessions.",
+	inet_ntoa(nat64_pool_base), nat64_pool_plen, nat64_min_port,
+	nat64_max_port, nat64_session_limit);
+
+  return (0);
+}
+
+int
+nat64_is_active(void)
+{
+  return (nat64_active);
+}
+
+/* Returns 1 if the address is in the pool of the active NAT64. */
+int
+nat64_is_pool_addr(const struct in_addr *addrp)
+{
+  assert(addrp != NULL);
+
+  return (nat64_active
+	  && (ntohl(addrp->s_addr) & nat64_pool_mask)
+	  == ntohl(nat64_pool_base.s_addr));
+}
+
+/*
+ * Translate the ports of an IPv6 packet from a host which has no
+ * static mapping, and get the IPv4 addresses for the packet.  The
+ * packetp parameter points the IPv6 header.  The source port is
+ * rewritten in place, and the transport checksum is updated for the
+ * port.  The caller updates the checksum for the addresses, as for a
+ * statically mapped packet.  Returns -1 if the packet must be dropped.
+ */
+int
+nat64_translate_6to4(uint8_t *packetp, size_t data_len,
+		     struct in_addr *ip4_srcp, struct in_addr *ip4_dstp)
+{
+  assert(packetp != NULL);
+  assert(ip4_srcp != NULL);
+  assert(ip4_dstp != NULL);
+
+  const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+  uint8_t proto = ip6_hdrp->ip6_nxt;
+  size_t hdr_len;
+  if (proto == IPPROTO_TCP) {
+    hdr_len = sizeof(struct tcphdr);
+  } else if (proto == IPPROTO_UDP) {
+    hdr_len = sizeof(struct udphdr);
+  } else {
+    /* ICMPv6, extension headers and fragments are not supported. */
+    nat64_count_unsupported();
+    return (-1);
+  }
+  size_t plen = ntohs(ip6_hdrp->ip6_plen);
+  if (data_len < sizeof(struct ip6_hdr) + hdr_len
+      || plen + sizeof(struct ip6_hdr) > data_len || plen < hdr_len) {
+    return (-1);
+  }
+  uint8_t *l4p = packetp + sizeof(struct ip6_hdr);
+  uint16_t sport = ((const uint16_t *)l4p)[0];
+  uint16_t dport = ((const uint16_t *)l4p)[1];
+  uint8_t flags = 0;
+  if (proto == IPPROTO_TCP) {
+    flags = ((const struct tcphdr *)l4p)->th_flags;
+  }
+
+  uint32_t now = nat64_now();
+  pthread_mutex_lock(&nat64_lock);
+  nat64_expire(now);
+  uint32_t index = nat64_find6(&ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst,
+			       sport, dport, proto);
+  if (index == 0) {
+    /* Only a UDP packet or a TCP SYN opens a session. */
+    if (proto == IPPROTO_TCP && (flags & (TH_SYN | TH_ACK)) != TH_SYN) {
+      nat64_counters.no_session++;
+      pthread_mutex_unlock(&nat64_lock);
+      return (-1);
+    }
+    index = nat64_create(&ip6_hdrp->ip6_src, &ip6_hdrp->ip6_dst,
+			 sport, dport, proto, now);
+    if (index == 0) {
+      nat64_counters.exhausted++;
+      pthread_mutex_unlock(&nat64_lock);
+      return (-1);
+    }
+  }
+  struct nat64_session *sp = &nat64_sessions[index];
+  if (proto == IPPROTO_TCP) {
+    if ((flags & (TH_SYN | TH_ACK)) == TH_SYN
+	&& (sp->state & (NAT64_TCP_FIN6 | NAT64_TCP_FIN4 | NAT64_TCP_RST))) {
+      /* The host reopens the connection with the same ports. */
+      sp->state = 0;
+    }
+    if (flags & TH_SYN)
+      sp->state |= NAT64_TCP_SYN6;
+    if (flags & TH_FIN)
+      sp->state |= NAT64_TCP_FIN6;
+    if (flags & TH_RST)
+      sp->state |= NAT64_TCP_RST;
+  }
+  nat64_refresh(index, now);
+  *ip4_srcp = sp->ip4_src;
+  ip4_dstp->s_addr = sp->ip6_dst.s6_addr32[3];
+  uint16_t port4 = sp->port4;
+  pthread_mutex_unlock(&nat64_lock);
+
+  nat64_update_port(l4p, proto, 0, port4);
+
+  return (0);
+}
+
+/*
+ * Translate the ports of an IPv4 packet to the pool, and get the IPv6
+ * addresses for the packet from the session.  The packetp parameter
+ * points the IPv4 header.  The destination port is rewritten in place
+ * as nat64_translate_6to4() does.  Returns -1 if the packet must be
+ * dropped.
+ */
+int
+nat64_translate_4to6(uint8_t *packetp, size_t data_len,
+		     struct in6_addr *ip6_srcp, struct in6_addr *ip6_dstp)
+{
+  assert(packetp != NULL);
+  assert(ip6_srcp != NULL);
+  assert(ip6_dstp != NULL);
+
+  const struct ip *ip4_hdrp = (const struct ip *)packetp;
+  uint8_t proto = ip4_hdrp->ip_p;
+  size_t hdr_len;
+  if (proto == IPPROTO_TCP) {
+    hdr_len = sizeof(struct tcphdr);
+  } else if (proto == IPPROTO_UDP) {
+    hdr_len = sizeof(struct udphdr);
+  } else {
+    /* ICMP, IPv4 options and fragments are not supported. */
+    nat64_count_unsupported();
+    return (-1);
+  }
+  if (data_len < sizeof(struct ip) + hdr_len
+      || ip4_hdrp->ip_hl << 2 != sizeof(struct ip)
+      || (ntohs(ip4_hdrp->ip_off) & (IP_MF | IP_OFFMASK)) != 0) {
+    nat64_count_unsupported();
+    return (-1);
+  }
+  size_t tlen = ntohs(ip4_hdrp->ip_len);
+  if (tlen > data_len || tlen < sizeof(struct ip) + hdr_len) {
+    return (-1);
+  }
+  uint8_t *l4p = packetp + sizeof(struct ip);
+  uint16_t sport = ((const uint16_t *)l4p)[0];
+  uint16_t dport = ((const uint16_t *)l4p)[1];
+  uint8_t flags = 0;
+  if (proto == IPPROTO_TCP) {
+    flags = ((const struct tcphdr *)l4p)->th_flags;
+  }
+
+  uint32_t now = nat64_now();
+  pthread_mutex_lock(&nat64_lock);
+  nat64_expire(now);
+  uint32_t index = nat64_find4(&ip4_hdrp->ip_src, &ip4_hdrp->ip_dst,
+			       sport, dport, proto);
+  if (index == 0) {
+    nat64_counters.no_session++;
+    pthread_mutex_unlock(&nat64_lock);
+    return (-1);
+  }
+  struct nat64_session *sp = &nat64_sessions[index];
+  if (proto == IPPROTO_TCP) {
+    if (flags & TH_SYN)
+      sp->state |= NAT64_TCP_SYN4;
+    if (flags & TH_FIN)
+      sp->state |= NAT64_TCP_FIN4;
+    if (flags & TH_RST)
+      sp->state |= NAT64_TCP_RST;
+  }
+  nat64_refresh(index, now);
+  *ip6_srcp = sp->ip6_dst;
+  *ip6_dstp = sp->ip6_src;
+  uint16_t port6 = sp->port6;
+  pthread_mutex_unlock(&nat64_lock);
+
+  nat64_update_port(l4p, proto, 1, port6);
+
+  return (0);
+}
+
+/*
+ * Route the pool to the tun interface, and steer it to the AF_XDP
+ * socket if it is active.
+ */
+int
+nat64_install_route(void)
+{
+  if (!nat64_active)
+    return (0);
+
+  if (tun_add_route(AF_INET, &nat64_pool_base, nat64_pool_plen) == -1) {
+    warnx("NAT64 pool %s/%d route entry addition failed.",
+	  inet_ntoa(nat64_pool_base), nat64_pool_plen);
+    return (-1);
+  }
+
+  unsigned int index;
+  for (index = 0; index < nat64_pool_size; index++) {
+    if (xsk_add_addr4(&nat64_pool[index].addr) == -1) {
+      warnx("NAT64 pool address %s XDP steering entry addition failed.",
+	    inet_ntoa(nat64_pool[index].addr));
+    }
+  }
+
+  return (0);
+}
+
+/*
+ * Delete the route installed by nat64_install_route().  The XDP
+ * steering entries are cleared together with the others.
+ */
+int
+nat64_uninstall_route(void)
+{
+  if (!nat64_active)
+    return (0);
+
+  if (tun_delete_route(AF_INET, &nat64_pool_base, nat64_pool_plen) == -1) {
+    warnx("NAT64 pool %s/%d route entry deletion failed.",
+	  inet_ntoa(nat64_pool_base), nat64_pool_plen);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Read the counters.  The expired sessions are destroyed first, since
+ * the wheel is otherwise advanced only by the packets.
+ */
+void
+nat64_get_stats(struct nat64_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  uint32_t now = nat64_now();
+  pthread_mutex_lock(&nat64_lock);
+  if (nat64_active)
+    nat64_expire(now);
+  memcpy(statsp, &nat64_counters, sizeof(struct nat64_stats));
+  pthread_mutex_unlock(&nat64_lock);
+}
+
+/* The coarse clock is enough for the timeouts in seconds. */
+static uint32_t
+nat64_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ((uint32_t)ts.tv_sec);
+}
+
+static uint32_t
+nat64_hash(const uint64_t *words, int count)
+{
+  uint64_t h = nat64_hash_seed;
+  while (count--) {
+    h = (h ^ *words++) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+  return ((uint32_t)h);
+}
+
+/* The hash of the IPv6 5-tuple of an outgoing packet. */
+static uint32_t
+nat64_hash6(const struct in6_addr *srcp, const struct in6_addr *dstp,
+	    uint16_t sport, uint16_t dport, uint8_t proto)
+{
+  uint64_t words[5];
+  memcpy(&words[0], srcp, sizeof(struct in6_addr));
+  memcpy(&words[2], dstp, sizeof(struct in6_addr));
+  words[4] = ((uint64_t)sport << 32) | ((uint64_t)dport << 16) | proto;
+  return (nat64_hash(words, 5));
+}
+
+/* The hash of the IPv4 5-tuple of an incoming packet. */
+static uint32_t
+nat64_hash4(const struct in_addr *srcp, const struct in_addr *dstp,
+	    uint16_t sport, uint16_t dport, uint8_t proto)
+{
+  uint64_t words[2];
+  words[0] = ((uint64_t)srcp->s_addr << 32) | dstp->s_addr;
+  words[1] = ((uint64_t)sport << 32) | ((uint64_t)dport << 16) | proto
+    | (1ULL << 63);
+  return (nat64_hash(words, 2));
+}
+
+/* Returns the index of the session, or 0 if not found. */
+static uint32_t
+nat64_find6(const struct in6_addr *srcp, const struct in6_addr *dstp,
+	    uint16_t sport, uint16_t dport, uint8_t proto)
+{
+  uint32_t hash = nat64_hash6(srcp, dstp, sport, dport, proto);
+  uint32_t pos = hash & nat64_slot_mask;
+  while (nat64_slots[pos].ref != 0) {
+    const struct nat64_slot *slotp = &nat64_slots[pos];
+    if (slotp->hash == hash && (slotp->ref & 1) == NAT64_KEY6) {
+      const struct nat64_session *sp = &nat64_sessions[slotp->ref >> 1];
+      if (sp->port6 == sport && sp->dport == dport && sp->proto == proto
+	  && IN6_ARE_ADDR_EQUAL(&sp->ip6_src, srcp)
+	  && IN6_ARE_ADDR_EQUAL(&sp->ip6_dst, dstp))
+	return (slotp->ref >> 1);
+    }
+    pos = (pos + 1) & nat64_slot_mask;
+  }
+  return (0);
+}
+
+/*
+ * The IPv4 peer is srcp and sport, and the pool address is dstp and
+ * dport.
+ */
+static uint32_t
+nat64_find4(const struct in_addr *srcp, const struct in_addr *dstp,
+	    uint16_t sport, uint16_t dport, uint8_t proto)
+{
+  uint32_t hash = nat64_hash4(srcp, dstp, sport, dport, proto);
+  uint32_t pos = hash & nat64_slot_mask;
+  while (nat64_slots[pos].ref != 0) {
+    const struct nat64_slot *slotp = &nat64_slots[pos];
+    if (slotp->hash == hash && (slotp->ref & 1) == NAT64_KEY4) {
+      const struct nat64_session *sp = &nat64_sessions[slotp->ref >> 1];
+      if (sp->port4 == dport && sp->dport == sport && sp->proto == proto
+	  && sp->ip4_src.s_addr == dstp->s_addr
+	  && sp->ip6_dst.s6_addr32[3] == srcp->s_addr)
+	return (slotp->ref >> 1);
+    }
+    pos = (pos + 1) & nat64_slot_mask;
+  }
+  return (0);
+}
+
+static void
+nat64_slot_insert(uint32_t hash, uint32_t ref)
+{
+  uint32_t pos = hash & nat64_slot_mask;
+  while (nat64_slots[pos].ref != 0) {
+    pos = (pos + 1) & nat64_slot_mask;
+  }
+  nat64_slots[pos].hash = hash;
+  nat64_slots[pos].ref = ref;
+}
+
+/*
+ * Remove the slot, and shift the following slots of the same probe
+ * sequence back so that no tombstone is left.
+ */
+static void
+nat64_slot_remove(uint32_t hash, uint32_t ref)
+{
+  uint32_t pos = hash & nat64_slot_mask;
+  while (nat64_slots[pos].ref != ref) {
+    assert(nat64_slots[pos].ref != 0);
+    pos = (pos + 1) & nat64_slot_mask;
+  }
+
+  uint32_t next = (pos + 1) & nat64_slot_mask;
+  while (nat64_slots[next].ref != 0) {
+    uint32_t home = nat64_slots[next].hash & nat64_slot_mask;
+    if (((next - home) & nat64_slot_mask) >= ((next - pos) & nat64_slot_mask)) {
+      nat64_slots[pos] = nat64_slots[next];
+      pos = next;
+    }
+    next = (next + 1) & nat64_slot_mask;
+  }
+  nat64_slots[pos].ref = 0;
+}
+
+/*
+ * Create a session.  The pool address is chosen by the IPv6 source
+ * address, so that a host uses the same IPv4 address as long as the
+ * address has free ports.  Returns 0 if no session or port is left.
+ */
+static uint32_t
+nat64_create(const struct in6_addr *srcp, const struct in6_addr *dstp,
+	     uint16_t sport, uint16_t dport, uint8_t proto, uint32_t now)
+{
+  uint32_t index;
+  if (nat64_free_list != 0) {
+    index = nat64_free_list;
+  } else if (nat64_session_used < nat64_session_limit) {
+    index = nat64_session_used + 1;
+  } else {
+    return (0);
+  }
+
+  uint64_t words[2];
+  memcpy(words, srcp, sizeof(struct in6_addr));
+  unsigned int first = nat64_hash(words, 2) % nat64_pool_size;
+  unsigned int count;
+  struct nat64_pool_addr *pap = NULL;
+  int port = -1;
+  for (count = 0; count < nat64_pool_size; count++) {
+    pap = &nat64_pool[(first + count) % nat64_pool_size];
+    if ((port = nat64_port_alloc(pap)) != -1)
+      break;
+  }
+  if (port == -1) {
+    return (0);
+  }
+
+  if (index == nat64_free_list) {
+    nat64_free_list = nat64_sessions[index].next;
+  } else {
+    nat64_session_used++;
+  }
+
+  struct nat64_session *sp = &nat64_sessions[index];
+  memset(sp, 0, sizeof(struct nat64_session));
+  sp->ip6_src = *srcp;
+  sp->ip6_dst = *dstp;
+  sp->ip4_src = pap->addr;
+  sp->port6 = sport;
+  sp->port4 = htons(port);
+  sp->dport = dport;
+  sp->proto = proto;
+
+  nat64_slot_insert(nat64_hash6(srcp, dstp, sport, dport, proto),
+		    index << 1 | NAT64_KEY6);
+  struct in_addr peer;
+  peer.s_addr = dstp->s6_addr32[3];
+  nat64_slot_insert(nat64_hash4(&peer, &pap->addr, dport, sp->port4, proto),
+		    index << 1 | NAT64_KEY4);
+
+  nat64_counters.sessions++;
+  nat64_counters.created++;
+
+  return (index);
+}
+
+static void
+nat64_destroy(uint32_t index)
+{
+  struct nat64_session *sp = &nat64_sessions[index];
+
+  nat64_slot_remove(nat64_hash6(&sp->ip6_src, &sp->ip6_dst, sp->port6,
+				sp->dport, sp->proto),
+		    index << 1 | NAT64_KEY6);
+  struct in_addr peer;
+  peer.s_addr = sp->ip6_dst.s6_addr32[3];
+  nat64_slot_remove(nat64_hash4(&peer, &sp->ip4_src, sp->dport, sp->port4,
+				sp->proto),
+		    index << 1 | NAT64_KEY4);
+
+  unsigned int pool_index = ntohl(sp->ip4_src.s_addr)
+    - ntohl(nat64_pool_base.s_addr);
+  nat64_port_free(&nat64_pool[pool_index], ntohs(sp->port4));
+
+  sp->next = nat64_free_list;
+  nat64_free_list = index;
+
+  nat64_counters.sessions--;
+  nat64_counters.expired++;
+}
+
+/* Returns a port in host byte order, or -1 if all are in use. */
+static int
+nat64_port_alloc(struct nat64_pool_addr *pap)
+{
+  if (pap->fresh < nat64_ports) {
+    return (nat64_min_port + (pap->start + pap->fresh++) % nat64_ports);
+  }
+  if (pap->count == 0) {
+    return (-1);
+  }
+  uint16_t port = pap->ring[pap->head];
+  pap->head = (pap->head + 1) % nat64_ports;
+  pap->count--;
+  return (port);
+}
+
+static void
+nat64_port_free(struct nat64_pool_addr *pap, uint16_t port)
+{
+  assert(pap->count < nat64_ports);
+
+  pap->ring[(pap->head + pap->count) % nat64_ports] = port;
+  pap->count++;
+}
+
+static void
+nat64_wheel_link(uint32_t index, uint32_t expire)
+{
+  struct nat64_session *sp = &nat64_sessions[index];
+  uint16_t slot = expire % NAT64_WHEEL_SIZE;
+
+  sp->slot = slot;
+  sp->prev = 0;
+  sp->next = nat64_wheel[slot];
+  if (sp->next != 0)
+    nat64_sessions[sp->next].prev = index;
+  nat64_wheel[slot] = index;
+}
+
+static void
+nat64_wheel_unlink(uint32_t index)
+{
+  struct nat64_session *sp = &nat64_sessions[index];
+
+  if (sp->prev != 0)
+    nat64_sessions[sp->prev].next = sp->next;
+  else
+    nat64_wheel[sp->slot] = sp->next;
+  if (sp->next != 0)
+    nat64_sessions[sp->next].prev = sp->prev;
+}
+
+/*
+ * Extend the expiry time of the session by the timeout of its state.
+ * The session stays in its wheel slot unless the time gets earlier.
+ * A new session (its expiry time is 0) is linked to the wheel here.
+ */
+static void
+nat64_refresh(uint32_t index, uint32_t now)
+{
+  struct nat64_session *sp = &nat64_sessions[index];
+  int timeout;
+  if (sp->proto == IPPROTO_UDP) {
+    timeout = nat64_udp_timeout;
+  } else if ((sp->state & (NAT64_TCP_SYN6 | NAT64_TCP_SYN4))
+	     == (NAT64_TCP_SYN6 | NAT64_TCP_SYN4)
+	     && !(sp->state & NAT64_TCP_RST)
+	     && (sp->state & (NAT64_TCP_FIN6 | NAT64_TCP_FIN4))
+	     != (NAT64_TCP_FIN6 | NAT64_TCP_FIN4)) {
+    timeout = nat64_tcp_established_timeout;
+  } else {
+    timeout = nat64_tcp_transitory_timeout;
+  }
+
+  uint32_t expire = now + timeout;
+  if (sp->expire == 0) {
+    nat64_wheel_link(index, expire);
+  } else if (expire < sp->expire) {
+    nat64_wheel_unlink(index);
+    nat64_wheel_link(index, expire);
+  }
+  sp->expire = expire;
+}
+
+/*
+ * Advance the wheel to now, destroying the expired sessions and
+ * moving the refreshed ones to the slots of their expiry times.
+ */
+static void
+nat64_expire(uint32_t now)
+{
+  if (now == nat64_wheel_time)
+    return;
+
+  uint32_t ticks = now - nat64_wheel_time;
+  if (ticks > NAT64_WHEEL_SIZE)
+    ticks = NAT64_WHEEL_SIZE;
+  while (ticks--) {
+    uint16_t slot = ++nat64_wheel_time % NAT64_WHEEL_SIZE;
+    uint32_t index = nat64_wheel[slot];
+    nat64_wheel[slot] = 0;
+    while (index != 0) {
+      struct nat64_session *sp = &nat64_sessions[index];
+      uint32_t next = sp->next;
+      if ((int32_t)(sp->expire - now) <= 0) {
+	nat64_destroy(index);
+      } else {
+	nat64_wheel_link(index, sp->expire);
+      }
+      index = next;
+    }
+  }
+  nat64_wheel_time = now;
+}
+
+/*
+ * Rewrite the source (dir 0) or destination (dir 1) port, and update
+ * the transport checksum for the change.  An IPv4 UDP packet without
+ * checksum is left without checksum.
+ */
+static void
+nat64_update_port(uint8_t *l4p, uint8_t proto, int dir, uint16_t port)
+{
+  uint16_t *portp = (uint16_t *)l4p + dir;
+  uint16_t *cksump;
+  if (proto == IPPROTO_TCP) {
+    cksump = &((struct tcphdr *)l4p)->th_sum;
+  } else {
+    cksump = &((struct udphdr *)l4p)->uh_sum;
+    if (*cksump == 0) {
+      *portp = port;
+      return;
+    }
+  }
+
+  int32_t sum = ~*cksump & 0xffff;
+  sum += (~*portp & 0xffff) + port;
+  while (sum >> 16) {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+  *cksump = ~sum & 0xffff;
+  *portp = port;
+}
+
+static void
+nat64_count_unsupported(void)
+{
+  pthread_mutex_lock(&nat64_lock);
+  nat64_counters.unsupported++;
+  pthread_mutex_unlock(&nat64_lock);
+}
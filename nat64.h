@@ -0,0 +1,74 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __NAT64_H__
+#define __NAT64_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NAT64_MAX_POOL_SIZE 1024
+#define NAT64_DEFAULT_MIN_PORT 1024
+#define NAT64_DEFAULT_MAX_PORT 65535
+#define NAT64_DEFAULT_MAX_SESSIONS 1048576
+#define NAT64_MAX_SESSIONS 16777216
+#define NAT64_DEFAULT_UDP_TIMEOUT 300
+#define NAT64_DEFAULT_TCP_ESTABLISHED_TIMEOUT 7440
+#define NAT64_DEFAULT_TCP_TRANSITORY_TIMEOUT 240
+#define NAT64_MAX_TIMEOUT 86400
+
+extern int nat64_max_sessions;
+
+struct nat64_stats {
+  unsigned int pool_size;	/* the IPv4 addresses in the pool */
+  unsigned int ports;		/* the ports of each address */
+  uint64_t sessions;		/* the active sessions */
+  uint64_t max_sessions;
+  uint64_t created;
+  uint64_t expired;
+  uint64_t no_session;		/* dropped, no session for the packet */
+  uint64_t exhausted;		/* dropped, no port or session left */
+  uint64_t unsupported;		/* dropped, not a TCP or UDP packet */
+};
+
+int nat64_set_pool(const char *);
+int nat64_set_ports(int, int);
+int nat64_set_timeout(const char *, int);
+int nat64_start(void);
+int nat64_is_active(void);
+int nat64_is_pool_addr(const struct in_addr *);
+int nat64_translate_6to4(uint8_t *, size_t, struct in_addr *,
+			 struct in_addr *);
+int nat64_translate_4to6(uint8_t *, size_t, struct in6_addr *,
+			 struct in6_addr *);
+int nat64_install_route(void);
+int nat64_uninstall_route(void);
+void nat64_get_stats(struct nat64_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+/*
+ * The hardware performance counters of the forwarding threads.  Each
+ * thread opens its own counters with perf_event_open(2) when it
+ * starts, and counts the packets it translates.  The counters keep
+ * counting in the kernel without any cost on the packet path, and are
+ * read by the stat command and divided by the packets.
+ *
+ * The kernel part, the reads and the writes of the tun interface, is
+ * counted if perf_event_paranoid allows it.  Otherwise only the user
+ * part is counted.  A counter the CPU or the hypervisor doesn't
+ * provide is left closed, and the task clock, which is a software
+ * counter, is available wherever perf_event_open(2) is.
+ */
+struct perfctr_thread {
+  SLIST_ENTRY(perfctr_thread) entries;
+  char name[PERFCTR_NAME_LEN];
+  uint64_t packets;
+  unsigned int events;
+  int fds[PERFCTR_EVENTS];
+  uint64_t base_packets;	/* at the last perfctr_reset() */
+  uint64_t bases[PERFCTR_EVENTS];
+};
+SLIST_HEAD(perfctr_thread_listhead, perfctr_thread);
+
+struct perfctr_event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+/*
+ * The generic cache miss event is the last level cache miss on the
+ * x86 CPUs.
+ */
+static const struct perfctr_event perfctr_events[PERFCTR_EVENTS] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {"task clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+int perfctr_enabled = 0;
+__thread uint64_t *perfctr_packetp;
+
+static struct perfctr_thread_listhead perfctr_threads
+  = SLIST_HEAD_INITIALIZER(perfctr_threads);
+static int perfctr_thread_count;
+static pthread_mutex_t perfctr_lock = PTHREAD_MUTEX_INITIALIZER;
+static int perfctr_user_only;
+static int perfctr_error;
+static unsigned int perfctr_warned;
+
+static int perfctr_open(const struct perfctr_event *, int);
+static int perfctr_read(int, uint64_t *);
+
+/*
+ * Open the counters of the calling thread, which is named as the
+ * cpu-affinity directive does.  The failures are logged once, and the
+ * thread runs without the counters.
+ */
+void
+perfctr_thread_start(const char *name)
+{
+  assert(name != NULL);
+
+  if (!perfctr_enabled)
+    return;
+
+  pthread_mutex_lock(&perfctr_lock);
+  if (perfctr_thread_count >= PERFCTR_MAX_THREADS) {
+    pthread_mutex_unlock(&perfctr_lock);
+    warnx("too many threads for the performance counters.");
+    return;
+  }
+  struct perfctr_thread *threadp = calloc(1, sizeof(struct perfctr_thread));
+  if (threadp == NULL) {
+    pthread_mutex_unlock(&perfctr_lock);
+    warn("cannot allocate the performance counters of %s.", name);
+    return;
+  }
+  snprintf(threadp->name, sizeof(threadp->name), "%s", name);
+
+  int index;
+  for (index = 0; index < PERFCTR_EVENTS; index++) {
+    const struct perfctr_event *eventp = &perfctr_events[index];
+    int fd = perfctr_open(eventp, perfctr_user_only);
+    if (fd == -1 && (errno == EACCES || errno == EPERM)
+	&& !perfctr_user_only) {
+      /* Not allowed to count the kernel. */
+      fd = perfctr_open(eventp, 1);
+      if (fd != -1) {
+	perfctr_user_only = 1;
+	warnx("the performance counters count the user space only.");
+      }
+    }
+    threadp->fds[index] = fd;
+    if (fd == -1) {
+      if (perfctr_error == 0)
+	perfctr_error = errno;
+      if ((perfctr_warned & (1U << index)) == 0) {
+	warn("the %s counter is not available.", eventp->name);
+	perfctr_warned |= 1U << index;
+      }
+      continue;
+    }
+    threadp->events |= 1U << index;
+  }
+  if (threadp->events == 0) {
+    pthread_mutex_unlock(&perfctr_lock);
+    free(threadp);
+    return;
+  }
+
+  SLIST_INSERT_HEAD(&perfctr_threads, threadp, entries);
+  perfctr_thread_count++;
+  pthread_mutex_unlock(&perfctr_lock);
+  perfctr_packetp = &threadp->packets;
+}
+
+/* Returns 1 if any thread has the counters. */
+int
+perfctr_is_active(void)
+{
+  pthread_mutex_lock(&perfctr_lock);
+  int active = !SLIST_EMPTY(&perfctr_threads);
+  pthread_mutex_unlock(&perfctr_lock);
+  return (active);
+}
+
+/*
+ * Start a new measurement.  The stats are reported from this point,
+ * to compare the traffic before and after a change.
+ */
+void
+perfctr_reset(void)
+{
+  pthread_mutex_lock(&perfctr_lock);
+  struct perfctr_thread *threadp;
+  SLIST_FOREACH(threadp, &perfctr_threads, entries) {
+    int index;
+    for (index = 0; index < PERFCTR_EVENTS; index++) {
+      uint64_t value;
+      if ((threadp->events & (1U << index)) != 0
+	  && perfctr_read(threadp->fds[index], &value) == 0)
+	threadp->bases[index] = value;
+    }
+    threadp->base_packets = __atomic_load_n(&threadp->packets,
+					    __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&perfctr_lock);
+}
+
+/*
+ * Read the counters and the packets of each thread since the last
+ * reset.  The threads are listed in the order they started.
+ */
+void
+perfctr_get_stats(struct perfctr_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  memset(statsp, 0, sizeof(struct perfctr_stats));
+  pthread_mutex_lock(&perfctr_lock);
+  statsp->user_only = perfctr_user_only;
+  statsp->error = perfctr_error;
+  statsp->threads = perfctr_thread_count;
+  int count = perfctr_thread_count;
+  struct perfctr_thread *threadp;
+  SLIST_FOREACH(threadp, &perfctr_threads, entries) {
+    struct perfctr_thread_stats *thread_statsp = &statsp->thread[--count];
+    memcpy(thread_statsp->name, threadp->name, sizeof(thread_statsp->name));
+    thread_statsp->packets = __atomic_load_n(&threadp->packets,
+					     __ATOMIC_RELAXED)
+      - threadp->base_packets;
+    int index;
+    for (index = 0; index < PERFCTR_EVENTS; index++) {
+      uint64_t value;
+      if ((threadp->events & (1U << index)) == 0
+	  || perfctr_read(threadp->fds[index], &value) == -1)
+	continue;
+      thread_statsp->events |= 1U << index;
+      thread_statsp->values[index] = value > threadp->bases[index]
+	? value - threadp->bases[index] : 0;
+    }
+  }
+  pthread_mutex_unlock(&perfctr_lock);
+}
+
+/*
+ * Open a counter of the calling thread on any CPU.  Returns the file
+ * descriptor, or -1 with errno set.
+ */
+static int
+perfctr_open(const struct perfctr_event *eventp, int exclude_kernel)
+{
+  assert(eventp != NULL);
+
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = eventp->type;
+  attr.config = eventp->config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+    | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  return ((int)syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+		       PERF_FLAG_FD_CLOEXEC));
+}
+
+/*
+ * Read a counter.  When the counters of the thread outnumber the
+ * hardware and are multiplexed, the value is scaled to the time the
+ * counter was enabled.
+ */
+static int
+perfctr_read(int fd, uint64_t *valuep)
+{
+  assert(valuep != NULL);
+
+  uint64_t buf[3];		/* the value, the time enabled and running */
+  if (read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+    return (-1);
+  if (buf[2] == 0) {
+    *valuep = 0;
+  } else if (buf[2] < buf[1]) {
+    *valuep = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+  } else {
+    *valuep = buf[0];
+  }
+  return (0);
+}
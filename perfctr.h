@@ -0,0 +1,83 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PERFCTR_H__
+#define __PERFCTR_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PERFCTR_MAX_THREADS 48
+#define PERFCTR_NAME_LEN 32
+
+/* The counters opened for each forwarding thread. */
+enum {
+  PERFCTR_CYCLES,
+  PERFCTR_INSTRUCTIONS,
+  PERFCTR_LLC_MISSES,
+  PERFCTR_BRANCH_MISSES,
+  PERFCTR_TASK_CLOCK,		/* in nanoseconds, a software counter */
+  PERFCTR_EVENTS
+};
+
+struct perfctr_thread_stats {
+  char name[PERFCTR_NAME_LEN];
+  uint64_t packets;		/* translated by the thread */
+  unsigned int events;		/* the bit of each counter opened */
+  uint64_t values[PERFCTR_EVENTS];
+};
+
+struct perfctr_stats {
+  int user_only;		/* the kernel part is not counted */
+  int error;			/* errno if no counter could be opened */
+  int threads;
+  struct perfctr_thread_stats thread[PERFCTR_MAX_THREADS];
+};
+
+extern int perfctr_enabled;
+extern __thread uint64_t *perfctr_packetp;
+
+void perfctr_thread_start(const char *);
+int perfctr_is_active(void);
+void perfctr_reset(void);
+void perfctr_get_stats(struct perfctr_stats *);
+
+/*
+ * Count a packet translated by the current thread.  A thread without
+ * the counters costs one branch.
+ */
+static inline void
+perfctr_count(void)
+{
+  uint64_t *packetp = perfctr_packetp;
+  if (packetp != NULL)
+    __atomic_store_n(packetp, *packetp + 1, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,608 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include "mapping.h"
+#include "tunif.h"
+#include "ring.h"
+#include "pipeline.h"
+#include "affinity.h"
+#include "pktbuf.h"
+#include "perfctr.h"
+
+int pipeline_workers = 0;
+int pipeline_ring_size = PIPELINE_DEFAULT_RING_SIZE;
+int pipeline_batch_size = PIPELINE_DEFAULT_BATCH_SIZE;
+
+/*
+ * A thread sleeping on an empty ring.  The producer writes to the
+ * eventfd only if the consumer is sleeping.
+ */
+struct pipeline_waiter {
+  int efd;
+  int sleeping;
+};
+
+/*
+ * A translator worker.  All the rings are single-producer and
+ * single-consumer.
+ *
+ *   rx:      reader -> worker, the packets to be translated
+ *   rx_free: worker -> reader, the empty buffers for rx
+ *   tx:      worker -> writer, the translated packets
+ *   tx_free: writer -> worker, the empty buffers for tx
+ *
+ * Each ring can hold all the buffers which circulate through it, so
+ * the enqueue operations never fail.  When a free ring is empty, the
+ * packet is dropped.
+ */
+struct pipeline_worker {
+  struct ring rx;
+  struct ring rx_free;
+  struct ring tx;
+  struct ring tx_free;
+  struct pipeline_waiter waiter;
+  pthread_t thread;
+  int index;
+  int tx_pending;
+  uint64_t packets;
+  uint64_t tx_drops;
+  uint32_t rx_max_occupancy;
+  uint32_t tx_max_occupancy;
+} __attribute__((aligned(RING_CACHE_LINE_SIZE)));
+
+static struct pipeline_worker *pipeline_worker_list[PIPELINE_MAX_WORKERS];
+/* The values the pipeline is started with, not changed by a reload. */
+static int pipeline_worker_count;
+static int pipeline_running_ring_size;
+static int pipeline_running_batch_size;
+static struct pipeline_waiter pipeline_writer_waiter;
+static int pipeline_tun_fd = -1;
+static pipeline_translate_t pipeline_translate;
+static pthread_t pipeline_reader_thread;
+static struct pktbuf *pipeline_reader_spare;
+static pthread_t pipeline_writer_thread;
+
+static uint64_t pipeline_rx_packets;
+static uint64_t pipeline_rx_drops;
+static uint64_t pipeline_tx_packets;
+
+/* The worker running in the current thread, or NULL. */
+static __thread struct pipeline_worker *pipeline_current;
+
+static int pipeline_init_worker(struct pipeline_worker *, int, int);
+static void *pipeline_reader_main(void *);
+static void *pipeline_worker_main(void *);
+static void *pipeline_writer_main(void *);
+static uint32_t pipeline_hash(const uint8_t *, ssize_t, int);
+static void pipeline_wait(struct pipeline_waiter *, int (*)(void *), void *);
+static void pipeline_wake(struct pipeline_waiter *);
+static int pipeline_worker_ready(void *);
+static int pipeline_writer_ready(void *);
+static void pipeline_add_u64(uint64_t *, uint64_t);
+
+/*
+ * Start the pipeline which serves the tun queue tun_fd: one reader
+ * thread, pipeline_workers translator threads calling the translate
+ * function, and one writer thread.  The caller must not read from
+ * tun_fd after this.
+ *
+ * Returns 0 if the pipeline is not configured or started, -1 on
+ * failure.
+ */
+int
+pipeline_start(int tun_fd, pipeline_translate_t translate)
+{
+  assert(translate != NULL);
+
+  if (pipeline_workers == 0) {
+    /* Not configured. */
+    return (0);
+  }
+
+  /*
+   * The buffers are taken from the packet buffer pool, placed on the
+   * NUMA node of the reader which fills the received packets.  Each
+   * worker and its rings are allocated on the NUMA node of the CPUs
+   * the worker is pinned to.
+   */
+  pipeline_running_ring_size = pipeline_ring_size;
+  pipeline_running_batch_size = pipeline_batch_size;
+  if (pktbuf_init(pipeline_workers * pipeline_running_ring_size * 2 + 1,
+		  tun_get_buffer_size(), affinity_node("pipeline-reader")) == -1)
+    return (-1);
+  int count;
+  for (count = 0; count < pipeline_workers; count++) {
+    char name[AFFINITY_NAME_LEN];
+    snprintf(name, sizeof(name), "pipeline%d", count);
+    int node = affinity_node(name);
+    struct pipeline_worker *workerp;
+    workerp = affinity_alloc(sizeof(struct pipeline_worker), node);
+    if (workerp == NULL) {
+      warnx("cannot allocate memory for the pipeline workers.");
+      return (-1);
+    }
+    if (pipeline_init_worker(workerp, count, node) == -1)
+      return (-1);
+    pipeline_worker_list[count] = workerp;
+  }
+  pipeline_reader_spare = pktbuf_alloc();
+  if (pipeline_reader_spare == NULL) {
+    warnx("cannot allocate the pipeline buffers.");
+    return (-1);
+  }
+  pipeline_writer_waiter.efd = eventfd(0, 0);
+  if (pipeline_writer_waiter.efd == -1) {
+    warn("cannot create an eventfd for the pipeline writer.");
+    return (-1);
+  }
+
+  pipeline_worker_count = pipeline_workers;
+  pipeline_tun_fd = tun_fd;
+  pipeline_translate = translate;
+
+  int error;
+  pthread_attr_t attr;
+  for (count = 0; count < pipeline_worker_count; count++) {
+    char name[AFFINITY_NAME_LEN];
+    snprintf(name, sizeof(name), "pipeline%d", count);
+    affinity_init_attr(name, &attr);
+    error = pthread_create(&pipeline_worker_list[count]->thread, &attr,
+			   pipeline_worker_main, pipeline_worker_list[count]);
+    pthread_attr_destroy(&attr);
+    if (error != 0) {
+      errno = error;
+      err(EXIT_FAILURE, "cannot start the pipeline worker %d.", count);
+    }
+    affinity_log(name);
+  }
+  affinity_init_attr("pipeline-writer", &attr);
+  error = pthread_create(&pipeline_writer_thread, &attr, pipeline_writer_main,
+			 NULL);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    errno = error;
+    err(EXIT_FAILURE, "cannot start the pipeline writer.");
+  }
+  affinity_log("pipeline-writer");
+  affinity_init_attr("pipeline-reader", &attr);
+  error = pthread_create(&pipeline_reader_thread, &attr, pipeline_reader_main,
+			 NULL);
+  pthread_attr_destroy(&attr);
+  if (error != 0) {
+    errno = error;
+    err(EXIT_FAILURE, "cannot start the pipeline reader.");
+  }
+  affinity_log("pipeline-reader");
+
+  return (0);
+}
+
+/* Returns 1 if the pipeline is running. */
+int
+pipeline_is_active(void)
+{
+  return (pipeline_worker_count > 0);
+}
+
+/* Returns 1 if called from a pipeline worker thread. */
+int
+pipeline_in_worker(void)
+{
+  return (pipeline_current != NULL);
+}
+
+/*
+ * Pass a translated packet to the writer.  Called by the translate
+ * function in a worker thread instead of writing to the tun
+ * interface.  The packet is copied to a buffer since the iovec may
+ * point the stack of the caller.
+ */
+ssize_t
+pipeline_output(const struct iovec *iov, int iovcnt)
+{
+  assert(iov != NULL);
+  assert(pipeline_current != NULL);
+
+  struct pipeline_worker *workerp = pipeline_current;
+
+  size_t total = 0;
+  int count;
+  for (count = 0; count < iovcnt; count++) {
+    total += iov[count].iov_len;
+  }
+  if (total > pktbuf_data_len()) {
+    errno = EMSGSIZE;
+    return (-1);
+  }
+
+  struct pktbuf *bufp;
+  if (ring_dequeue_burst(&workerp->tx_free, (void **)&bufp, 1) == 0) {
+    /* The writer is behind. */
+    pipeline_add_u64(&workerp->tx_drops, 1);
+    errno = ENOBUFS;
+    return (-1);
+  }
+
+  uint8_t *datap = bufp->data;
+  for (count = 0; count < iovcnt; count++) {
+    memcpy(datap, iov[count].iov_base, iov[count].iov_len);
+    datap += iov[count].iov_len;
+  }
+  bufp->len = total;
+  ring_enqueue_burst(&workerp->tx, (void *const *)&bufp, 1);
+  workerp->tx_pending = 1;
+
+  return (total);
+}
+
+/*
+ * Read the counters and the ring occupancies.  The values are read
+ * without stopping the threads, so they are not a consistent
+ * snapshot.
+ */
+void
+pipeline_get_stats(struct pipeline_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  memset(statsp, 0, sizeof(struct pipeline_stats));
+  statsp->worker_count = pipeline_worker_count;
+  statsp->ring_size = pipeline_running_ring_size;
+  statsp->batch_size = pipeline_running_batch_size;
+  statsp->rx_packets = __atomic_load_n(&pipeline_rx_packets, __ATOMIC_RELAXED);
+  statsp->rx_drops = __atomic_load_n(&pipeline_rx_drops, __ATOMIC_RELAXED);
+  statsp->tx_packets = __atomic_load_n(&pipeline_tx_packets, __ATOMIC_RELAXED);
+
+  int count;
+  for (count = 0; count < pipeline_worker_count; count++) {
+    struct pipeline_worker *workerp = pipeline_worker_list[count];
+    struct pipeline_worker_stats *wstatsp = &statsp->workers[count];
+    wstatsp->packets = __atomic_load_n(&workerp->packets, __ATOMIC_RELAXED);
+    wstatsp->tx_drops = __atomic_load_n(&workerp->tx_drops, __ATOMIC_RELAXED);
+    wstatsp->rx_occupancy = ring_count(&workerp->rx);
+    wstatsp->rx_max_occupancy = __atomic_load_n(&workerp->rx_max_occupancy,
+						__ATOMIC_RELAXED);
+    wstatsp->tx_occupancy = ring_count(&workerp->tx);
+    wstatsp->tx_max_occupancy = __atomic_load_n(&workerp->tx_max_occupancy,
+						__ATOMIC_RELAXED);
+  }
+}
+
+static int
+pipeline_init_worker(struct pipeline_worker *workerp, int index, int node)
+{
+  assert(workerp != NULL);
+
+  workerp->index = index;
+  if (ring_init(&workerp->rx, pipeline_running_ring_size, node) == -1
+      || ring_init(&workerp->rx_free, pipeline_running_ring_size, node) == -1
+      || ring_init(&workerp->tx, pipeline_running_ring_size, node) == -1
+      || ring_init(&workerp->tx_free, pipeline_running_ring_size,
+		   node) == -1) {
+    return (-1);
+  }
+  workerp->waiter.efd = eventfd(0, 0);
+  if (workerp->waiter.efd == -1) {
+    warn("cannot create an eventfd for the pipeline worker %d.", index);
+    return (-1);
+  }
+
+  /*
+   * The buffers are never returned to the pool.  They move between the
+   * workers through the reader (see pipeline_reader_main()).
+   */
+  int count;
+  for (count = 0; count < pipeline_running_ring_size; count++) {
+    struct pktbuf *rx_bufp = pktbuf_alloc();
+    struct pktbuf *tx_bufp = pktbuf_alloc();
+    if (rx_bufp == NULL || tx_bufp == NULL) {
+      warnx("cannot allocate the pipeline buffers.");
+      return (-1);
+    }
+    ring_enqueue_burst(&workerp->rx_free, (void *const *)&rx_bufp, 1);
+    ring_enqueue_burst(&workerp->tx_free, (void *const *)&tx_bufp, 1);
+  }
+
+  return (0);
+}
+
+/*
+ * The reader thread.  It reads a packet into the spare buffer, and
+ * passes it to the worker selected by the flow hash in exchange for
+ * an empty buffer of the worker.  The number of the buffers of each
+ * worker is kept the same, so the rx ring never overflows.
+ */
+static void *
+pipeline_reader_main(void *argp)
+{
+  struct pktbuf *sparep = pipeline_reader_spare;
+
+  perfctr_thread_start("pipeline-reader");
+  while (1) {
+    sparep->len = read(pipeline_tun_fd, sparep->data, pktbuf_data_len());
+    if (sparep->len == -1) {
+      if (errno == EINTR)
+	continue;
+      err(EXIT_FAILURE, "read from tun failed.");
+    }
+    if (sparep->len <= (ssize_t)sizeof(uint32_t))
+      continue;
+    if (tun_is_truncated(sparep->data)) {
+      warnx("a packet larger than the buffer size %zu is dropped.",
+	    pktbuf_data_len());
+      continue;
+    }
+
+    mapping_read_lock();
+    sparep->dispatch = dispatch(sparep->data, sparep->len);
+    mapping_read_unlock();
+
+    struct pipeline_worker *workerp;
+    workerp = pipeline_worker_list[pipeline_hash(sparep->data, sparep->len,
+						 sparep->dispatch)
+				   % pipeline_worker_count];
+    struct pktbuf *nextp;
+    if (ring_dequeue_burst(&workerp->rx_free, (void **)&nextp, 1) == 0) {
+      /* The worker is behind. */
+      pipeline_add_u64(&pipeline_rx_drops, 1);
+      continue;
+    }
+    ring_enqueue_burst(&workerp->rx, (void *const *)&sparep, 1);
+    pipeline_wake(&workerp->waiter);
+    sparep = nextp;
+    pipeline_add_u64(&pipeline_rx_packets, 1);
+  }
+
+  return (NULL);
+}
+
+/*
+ * The worker thread.  It translates the packets in batches, holding
+ * the read lock of the mapping table during each batch.
+ */
+static void *
+pipeline_worker_main(void *argp)
+{
+  assert(argp != NULL);
+
+  struct pipeline_worker *workerp = (struct pipeline_worker *)argp;
+  struct pktbuf *bufs[PIPELINE_MAX_BATCH_SIZE];
+  char name[AFFINITY_NAME_LEN];
+
+  snprintf(name, sizeof(name), "pipeline%d", workerp->index);
+  perfctr_thread_start(name);
+  pipeline_current = workerp;
+  while (1) {
+    uint32_t occupancy = ring_count(&workerp->rx);
+    if (occupancy > workerp->rx_max_occupancy) {
+      __atomic_store_n(&workerp->rx_max_occupancy, occupancy,
+		       __ATOMIC_RELAXED);
+    }
+    unsigned int nbufs = ring_dequeue_burst(&workerp->rx, (void **)bufs,
+					    pipeline_running_batch_size);
+    if (nbufs == 0) {
+      pipeline_wait(&workerp->waiter, pipeline_worker_ready, workerp);
+      continue;
+    }
+
+    uint8_t *datas[PIPELINE_MAX_BATCH_SIZE];
+    ssize_t lens[PIPELINE_MAX_BATCH_SIZE];
+    int dispatches[PIPELINE_MAX_BATCH_SIZE];
+    unsigned int count;
+    for (count = 0; count < nbufs; count++) {
+      datas[count] = bufs[count]->data;
+      lens[count] = bufs[count]->len;
+      dispatches[count] = bufs[count]->dispatch;
+    }
+    mapping_read_lock();
+    pipeline_translate(datas, lens, dispatches, nbufs);
+    mapping_read_unlock();
+
+    ring_enqueue_burst(&workerp->rx_free, (void *const *)bufs, nbufs);
+    pipeline_add_u64(&workerp->packets, nbufs);
+    if (workerp->tx_pending) {
+      workerp->tx_pending = 0;
+      pipeline_wake(&pipeline_writer_waiter);
+    }
+  }
+
+  return (NULL);
+}
+
+/*
+ * The writer thread.  It writes the translated packets of all the
+ * workers to the tun interface in a round-robin manner.
+ */
+static void *
+pipeline_writer_main(void *argp)
+{
+  struct pktbuf *bufs[PIPELINE_MAX_BATCH_SIZE];
+
+  perfctr_thread_start("pipeline-writer");
+  while (1) {
+    unsigned int total = 0;
+    int index;
+    for (index = 0; index < pipeline_worker_count; index++) {
+      struct pipeline_worker *workerp = pipeline_worker_list[index];
+      uint32_t occupancy = ring_count(&workerp->tx);
+      if (occupancy > workerp->tx_max_occupancy) {
+	__atomic_store_n(&workerp->tx_max_occupancy, occupancy,
+			 __ATOMIC_RELAXED);
+      }
+      unsigned int nbufs = ring_dequeue_burst(&workerp->tx, (void **)bufs,
+					      pipeline_running_batch_size);
+      unsigned int count;
+      for (count = 0; count < nbufs; count++) {
+	if (write(pipeline_tun_fd, bufs[count]->data, bufs[count]->len)
+	    == -1) {
+	  warn("sending a translated packet failed.");
+	}
+      }
+      ring_enqueue_burst(&workerp->tx_free, (void *const *)bufs, nbufs);
+      total += nbufs;
+    }
+    if (total == 0) {
+      pipeline_wait(&pipeline_writer_waiter, pipeline_writer_ready, NULL);
+      continue;
+    }
+    pipeline_add_u64(&pipeline_tx_packets, total);
+  }
+
+  return (NULL);
+}
+
+/*
+ * Select a worker so that both directions of a flow go to the same
+ * worker.  The key is the address of the peer which doesn't change by
+ * the translation (the IPv4 source address of the 4-to-6 direction is
+ * embedded in the IPv6 destination address of the reverse direction),
+ * and the TCP or UDP ports for non-fragmented packets.
+ */
+static uint32_t
+pipeline_hash(const uint8_t *bufp, ssize_t len, int d)
+{
+  assert(bufp != NULL);
+
+  const uint8_t *packetp = bufp + sizeof(uint32_t);
+  len -= sizeof(uint32_t);
+
+  uint32_t key = 0;
+  const uint8_t *l4p = NULL;
+  if (d == FOURTOSIX || d == FOURTOSIX_NAT || d == FOURTOSIX_MAP
+      || d == FOURTOSIX_PORT || d == FOURTOSIX_POOL) {
+    const struct ip *ip4_hdrp = (const struct ip *)packetp;
+    if (len < (ssize_t)sizeof(struct ip))
+      return (0);
+    key = ip4_hdrp->ip_src.s_addr;
+    if (ip4_hdrp->ip_hl << 2 == sizeof(struct ip)
+	&& (ip4_hdrp->ip_off & htons(IP_MF | IP_OFFMASK)) == 0
+	&& (ip4_hdrp->ip_p == IPPROTO_TCP || ip4_hdrp->ip_p == IPPROTO_UDP)) {
+      l4p = packetp + sizeof(struct ip);
+    }
+  } else if (d == SIXTOFOUR || d == SIXTOFOUR_NAT || d == SIXTOFOUR_MAP
+	     || d == SIXTOFOUR_PORT || d == SIXTOSIX_GtoI
+	     || d == SIXTOSIX_ItoG || d == SIXTOSIX_HAIRPIN) {
+    const struct ip6_hdr *ip6_hdrp = (const struct ip6_hdr *)packetp;
+    if (len < (ssize_t)sizeof(struct ip6_hdr))
+      return (0);
+    if (d == SIXTOSIX_GtoI) {
+      key = ip6_hdrp->ip6_src.s6_addr32[3];
+    } else {
+      key = ip6_hdrp->ip6_dst.s6_addr32[3];
+    }
+    if (ip6_hdrp->ip6_nxt == IPPROTO_TCP || ip6_hdrp->ip6_nxt == IPPROTO_UDP) {
+      l4p = packetp + sizeof(struct ip6_hdr);
+    }
+  }
+  if (l4p != NULL && l4p + sizeof(uint32_t) <= packetp + len) {
+    /* XOR of the source and destination ports. */
+    key ^= ((const uint16_t *)l4p)[0] ^ ((const uint16_t *)l4p)[1];
+  }
+
+  return ((key * 0x9e3779b1U) >> 16);
+}
+
+/*
+ * Sleep until the ready function returns true.  The sleeping flag is
+ * set before checking the ring, and the producer checks the flag
+ * after updating the ring, so a wakeup is never missed.
+ */
+static void
+pipeline_wait(struct pipeline_waiter *waiterp, int (*ready)(void *),
+	      void *argp)
+{
+  assert(waiterp != NULL);
+
+  __atomic_store_n(&waiterp->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!ready(argp)) {
+    uint64_t value;
+    while (read(waiterp->efd, &value, sizeof(value)) == -1
+	   && errno == EINTR)
+      ;
+  }
+  __atomic_store_n(&waiterp->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void
+pipeline_wake(struct pipeline_waiter *waiterp)
+{
+  assert(waiterp != NULL);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&waiterp->sleeping, __ATOMIC_RELAXED)) {
+    uint64_t value = 1;
+    if (write(waiterp->efd, &value, sizeof(value)) == -1) {
+      warn("cannot wake up a pipeline thread.");
+    }
+  }
+}
+
+static int
+pipeline_worker_ready(void *argp)
+{
+  struct pipeline_worker *workerp = (struct pipeline_worker *)argp;
+
+  return (ring_count(&workerp->rx) != 0);
+}
+
+static int
+pipeline_writer_ready(void *argp)
+{
+  int index;
+  for (index = 0; index < pipeline_worker_count; index++) {
+    if (ring_count(&pipeline_worker_list[index]->tx) != 0)
+      return (1);
+  }
+
+  return (0);
+}
+
+/*
+ * Add to a counter which is updated only by one thread and read by
+ * the stat interface.
+ */
+static void
+pipeline_add_u64(uint64_t *counterp, uint64_t value)
+{
+  __atomic_store_n(counterp, *counterp + value, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIPELINE_MAX_WORKERS 16
+#define PIPELINE_DEFAULT_RING_SIZE 256
+#define PIPELINE_MAX_RING_SIZE 65536
+#define PIPELINE_DEFAULT_BATCH_SIZE 32
+#define PIPELINE_MAX_BATCH_SIZE 256
+
+extern int pipeline_workers;
+extern int pipeline_ring_size;
+extern int pipeline_batch_size;
+
+/*
+ * The function which translates a batch of packets.  The arguments
+ * are the packets beginning with the address family information (see
+ * tun_get_af()), their lengths, the directions returned by the
+ * dispatch() function, and the number of the packets.
+ */
+typedef void (*pipeline_translate_t)(uint8_t *const *, const ssize_t *,
+				     const int *, unsigned int);
+
+struct pipeline_worker_stats {
+  uint64_t packets;
+  uint64_t tx_drops;
+  uint32_t rx_occupancy;
+  uint32_t rx_max_occupancy;
+  uint32_t tx_occupancy;
+  uint32_t tx_max_occupancy;
+};
+
+struct pipeline_stats {
+  int worker_count;		/* the values the pipeline runs with */
+  int ring_size;
+  int batch_size;
+  uint64_t rx_packets;
+  uint64_t rx_drops;
+  uint64_t tx_packets;
+  struct pipeline_worker_stats workers[PIPELINE_MAX_WORKERS];
+};
+
+int pipeline_start(int, pipeline_translate_t);
+int pipeline_is_active(void);
+int pipeline_in_worker(void);
+ssize_t pipeline_output(const struct iovec *, int);
+void pipeline_get_stats(struct pipeline_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "affinity.h"
+#include "pktbuf.h"
+
+/* The size of the huge pages assumed when rounding the arena size. */
+#define PKTBUF_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+int pktbuf_count = 0;
+int pktbuf_headroom = PKTBUF_DEFAULT_HEADROOM;
+
+/*
+ * The pool.  All the buffers are carved from one arena at startup,
+ * and never returned to the system.  The free buffers are kept in the
+ * global free list and in the cache of each thread.  The global list
+ * is accessed only when a cache becomes empty or full, and then
+ * PKTBUF_CACHE_SIZE buffers are moved at once.
+ */
+static uint8_t *pktbuf_arena;
+static size_t pktbuf_arena_size;
+static size_t pktbuf_stride;
+static size_t pktbuf_data_size;
+static struct pktbuf *pktbuf_free_list;
+static pthread_mutex_t pktbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pktbuf_cache {
+  unsigned int count;
+  struct pktbuf *bufs[PKTBUF_CACHE_SIZE * 2];
+};
+static __thread struct pktbuf_cache pktbuf_local;
+
+static void *pktbuf_map_arena(size_t, int, int *);
+
+/*
+ * Create the pool of count buffers, or pktbuf_count buffers if it is
+ * larger, each having the data area of data_len bytes.  The arena is
+ * allocated on huge pages if possible, and placed on the NUMA node
+ * (-1 for any node).  The pool can be created only once.
+ */
+int
+pktbuf_init(unsigned int count, size_t data_len, int node)
+{
+  if (pktbuf_arena != NULL) {
+    warnx("the packet buffer pool is already created.");
+    return (-1);
+  }
+
+  if (count < (unsigned int)pktbuf_count)
+    count = pktbuf_count;
+  if (count == 0 || count > PKTBUF_MAX_COUNT) {
+    warnx("invalid number of the packet buffers %u.", count);
+    return (-1);
+  }
+
+  size_t stride = sizeof(struct pktbuf) + pktbuf_headroom + data_len;
+  stride = (stride + PKTBUF_ALIGN - 1) & ~(size_t)(PKTBUF_ALIGN - 1);
+
+  int huge;
+  uint8_t *arena = pktbuf_map_arena(stride * count, node, &huge);
+  if (arena == NULL)
+    return (-1);
+
+  /*
+   * Link the buffers in the address order, so that the buffers
+   * allocated together are adjacent.
+   */
+  unsigned int index;
+  for (index = count; index > 0; index--) {
+    struct pktbuf *bufp = (struct pktbuf *)(arena + stride * (index - 1));
+    bufp->data = (uint8_t *)bufp + sizeof(struct pktbuf) + pktbuf_headroom;
+    bufp->next = pktbuf_free_list;
+    pktbuf_free_list = bufp;
+  }
+
+  pktbuf_arena = arena;
+  pktbuf_stride = stride;
+  pktbuf_data_size = data_len;
+
+  warnx("packet buffer pool: %u buffers of %zu bytes on %s pages.",
+	count, stride, huge ? "huge" : "normal");
+
+  return (0);
+}
+
+/* Returns the size of the data area of the buffers. */
+size_t
+pktbuf_data_len(void)
+{
+  return (pktbuf_data_size);
+}
+
+/*
+ * Allocate a buffer from the pool.  Returns NULL if all the buffers
+ * are in use.
+ */
+struct pktbuf *
+pktbuf_alloc(void)
+{
+  struct pktbuf_cache *cachep = &pktbuf_local;
+
+  if (cachep->count == 0) {
+    pthread_mutex_lock(&pktbuf_lock);
+    while (cachep->count < PKTBUF_CACHE_SIZE && pktbuf_free_list != NULL) {
+      cachep->bufs[cachep->count++] = pktbuf_free_list;
+      pktbuf_free_list = pktbuf_free_list->next;
+    }
+    pthread_mutex_unlock(&pktbuf_lock);
+    if (cachep->count == 0)
+      return (NULL);
+  }
+
+  struct pktbuf *bufp = cachep->bufs[--cachep->count];
+  bufp->len = 0;
+  bufp->dispatch = 0;
+
+  return (bufp);
+}
+
+/* Return the buffer to the pool. */
+void
+pktbuf_free(struct pktbuf *bufp)
+{
+  assert(bufp != NULL);
+  assert((uint8_t *)bufp >= pktbuf_arena
+	 && (uint8_t *)bufp < pktbuf_arena + pktbuf_arena_size);
+
+  struct pktbuf_cache *cachep = &pktbuf_local;
+
+  if (cachep->count == PKTBUF_CACHE_SIZE * 2) {
+    pthread_mutex_lock(&pktbuf_lock);
+    while (cachep->count > PKTBUF_CACHE_SIZE) {
+      struct pktbuf *flushp = cachep->bufs[--cachep->count];
+      flushp->next = pktbuf_free_list;
+      pktbuf_free_list = flushp;
+    }
+    pthread_mutex_unlock(&pktbuf_lock);
+  }
+
+  cachep->bufs[cachep->count++] = bufp;
+}
+
+/*
+ * Map the arena.  Huge pages are tried first so that a few TLB
+ * entries cover all the buffers.  If no huge page is reserved, the
+ * normal pages are used with the hint for the transparent huge pages.
+ */
+static void *
+pktbuf_map_arena(size_t size, int node, int *hugep)
+{
+  size_t huge_size = (size + PKTBUF_HUGEPAGE_SIZE - 1)
+    & ~(size_t)(PKTBUF_HUGEPAGE_SIZE - 1);
+  void *p = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    affinity_bind(p, huge_size, node);
+    pktbuf_arena_size = huge_size;
+    *hugep = 1;
+    return (p);
+  }
+
+  p = affinity_alloc(size, node);
+  if (p == NULL) {
+    warnx("cannot allocate memory for the packet buffers.");
+    return (NULL);
+  }
+  madvise(p, size, MADV_HUGEPAGE);
+  pktbuf_arena_size = size;
+  *hugep = 0;
+
+  return (p);
+}
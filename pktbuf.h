@@ -0,0 +1,63 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PKTBUF_H__
+#define __PKTBUF_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PKTBUF_ALIGN 64
+#define PKTBUF_DEFAULT_HEADROOM 64
+#define PKTBUF_MAX_HEADROOM 1024
+#define PKTBUF_MAX_COUNT 1048576
+#define PKTBUF_CACHE_SIZE 32
+
+extern int pktbuf_count;
+extern int pktbuf_headroom;
+
+/*
+ * A packet buffer.  The header is followed by the headroom and the
+ * data area of the size given to pktbuf_init().  The data pointer
+ * points the beginning of the data area, and the headroom can be used
+ * to prepend a header to the packet without copying it.
+ */
+struct pktbuf {
+  struct pktbuf *next;
+  uint8_t *data;
+  ssize_t len;
+  int dispatch;
+} __attribute__((aligned(PKTBUF_ALIGN)));
+
+int pktbuf_init(unsigned int, size_t, int);
+struct pktbuf *pktbuf_alloc(void);
+void pktbuf_free(struct pktbuf *);
+size_t pktbuf_data_len(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <err.h>
+#include <pthread.h>
 
 #include <sys/queue.h>
 #include <sys/types.h>
@@ -35,6 +36,10 @@
 
 #include <netinet/in.h>
 
+#include "pmtudisc.h"
+#include "fastpath.h"
+#include "probe.h"
+
 struct path_mtu {
   LIST_ENTRY(path_mtu) entries;
   struct sockaddr_storage ss_addr;
@@ -50,22 +55,56 @@ struct path_mtu_hash {
 };
 LIST_HEAD(path_mtu_hash_listhead, path_mtu_hash);
 
-#define PMTUDISC_DEFAULT_MTU 1500
 #define PMTUDISC_DEFAULT_LIFETIME 3600
 #define PMTUDISC_HASH_SIZE 1009
 #define PMTUDISC_PATH_MTU_MAX_INSTANCE_SIZE 10000
+#define PMTUDISC_BATCH_CHUNK 32
+#define PMTUDISC_CACHE_SIZE 256
 
 static struct path_mtu_listhead path_mtu_head;
 static struct path_mtu_hash_listhead path_mtu_hash_heads[PMTUDISC_HASH_SIZE];
 
 static int pmtudisc_get_hash_index(const void *, int);
 static struct path_mtu *pmtudisc_find_path_mtu(int, const void *addrp);
+static struct path_mtu *pmtudisc_find_in_bucket(int, const void *, int, int);
+static int pmtudisc_get_addr_len(int);
 static int pmtudisc_insert_path_mtu(struct path_mtu *);
 static void pmtudisc_expire_path_mtus(void);
 static void pmtudisc_remove_path_mtu(struct path_mtu *);
+static int pmtudisc_cache_lookup(int, const void *, int, int, time_t);
+static void pmtudisc_cache_fill(int, const void *, int, int,
+				const struct path_mtu *);
 
 static int path_mtu_instance_size;
 
+/* The path MTU used when no smaller one is learned. */
+int pmtudisc_default_mtu = PMTUDISC_DEFAULT_MTU;
+
+/*
+ * The tables are shared by the worker threads serving the tun queues
+ * (see the tun-queues directive).
+ */
+static pthread_mutex_t pmtudisc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread keeps the recent results of the lookups in its own
+ * direct mapped cache, so that a hit doesn't take the lock.  The
+ * generation is incremented under the lock whenever an entry of the
+ * tables is added, changed or removed, which invalidates all the
+ * cached results.  The path_mtu member is 0 when the address had no
+ * entry.
+ */
+struct pmtudisc_cache_entry {
+  uint32_t generation;
+  time_t expire;
+  int path_mtu;
+  int af;
+  uint8_t addr[sizeof(struct in6_addr)];
+};
+static uint32_t pmtudisc_generation = 1;
+static __thread struct pmtudisc_cache_entry
+pmtudisc_cache[PMTUDISC_CACHE_SIZE];
+
 int
 pmtudisc_initialize(void)
 {
@@ -86,22 +125,131 @@ pmtudisc_get_path_mtu_size(int af, const void *addr)
 {
   assert(addr != NULL);
 
-  time_t now = time(NULL);
-  int pmtu = PMTUDISC_DEFAULT_MTU;
+  int addr_len = pmtudisc_get_addr_len(af);
+  if (addr_len == 0) {
+    warnx("unsupported address family %d.", af);
+    return (pmtudisc_default_mtu);
+  }
 
-  struct path_mtu *pmtup = pmtudisc_find_path_mtu(af, addr);
-  if (pmtup != NULL) {
-    if (now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME) {
-      /* Entry is expired. */
-      pmtudisc_remove_path_mtu(pmtup);
-    } else {
-      pmtu = pmtup->path_mtu;
-    }
+  time_t now = time(NULL);
+  int hash_index = pmtudisc_get_hash_index(addr, addr_len);
+  int pmtu = pmtudisc_cache_lookup(af, addr, addr_len, hash_index, now);
+  if (pmtu != -1)
+    return (pmtu);
+  pmtu = pmtudisc_default_mtu;
+
+  pthread_mutex_lock(&pmtudisc_lock);
+  struct path_mtu *pmtup = pmtudisc_find_in_bucket(af, addr, addr_len,
+						   hash_index);
+  if (pmtup == NULL) {
+    PROBE2(pmtu_miss, af, addr);
+  } else if (now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME) {
+    /* Entry is expired. */
+    PROBE2(pmtu_miss, af, addr);
+    pmtudisc_remove_path_mtu(pmtup);
+    pmtup = NULL;
+  } else {
+    pmtu = pmtup->path_mtu;
+    PROBE3(pmtu_hit, af, addr, pmtu);
   }
+  pmtudisc_cache_fill(af, addr, addr_len, hash_index, pmtup);
+  pthread_mutex_unlock(&pmtudisc_lock);
 
   return (pmtu);
 }
 
+/*
+ * The batch version of pmtudisc_get_path_mtu_size().  The addrs
+ * parameter is an array of count addresses of the address family af,
+ * and the path MTU of each address is stored in the mtus array.
+ *
+ * The hash indexes of all the addresses are computed and the buckets
+ * and their first entries are prefetched before any bucket is
+ * searched, so the cache misses of the addresses are overlapped.  The
+ * addresses found in the cache of the thread are not searched, and
+ * the lock is taken once for each chunk of PMTUDISC_BATCH_CHUNK
+ * addresses only if some of them are not found.
+ */
+void
+pmtudisc_get_path_mtu_size_batch(int af, const void *addrs, int *mtus,
+				 int count)
+{
+  assert(addrs != NULL);
+  assert(mtus != NULL);
+
+  int addr_len = pmtudisc_get_addr_len(af);
+  if (addr_len == 0) {
+    warnx("unsupported address family %d.", af);
+    return;
+  }
+
+  time_t now = time(NULL);
+  int hash_indexes[PMTUDISC_BATCH_CHUNK];
+  int base;
+  for (base = 0; base < count; base += PMTUDISC_BATCH_CHUNK) {
+    int chunk = count - base;
+    if (chunk > PMTUDISC_BATCH_CHUNK)
+      chunk = PMTUDISC_BATCH_CHUNK;
+    const uint8_t *addrp = (const uint8_t *)addrs + addr_len * base;
+
+    int index;
+    int misses = 0;
+    for (index = 0; index < chunk; index++) {
+      hash_indexes[index]
+	= pmtudisc_get_hash_index(addrp + addr_len * index, addr_len);
+      mtus[base + index]
+	= pmtudisc_cache_lookup(af, addrp + addr_len * index, addr_len,
+				hash_indexes[index], now);
+      if (mtus[base + index] != -1)
+	continue;
+      __builtin_prefetch(&path_mtu_hash_heads[hash_indexes[index]]);
+      misses++;
+    }
+    if (misses == 0)
+      continue;
+
+    pthread_mutex_lock(&pmtudisc_lock);
+    for (index = 0; index < chunk; index++) {
+      if (mtus[base + index] != -1)
+	continue;
+      struct path_mtu_hash *path_mtu_hashp
+	= LIST_FIRST(&path_mtu_hash_heads[hash_indexes[index]]);
+      if (path_mtu_hashp != NULL)
+	__builtin_prefetch(path_mtu_hashp);
+    }
+    for (index = 0; index < chunk; index++) {
+      if (mtus[base + index] != -1)
+	continue;
+      struct path_mtu_hash *path_mtu_hashp
+	= LIST_FIRST(&path_mtu_hash_heads[hash_indexes[index]]);
+      if (path_mtu_hashp != NULL)
+	__builtin_prefetch(path_mtu_hashp->path_mtup);
+    }
+    for (index = 0; index < chunk; index++) {
+      if (mtus[base + index] != -1)
+	continue;
+      mtus[base + index] = pmtudisc_default_mtu;
+      struct path_mtu *pmtup
+	= pmtudisc_find_in_bucket(af, addrp + addr_len * index, addr_len,
+				  hash_indexes[index]);
+      if (pmtup == NULL) {
+	PROBE2(pmtu_miss, af, addrp + addr_len * index);
+      } else if (now - pmtup->last_updated > PMTUDISC_DEFAULT_LIFETIME) {
+	/* Entry is expired. */
+	PROBE2(pmtu_miss, af, addrp + addr_len * index);
+	pmtudisc_remove_path_mtu(pmtup);
+	pmtup = NULL;
+      } else {
+	mtus[base + index] = pmtup->path_mtu;
+	PROBE3(pmtu_hit, af, addrp + addr_len * index, pmtup->path_mtu);
+      }
+      pmtudisc_cache_fill(af, addrp + addr_len * index, addr_len,
+			  hash_indexes[index], pmtup);
+    }
+    pthread_mutex_unlock(&pmtudisc_lock);
+  }
+}
+
 int
 pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
 {
@@ -110,6 +258,7 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
 
   time_t now = time(NULL);
 
+  pthread_mutex_lock(&pmtudisc_lock);
   struct path_mtu *pmtup = pmtudisc_find_path_mtu(af, addrp);
   if (pmtup != NULL) {
     /*
@@ -119,6 +268,7 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
     if (pmtup->path_mtu != pmtu) {
       pmtup->path_mtu = pmtu;
       pmtup->last_updated = now;
+      __atomic_add_fetch(&pmtudisc_generation, 1, __ATOMIC_RELEASE);
       /* Reorder the global list so that the recent entry comes to head. */
       LIST_REMOVE(pmtup, entries);
       LIST_INSERT_HEAD(&path_mtu_head, pmtup, entries);
@@ -128,6 +278,7 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
     pmtup = malloc(sizeof(struct path_mtu));
     if (pmtup == NULL) {
       warnx("cannot allocate memory for struct path_mtu{}.");
+      pthread_mutex_unlock(&pmtudisc_lock);
       return (-1);
     }
     memset(pmtup, 0, sizeof(struct path_mtu));
@@ -144,6 +295,7 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
     default:
       warnx("unsupported address family %d.", af);
       free(pmtup);
+      pthread_mutex_unlock(&pmtudisc_lock);
       return (-1);
     }
     pmtup->path_mtu = pmtu;
@@ -152,10 +304,16 @@ pmtudisc_update_path_mtu_size(int af, const void *addrp, int pmtu)
     if (pmtudisc_insert_path_mtu(pmtup) == -1) {
       warnx("insersion of path_mtu{} structure to the management list fialed.");
       free(pmtup);
+      pthread_mutex_unlock(&pmtudisc_lock);
       return (-1);
     }
+    __atomic_add_fetch(&pmtudisc_generation, 1, __ATOMIC_RELEASE);
   }
 
+  /* Let the fast path pass the bigger packets to us. */
+  fastpath_set_path_mtu(af, addrp, pmtu);
+  pthread_mutex_unlock(&pmtudisc_lock);
+
   return (0);
 }
 
@@ -180,22 +338,37 @@ pmtudisc_find_path_mtu(int af, const void *addrp)
 {
   assert(addrp != NULL);
 
-  int addr_len = 0;
+  int addr_len = pmtudisc_get_addr_len(af);
+  if (addr_len == 0) {
+    warnx("unsupported address family %d.", af);
+    return (NULL);
+  }
+
+  int hash_index = pmtudisc_get_hash_index(addrp, addr_len);
+
+  return (pmtudisc_find_in_bucket(af, addrp, addr_len, hash_index));
+}
+
+/* Returns the length of the address of the family, or 0. */
+static int
+pmtudisc_get_addr_len(int af)
+{
   switch (af) {
   case AF_INET:
-    addr_len = sizeof(struct in_addr);
-    break;
-
+    return (sizeof(struct in_addr));
   case AF_INET6:
-    addr_len = sizeof(struct in6_addr);
-    break;
-
+    return (sizeof(struct in6_addr));
   default:
-    warnx("unsupported address family %d.", af);
-    return (NULL);
+    return (0);
   }
+}
 
-  int hash_index = pmtudisc_get_hash_index(addrp, addr_len);
+/* Search the bucket of the hash index for the address. */
+static struct path_mtu *
+pmtudisc_find_in_bucket(int af, const void *addrp, int addr_len,
+			int hash_index)
+{
+  assert(addrp != NULL);
 
   struct path_mtu_hash *path_mtu_hashp = NULL;
   struct path_mtu *path_mtup = NULL;
@@ -310,6 +483,17 @@ pmtudisc_remove_path_mtu(struct path_mtu *path_mtup)
   assert(path_mtup != NULL);
   assert(path_mtup->path_mtu_hashp != NULL);
 
+  switch (path_mtup->ss_addr.ss_family) {
+  case AF_INET:
+    fastpath_set_path_mtu(AF_INET,
+      &((struct sockaddr_in *)&path_mtup->ss_addr)->sin_addr, 0);
+    break;
+  case AF_INET6:
+    fastpath_set_path_mtu(AF_INET6,
+      &((struct sockaddr_in6 *)&path_mtup->ss_addr)->sin6_addr, 0);
+    break;
+  }
+
   struct path_mtu_hash *path_mtu_hashp = path_mtup->path_mtu_hashp;
   LIST_REMOVE(path_mtu_hashp, entries);
   free(path_mtu_hashp);
@@ -318,4 +502,54 @@ pmtudisc_remove_path_mtu(struct path_mtu *path_mtup)
   free(path_mtup);
 
   path_mtu_instance_size--;
+  __atomic_add_fetch(&pmtudisc_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Look up the cache of the current thread.  Returns the path MTU, or
+ * -1 if the address is not cached or the cached result is outdated.
+ */
+static int
+pmtudisc_cache_lookup(int af, const void *addrp, int addr_len,
+		      int hash_index, time_t now)
+{
+  struct pmtudisc_cache_entry *entryp
+    = &pmtudisc_cache[hash_index % PMTUDISC_CACHE_SIZE];
+  if (entryp->generation
+      != __atomic_load_n(&pmtudisc_generation, __ATOMIC_ACQUIRE)
+      || entryp->af != af
+      || now > entryp->expire
+      || memcmp(entryp->addr, addrp, addr_len) != 0)
+    return (-1);
+
+  if (entryp->path_mtu == 0) {
+    PROBE2(pmtu_miss, af, addrp);
+    return (pmtudisc_default_mtu);
+  }
+  PROBE3(pmtu_hit, af, addrp, entryp->path_mtu);
+  return (entryp->path_mtu);
+}
+
+/*
+ * Store the result of a lookup in the cache of the current thread.
+ * The pmtup parameter is NULL if the address has no entry.  Called
+ * with the lock held, so the generation is stable.
+ */
+static void
+pmtudisc_cache_fill(int af, const void *addrp, int addr_len, int hash_index,
+		    const struct path_mtu *pmtup)
+{
+  time_t now = time(NULL);
+  struct pmtudisc_cache_entry *entryp
+    = &pmtudisc_cache[hash_index % PMTUDISC_CACHE_SIZE];
+  entryp->generation = pmtudisc_generation;
+  entryp->af = af;
+  memcpy(entryp->addr, addrp, addr_len);
+  if (pmtup == NULL) {
+    entryp->path_mtu = 0;
+    entryp->expire = now + PMTUDISC_DEFAULT_LIFETIME;
+  } else {
+    entryp->path_mtu = pmtup->path_mtu;
+    entryp->expire = pmtup->last_updated + PMTUDISC_DEFAULT_LIFETIME;
+  }
 }
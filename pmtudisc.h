@@ -29,8 +29,15 @@
 extern "C" {
 #endif
 
+#define PMTUDISC_DEFAULT_MTU 1500
+#define PMTUDISC_MIN_MTU 1280
+#define PMTUDISC_MAX_MTU 65535
+
+extern int pmtudisc_default_mtu;
+
 int pmtudisc_initialize(void);
 int pmtudisc_get_path_mtu_size(int, const void *);
+void pmtudisc_get_path_mtu_size_batch(int, const void *, int *, int);
 int pmtudisc_update_path_mtu_size(int, const void *, int);
 
 #ifdef __cplusplus
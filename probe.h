@@ -0,0 +1,113 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include <stdint.h>
+
+/*
+ * Statically defined tracepoints.  A probe is a nop instruction and
+ * an ELF note in the format of the SystemTap SDT notes (sys/sdt.h),
+ * which tells the tracers where the instruction and its arguments
+ * are.  Nothing is needed at run time: perf, bpftrace and gdb replace
+ * the nop with a breakpoint only while they are attached, e.g.
+ *
+ *   bpftrace -e 'usdt:./map646:map646:drop { @[arg0] = count(); }'
+ *
+ * The probes are listed in the README.  The arguments are passed as
+ * 64-bit signed integers, and a pointer as its address.  The probes
+ * are compiled out on the platforms other than x86-64 and AArch64
+ * ELF, or if MAP646_NO_PROBES is defined.
+ */
+
+/* The reasons of the drop probe. */
+#define PROBE_DROP_UNSUPPORTED 1	/* no translation for the direction */
+#define PROBE_DROP_IP_OPTIONS 2
+#define PROBE_DROP_EXT_HEADER 3		/* an IPv6 extension header */
+#define PROBE_DROP_TRUNCATED 4		/* shorter than the IP header says */
+#define PROBE_DROP_NO_MAPPING 5		/* no address to translate to */
+#define PROBE_DROP_ICMP 6		/* an ICMP message not translated */
+#define PROBE_DROP_ICMP_FRAGMENT 7
+#define PROBE_DROP_HOP_LIMIT 8		/* the hop limit expired */
+
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__)) \
+  && !defined(MAP646_NO_PROBES)
+
+#define PROBE_ARG(x) "nor" ((int64_t)(x))
+
+/*
+ * The note has the address of the nop, the address of the
+ * .stapsdt.base section for prelinked binaries, the address of the
+ * semaphore (none), the provider and probe names, and the locations
+ * of the arguments.
+ */
+#define PROBE_ASM(name, args)						\
+  "990:	nop\n"								\
+  "	.pushsection .note.stapsdt,\"?\",\"note\"\n"			\
+  "	.balign 4\n"							\
+  "	.4byte 992f-991f, 994f-993f, 3\n"				\
+  "991:	.asciz \"stapsdt\"\n"						\
+  "992:	.balign 4\n"							\
+  "993:	.8byte 990b\n"							\
+  "	.8byte _.stapsdt.base\n"					\
+  "	.8byte 0\n"							\
+  "	.asciz \"map646\"\n"						\
+  "	.asciz \"" #name "\"\n"						\
+  "	.asciz \"" args "\"\n"						\
+  "994:	.balign 4\n"							\
+  "	.popsection\n"							\
+  "	.ifndef _.stapsdt.base\n"					\
+  "	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  "	.weak _.stapsdt.base\n"						\
+  "	.hidden _.stapsdt.base\n"					\
+  "_.stapsdt.base:	.space 1\n"					\
+  "	.size _.stapsdt.base, 1\n"					\
+  "	.popsection\n"							\
+  "	.endif\n"
+
+#define PROBE1(name, a0)						\
+  __asm__ __volatile__ (PROBE_ASM(name, "-8@%0")			\
+			: : PROBE_ARG(a0))
+#define PROBE2(name, a0, a1)						\
+  __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1")			\
+			: : PROBE_ARG(a0), PROBE_ARG(a1))
+#define PROBE3(name, a0, a1, a2)					\
+  __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1 -8@%2")		\
+			: : PROBE_ARG(a0), PROBE_ARG(a1), PROBE_ARG(a2))
+#define PROBE4(name, a0, a1, a2, a3)					\
+  __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1 -8@%2 -8@%3")	\
+			: : PROBE_ARG(a0), PROBE_ARG(a1), PROBE_ARG(a2),	\
+			  PROBE_ARG(a3))
+
+#else
+
+#define PROBE1(name, a0) do { } while (0)
+#define PROBE2(name, a0, a1) do { } while (0)
+#define PROBE3(name, a0, a1, a2) do { } while (0)
+#define PROBE4(name, a0, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+
+#include "affinity.h"
+#include "ring.h"
+
+/*
+ * Initialize the ring with the size slots.  The slots are allocated
+ * on the NUMA node, or anywhere if the node is -1.
+ */
+int
+ring_init(struct ring *ringp, uint32_t size, int node)
+{
+  assert(ringp != NULL);
+
+  if (size == 0 || (size & (size - 1)) != 0) {
+    warnx("the ring size %u is not a power of 2.", size);
+    return (-1);
+  }
+
+  memset(ringp, 0, sizeof(struct ring));
+  ringp->slots = affinity_alloc(size * sizeof(void *), node);
+  if (ringp->slots == NULL) {
+    warnx("cannot allocate memory for a ring.");
+    return (-1);
+  }
+  ringp->size = size;
+  ringp->mask = size - 1;
+
+  return (0);
+}
+
+void
+ring_destroy(struct ring *ringp)
+{
+  assert(ringp != NULL);
+
+  if (ringp->slots != NULL) {
+    munmap(ringp->slots, ringp->size * sizeof(void *));
+    ringp->slots = NULL;
+  }
+}
+
+/*
+ * Add up to n objects.  Called only by the producer.  Returns the
+ * number of the objects added, which is less than n if the ring is
+ * full.
+ */
+unsigned int
+ring_enqueue_burst(struct ring *ringp, void *const *objs, unsigned int n)
+{
+  assert(ringp != NULL);
+  assert(objs != NULL);
+
+  uint32_t head = ringp->head;
+  uint32_t tail = __atomic_load_n(&ringp->tail, __ATOMIC_ACQUIRE);
+  uint32_t room = ringp->size - (head - tail);
+  if (n > room)
+    n = room;
+
+  unsigned int count;
+  for (count = 0; count < n; count++) {
+    ringp->slots[(head + count) & ringp->mask] = objs[count];
+  }
+  __atomic_store_n(&ringp->head, head + n, __ATOMIC_RELEASE);
+
+  return (n);
+}
+
+/*
+ * Remove up to n objects.  Called only by the consumer.  Returns the
+ * number of the objects removed.
+ */
+unsigned int
+ring_dequeue_burst(struct ring *ringp, void **objs, unsigned int n)
+{
+  assert(ringp != NULL);
+  assert(objs != NULL);
+
+  uint32_t tail = ringp->tail;
+  uint32_t head = __atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE);
+  uint32_t avail = head - tail;
+  if (n > avail)
+    n = avail;
+
+  unsigned int count;
+  for (count = 0; count < n; count++) {
+    objs[count] = ringp->slots[(tail + count) & ringp->mask];
+  }
+  __atomic_store_n(&ringp->tail, tail + n, __ATOMIC_RELEASE);
+
+  return (n);
+}
+
+/*
+ * The number of the objects in the ring.  The value may be stale when
+ * called by a thread other than the producer and the consumer.
+ */
+unsigned int
+ring_count(const struct ring *ringp)
+{
+  assert(ringp != NULL);
+
+  return (__atomic_load_n(&ringp->head, __ATOMIC_ACQUIRE)
+	  - __atomic_load_n(&ringp->tail, __ATOMIC_ACQUIRE));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RING_CACHE_LINE_SIZE 64
+
+/*
+ * A lock-free ring of pointers with a single producer and a single
+ * consumer.  The size must be a power of 2.  The head index is
+ * written only by the producer and the tail index only by the
+ * consumer, and they are placed in different cache lines.
+ */
+struct ring {
+  void **slots;
+  uint32_t size;
+  uint32_t mask;
+  uint32_t head __attribute__((aligned(RING_CACHE_LINE_SIZE)));
+  uint32_t tail __attribute__((aligned(RING_CACHE_LINE_SIZE)));
+};
+
+int ring_init(struct ring *, uint32_t, int);
+void ring_destroy(struct ring *);
+unsigned int ring_enqueue_burst(struct ring *, void *const *, unsigned int);
+unsigned int ring_dequeue_burst(struct ring *, void **, unsigned int);
+unsigned int ring_count(const struct ring *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -30,6 +30,8 @@
 #include <assert.h>
 #include <err.h>
 #include <unistd.h>
+#include <math.h>
+#include <time.h>
 
 #if !defined(__linux__)
 #include <sys/types.h>
@@ -68,6 +70,9 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <queue>
+#include <vector>
+#include <functional>
 #include <json/json.h>
 #include <sys/time.h>
 
@@ -76,6 +81,23 @@
 #include "icmpsub.h"
 
 namespace map646_stat{
+   static uint64_t get_msec();
+   static json_object *get_traffic_json(stat_chunk &chunk, uint64_t now);
+
+   /*
+    * A mapping ranked by write_top().  The address points the key of
+    * stat46 or stat66.
+    */
+   struct top_entry{
+      double value;
+      int af;
+      const void *addrp;
+      const stat_chunk *chunkp;
+      bool operator>(const top_entry &rhs)const{
+         return value > rhs.value;
+      }
+   };
+
    int statif_alloc(){
       int stat_listen_fd;   
       sockaddr_un saddr;
@@ -141,6 +163,7 @@ namespace map646_stat{
                         len, ip4_tlen);
                   break;
                }
+               stat46[addr].count(STAT_DIR_IN, ip4_tlen, get_msec());
                if(ip4_proto == IPPROTO_ICMP){
                   stat46[addr].stat_element[ICMP_IN].num++;
                   stat46[addr].stat_element[ICMP_IN].len[get_hist(ip4_plen - sizeof(icmp))]++;
@@ -162,6 +185,7 @@ namespace map646_stat{
              break;
             }
          case SIXTOFOUR:
+         case SIXTOSIX_HAIRPIN:
             {
                ip6_hdr* ip6_hdrp = (ip6_hdr*)bufp;
                in_addr service_addr;
@@ -206,6 +230,8 @@ namespace map646_stat{
                         len, ip6_payload_len + sizeof(ip6_hdr));
                   break;
                }
+               stat46[addr].count(STAT_DIR_OUT,
+                     ntohs(ip6_hdrp->ip6_plen) + sizeof(ip6_hdr), get_msec());
 
                if(ip6_proto == IPPROTO_ICMPV6){
                   stat46[addr].stat_element[ICMP_OUT].num++;
@@ -264,6 +290,8 @@ namespace map646_stat{
                         len, ip6_payload_len + sizeof(ip6_hdr));
                   break;
                }
+               stat66[addr].count(STAT_DIR_IN,
+                     ntohs(ip6_hdrp->ip6_plen) + sizeof(ip6_hdr), get_msec());
 
                if(ip6_proto == IPPROTO_ICMPV6){
                   stat66[addr].stat_element[ICMP_IN].num++;
@@ -326,6 +354,8 @@ namespace map646_stat{
                         len, ip6_payload_len + sizeof(ip6_hdr));
                   break;
                }
+               stat66[addr].count(STAT_DIR_OUT,
+                     ntohs(ip6_hdrp->ip6_plen) + sizeof(ip6_hdr), get_msec());
 
 
                if(ip6_proto == IPPROTO_ICMPV6){
@@ -349,6 +379,49 @@ namespace map646_stat{
       return 0;
    }
   
+   /*
+    * Add the counters of a chunk counted by another thread.  The rates
+    * of the other chunk are brought up to now first, so the sum is the
+    * rate of the both.
+    */
+   void stat_chunk::merge(stat_chunk &other, uint64_t now){
+      for(int i = 0; i < 6; i++){
+         _stat_element &element = stat_element[i];
+         const _stat_element &other_element = other.stat_element[i];
+         element.num += other_element.num;
+         element.error += other_element.error;
+         std::map<int, int>::const_iterator it;
+         for(it = other_element.len.begin(); it != other_element.len.end(); it++){
+            element.len[it->first] += it->second;
+         }
+         for(it = other_element.port_stat.begin(); it != other_element.port_stat.end(); it++){
+            element.port_stat[it->first] += it->second;
+         }
+      }
+      for(int d = STAT_DIR_IN; d <= STAT_DIR_OUT; d++){
+         other.rate[d].advance(now);
+         rate[d].merge(other.rate[d]);
+      }
+   }
+
+   /*
+    * Add the statistics counted by another thread, which are kept in
+    * their own shard so that the threads don't share a lock.
+    */
+   void stat::merge(stat &other){
+      uint64_t now = get_msec();
+      std::map<map646_in_addr, stat_chunk>::iterator it = other.stat46.begin();
+      while(it != other.stat46.end()){
+         stat46[it->first].merge(it->second, now);
+         it++;
+      }
+      std::map<map646_in6_addr, stat_chunk>::iterator it6 = other.stat66.begin();
+      while(it6 != other.stat66.end()){
+         stat66[it6->first].merge(it6->second, now);
+         it6++;
+      }
+   }
+
    void stat::flush(){
       last_flush.update();
       std::map<map646_in6_addr, stat_chunk>().swap(stat66);
@@ -409,6 +482,7 @@ namespace map646_stat{
    
    std::string stat::get_json(){
       json_object *jobj = json_object_new_object();
+      uint64_t now = get_msec();
       
       if(stat46.empty())
          json_object_object_add(jobj, "v4", NULL);
@@ -467,6 +541,8 @@ namespace map646_stat{
                   json_object_object_add(chunk, get_proto(i).c_str(), element); 
                }
             }
+            json_object_object_add(chunk, "traffic",
+                  get_traffic_json(it->second, now));
             json_object_object_add(v4, (it->first.get_addr()).c_str(), chunk);
             it++;
          }
@@ -531,6 +607,8 @@ namespace map646_stat{
                   json_object_object_add(chunk, get_proto(i).c_str(), element); 
                }
             }
+            json_object_object_add(chunk, "traffic",
+                  get_traffic_json(it6->second, now));
             json_object_object_add(v6, (it6->first.get_addr()).c_str(), chunk);
             it6++;
          }
@@ -541,6 +619,149 @@ namespace map646_stat{
       return json_object_to_json_string(jobj);
    }
 
+   /*
+    * Write the mappings with the highest rates or counters, the sum
+    * of the both directions.  The args parameter is "[<count>]
+    * [bps|pps|bytes|packets]", the top 10 by bps by default.  The
+    * mappings are selected with a heap of the count entries, in
+    * O(N log K) for N mappings and the top K.
+    */
+   int stat::write_top(int fd, const char *args){
+      assert(args != NULL);
+
+      int top = STAT_DEFAULT_TOP;
+      std::string key("bps");
+      std::istringstream argss(args);
+      std::string word;
+      while(argss >> word){
+         if(word == "bps" || word == "pps" || word == "bytes"
+               || word == "packets"){
+            key = word;
+         }else if(atoi(word.c_str()) >= 1 && atoi(word.c_str()) <= STAT_MAX_TOP){
+            top = atoi(word.c_str());
+         }else{
+            return safe_write(fd, std::string("invalid top command: top [<count>] [bps|pps|bytes|packets]"));
+         }
+      }
+
+      uint64_t now = get_msec();
+      std::priority_queue<top_entry, std::vector<top_entry>,
+         std::greater<top_entry> > heap;
+      std::map<map646_in_addr, stat_chunk>::iterator it = stat46.begin();
+      std::map<map646_in6_addr, stat_chunk>::iterator it6 = stat66.begin();
+      while(it != stat46.end() || it6 != stat66.end()){
+         top_entry entry;
+         stat_chunk *chunkp;
+         if(it != stat46.end()){
+            entry.af = AF_INET;
+            entry.addrp = &it->first;
+            chunkp = &it->second;
+            it++;
+         }else{
+            entry.af = AF_INET6;
+            entry.addrp = &it6->first;
+            chunkp = &it6->second;
+            it6++;
+         }
+         entry.chunkp = chunkp;
+         entry.value = 0;
+         for(int d = STAT_DIR_IN; d <= STAT_DIR_OUT; d++){
+            rate_estimator &rate = chunkp->rate[d];
+            rate.advance(now);
+            if(key == "bps"){
+               entry.value += rate.bps;
+            }else if(key == "pps"){
+               entry.value += rate.pps;
+            }else if(key == "bytes"){
+               entry.value += rate.bytes;
+            }else{
+               entry.value += rate.packets;
+            }
+         }
+         if(heap.size() < (size_t)top){
+            heap.push(entry);
+         }else if(entry.value > heap.top().value){
+            heap.pop();
+            heap.push(entry);
+         }
+      }
+
+      std::vector<top_entry> entries;
+      while(!heap.empty()){
+         entries.push_back(heap.top());
+         heap.pop();
+      }
+      std::stringstream ss;
+      ss.setf(std::ios::fixed);
+      ss.precision(1);
+      for(int i = entries.size() - 1; i >= 0; i--){
+         const top_entry &entry = entries[i];
+         if(entry.af == AF_INET){
+            ss << ((const map646_in_addr *)entry.addrp)->get_addr();
+         }else{
+            ss << ((const map646_in6_addr *)entry.addrp)->get_addr();
+         }
+         for(int d = STAT_DIR_IN; d <= STAT_DIR_OUT; d++){
+            const rate_estimator &rate = entry.chunkp->rate[d];
+            ss << (d == STAT_DIR_IN ? " in" : " out")
+               << " packets " << rate.packets
+               << " bytes " << rate.bytes
+               << " pps " << rate.pps
+               << " bps " << rate.bps;
+         }
+         ss << std::endl;
+      }
+
+      return safe_write(fd, ss.str());
+   }
+
+   /*
+    * Fold the packets and the bytes counted since the last update into
+    * the rates.  The weight of the new rate grows with the time
+    * elapsed, so a mapping idle for a long time decays to 0.
+    */
+   void rate_estimator::update(uint64_t now){
+      if(last_update == 0){
+         /* The first packet starts the first interval. */
+         last_update = now;
+         return;
+      }
+      uint64_t elapsed = now - last_update;
+      double weight = 1.0 - exp(-(double)elapsed / STAT_RATE_TIME_CONSTANT);
+      double cur_pps = (double)(packets - last_packets) * 1000 / elapsed;
+      double cur_bps = (double)(bytes - last_bytes) * 8000 / elapsed;
+      pps += (cur_pps - pps) * weight;
+      bps += (cur_bps - bps) * weight;
+      last_packets = packets;
+      last_bytes = bytes;
+      last_update = now;
+   }
+
+   /*
+    * The coarse monotonic clock is enough for the 1 second interval,
+    * and cheaper to read on every packet.
+    */
+   static uint64_t get_msec(){
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+      return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+   }
+
+   static json_object *get_traffic_json(stat_chunk &chunk, uint64_t now){
+      json_object *traffic = json_object_new_object();
+      for(int d = STAT_DIR_IN; d <= STAT_DIR_OUT; d++){
+         rate_estimator &rate = chunk.rate[d];
+         rate.advance(now);
+         json_object *element = json_object_new_object();
+         json_object_object_add(element, "packets", json_object_new_int64(rate.packets));
+         json_object_object_add(element, "bytes", json_object_new_int64(rate.bytes));
+         json_object_object_add(element, "pps", json_object_new_double(rate.pps));
+         json_object_object_add(element, "bps", json_object_new_double(rate.bps));
+         json_object_object_add(traffic, d == STAT_DIR_IN ? "in" : "out", element);
+      }
+      return traffic;
+   }
+
    int stat::get_hist(int len){
       int ret = len / 150;
       if(ret > 10)
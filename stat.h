@@ -31,6 +31,53 @@ namespace map646_stat{
 
    int statif_alloc();
 
+#define STAT_DIR_IN  0
+#define STAT_DIR_OUT 1
+
+#define STAT_RATE_INTERVAL 1000      /* in milliseconds */
+#define STAT_RATE_TIME_CONSTANT 8000 /* in milliseconds */
+
+#define STAT_DEFAULT_TOP 10
+#define STAT_MAX_TOP 1000
+
+   /*
+    * The packet and byte counters of a mapping in one direction, and
+    * their rates smoothed by an exponentially weighted moving
+    * average.  The rates are updated at most once in the interval,
+    * when a packet is counted or the stats are read, so counting a
+    * packet costs two additions and a comparison.
+    */
+   struct rate_estimator{
+      uint64_t packets;
+      uint64_t bytes;
+      uint64_t last_packets;
+      uint64_t last_bytes;
+      uint64_t last_update;   /* in milliseconds, 0 before the first packet */
+      double pps;
+      double bps;
+
+      rate_estimator() : packets(0), bytes(0), last_packets(0),
+         last_bytes(0), last_update(0), pps(0), bps(0){
+      }
+      void count(uint64_t len, uint64_t now){
+         packets++;
+         bytes += len;
+         if(now - last_update >= STAT_RATE_INTERVAL)
+            update(now);
+      }
+      void advance(uint64_t now){
+         if(last_update != 0 && now - last_update >= STAT_RATE_INTERVAL)
+            update(now);
+      }
+      void update(uint64_t now);
+      void merge(const rate_estimator &other){
+         packets += other.packets;
+         bytes += other.bytes;
+         pps += other.pps;
+         bps += other.bps;
+      }
+   };
+
    struct stat_chunk{
 
 #define ICMP_IN  0
@@ -47,6 +94,13 @@ namespace map646_stat{
          std::map<int, int> port_stat;
       }stat_element[6];
 
+      rate_estimator rate[2];
+
+      void count(int dir, uint64_t len, uint64_t now){
+         rate[dir].count(len, now);
+      }
+      void merge(stat_chunk &other, uint64_t now);
+
       int total_num(){
          int total_num = 0;
          for(int i = 0; i < 6; i++){
@@ -167,6 +221,8 @@ namespace map646_stat{
          int write_stat(int fd);
          int write_info(int fd);
          int write_last_flush_time(int fd);
+         int write_top(int fd, const char *args);
+         void merge(stat &other);
          /*
           *  int safe_write(int fd, std::string msg)
           *  communicate with stat_client and send the msg size before send the msg itself 
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "bpfsub.h"
+#include "tunif.h"
+#include "steer.h"
+
+/*
+ * The IPv6 addresses which are translated to or from other addresses.
+ * The value is a 32 bit word which identifies the mapping, so that
+ * both directions of one flow get the same hash value.
+ *
+ *   - map-static: the IPv6 address -> the mapped IPv4 address.  The
+ *     IPv4 side of the flow has the IPv4 address as its destination,
+ *     and the IPv6 side has the embedded IPv4 address of the peer in
+ *     the last 32 bits of the destination address.
+ *   - map66-static: both the global and the intra addresses -> the
+ *     last 32 bits of the global address.
+ */
+static int steer_addr_map_fd = -1;
+static int steer_prog_fd = -1;
+static int steer_attached;
+
+static int steer_load_program(void);
+static void steer_close_fd(int *);
+
+/*
+ * Load the queue steering program and attach it to the multi-queue
+ * tun interface.  Without the program, the kernel selects the queue
+ * based on its own flow hash which doesn't know the address mapping,
+ * so the two directions of a flow may be served by different worker
+ * threads.
+ */
+int
+steer_alloc(int tun_fd)
+{
+  steer_addr_map_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+    sizeof(struct in6_addr), sizeof(uint32_t), STEER_MAX_ADDRS, 0);
+  if (steer_addr_map_fd == -1
+      || steer_load_program() == -1
+      || tun_set_steering(tun_fd, steer_prog_fd) == -1) {
+    steer_dealloc();
+    return (-1);
+  }
+  steer_attached = 1;
+
+  return (0);
+}
+
+/*
+ * Release the program and the map.  The program is detached from the
+ * tun interface when the interface is closed.
+ */
+void
+steer_dealloc(void)
+{
+  steer_attached = 0;
+  steer_close_fd(&steer_prog_fd);
+  steer_close_fd(&steer_addr_map_fd);
+}
+
+/* Returns 1 if the queue steering program is attached. */
+int
+steer_is_active(void)
+{
+  return (steer_attached);
+}
+
+/* Add a mapping entry of the map-static directive. */
+int
+steer_add_mapping(const struct in_addr *addr4p, const struct in6_addr *addr6p)
+{
+  assert(addr4p != NULL);
+  assert(addr6p != NULL);
+
+  if (steer_addr_map_fd == -1)
+    return (0);
+
+  if (bpfsub_map_update(steer_addr_map_fd, addr6p, addr4p) == -1) {
+    warn("failed to add a mapping entry to the queue steering map.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* Add a mapping entry of the map66-static directive. */
+int
+steer_add_mapping66(const struct in6_addr *globalp,
+		    const struct in6_addr *intrap)
+{
+  assert(globalp != NULL);
+  assert(intrap != NULL);
+
+  if (steer_addr_map_fd == -1)
+    return (0);
+
+  const uint32_t *idp = &globalp->s6_addr32[3];
+  if (bpfsub_map_update(steer_addr_map_fd, globalp, idp) == -1
+      || bpfsub_map_update(steer_addr_map_fd, intrap, idp) == -1) {
+    warn("failed to add a 6-to-6 mapping entry to the queue steering map.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Remove all the mapping entries.  The flows are still steered by the
+ * addresses and ports, but the two directions of a flow may go to
+ * different queues until the entries are added again.
+ */
+int
+steer_clear(void)
+{
+  if (steer_addr_map_fd == -1)
+    return (0);
+
+  if (bpfsub_map_clear(steer_addr_map_fd, sizeof(struct in6_addr)) == -1) {
+    warnx("failed to clear the queue steering map.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* The stack layout of the program. */
+#define ST_STACK_HDR (-48)	/* the first 44 bytes of the packet */
+#define ST_IP4_HDR_LEN 24	/* IPv4 header and the ports */
+#define ST_IP6_HDR_LEN 44	/* IPv6 header and the ports */
+
+enum {
+  ST_L_ZERO, ST_L_HASH,
+  ST_L_IP4, ST_L_IP4_PORTS,
+  ST_L_IP6_PORTS, ST_L_IP6_ADDRS, ST_L_IP6_DST, ST_L_IP6_NOMAP
+};
+
+/*
+ * Build and load the queue steering program.  The program computes a
+ * key which is the same for both directions of a flow, and returns a
+ * hash value of the key.  r6 holds the context, and r7 accumulates
+ * the key.
+ *
+ *   - IPv4 (always translated to IPv6): the source address XOR the
+ *     destination address.
+ *   - IPv6 whose source address is in the map (translated to IPv4,
+ *     or the intra to global 6-to-6 direction): the mapped value XOR
+ *     the last 32 bits of the destination address.
+ *   - IPv6 whose destination address is in the map (the global to
+ *     intra 6-to-6 direction): the mapped value XOR the last 32 bits
+ *     of the source address.
+ *
+ * The ports are XORed in for TCP and UDP, except for fragments so
+ * that all the fragments of a datagram go to the same queue.  The
+ * packet data begins with the IP header, since the tun interface has
+ * no link layer header.
+ */
+static int
+steer_load_program(void)
+{
+  struct bpfsub_prog *progp;
+  progp = malloc(sizeof(struct bpfsub_prog));
+  if (progp == NULL) {
+    warnx("cannot allocate memory for the queue steering program.");
+    return (-1);
+  }
+  bpfsub_prog_init(progp);
+
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_7, 0));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+				 offsetof(struct __sk_buff, protocol)));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IP), 0),
+		  ST_L_IP4);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, htons(ETH_P_IPV6),
+				     0), ST_L_ZERO);
+
+  /* IPv6. */
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, ST_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, ST_IP6_HDR_LEN));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), ST_L_ZERO);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 6));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, IPPROTO_TCP, 0),
+		  ST_L_IP6_PORTS);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, IPPROTO_UDP, 0),
+		  ST_L_IP6_ADDRS);
+  bpfsub_label(progp, ST_L_IP6_PORTS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_7, BPF_REG_10,
+				 ST_STACK_HDR + 40));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 42));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+
+  bpfsub_label(progp, ST_L_IP6_ADDRS);
+  bpfsub_emit_map_fd(progp, BPF_REG_1, steer_addr_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, ST_STACK_HDR + 8));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0),
+		  ST_L_IP6_DST);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0, 0));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 36));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), ST_L_HASH);
+
+  bpfsub_label(progp, ST_L_IP6_DST);
+  bpfsub_emit_map_fd(progp, BPF_REG_1, steer_addr_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, ST_STACK_HDR + 24));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0),
+		  ST_L_IP6_NOMAP);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0, 0));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 20));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), ST_L_HASH);
+
+  /* Not mapped.  Use the last 32 bits of both addresses. */
+  bpfsub_label(progp, ST_L_IP6_NOMAP);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 20));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 36));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), ST_L_HASH);
+
+  /* IPv4. */
+  bpfsub_label(progp, ST_L_IP4);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_1, BPF_REG_6));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_2, 0));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_3, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, ST_STACK_HDR));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_4, ST_IP4_HDR_LEN));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_skb_load_bytes));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), ST_L_ZERO);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_10,
+				 ST_STACK_HDR + 12));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 16));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  /* No options, not a fragment, and TCP or UDP. */
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, 0x45, 0), ST_L_HASH);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 6));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_AND, BPF_REG_2,
+				   htons(IP_MF | IP_OFFMASK)));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, 0, 0), ST_L_HASH);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 9));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_2, IPPROTO_TCP, 0),
+		  ST_L_IP4_PORTS);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JNE, BPF_REG_2, IPPROTO_UDP, 0),
+		  ST_L_HASH);
+  bpfsub_label(progp, ST_L_IP4_PORTS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 20));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10,
+				 ST_STACK_HDR + 22));
+  bpfsub_emit(progp, BPF_ALU64_REG(BPF_XOR, BPF_REG_7, BPF_REG_2));
+
+  /*
+   * Multiplicative hash.  The kernel uses the lower 16 bits of the
+   * return value, so return the upper 16 bits of the product.
+   */
+  bpfsub_label(progp, ST_L_HASH);
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_MUL, BPF_REG_7, 0x9e3779b1));
+  bpfsub_emit(progp, BPF_ALU32_IMM(BPF_RSH, BPF_REG_7, 16));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_0, BPF_REG_7));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  bpfsub_label(progp, ST_L_ZERO);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, 0));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  steer_prog_fd = bpfsub_prog_load(progp, BPF_PROG_TYPE_SOCKET_FILTER,
+				   "map646_steer");
+  free(progp);
+
+  return (steer_prog_fd == -1 ? -1 : 0);
+}
+
+static void
+steer_close_fd(int *fdp)
+{
+  assert(fdp != NULL);
+
+  if (*fdp != -1) {
+    close(*fdp);
+    *fdp = -1;
+  }
+}
@@ -54,9 +54,15 @@
 #endif
 #include <netinet/in.h>
 
+#include "tunif.h"
+
 #define POLICY_TABLE_ID 1
 
 char tun_if_name[IFNAMSIZ];
+int tun_queues = 1;
+int tun_busy_poll_usec = 0;
+int tun_mtu = 0;          /* 0 keeps the default MTU of the system. */
+int tun_buffer_size = 0;  /* 0 derives the size from tun_mtu. */
 
 static int tun_op_route(int, int, const void *, int, int);
 static int tun_op_rule(int op, int af, const void *addr, int prefix_len, int rt_class);
@@ -68,6 +74,13 @@ static int tun_op_rule(int op, int af, const void *addr, int prefix_len, int rt_
  * The created tun interface doesn't have the NO_PI flag (in Linux),
  * and has the TUNSIFHEAD flag (in BSD) to provide address family
  * information at the beginning of all incoming/outgoing packets.
+ *
+ * The MTU of the interface is set to tun_mtu if it is not 0.
+ *
+ * In Linux, the interface is created with the IFF_MULTI_QUEUE flag if
+ * the tun_queues variable is bigger than 1.  The returned descriptor
+ * is the queue 0, and the rest of the queues are opened by the
+ * tun_alloc_queue() function.
  */
 int
 tun_alloc(char *tun_if_name)
@@ -91,6 +104,9 @@ tun_alloc(char *tun_if_name)
   struct ifreq ifr;
   memset(&ifr, 0, sizeof(struct ifreq));
   ifr.ifr_flags = IFF_TUN;
+  if (tun_queues > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
   strncpy(ifr.ifr_name, tun_if_name, IFNAMSIZ);
   if (ioctl(tun_fd, TUNSETIFF, (void *)&ifr) == -1) {
     close(tun_fd);
@@ -140,6 +156,21 @@ tun_alloc(char *tun_if_name)
   }
 #endif
 
+  if (tun_mtu != 0) {
+    memset(&ifr, 0, sizeof(struct ifreq));
+    ifr.ifr_mtu = tun_mtu;
+    strncpy(ifr.ifr_name, tun_if_name, IFNAMSIZ);
+    if (ioctl(udp_fd, SIOCSIFMTU, (void *)&ifr) == -1) {
+      err(EXIT_FAILURE, "failed to set the MTU of %s to %d.", tun_if_name,
+	  tun_mtu);
+    }
+  }
+  if (tun_get_buffer_size() < (size_t)tun_mtu + sizeof(uint32_t)) {
+    warnx("the buffer size %zu is smaller than the MTU %d of %s.  "
+	  "Larger packets are dropped.", tun_get_buffer_size(), tun_mtu,
+	  tun_if_name);
+  }
+
   /* Make the tun device up. */
   memset(&ifr, 0, sizeof(struct ifreq));
   ifr.ifr_flags = IFF_UP;
@@ -153,6 +184,58 @@ tun_alloc(char *tun_if_name)
   return (tun_fd);
 }
 
+#if defined(__linux__)
+/*
+ * Open one more queue of the multi-queue tun interface created by the
+ * tun_alloc() function.  The kernel selects the queue of each packet
+ * sent to the interface (see tun_set_steering()), and a packet
+ * written to any of the queues is received by the kernel in the same
+ * way.
+ */
+int
+tun_alloc_queue(const char *tun_if_name)
+{
+  assert(tun_if_name != NULL);
+
+  int queue_fd;
+  queue_fd = open("/dev/net/tun", O_RDWR);
+  if (queue_fd == -1) {
+    warn("cannot create a control channel of the tun queue.");
+    return (-1);
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(struct ifreq));
+  ifr.ifr_flags = IFF_TUN | IFF_MULTI_QUEUE;
+  strncpy(ifr.ifr_name, tun_if_name, IFNAMSIZ);
+  if (ioctl(queue_fd, TUNSETIFF, (void *)&ifr) == -1) {
+    warn("cannot attach a new queue to %s interface.", tun_if_name);
+    close(queue_fd);
+    return (-1);
+  }
+
+  return (queue_fd);
+}
+
+/*
+ * Attach the eBPF program which selects the queue of each packet sent
+ * to the tun interface.  The return value of the program modulo the
+ * number of the queues is used as the queue index.  The program is
+ * shared by all the queues, so any of the queue descriptors can be
+ * used.
+ */
+int
+tun_set_steering(int tun_fd, int prog_fd)
+{
+  if (ioctl(tun_fd, TUNSETSTEERINGEBPF, (void *)&prog_fd) == -1) {
+    warn("failed to set the queue steering program.");
+    return (-1);
+  }
+
+  return (0);
+}
+#endif
+
 #if !defined(__linux__)
 /*
  * Delete the tun interface created at launch time.  This code is
@@ -187,6 +270,43 @@ tun_dealloc(const char *tun_if_name)
 }
 #endif
 
+/*
+ * Returns the size of the buffers to read packets from the tun
+ * interface, including the address family information.  If the
+ * buffer-size directive is not specified, the size is large enough
+ * for the tun MTU.
+ */
+size_t
+tun_get_buffer_size(void)
+{
+  if (tun_buffer_size != 0)
+    return (tun_buffer_size);
+  if (tun_mtu + sizeof(uint32_t) > TUN_DEFAULT_BUFFER_SIZE)
+    return (tun_mtu + sizeof(uint32_t));
+
+  return (TUN_DEFAULT_BUFFER_SIZE);
+}
+
+/*
+ * Returns 1 if the packet read from the tun interface was truncated
+ * because it didn't fit in the buffer.  Linux sets the TUN_PKT_STRIP
+ * flag in the tun_pi{} structure in that case.  BSD systems silently
+ * truncate the packet, so 0 is always returned.
+ */
+int
+tun_is_truncated(const void *buf)
+{
+  assert(buf != NULL);
+
+#if defined(__linux__)
+  /* The kernel sets the flag in the host byte order. */
+  const struct tun_pi *pi = (const struct tun_pi *)buf;
+  return ((pi->flags & TUN_PKT_STRIP) != 0);
+#else
+  return (0);
+#endif
+}
+
 /*
  * Get the address family information from the head of the packet.
  * The buf pointer must point the head of the packet, and the buffer
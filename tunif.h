@@ -30,13 +30,29 @@ extern "C" {
 #endif
 
 #define TUN_DEFAULT_IF_NAME "tun646"
+#define TUN_MAX_QUEUES 16
+#define TUN_MAX_BUSY_POLL_USEC 100000
+#define TUN_MIN_MTU 1280
+#define TUN_MAX_MTU 65535
+#define TUN_DEFAULT_BUFFER_SIZE 1600
+#define TUN_MAX_BUFFER_SIZE (TUN_MAX_MTU + 64)
 
 extern char tun_if_name[];
+extern int tun_queues;
+extern int tun_busy_poll_usec;
+extern int tun_mtu;
+extern int tun_buffer_size;
 
 int tun_alloc(char *);
+#if defined(__linux__)
+int tun_alloc_queue(const char *);
+int tun_set_steering(int, int);
+#endif
 #if !defined(__linux__)
 int tun_dealloc(const char *);
 #endif
+size_t tun_get_buffer_size(void);
+int tun_is_truncated(const void *);
 uint32_t tun_get_af(const void *);
 int tun_set_af(void *, uint32_t);
 int tun_add_route(int, const void *, int);
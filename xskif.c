@@ -0,0 +1,871 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "bpfsub.h"
+#include "tunif.h"
+#include "xskif.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* The number of frames kept aside from the fill ring for copied TX. */
+#define XSK_TX_RESERVE 256
+
+/* The maximum number of the mapped IPv4 addresses steered to us. */
+#define XSK_MAX_ADDR4 65536
+
+char xsk_if_name[IFNAMSIZ];
+int xsk_queue_id;
+int xsk_mode = XSK_MODE_AUTO;
+
+/* One of the four rings shared with the kernel. */
+struct xsk_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *descs;
+  uint32_t size;
+  uint32_t cached_prod;
+  uint32_t cached_cons;
+  void *map;
+  size_t map_len;
+};
+
+static int xsk_sock = -1;
+static int xsk_ifindex;
+static uint32_t xsk_xdp_flags;
+static int xsk_bind_flags;
+static int xsk_prog_fd = -1;
+static int xsk_map_fd = -1;
+static int xsk_addr4_map_fd = -1;
+static int xsk_prefix6_map_fd = -1;
+
+static uint8_t *xsk_umem;
+static size_t xsk_umem_len;
+static uint32_t xsk_frame_size = XSK_DEFAULT_FRAME_SIZE;
+static uint32_t xsk_num_frames = XSK_DEFAULT_NUM_FRAMES;
+
+static struct xsk_ring xsk_fill, xsk_comp, xsk_rx, xsk_tx;
+
+/* The stack of the frames owned by the userland. */
+static uint64_t *xsk_free_frames;
+static uint32_t xsk_free_count;
+static int xsk_tx_pending;
+
+static uint8_t xsk_if_mac[ETH_ALEN];
+static uint8_t xsk_nexthop4_mac[ETH_ALEN];
+static uint8_t xsk_nexthop6_mac[ETH_ALEN];
+static int xsk_nexthop4_set, xsk_nexthop6_set;
+
+static struct xsk_stats xsk_stats;
+
+static int xsk_load_program(void);
+static int xsk_attach_program(void);
+static int xsk_create_umem(void);
+static int xsk_map_ring(struct xsk_ring *, int, int, uint64_t,
+			const struct xdp_ring_offset *, size_t);
+static void xsk_unmap_ring(struct xsk_ring *);
+static int xsk_bind(void);
+static void xsk_reap_completions(void);
+static void xsk_refill(int);
+static int xsk_get_if_mac(const char *, uint8_t *);
+
+/*
+ * Create an AF_XDP socket bound to the queue xsk_queue_id of the
+ * interface xsk_if_name, and attach a small XDP program to that
+ * interface which redirects the packets destined to the mapped IPv4
+ * addresses and to the mapping prefix to the socket.  All other
+ * packets are passed to the kernel as usual.
+ *
+ * Returns the file descriptor of the socket, or -1 if AF_XDP is not
+ * available.  In that case, the caller should keep using the tun
+ * interface only.
+ */
+int
+xsk_alloc(void)
+{
+  if (xsk_if_name[0] == '\0') {
+    /* Not configured. */
+    return (-1);
+  }
+
+  xsk_ifindex = if_nametoindex(xsk_if_name);
+  if (xsk_ifindex == 0) {
+    warn("cannot find the XDP interface %s.", xsk_if_name);
+    return (-1);
+  }
+  if (xsk_get_if_mac(xsk_if_name, xsk_if_mac) == -1) {
+    return (-1);
+  }
+
+  xsk_sock = socket(AF_XDP, SOCK_RAW, 0);
+  if (xsk_sock == -1) {
+    warn("AF_XDP socket is not available.");
+    return (-1);
+  }
+
+  if (xsk_create_umem() == -1
+      || xsk_bind() == -1
+      || xsk_load_program() == -1
+      || xsk_attach_program() == -1) {
+    warnx("falling back to the tun interface only.");
+    xsk_dealloc();
+    return (-1);
+  }
+
+  /* Give the half of the frames to the kernel for receiving. */
+  xsk_refill(0);
+
+  warnx("AF_XDP socket is bound to %s queue %d (%s mode, %s).",
+	xsk_if_name, xsk_queue_id,
+	(xsk_xdp_flags & XDP_FLAGS_SKB_MODE) ? "generic" : "native",
+	(xsk_bind_flags & XDP_ZEROCOPY) ? "zero-copy" : "copy");
+
+  return (xsk_sock);
+}
+
+/*
+ * Detach the XDP program and release all the resources.  Packets
+ * will flow through the kernel and the tun interface after this.
+ */
+void
+xsk_dealloc(void)
+{
+  if (xsk_xdp_flags != 0) {
+    if (bpfsub_detach_xdp(xsk_ifindex, xsk_xdp_flags) == -1) {
+      warn("failed to detach the XDP program from %s.", xsk_if_name);
+    }
+    xsk_xdp_flags = 0;
+  }
+  if (xsk_prog_fd != -1) {
+    close(xsk_prog_fd);
+    xsk_prog_fd = -1;
+  }
+  if (xsk_map_fd != -1) {
+    close(xsk_map_fd);
+    xsk_map_fd = -1;
+  }
+  if (xsk_addr4_map_fd != -1) {
+    close(xsk_addr4_map_fd);
+    xsk_addr4_map_fd = -1;
+  }
+  if (xsk_prefix6_map_fd != -1) {
+    close(xsk_prefix6_map_fd);
+    xsk_prefix6_map_fd = -1;
+  }
+
+  xsk_unmap_ring(&xsk_fill);
+  xsk_unmap_ring(&xsk_comp);
+  xsk_unmap_ring(&xsk_rx);
+  xsk_unmap_ring(&xsk_tx);
+
+  if (xsk_sock != -1) {
+    close(xsk_sock);
+    xsk_sock = -1;
+  }
+  if (xsk_umem != NULL) {
+    munmap(xsk_umem, xsk_umem_len);
+    xsk_umem = NULL;
+  }
+  free(xsk_free_frames);
+  xsk_free_frames = NULL;
+  xsk_free_count = 0;
+}
+
+/*
+ * Set the Ethernet address of the next hop router used for the
+ * translated packets of the address family.  If it is not set, the
+ * source Ethernet address of the original packet is used.
+ */
+int
+xsk_set_nexthop(int af, const char *mac_str)
+{
+  assert(mac_str != NULL);
+
+  unsigned int mac[ETH_ALEN];
+  if (sscanf(mac_str, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2],
+	     &mac[3], &mac[4], &mac[5]) != ETH_ALEN) {
+    warnx("invalid Ethernet address %s.", mac_str);
+    return (-1);
+  }
+
+  uint8_t *macp;
+  switch (af) {
+  case AF_INET:
+    macp = xsk_nexthop4_mac;
+    xsk_nexthop4_set = 1;
+    break;
+  case AF_INET6:
+    macp = xsk_nexthop6_mac;
+    xsk_nexthop6_set = 1;
+    break;
+  default:
+    warnx("unsupported address family %d.", af);
+    return (-1);
+  }
+  int count = ETH_ALEN;
+  while (count--) {
+    macp[count] = mac[count];
+  }
+
+  return (0);
+}
+
+/* Steer the packets destined to the IPv4 address to the socket. */
+int
+xsk_add_addr4(const struct in_addr *addrp)
+{
+  assert(addrp != NULL);
+
+  if (xsk_addr4_map_fd == -1)
+    return (0);
+
+  uint8_t dummy = 1;
+  if (bpfsub_map_update(xsk_addr4_map_fd, addrp, &dummy) == -1) {
+    warn("failed to add the IPv4 address to the XDP steering map.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Steer the packets destined to the IPv6 mapping prefix to the
+ * socket.  Only the upper 64 bits are used, the same as the route
+ * entry installed for the prefix.
+ */
+int
+xsk_set_prefix6(const struct in6_addr *prefixp)
+{
+  assert(prefixp != NULL);
+
+  if (xsk_prefix6_map_fd == -1)
+    return (0);
+
+  uint8_t dummy = 1;
+  if (bpfsub_map_update(xsk_prefix6_map_fd, prefixp, &dummy) == -1) {
+    warn("failed to add the IPv6 prefix to the XDP steering map.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/* Remove all the steering information. */
+int
+xsk_clear_addrs(void)
+{
+  if (xsk_addr4_map_fd == -1)
+    return (0);
+
+  if (bpfsub_map_clear(xsk_addr4_map_fd, sizeof(struct in_addr)) == -1
+      || bpfsub_map_clear(xsk_prefix6_map_fd, sizeof(uint64_t)) == -1) {
+    warnx("failed to clear the XDP steering maps.");
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * Take at most max_frames packets from the RX ring.  The frames must
+ * be returned by the xsk_release() function after processing.
+ */
+int
+xsk_recv(struct xsk_frame *framesp, int max_frames)
+{
+  assert(framesp != NULL);
+
+  uint32_t prod = __atomic_load_n(xsk_rx.producer, __ATOMIC_ACQUIRE);
+  uint32_t cons = *xsk_rx.consumer;
+  uint32_t avail = prod - cons;
+  if (avail > (uint32_t)max_frames)
+    avail = max_frames;
+
+  struct xdp_desc *descs = xsk_rx.descs;
+  uint32_t count;
+  for (count = 0; count < avail; count++) {
+    const struct xdp_desc *descp = &descs[(cons + count) & (xsk_rx.size - 1)];
+    framesp[count].addr = descp->addr;
+    framesp[count].len = descp->len;
+    framesp[count].datap = xsk_umem + descp->addr;
+    framesp[count].tx_used = 0;
+  }
+  __atomic_store_n(xsk_rx.consumer, cons + avail, __ATOMIC_RELEASE);
+
+  xsk_stats.rx_packets += avail;
+
+  return (avail);
+}
+
+/*
+ * Transmit the packet described by the iov parameter, which has the
+ * same layout as the one written to the tun interface (see
+ * cksum_update_ulp()).  iov[0] contains the address family
+ * information and it is replaced with an Ethernet header.
+ *
+ * If the last element of the iov points the inside of the received
+ * frame, the headers are written just before it in the same frame
+ * and the frame itself is put to the TX ring, so the payload is never
+ * copied.  This is possible only once per received frame.  Otherwise,
+ * the packet is copied to a free frame.
+ *
+ * Returns the number of bytes sent, or -1 if the packet should be
+ * sent through the tun interface instead.
+ */
+ssize_t
+xsk_writev(struct xsk_frame *rx_framep, const struct iovec *iov, int iovcnt)
+{
+  assert(rx_framep != NULL);
+  assert(iov != NULL);
+  assert(iovcnt >= 2);
+
+  uint32_t af = tun_get_af(iov[0].iov_base);
+  uint16_t ether_type;
+  const uint8_t *dst_macp;
+  switch (af) {
+  case AF_INET:
+    ether_type = htons(ETH_P_IP);
+    dst_macp = xsk_nexthop4_set ? xsk_nexthop4_mac : rx_framep->datap + ETH_ALEN;
+    break;
+  case AF_INET6:
+    ether_type = htons(ETH_P_IPV6);
+    dst_macp = xsk_nexthop6_set ? xsk_nexthop6_mac : rx_framep->datap + ETH_ALEN;
+    break;
+  default:
+    return (-1);
+  }
+
+  size_t hdr_len = ETH_HLEN;
+  int iovidx;
+  for (iovidx = 1; iovidx < iovcnt - 1; iovidx++) {
+    hdr_len += iov[iovidx].iov_len;
+  }
+  const struct iovec *lastp = &iov[iovcnt - 1];
+  size_t pkt_len = hdr_len + lastp->iov_len;
+  if (pkt_len > xsk_frame_size - XSK_FRAME_HEADROOM) {
+    return (-1);
+  }
+
+  /* Reserve a TX descriptor. */
+  uint32_t tx_prod = *xsk_tx.producer;
+  if (tx_prod - __atomic_load_n(xsk_tx.consumer, __ATOMIC_ACQUIRE)
+      >= xsk_tx.size) {
+    xsk_stats.tx_fallback++;
+    return (-1);
+  }
+
+  uint8_t *chunkp = xsk_umem + (rx_framep->addr & ~(uint64_t)(xsk_frame_size - 1));
+  uint8_t *payloadp = lastp->iov_base;
+  uint8_t *startp;
+  if (!rx_framep->tx_used
+      && payloadp >= chunkp + hdr_len
+      && payloadp + lastp->iov_len <= chunkp + xsk_frame_size) {
+    /* Zero-copy: put the headers in front of the payload. */
+    startp = payloadp - hdr_len;
+    rx_framep->tx_used = 1;
+    xsk_stats.tx_zerocopy++;
+  } else {
+    if (xsk_free_count == 0) {
+      xsk_reap_completions();
+    }
+    if (xsk_free_count == 0) {
+      xsk_stats.tx_fallback++;
+      return (-1);
+    }
+    startp = xsk_umem + xsk_free_frames[--xsk_free_count];
+    memcpy(startp + hdr_len, payloadp, lastp->iov_len);
+    xsk_stats.tx_copy++;
+  }
+
+  /*
+   * Fill the headers.  The original Ethernet header may be overwritten
+   * here, so pick the destination address up first.
+   */
+  uint8_t dst_mac[ETH_ALEN];
+  memcpy(dst_mac, dst_macp, ETH_ALEN);
+  uint8_t *p = startp;
+  memcpy(p, dst_mac, ETH_ALEN);
+  memcpy(p + ETH_ALEN, xsk_if_mac, ETH_ALEN);
+  memcpy(p + 2 * ETH_ALEN, &ether_type, sizeof(uint16_t));
+  p += ETH_HLEN;
+  for (iovidx = 1; iovidx < iovcnt - 1; iovidx++) {
+    if (iov[iovidx].iov_len == 0)
+      continue;
+    memmove(p, iov[iovidx].iov_base, iov[iovidx].iov_len);
+    p += iov[iovidx].iov_len;
+  }
+
+  struct xdp_desc *descp
+    = &((struct xdp_desc *)xsk_tx.descs)[tx_prod & (xsk_tx.size - 1)];
+  descp->addr = startp - xsk_umem;
+  descp->len = pkt_len;
+  descp->options = 0;
+  __atomic_store_n(xsk_tx.producer, tx_prod + 1, __ATOMIC_RELEASE);
+  xsk_tx_pending++;
+
+  return (pkt_len - ETH_HLEN);
+}
+
+/*
+ * Return the received frame.  If the frame was not used for
+ * transmission, it is put back to the fill ring immediately.
+ */
+void
+xsk_release(struct xsk_frame *framep)
+{
+  assert(framep != NULL);
+
+  if (framep->tx_used) {
+    /* Will come back through the completion ring. */
+    return;
+  }
+
+  uint64_t base = framep->addr & ~(uint64_t)(xsk_frame_size - 1);
+  uint32_t prod = *xsk_fill.producer;
+  if (prod - __atomic_load_n(xsk_fill.consumer, __ATOMIC_ACQUIRE)
+      < xsk_fill.size) {
+    ((uint64_t *)xsk_fill.descs)[prod & (xsk_fill.size - 1)] = base;
+    __atomic_store_n(xsk_fill.producer, prod + 1, __ATOMIC_RELEASE);
+  } else {
+    xsk_free_frames[xsk_free_count++] = base;
+  }
+}
+
+/*
+ * Kick the kernel to transmit the queued packets, and recycle the
+ * frames which have been transmitted.  Called after each batch.
+ */
+void
+xsk_flush(void)
+{
+  if (xsk_sock == -1)
+    return;
+
+  if (xsk_tx_pending) {
+    if (!(xsk_bind_flags & XDP_USE_NEED_WAKEUP)
+	|| (*xsk_tx.flags & XDP_RING_NEED_WAKEUP)) {
+      if (sendto(xsk_sock, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1
+	  && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+	warn("failed to kick the AF_XDP TX ring.");
+      }
+    }
+    xsk_tx_pending = 0;
+  }
+
+  xsk_reap_completions();
+  xsk_refill(XSK_TX_RESERVE);
+
+  if ((xsk_bind_flags & XDP_USE_NEED_WAKEUP)
+      && (*xsk_fill.flags & XDP_RING_NEED_WAKEUP)) {
+    recvfrom(xsk_sock, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+  }
+}
+
+/* Copy the AF_XDP statistics. */
+void
+xsk_get_stats(struct xsk_stats *statsp)
+{
+  assert(statsp != NULL);
+
+  memcpy(statsp, &xsk_stats, sizeof(struct xsk_stats));
+}
+
+/* Returns 1 if the socket works in the zero-copy mode. */
+int
+xsk_is_zerocopy(void)
+{
+  return (xsk_sock != -1 && (xsk_bind_flags & XDP_ZEROCOPY) != 0);
+}
+
+/*
+ * Build the XDP program.  It is equivalent to the following C code.
+ *
+ *   if (eth->h_proto == ETH_P_IP
+ *       && bpf_map_lookup_elem(&addr4_map, &ip->daddr))
+ *     return bpf_redirect_map(&xsk_map, ctx->rx_queue_index, XDP_PASS);
+ *   if (eth->h_proto == ETH_P_IPV6
+ *       && bpf_map_lookup_elem(&prefix6_map, &ip6->daddr[0..7]))
+ *     return bpf_redirect_map(&xsk_map, ctx->rx_queue_index, XDP_PASS);
+ *   return XDP_PASS;
+ */
+enum {
+  XSK_L_PASS, XSK_L_IPV4, XSK_L_IPV6, XSK_L_REDIRECT
+};
+
+static int
+xsk_load_program(void)
+{
+  xsk_map_fd = bpfsub_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t),
+				 sizeof(uint32_t), xsk_queue_id + 1, 0);
+  xsk_addr4_map_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH,
+				       sizeof(struct in_addr), sizeof(uint8_t),
+				       XSK_MAX_ADDR4, 0);
+  xsk_prefix6_map_fd = bpfsub_map_create(BPF_MAP_TYPE_HASH, sizeof(uint64_t),
+					 sizeof(uint8_t), 16, 0);
+  if (xsk_map_fd == -1 || xsk_addr4_map_fd == -1
+      || xsk_prefix6_map_fd == -1) {
+    return (-1);
+  }
+
+  uint32_t key = xsk_queue_id;
+  uint32_t value = xsk_sock;
+  if (bpfsub_map_update(xsk_map_fd, &key, &value) == -1) {
+    warn("failed to register the AF_XDP socket to the XSKMAP.");
+    return (-1);
+  }
+
+  struct bpfsub_prog *progp = malloc(sizeof(struct bpfsub_prog));
+  if (progp == NULL) {
+    warnx("memory allocation failed for struct bpfsub_prog{}.");
+    return (-1);
+  }
+  bpfsub_prog_init(progp);
+
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+				 offsetof(struct xdp_md, data)));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6,
+				 offsetof(struct xdp_md, data_end)));
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_2));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, ETH_HLEN + 20));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  XSK_L_PASS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IP), 0),
+		  XSK_L_IPV4);
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IPV6), 0),
+		  XSK_L_IPV6);
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), XSK_L_PASS);
+
+  /* IPv4: look up the destination address. */
+  bpfsub_label(progp, XSK_L_IPV4);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + 16));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_5, -8));
+  bpfsub_emit_map_fd(progp, BPF_REG_1, xsk_addr4_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -8));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), XSK_L_PASS);
+  bpfsub_emit_jmp(progp, BPF_JMP_A(0), XSK_L_REDIRECT);
+
+  /* IPv6: look up the upper 64 bits of the destination address. */
+  bpfsub_label(progp, XSK_L_IPV6);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_4, BPF_REG_2));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_4, ETH_HLEN + 40));
+  bpfsub_emit_jmp(progp, BPF_JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, 0),
+		  XSK_L_PASS);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + 24));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_5, -16));
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + 28));
+  bpfsub_emit(progp, BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_5, -12));
+  bpfsub_emit_map_fd(progp, BPF_REG_1, xsk_prefix6_map_fd);
+  bpfsub_emit(progp, BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+  bpfsub_emit(progp, BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -16));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem));
+  bpfsub_emit_jmp(progp, BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), XSK_L_PASS);
+
+  /* Redirect to the socket, or pass if the socket is not there. */
+  bpfsub_label(progp, XSK_L_REDIRECT);
+  bpfsub_emit_map_fd(progp, BPF_REG_1, xsk_map_fd);
+  bpfsub_emit(progp, BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+				 offsetof(struct xdp_md, rx_queue_index)));
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_3, XDP_PASS));
+  bpfsub_emit(progp, BPF_EMIT_CALL(BPF_FUNC_redirect_map));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  bpfsub_label(progp, XSK_L_PASS);
+  bpfsub_emit(progp, BPF_MOV64_IMM(BPF_REG_0, XDP_PASS));
+  bpfsub_emit(progp, BPF_EXIT_INSN());
+
+  xsk_prog_fd = bpfsub_prog_load(progp, BPF_PROG_TYPE_XDP, "map646_xsk");
+  free(progp);
+
+  return (xsk_prog_fd == -1 ? -1 : 0);
+}
+
+/*
+ * Attach the XDP program.  The native mode is tried first unless the
+ * generic (SKB) mode is requested explicitly.
+ */
+static int
+xsk_attach_program(void)
+{
+  if (xsk_mode != XSK_MODE_SKB) {
+    uint32_t flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_DRV_MODE;
+    if (bpfsub_attach_xdp(xsk_ifindex, xsk_prog_fd, flags) == 0) {
+      xsk_xdp_flags = XDP_FLAGS_DRV_MODE;
+      return (0);
+    }
+    if (xsk_mode == XSK_MODE_NATIVE) {
+      warn("failed to attach the XDP program to %s in the native mode.",
+	   xsk_if_name);
+      return (-1);
+    }
+  }
+
+  uint32_t flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_SKB_MODE;
+  if (bpfsub_attach_xdp(xsk_ifindex, xsk_prog_fd, flags) == 0) {
+    xsk_xdp_flags = XDP_FLAGS_SKB_MODE;
+    return (0);
+  }
+  warn("failed to attach the XDP program to %s.", xsk_if_name);
+
+  return (-1);
+}
+
+/* Register the UMEM area and map the four rings. */
+static int
+xsk_create_umem(void)
+{
+  xsk_umem_len = (size_t)xsk_frame_size * xsk_num_frames;
+  xsk_umem = mmap(NULL, xsk_umem_len, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (xsk_umem == MAP_FAILED) {
+    warn("cannot allocate the UMEM area.");
+    xsk_umem = NULL;
+    return (-1);
+  }
+
+  xsk_free_frames = malloc(sizeof(uint64_t) * xsk_num_frames);
+  if (xsk_free_frames == NULL) {
+    warnx("memory allocation failed for the free frame list.");
+    return (-1);
+  }
+  uint32_t count;
+  for (count = 0; count < xsk_num_frames; count++) {
+    xsk_free_frames[count]
+      = (uint64_t)(xsk_num_frames - count - 1) * xsk_frame_size;
+  }
+  xsk_free_count = xsk_num_frames;
+
+  struct xdp_umem_reg umem_reg;
+  memset(&umem_reg, 0, sizeof(umem_reg));
+  umem_reg.addr = (uint64_t)(unsigned long)xsk_umem;
+  umem_reg.len = xsk_umem_len;
+  umem_reg.chunk_size = xsk_frame_size;
+  umem_reg.headroom = XSK_FRAME_HEADROOM;
+  if (setsockopt(xsk_sock, SOL_XDP, XDP_UMEM_REG, &umem_reg,
+		 sizeof(umem_reg)) == -1) {
+    warn("failed to register the UMEM area.");
+    return (-1);
+  }
+
+  int ring_size = XSK_RING_SIZE;
+  if (setsockopt(xsk_sock, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+		 sizeof(int)) == -1
+      || setsockopt(xsk_sock, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+		    sizeof(int)) == -1
+      || setsockopt(xsk_sock, SOL_XDP, XDP_RX_RING, &ring_size,
+		    sizeof(int)) == -1
+      || setsockopt(xsk_sock, SOL_XDP, XDP_TX_RING, &ring_size,
+		    sizeof(int)) == -1) {
+    warn("failed to set the AF_XDP ring size.");
+    return (-1);
+  }
+
+  struct xdp_mmap_offsets off;
+  socklen_t optlen = sizeof(off);
+  if (getsockopt(xsk_sock, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+    warn("failed to get the AF_XDP ring offsets.");
+    return (-1);
+  }
+
+  if (xsk_map_ring(&xsk_fill, xsk_sock, ring_size, XDP_UMEM_PGOFF_FILL_RING,
+		   &off.fr, sizeof(uint64_t)) == -1
+      || xsk_map_ring(&xsk_comp, xsk_sock, ring_size,
+		      XDP_UMEM_PGOFF_COMPLETION_RING, &off.cr,
+		      sizeof(uint64_t)) == -1
+      || xsk_map_ring(&xsk_rx, xsk_sock, ring_size, XDP_PGOFF_RX_RING,
+		      &off.rx, sizeof(struct xdp_desc)) == -1
+      || xsk_map_ring(&xsk_tx, xsk_sock, ring_size, XDP_PGOFF_TX_RING,
+		      &off.tx, sizeof(struct xdp_desc)) == -1) {
+    return (-1);
+  }
+
+  return (0);
+}
+
+static int
+xsk_map_ring(struct xsk_ring *ringp, int fd, int ring_size, uint64_t pgoff,
+	     const struct xdp_ring_offset *offp, size_t desc_size)
+{
+  assert(ringp != NULL);
+  assert(offp != NULL);
+
+  ringp->map_len = offp->desc + ring_size * desc_size;
+  ringp->map = mmap(NULL, ringp->map_len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, fd, pgoff);
+  if (ringp->map == MAP_FAILED) {
+    warn("failed to map an AF_XDP ring.");
+    ringp->map = NULL;
+    return (-1);
+  }
+  ringp->producer = (uint32_t *)((uint8_t *)ringp->map + offp->producer);
+  ringp->consumer = (uint32_t *)((uint8_t *)ringp->map + offp->consumer);
+  ringp->flags = (uint32_t *)((uint8_t *)ringp->map + offp->flags);
+  ringp->descs = (uint8_t *)ringp->map + offp->desc;
+  ringp->size = ring_size;
+
+  return (0);
+}
+
+static void
+xsk_unmap_ring(struct xsk_ring *ringp)
+{
+  assert(ringp != NULL);
+
+  if (ringp->map != NULL) {
+    munmap(ringp->map, ringp->map_len);
+  }
+  memset(ringp, 0, sizeof(struct xsk_ring));
+}
+
+/*
+ * Bind the socket to the queue.  The zero-copy mode is tried first,
+ * and the copy mode is used if the driver doesn't support it (e.g.
+ * veth, or when the XDP program runs in the generic mode).
+ */
+static int
+xsk_bind(void)
+{
+  static const int bind_flags[] = {
+    XDP_ZEROCOPY|XDP_USE_NEED_WAKEUP,
+    XDP_COPY|XDP_USE_NEED_WAKEUP,
+    XDP_COPY,
+  };
+
+  struct sockaddr_xdp sxdp;
+  memset(&sxdp, 0, sizeof(sxdp));
+  sxdp.sxdp_family = AF_XDP;
+  sxdp.sxdp_ifindex = xsk_ifindex;
+  sxdp.sxdp_queue_id = xsk_queue_id;
+
+  unsigned int count;
+  for (count = 0; count < sizeof(bind_flags) / sizeof(int); count++) {
+    if (xsk_mode == XSK_MODE_SKB && (bind_flags[count] & XDP_ZEROCOPY))
+      continue;
+    sxdp.sxdp_flags = bind_flags[count];
+    if (bind(xsk_sock, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+      xsk_bind_flags = bind_flags[count];
+      return (0);
+    }
+  }
+  warn("failed to bind the AF_XDP socket to %s queue %d.", xsk_if_name,
+       xsk_queue_id);
+
+  return (-1);
+}
+
+/* Move the transmitted frames to the free frame stack. */
+static void
+xsk_reap_completions(void)
+{
+  uint32_t prod = __atomic_load_n(xsk_comp.producer, __ATOMIC_ACQUIRE);
+  uint32_t cons = *xsk_comp.consumer;
+  for (; cons != prod; cons++) {
+    uint64_t addr = ((uint64_t *)xsk_comp.descs)[cons & (xsk_comp.size - 1)];
+    xsk_free_frames[xsk_free_count++]
+      = addr & ~(uint64_t)(xsk_frame_size - 1);
+  }
+  __atomic_store_n(xsk_comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give the free frames to the fill ring, keeping the reserve frames
+ * for the copied transmission.
+ */
+static void
+xsk_refill(int reserve)
+{
+  uint32_t prod = *xsk_fill.producer;
+  uint32_t room = xsk_fill.size
+    - (prod - __atomic_load_n(xsk_fill.consumer, __ATOMIC_ACQUIRE));
+  if (reserve == 0) {
+    /* Initial filling: half of the frames. */
+    reserve = xsk_free_count / 2;
+  }
+  while (room > 0 && xsk_free_count > (uint32_t)reserve) {
+    ((uint64_t *)xsk_fill.descs)[prod & (xsk_fill.size - 1)]
+      = xsk_free_frames[--xsk_free_count];
+    prod++;
+    room--;
+  }
+  __atomic_store_n(xsk_fill.producer, prod, __ATOMIC_RELEASE);
+}
+
+/* Get the Ethernet address of the interface. */
+static int
+xsk_get_if_mac(const char *if_name, uint8_t *macp)
+{
+  assert(if_name != NULL);
+  assert(macp != NULL);
+
+  int udp_fd;
+  udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (udp_fd == -1) {
+    warn("failed to open control socket.");
+    return (-1);
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(struct ifreq));
+  strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+  if (ioctl(udp_fd, SIOCGIFHWADDR, &ifr) == -1) {
+    warn("cannot get the Ethernet address of %s.", if_name);
+    close(udp_fd);
+    return (-1);
+  }
+  memcpy(macp, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+  close(udp_fd);
+
+  return (0);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2010 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __XSKIF_H__
+#define __XSKIF_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XSK_DEFAULT_FRAME_SIZE 2048
+#define XSK_DEFAULT_NUM_FRAMES 4096
+#define XSK_RING_SIZE 2048
+#define XSK_FRAME_HEADROOM 128
+#define XSK_BATCH_SIZE 64
+
+#define XSK_MODE_AUTO 0
+#define XSK_MODE_NATIVE 1
+#define XSK_MODE_SKB 2
+
+extern char xsk_if_name[];
+extern int xsk_queue_id;
+extern int xsk_mode;
+
+/*
+ * A packet received from the AF_XDP socket.  The datap member points
+ * the Ethernet header in the UMEM area.
+ */
+struct xsk_frame {
+  uint64_t addr;
+  uint32_t len;
+  uint8_t *datap;
+  int tx_used;
+};
+
+struct xsk_stats {
+  uint64_t rx_packets;
+  uint64_t tx_zerocopy;
+  uint64_t tx_copy;
+  uint64_t tx_fallback;
+};
+
+int xsk_alloc(void);
+void xsk_dealloc(void);
+int xsk_set_nexthop(int, const char *);
+int xsk_add_addr4(const struct in_addr *);
+int xsk_set_prefix6(const struct in6_addr *);
+int xsk_clear_addrs(void);
+int xsk_recv(struct xsk_frame *, int);
+ssize_t xsk_writev(struct xsk_frame *, const struct iovec *, int);
+void xsk_release(struct xsk_frame *);
+void xsk_flush(void);
+void xsk_get_stats(struct xsk_stats *);
+int xsk_is_zerocopy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif